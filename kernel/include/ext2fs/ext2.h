@@ -3,6 +3,7 @@
 
 #include "stewieos/kernel.h"
 #include "stewieos/spinlock.h"
+#include "stewieos/sem.h"
 #include "stewieos/fs.h"
 
 #define MODULE_NAME "ext2fs"
@@ -130,6 +131,25 @@
 #define DX_HASH_LEGACY					0
 #define DX_HASH_HALF_MD4				1
 #define DX_HASH_TEA					2
+// Variants used when the filesystem hashes names as unsigned chars
+#define DX_HASH_LEGACY_UNSIGNED				3
+#define DX_HASH_HALF_MD4_UNSIGNED			4
+#define DX_HASH_TEA_UNSIGNED				5
+
+// Values for s_flags
+#define EXT2_FLAGS_SIGNED_HASH				0x0001 /* names hash as signed chars */
+#define EXT2_FLAGS_UNSIGNED_HASH			0x0002 /* names hash as unsigned chars */
+
+// Hash tree layout. The root information follows the "." and ".." entries
+// of the first directory block, while lower index blocks start with an
+// empty directory entry spanning the whole block.
+#define EXT2_DX_ROOT_INFO				24
+#define EXT2_DX_NODE_ENTRIES				8
+#define EXT2_DX_MAX_LEVELS				2 /* the root plus one level of index blocks */
+#define EXT2_DX_BLOCK_MASK				0x0FFFFFFF
+
+// Space used by a directory entry with a name of length n
+#define EXT2_DIRENT_LEN(n)				((8 + (u32)(n) + 3) & ~3u)
 
 // Values for h_magic with e2_xattr_header_t
 #define EXT2_XATTR_MAGIC				0xEA020000
@@ -138,8 +158,31 @@
 #define EXT2_SUPER(s)					((e2_super_private_t*)((s)->s_private))
 #define EXT2_INODE(i)					((e2_inode_private_t*)((i)->i_private))
 
-// Calculate the number of block groups
-#define EXT2_BGCOUNT(s)					(EXT2_SUPER(s)->super.s_blocks_count/EXT2_SUPER(s)->super.s_blocks_per_group)
+// Calculate the number of block groups (the last one may be partial)
+#define EXT2_BGCOUNT(s)					((EXT2_SUPER(s)->super.s_blocks_count - EXT2_SUPER(s)->super.s_first_data_block + EXT2_SUPER(s)->super.s_blocks_per_group - 1)/EXT2_SUPER(s)->super.s_blocks_per_group)
+
+// Number of indirect blocks cached for each inode
+#define EXT2_INDIRECT_CACHE				4
+
+// Number of blocks spanned by the contents of an inode
+#define EXT2_NBLOCKS(sb, priv)				(((priv)->inode->i_size + (sb)->s_blocksize - 1) / (sb)->s_blocksize)
+
+// Blocks preallocated past the end of a growing file if the superblock has no hint
+#define EXT2_PREALLOC_DEFAULT				8
+
+// Milliseconds between background write-back passes over dirty inodes and the superblock
+#define EXT2_WRITEBACK_DELAY				5000
+
+// Readahead window bounds (in blocks) for sequentially read files
+#define EXT2_RA_MIN					4
+#define EXT2_RA_MAX					32
+
+// Largest run of a write vector gathered into one buffer (in bytes)
+#define EXT2_IOV_MAX					65536
+
+// Values for the bitmap argument of e2_bitmap_* functions
+#define EXT2_BLOCK_BITMAP				0
+#define EXT2_INODE_BITMAP				1
 
 // Values for e2_inode_io command
 #define EXT2_READ					0
@@ -197,12 +240,18 @@ typedef struct _e2_superblock
 	// Directory Indexing Support
 	char s_hash_seed[16];
 	u8 s_def_hash_version;
-	u16 s_reserved1;
-	u8 s_reserved2;
+	u8 s_reserved1;
+	u16 s_reserved2;
 	// Other Options
 	u32 s_default_mount_options;
 	u32 s_first_meta_bg;
-	// There are 760 other bytes of unused memory after this
+	u32 s_mkfs_time;
+	u32 s_jnl_blocks[17];
+	u32 s_reserved3[3];
+	u16 s_min_extra_isize;
+	u16 s_want_extra_isize;
+	u32 s_flags;
+	// There are 668 other bytes of unused memory after this
 #endif
 } e2_superblock_t;
 
@@ -311,28 +360,62 @@ typedef struct _e2_xattr_entry
 	char e_name[];
 } e2_xattr_entry_t;
 
+/* Cached Block Group Bitmap */
+typedef struct _e2_bitmap
+{
+	u32* map; // bitmap contents (NULL until the group is first used)
+	u32 cursor; // every bit below this one is in use
+	int dirty; // 1 if the bitmap needs to be written back
+} e2_bitmap_t;
+
 /* Private Ext2 Filesystem information for runtime filesystem driver */
 typedef struct _e2_super_private
 {
 	e2_superblock_t super; // internal superblock structure
 	e2_bg_descr_t* bgtable; // block group table
-	u8** inomap; // inode bitmap
-	u8* blkmap; // block bitmap
+	e2_bitmap_t* bitmap[2]; // cached block and inode bitmaps for each group
 	int dirty;
 	spinlock_t rw_lock;
+	struct superblock* sb; // the superblock this belongs to
+	list_t dirty_inodes; // inodes waiting for write-back
+	spinlock_t dirty_lock; // protects dirty_inodes
+	list_t link; // link in the list of mounted ext2 filesystems
 } e2_super_private_t;
 
+/* Cached Indirect Block */
+typedef struct _e2_indirect
+{
+	u32 block; // block number on disk (0 if unused)
+	u32* data; // block contents
+	u32 stamp; // last use, for replacement
+	int dirty; // 1 if the block needs to be written back
+} e2_indirect_t;
+
 /* Private Ext2 Inode Information */
 typedef struct _e2_inode_private
 {
 	e2_inode_t* inode; // the internal inode structure (pointer to inode_data for convenience)
 	spinlock_t rw_lock; // lock for the read/write buffer
 	char* rw; // the read/write buffer (should be super->s_blocksize bytes long)
-	u32* block; // the entire block map for this inode
+	e2_indirect_t indirect[EXT2_INDIRECT_CACHE]; // recently used indirect blocks
+	u32 indirect_stamp; // use counter for the indirect block cache
+	mutex_t* bmap_lock; // protects the block tree, indirect cache and preallocation window
+	u32 prealloc; // next block of the preallocation window
+	u32 prealloc_count; // number of blocks left in the preallocation window
 	int dirty; // 1/0 for dirty/clean. If it is dirty, its internal inode will be written to disk before closing.
+	ino_t ino; // inode number, to find the inode again from dirty_link
+	list_t dirty_link; // link in the superblock dirty inode list
 	char inode_data[]; // inode data (will occupy super->s_inode_size bytes)
 } e2_inode_private_t;
 
+/* Per-file Readahead State (kept in file->f_private) */
+typedef struct _e2_readahead
+{
+	u32 next; // logical block a sequential reader would start at next
+	u32 window; // blocks kept ahead of a sequential reader (0 after a random read)
+	u32 ahead; // first logical block not yet queued for readahead
+} e2_readahead_t;
+
 /* Filesystem Callback Functions */
 int e2_read_super(struct filesystem* fs, struct superblock* sb, dev_t devid, unsigned long flags, void* data);
 int e2_put_super(struct filesystem* fs, struct superblock* sb);
@@ -340,6 +423,7 @@ int e2_put_super(struct filesystem* fs, struct superblock* sb);
 int e2_read_inode(struct superblock* sb, struct inode* inode);
 void e2_put_inode(struct superblock* sb, struct inode* inode);
 int e2_super_flush(struct superblock* sb);
+int e2_super_sync(struct superblock* sb);
 /* Inode Callback Functions */
 int e2_inode_lookup(struct inode* inode, struct dentry* dentry);
 int e2_inode_mknod(struct inode* inode, const char* name, mode_t mode, dev_t dev);
@@ -348,26 +432,48 @@ int e2_inode_flush(struct inode* inode);
 int e2_file_open(struct file* file, struct dentry* dentry, int mode);
 int e2_file_close(struct file* file, struct dentry* dentry);
 ssize_t e2_file_read(struct file* file, char* buffer, size_t count);
+int e2_file_readpage(struct file* file, off_t offset, char* page);
 ssize_t e2_file_write(struct file* file, const char* buffer, size_t count);
+ssize_t e2_file_writev(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos);
+int e2_file_fsync(struct file* file);
 int e2_file_readdir(struct file* file, struct dirent* dirent, size_t count);
 
 /* Low-Level Filesystem Operations */
 int e2_read_block(struct superblock* sb, u32 block, size_t count, char* buffer);
 int e2_write_block(struct superblock* sb, u32 block, size_t count, const char* buffer);
 u32 e2_alloc_block(struct superblock* sb);
+u32 e2_alloc_blocks(struct superblock* sb, u32 goal, u32* count); // allocate up to *count contiguous blocks near goal
 int e2_free_block(struct superblock* sb, u32 block);
+int e2_free_blocks(struct superblock* sb, u32 block, u32 count);
 ino_t e2_alloc_inode(struct superblock* sb, e2_inode_t* inode_data);
+int e2_bitmap_alloc(struct superblock* sb, int which, u32 bg, u32* bit); // claim a free bit in a group bitmap (superblock locked)
+int e2_bitmap_free(struct superblock* sb, int which, u32 bg, u32 bit); // release a bit in a group bitmap (superblock locked)
+int e2_bitmap_flush(struct superblock* sb); // write back every dirty bitmap
+void e2_bitmap_release(struct superblock* sb); // free the cached bitmaps
 int e2_free_inode(struct superblock* sb, struct inode* inode);
 /* Low-Level Inode Operations */
-//u32 e2_absolute_block(struct inode* inode, u32 offset); // function superseded by the cached block array within e2_inode_private_t
-int e2_inode_read_block_map(struct inode* inode, u32* buffer); // read the entire block map (direct, indirect, doubly, and triply)
-int e2_inode_write_block_map(struct inode* inode, u32* buffer); // write the entire block map
+int e2_inode_bmap(struct inode* inode, u32 lblock, u32* block); // find the disk block holding a logical block (0 for a hole)
+int e2_bmap_find(struct inode* inode, u32 lblock, u32* block); // e2_inode_bmap with bmap_lock already held
+int e2_bmap_set(struct inode* inode, u32 lblock, u32 pblock); // map a logical block to a disk block (bmap_lock held)
+int e2_inode_block_io(struct inode* inode, int cmd, u32 lblock, char* buffer); // read or write one whole directory block
+void e2_inode_truncate_blocks(struct inode* inode, u32 from); // free every block from the given logical block on
+int e2_indirect_flush(struct inode* inode); // write back cached indirect blocks
+void e2_indirect_release(struct inode* inode); // free cached indirect blocks
 ssize_t e2_inode_resize(struct inode* inode, size_t newsize);
 ssize_t e2_inode_io(struct inode* inode, int cmd, off_t offset, size_t size, char* buffer);
 int e2_inode_truncate(struct inode* inode);
+void e2_inode_discard_prealloc(struct inode* inode); // give back unused preallocated blocks (takes bmap_lock)
+void e2_inode_dirty(struct inode* inode); // queue the inode for the write-back worker
+void e2_writeback_init( void ); // start the metadata write-back worker
 /* Middle-Level Inode Operations */
 int e2_inode_link(struct inode* parent, const char* name, struct inode* inode); // associate the given with the inode within the given parent directory
 int e2_inode_unlink(struct inode* inode, struct dentry* name); // unlink the given name from within the given directory
+void e2_dirent_fill(e2_dirent_t* dirent, const char* name, struct inode* inode); // fill in a directory entry for the given inode
+/* Directory Hash Index Operations (htree.c) */
+int e2_dx_indexed(struct inode* dir); // is the directory index usable?
+e2_dirent_t* e2_dx_search(struct inode* dir, const char* name, char* leaf, u32* block); // find a name using the index
+int e2_dx_add(struct inode* dir, const char* name, struct inode* inode); // add a name using the index
+int e2_dx_build(struct inode* dir); // index a full single block directory
 
 // Filesystem Operations Structures (defined in module.c)
 extern struct inode_operations e2_inode_operations;
@@ -12,6 +12,8 @@
 #define _ATA_H_
 
 #include "stewieos/kernel.h"
+#include "stewieos/pci.h"
+#include "stewieos/sem.h"
 
 // Builds an ata device control register value based on the HOB, SRST and nIEN values.
 // See ATA-ATAPI-6 Specification Page 67
@@ -45,10 +47,15 @@
 #define ATA_CMD_READ_PIO_EXT	0x24
 #define ATA_CMD_READ_DMA	0xC8
 #define ATA_CMD_READ_DMA_EXT	0x25
+#define ATA_CMD_READ_MULTIPLE	0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT	0x29
 #define ATA_CMD_WRITE_SECTORS	0x30
 #define ATA_CMD_WRITE_PIO_EXT	0x34
 #define ATA_CMD_WRITE_DMA	0xCA
 #define ATA_CMD_WRITE_DMA_EXT	0x35
+#define ATA_CMD_WRITE_MULTIPLE	0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT	0x39
+#define ATA_CMD_SET_MULTIPLE	0xC6
 #define ATA_CMD_CACHE_FLUSH	0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT	0xEA
 #define ATA_CMD_PACKET		0xA0
@@ -65,6 +72,7 @@
 #define ATA_IDENT_SECTORS	12
 #define ATA_IDENT_SERIAL	20
 #define ATA_IDENT_MODEL		54
+#define ATA_IDENT_MAX_MULTIPLE	94
 #define ATA_IDENT_CAPABILITIES	98
 #define ATA_IDENT_FIELDVALID	106
 #define ATA_IDENT_MAX_LBA	120
@@ -116,13 +124,75 @@
 #define ATA_PIO_READ		0
 #define ATA_PIO_WRITE		1
 
+// Bus Master IDE Registers (offsets from the channel's bmide port)
+#define ATA_BM_COMMAND		0x00
+#define ATA_BM_STATUS		0x02
+#define ATA_BM_PRDT		0x04
+
+// Bus Master Command Register Flags
+#define ATA_BM_CMD_START	0x01
+#define ATA_BM_CMD_READ		0x08 // transfer from the device to memory
+
+// Bus Master Status Register Flags
+#define ATA_BM_SR_ACTIVE	0x01
+#define ATA_BM_SR_ERR		0x02
+#define ATA_BM_SR_IRQ		0x04
+#define ATA_BM_SR_DRV0_DMA	0x20
+#define ATA_BM_SR_DRV1_DMA	0x40
+
+// Marks the last entry in a physical region descriptor table
+#define ATA_PRD_EOT		0x8000
+
+// Identify capabilities bit for DMA support
+#define ATA_CAP_DMA		0x0100
+// Identify command set bit for 48-bit addressing
+#define ATA_CMDSET_LBA48	(1<<26)
+
+// Largest LBA reachable with 28-bit commands
+#define ATA_LBA28_MAX		0x0FFFFFFF
+// Largest sector counts for a single command
+#define ATA_LBA28_MAX_SECTORS	256
+#define ATA_LBA48_MAX_SECTORS	65536
+// Largest DRQ block we ask for with SET MULTIPLE MODE
+#define ATA_MULTIPLE_MAX	16
+
+// Size of the per-channel DMA bounce buffer
+#define ATA_DMA_PAGES		16
+#define ATA_DMA_BUFSZ		(ATA_DMA_PAGES * 0x1000)
+#define ATA_DMA_MAX_SECTORS	ATA_BYTE_TO_SECTOR(ATA_DMA_BUFSZ)
+
+// Number of sectors ide_benchmark reads from the first disk when the
+// driver loads. Zero disables the benchmark.
+#define ATA_BENCHMARK_SECTORS	0
+
+// Physical Region Descriptor (ATA Bus Master IDE Spec., Rev 1.0)
+typedef struct _ata_prd
+{
+	u32 addr; // physical address of the memory region
+	u16 size; // byte count of the region (0 means 64K)
+	u16 flags; // ATA_PRD_EOT for the last entry
+} __attribute__((packed)) ata_prd_t;
+
+struct task;
+
 // Defines IDE ATA Channel Structure
 typedef struct _ide_channel
 {
 	u16 base; // I/O Base Address
 	u16 ctrl; // I/O Control Base Address
 	u16 bmide; // Bus Master IDE
-	u8  interrupt; // The interrupt vector for this channel
+	u8  interrupt; // The nIEN value written to the control register
+	u8  irq; // The interrupt vector for this channel
+	u8  dma; // Whether bus mastering is available on this channel
+	volatile u8 irq_pending; // The channel interrupted since the last command
+	volatile u8 dma_active; // A DMA command has been issued and not completed
+	volatile u8 dma_status; // Bus master status at completion
+	volatile u8 ata_status; // Device status at the last interrupt
+	struct task* waiter; // Task sleeping until the channel interrupts
+	mutex_t* lock; // Held while a request is in progress on the channel
+	ata_prd_t* prdt; // Physical region descriptor table
+	u32 prdt_phys; // Physical address of the descriptor table
+	u8* dma_buffer; // Bounce buffer the descriptors point into
 } ide_channel_t;
 
 typedef struct _ata_partition
@@ -144,6 +214,9 @@ typedef struct _ide_device
 	u16 cap;			// Features
 	u32 command_set;		// Supported Command Sets
 	u32 size;			// Size in sectors
+	u8 dma;				// Transfers may use the bus master
+	u8 lba48;			// The device supports 48-bit addressing
+	u8 multiple;			// Sectors per DRQ block for READ/WRITE MULTIPLE (0 if unused)
 	unsigned char model[41];	// Model String
 	
 	ata_partition_t part[5];	// Partition table
@@ -172,7 +245,14 @@ int ata_check_partition(u8* partition);
 int ata_read_sectors(u8 channel, u8 drive, u32 lba, u8 count, void* location);
 int ata_write_sectors(u8 channel, u8 drive, u32 lba, u32 count, void* data);
 
-int ata_pio_transfer(u8 channel, u8 drive, u8 direction, u32 lba, u8 count, void* location);
+int ata_pio_transfer(ide_device_t* dev, u8 direction, u32 lba, u32 count, void* location);
+int ata_dma_transfer(ide_device_t* dev, u8 direction, u32 lba, u32 count, void* location);
+int ata_transfer(u8 disk, u8 direction, u32 lba, u32 count, void* location);
+int ata_set_multiple(ide_device_t* dev, u8 max);
+int ata_dma_initialize(pci_device_t* device);
+void ata_wait_irq(u8 channel);
+
+void ide_benchmark(u8 disk, u32 nsectors);
 
 int ide_read(int drive, int partition, u32 pos, u32 count, void* buffer);
 
@@ -0,0 +1,117 @@
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "stewieos/kernel.h"
+#include "stewieos/linkedlist.h"
+
+// Number of hash chains (must be a power of two)
+#define BCACHE_HASH_SIZE		256
+// Default number of cached device blocks
+#define BCACHE_DEFAULT_CAPACITY	1024
+// Milliseconds between background write-back passes
+#define BCACHE_WRITEBACK_DELAY	5000
+// Largest number of uncached blocks read with a single device request
+#define BCACHE_MAX_RUN			128
+// Number of readahead requests which may wait for the readahead worker
+#define BCACHE_RA_QUEUE			16
+
+// The buffer holds data not yet written to the device
+#define BCACHE_DIRTY			((u32)(1<<0))
+// A task owns the buffer (its data is being read, written back or changed)
+#define BCACHE_BUSY				((u32)(1<<1))
+
+struct block_device;
+
+/* structure: bcache_buffer_t
+ * purpose:
+ * 	a cached device block. The cache lock is never held across device
+ * 	i/o or copies to and from the callers memory. Instead, a buffer is
+ * 	pinned (b_count) while a task uses it without the lock, and pinned
+ * 	buffers are never reused. A task reading from or writing to the
+ * 	device, or changing the data, owns the buffer (BCACHE_BUSY), and
+ * 	nobody else may use it until it is released.
+ */
+typedef struct _bcache_buffer
+{
+	dev_t					b_dev;		// device id this block belongs to
+	off_t					b_lba;		// block address on the device
+	u32						b_flags;	// BCACHE_* flags
+	u32						b_count;	// tasks using the buffer without the lock
+	u32						b_pass;		// last write-back pass which tried the buffer
+	size_t					b_size;		// size of b_data
+	struct block_device*	b_device;	// device used for write-back
+	char*					b_data;		// the cached block
+	list_t					b_hash;		// link in the hash chain
+	list_t					b_lru;		// link in the LRU list (most recent first)
+} bcache_buffer_t;
+
+typedef struct _bcache_stat
+{
+	u32 hits;			// blocks found in the cache
+	u32 misses;			// blocks read from the device
+	u32 writebacks;		// dirty blocks written to the device
+	u32 evictions;		// buffers reused for a different block
+	u32 prefetched;		// blocks read ahead by the readahead worker
+	u32 nbuffers;		// buffers currently allocated
+	u32 ndirty;			// buffers currently dirty
+	u32 capacity;		// maximum number of buffers
+} bcache_stat_t;
+
+/* function: bcache_init
+ * purpose:
+ * 	initialize the buffer cache and start the write-back and
+ * 	readahead workers.
+ * 	This must be called after the tasking subsystem is up.
+ */
+void bcache_init( void );
+/* function: bcache_read
+ * purpose:
+ * 	read `count` bytes starting at byte offset `off` of the
+ * 	device through the cache. Returns the number of bytes
+ * 	read or a negative error.
+ */
+ssize_t bcache_read(struct block_device* device, dev_t devid, off_t off, size_t count, char* buffer);
+/* function: bcache_write
+ * purpose:
+ * 	write `count` bytes at byte offset `off` into the cache. The
+ * 	data reaches the device on the next write-back pass, eviction
+ * 	or call to bcache_sync.
+ */
+ssize_t bcache_write(struct block_device* device, dev_t devid, off_t off, size_t count, const char* buffer);
+/* function: bcache_prefetch
+ * purpose:
+ * 	queue `count` blocks starting at block `lba` of the device to be
+ * 	read into the cache by the readahead worker. Blocks already
+ * 	cached are skipped. Returns -EAGAIN if the queue is full, in
+ * 	which case the request is simply dropped.
+ */
+int bcache_prefetch(struct block_device* device, dev_t devid, off_t lba, size_t count);
+/* function: bcache_sync
+ * purpose:
+ * 	write every dirty buffer belonging to a device back to disk.
+ */
+int bcache_sync(dev_t devid);
+/* function: bcache_sync_all
+ * purpose:
+ * 	write every dirty buffer in the cache back to disk.
+ */
+int bcache_sync_all( void );
+/* function: bcache_invalidate
+ * purpose:
+ * 	write back and drop every buffer belonging to the major
+ * 	device number of `devid`. Used when a driver goes away.
+ */
+void bcache_invalidate(dev_t devid);
+/* function: bcache_set_capacity
+ * purpose:
+ * 	change the maximum number of cached blocks. Clean buffers
+ * 	beyond the new limit are released immediately.
+ */
+void bcache_set_capacity(size_t nbuffers);
+/* function: bcache_stat
+ * purpose:
+ * 	retrieve a snapshot of the cache counters.
+ */
+void bcache_stat(bcache_stat_t* stat);
+
+#endif
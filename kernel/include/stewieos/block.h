@@ -79,6 +79,7 @@ int block_open(dev_t device);
 int block_close(dev_t device);
 ssize_t block_read(dev_t devid, off_t off, size_t count, char* buffer);
 int block_write(dev_t device, off_t lba, size_t count, const char* buffer);
+int block_prefetch(dev_t devid, off_t off, size_t count);
 int block_ioctl(dev_t device, int cmd, char* argp);
 
 
@@ -8,6 +8,17 @@
 struct filesystem;
 struct inode;
 struct mountpoint;
+struct superblock;
+
+// Number of dentry hash chains (must be a power of two)
+#define DENTRY_HASH_SIZE	512
+// Default number of unreferenced dentries kept in memory
+#define DENTRY_CACHE_DEFAULT	1024
+
+// The dentry is in the lookup hash
+#define DF_HASHED		((u32)(1<<0))
+// The name does not exist in the parent (cached -ENOENT lookup)
+#define DF_NEGATIVE		((u32)(1<<1))
 
 /* type: struct dentry
  * purpose:
@@ -35,11 +46,15 @@ struct dentry
 	
 	// List related items (lists we are a part of or lists we maintain)
 	size_t				d_ref;					// Reference count, so we know when to delete it
+	u32				d_flags;				// DF_* flags
+	u32				d_namehash;				// hash of d_name
 	struct dentry*			d_parent;				// the parent directory entry of this entry
 	list_t				d_fslink;				// Link in the filesystem's dentry list
 	list_t				d_sibling;				// link in the inodes dentry list
 	list_t				d_children;				// list of already loaded children (if this is a directory)
 	struct mountpoint*		d_mountpoint;				// mountpoint information (if mounted)
+	list_t				d_hash;					// link in the global lookup hash
+	list_t				d_lru;					// link in the unused dentry list (while d_ref == 0)
 };
 
 struct dentry*		d_alloc(const char* name, struct dentry* parent);	// allocate a new dentry pointing to inode with the name 'name'
@@ -49,5 +64,9 @@ void			d_free(struct dentry* dentry);				// free the dentry and associated resou
 struct dentry*		d_lookup(struct dentry* dir, const char* name);		// Look up a directory entry within a directory by name
 struct dentry*		d_get(struct dentry* dentry);				// increase the reference count for this dentry
 void			d_put(struct dentry* dentry);				// decrease the reference count for this dentry
+void			d_drop(struct dentry* dentry);				// remove a dentry from the lookup hash (e.g. after unlink)
+void			d_invalidate(struct dentry* dir, const char* name);	// forget a cached negative entry before creating `name`
+void			d_prune(struct superblock* super);			// free every unused dentry belonging to a superblock
+void			d_set_cache_limit(size_t count);			// set the number of unused dentries kept in memory
 
 #endif
@@ -3,6 +3,11 @@
 
 #include "stewieos/kernel.h"
 
+// Model specific registers read by the sysenter instruction
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
 #define IRQ0 32
 #define IRQ1 33
 #define IRQ2 34
@@ -173,6 +178,7 @@ void irq14( void );
 void irq15( void );
 
 void syscall_intr( void );
+void sysenter_entry( void );
 
 void isr_handler(struct regs regs);
 void irq_handler(struct regs regs);
@@ -8,6 +8,7 @@
 #include "stewieos/linkedlist.h"
 #include <dirent.h>
 #include "stewieos/chrdev.h"
+#include "stewieos/pcache.h"
 
 // Filesystem flags
 #define FS_NODEV		0x00000001
@@ -25,6 +26,22 @@
 
 #define FS_MAX_OPEN_FILES TASK_MAX_OPEN_FILES
 
+// Number of inode hash chains per superblock (must be a power of two)
+#define INODE_HASH_SIZE		256
+// Default number of unreferenced inodes kept in memory
+#define INODE_CACHE_DEFAULT	512
+#define inode_hashfn(ino)	((u32)(ino) & (INODE_HASH_SIZE-1))
+
+// Vectored I/O (the C library does not provide sys/uio.h)
+#ifndef IOV_MAX
+#define IOV_MAX				1024
+struct iovec
+{
+	void*	iov_base;		// start of the segment
+	size_t	iov_len;		// length of the segment
+};
+#endif
+
 #define FD_VALID_RANGE(fd)	( (fd) >= 0  && (fd) < FS_MAX_OPEN_FILES )
 #define FD_VALID(fd) ( (fd) >= 0 && (fd) < FS_MAX_OPEN_FILES && (current->t_vfs.v_openvect[(fd)].flags & FD_OCCUPIED) && !(current->t_vfs.v_openvect[(fd)].flags & FD_INVALID) )
 #define FD_ISPIPE(fd)		(current->t_vfs.v_openvect[(fd)].flags & (FD_RDPIPE | FD_WRPIPE))
@@ -88,6 +105,15 @@ struct file_operations
 	int(*ioctl)(struct file*, int, char*);
 	int(*fstat)(struct file*, struct stat*);
 	int(*isatty)(struct file*);
+	int(*fsync)(struct file*);
+	// Fill one page of a regular file at the given page aligned offset
+	// (zeros past the end of file). Files with this are read through
+	// the page cache.
+	int(*readpage)(struct file*, off_t, char*);
+	// Transfer a whole vector of segments at *pos in one call, and
+	// advance *pos (either the file offset or a pread/pwrite position).
+	ssize_t(*readv)(struct file*, const struct iovec*, int, off_t*);
+	ssize_t(*writev)(struct file*, const struct iovec*, int, off_t*);
 };
 
 /* type: struct filesystem_operations
@@ -143,6 +169,18 @@ struct superblock_operations
 	 * 		none
 	 */
 	void(*put_inode)(struct superblock*, struct inode*);
+	/*
+	 * function: sync
+	 * description:
+	 * 		Optional. Write every change the driver is holding back
+	 * 		(e.g. dirty inodes and allocation data) to the device.
+	 * 		The blocks may still sit in the buffer cache afterwards.
+	 * parameters:
+	 * 		superblock*: the superblock to synchronize
+	 * return value:
+	 * 		a negative errno.h constant or zero on success.
+	 */
+	int(*sync)(struct superblock*);
 };
 
 /* type: struct filesystem
@@ -187,6 +225,7 @@ struct superblock
 	struct filesystem*		s_fs;			// The file system this superblock belongs to
 	struct dentry*			s_root;			// The root directory entry (usually ino=0)
 	list_t				s_inode_list;		// list of inodes associated with this superblock
+	list_t				s_inode_hash[INODE_HASH_SIZE];	// inodes hashed by inode number
 	list_t				s_dentry_list;		// list of directory entries associated with this superblock (or, with its inodes)
 	struct superblock_operations*	s_ops;			// superblock operations implemented by the filesystem driver
 };
@@ -216,7 +255,10 @@ struct inode
 	size_t				i_ref;			// Reference counting
 	struct superblock*		i_super;		// pointer to the superblock this inode belongs to
 	list_t				i_sblink;		// Link in the superblocks inode list
+	list_t				i_hash;			// Link in the superblocks inode hash chain
+	list_t				i_lru;			// Link in the unused inode list (while i_ref == 0)
 	list_t				i_dentries;		// List of dentries linked to this inode
+	pcache_tree_t			i_pages;		// Cached pages of the file contents
 	struct inode_operations*	i_ops;			// The list of operations functions for this inode
 	struct file_operations*		i_default_fops;		// Default file operations for this inode
 };
@@ -308,6 +350,11 @@ struct vfs
 
 void initialize_filesystem( void );				// setup the filesystem for boot
 
+struct _kmem_cache;
+extern struct _kmem_cache* inode_cache;				// object cache for struct inode
+extern struct _kmem_cache* dentry_cache;			// object cache for struct dentry
+extern struct _kmem_cache* file_cache;				// object cache for struct file
+
 int register_filesystem(struct filesystem* fs);
 int unregister_filesystem(struct filesystem* fs);
 
@@ -316,6 +363,8 @@ struct filesystem* get_filesystem(const char* id);		// get a filesystem pointer
 struct inode*	i_getref(struct inode* inode);			// get a reference to an inode
 struct inode*	i_get(struct superblock* super, ino_t ino);	// get an inode from the superblock
 void		i_put(struct inode* inode);			// release a reference to an inode (possible free)
+void		i_prune(struct superblock* super);		// free every unused inode of a superblock
+void		i_set_cache_limit(size_t count);		// set the number of unused inodes kept in memory
 
 char* basename(const char * path);
 
@@ -352,12 +401,16 @@ int file_close(struct file* file);
 struct file* file_get(struct file* file);
 ssize_t file_read(struct file* file, void* buf, size_t count);
 ssize_t file_write(struct file* file, const void* buf, size_t count);
+ssize_t file_splice(struct file* out, struct file* in, off_t* offset, size_t count);
+ssize_t file_readv(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos);
+ssize_t file_writev(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos);
 off_t file_seek(struct file* file, off_t offsets, int whence);
 int file_ioctl(struct file* file, int request, char* argp);
 int file_stat(struct file* file, struct stat* buf);
 int file_readdir(struct file* file, struct dirent* dirent, size_t count);
 int file_isatty(struct file* file);
 int file_flush(struct file* file);
+int file_sync(struct file* file);
 
 /* Unix System Call Definitions
  * 
@@ -390,6 +443,13 @@ int sys_getcwd(char* buf, size_t count);
 int sys_pipe(int* pipefd);
 int sys_dup2(int newfd, int oldfd);
 int sys_unlink(const char* pathname);
+int sys_fsync(int fd);
+void sys_sync( void );
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t* offset, size_t count);
+ssize_t sys_readv(int fd, const struct iovec* iov, int iovcnt);
+ssize_t sys_writev(int fd, const struct iovec* iov, int iovcnt);
+ssize_t sys_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t sys_pwrite(int fd, const void* buf, size_t count, off_t offset);
 
 int sys_resfd( void );
 void sys_relfd( int fd );
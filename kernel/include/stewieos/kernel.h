@@ -164,6 +164,7 @@ unsigned long inl(unsigned short port);
 
 void cpuid(int code, u32* a, u32* d);
 u32 cpuid_string(int code, char* str);
+void wrmsr(u32 msr, u32 lo, u32 hi);
 
 u32 enablei( void );
 u32 disablei( void );
@@ -28,15 +28,32 @@ typedef struct footer
 	header_t* header;
 } footer_t;
 
+// Holes are kept in power-of-two size bins. Bin `i` holds the holes
+// with 2^i <= size < 2^(i+1), each bin sorted by size.
+#define KHEAP_NBINS 32
+#define heap_bin_index(size) ((u32)(31 - __builtin_clz((u32)(size))))
+
 typedef struct heap
 {
 	void* memstart;
 	void* memend;
 	void* memmax;
-	list_t holes;
+	list_t bins[KHEAP_NBINS];	// holes, segregated by size
+	u32 binmap;					// bit `i` set if bins[i] is not empty
+	size_t nholes;				// number of holes in the bins
+	size_t free;				// bytes held in holes (including overhead)
 	spinlock_t lock;
 } heap_t;
 
+typedef struct heap_stat
+{
+	size_t size;			// bytes currently mapped for the heap
+	size_t free;			// bytes held in holes
+	size_t nholes;			// number of holes
+	size_t largest;			// size of the largest hole
+	u32 fragmentation;		// percentage of free memory outside the largest hole
+} heap_stat_t;
+
 // Initialize the heap structure and hole list
 void heap_init(heap_t* heap, void* start, void* end);
 // Expand the heap by at least 1 page, and at most `reqd` (rounded up to page boundary)
@@ -51,6 +68,8 @@ void* heap_alloc(heap_t* heap, size_t size, int align);
 void heap_free(heap_t* heap, void* data);
 // Compare two heads based on header size (for ordered list generation)
 int heap_compare_headers(list_t* v1, list_t* v2);
+// Retrieve the size and fragmentation of the heap
+void heap_stat(heap_t* heap, heap_stat_t* stat);
 
 static inline void head_init(header_t* head, size_t size)
 {
@@ -63,8 +82,23 @@ static inline void head_init(header_t* head, size_t size)
 
 static inline void heap_add_hole(heap_t* heap, header_t* head)
 {
+	u32 bin = heap_bin_index(head->size);
 	head_init(head, head->size);
-	list_add_ordered(&head->link, &heap->holes, heap_compare_headers);
+	list_add_ordered(&head->link, &heap->bins[bin], heap_compare_headers);
+	heap->binmap |= 1u << bin;
+	heap->nholes++;
+	heap->free += head->size;
+}
+
+static inline void heap_rem_hole(heap_t* heap, header_t* head)
+{
+	u32 bin = heap_bin_index(head->size);
+	list_rem(&head->link);
+	if( list_empty(&heap->bins[bin]) ){
+		heap->binmap &= ~(1u << bin);
+	}
+	heap->nholes--;
+	heap->free -= head->size;
 }
 
 // Kernel Specific heap functions
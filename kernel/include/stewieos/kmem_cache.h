@@ -0,0 +1,83 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+#include "stewieos/kernel.h"
+#include "stewieos/linkedlist.h"
+#include "stewieos/spinlock.h"
+
+// Minimum number of objects carved from each slab
+#define KMEM_SLAB_MIN_OBJECTS	8
+// Number of completely free slabs a cache keeps around for reuse
+#define KMEM_CACHE_MAX_EMPTY	1
+
+typedef void(*kmem_ctor_t)(void* object);
+
+struct _kmem_slab;
+
+/* structure: kmem_cache_t
+ * purpose:
+ * 	a cache of fixed size objects of a single type. Objects come from
+ * 	slabs allocated on the kernel heap, and are handed out from the
+ * 	slab free-lists without touching the heap hole list.
+ */
+typedef struct _kmem_cache
+{
+	const char*		name;		// name for diagnostics
+	size_t			objsize;	// size of each object
+	size_t			slotsize;	// size of each object plus its bookkeeping
+	size_t			slabsize;	// bytes allocated for each slab
+	u32				perslab;	// objects in each slab
+	kmem_ctor_t		ctor;		// constructor run once per object when its slab is created
+
+	list_t			partial;	// slabs with some objects free
+	list_t			full;		// slabs with no objects free
+	list_t			empty;		// slabs with every object free
+	u32				nempty;		// number of slabs in `empty`
+
+	u32				nslabs;		// slabs currently allocated
+	u32				nactive;	// objects currently allocated
+	u32				nallocs;	// total allocations
+	u32				nfrees;		// total frees
+
+	spinlock_t		lock;		// protects everything above
+	list_t			link;		// link in the global cache list
+} kmem_cache_t;
+
+/* function: kmem_cache_create
+ * purpose:
+ * 	create a cache for objects of `size` bytes. If `ctor` is given, it
+ * 	is run once for each object when its slab is created (not on each
+ * 	allocation), so objects should be freed back in their constructed
+ * 	state.
+ * returns:
+ * 	the new cache or NULL if out of memory.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, kmem_ctor_t ctor);
+/* function: kmem_cache_destroy
+ * purpose:
+ * 	release every slab of a cache, and the cache itself. Returns
+ * 	-EBUSY if objects are still allocated.
+ */
+int kmem_cache_destroy(kmem_cache_t* cache);
+/* function: kmem_cache_alloc
+ * purpose:
+ * 	allocate an object from the cache, or NULL if out of memory.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+/* function: kmem_cache_free
+ * purpose:
+ * 	return an object to the cache it was allocated from.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+/* function: kmem_cache_shrink
+ * purpose:
+ * 	return every completely free slab to the kernel heap.
+ */
+void kmem_cache_shrink(kmem_cache_t* cache);
+/* function: kmem_cache_reap
+ * purpose:
+ * 	shrink every cache in the system.
+ */
+void kmem_cache_reap( void );
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _MEMCTL_H_
+#define _MEMCTL_H_
+
+#include "stewieos/kernel.h"
+
+// Copy a statistics structure out to the argument
+#define MEMCTL_FRAME_STAT		0	/* pmm_stat_t (pmm.h) */
+#define MEMCTL_HEAP_STAT		1	/* heap_stat_t of the kernel heap (kheap.h) */
+#define MEMCTL_BCACHE_STAT		2	/* bcache_stat_t (bcache.h) */
+// Set a cache limit to the argument
+#define MEMCTL_BCACHE_CAPACITY	3	/* buffers kept by the buffer cache */
+#define MEMCTL_INODE_LIMIT		4	/* unused inodes kept in memory */
+#define MEMCTL_DENTRY_LIMIT		5	/* unused dentries kept in memory */
+
+/* function: sys_memctl
+ * purpose:
+ * 	query the memory and cache statistics, or size the caches.
+ * parameters:
+ * 	cmd - one of the MEMCTL_* commands
+ * 	arg - the structure to fill for a statistics command, or the new
+ * 		limit (cast to a pointer) for a limit command
+ * return value:
+ * 	zero or a negative error value.
+ */
+int sys_memctl(int cmd, void* arg);
+
+#endif
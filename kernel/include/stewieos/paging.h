@@ -22,7 +22,10 @@ typedef struct page
 	u32 user		: 1;	// Are users aloud to read/write?
 	u32 accessed	: 1;	// Has the page been accessed since last refresh
 	u32 dirty		: 1;	// Has the page been written to since last refresh
-	u32 unused		: 7;	// Unused bits
+	u32 unused		: 4;	// Unused bits
+	u32 cow			: 1;	// Shared copy-on-write frame (available bit 9)
+	u32 shared		: 1;	// Page cache frame of a MAP_SHARED mapping (available bit 10)
+	u32 avail		: 1;	// Available for kernel use
 	u32 frame		: 20;	// The Frame address (shifted right 12 bits)
 } page_t;
 
@@ -130,6 +133,19 @@ int copy_page_table(page_dir_t* dest, page_dir_t* srce, int tbl);
 
 int strip_page_dir(page_dir_t* dir);
 
+/*! \brief Give a copy-on-write page its own private frame
+ * 
+ * If the page at the given address is marked copy-on-write, it is
+ * made writable again. If the frame is still shared with another
+ * address space, a new frame is allocated and the contents copied,
+ * otherwise the existing frame is simply reused.
+ * 
+ * \param dir the directory containing the page
+ * \param virt the virtual address of the page
+ * \return 0 on success or -EFAULT if the page is not copy-on-write.
+ */
+int page_resolve_cow(page_dir_t* dir, void* virt);
+
 
 /*! \brief Translate a virtual to physical address.
  * 
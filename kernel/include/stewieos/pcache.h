@@ -0,0 +1,140 @@
+#ifndef _PCACHE_H_
+#define _PCACHE_H_
+
+#include "stewieos/kernel.h"
+#include "stewieos/linkedlist.h"
+#include "stewieos/paging.h"
+
+// Kernel window the cached pages are mapped into (one slot per page). Only
+// the page cache maps pages here; AcpiOsMapMemory allocates above KDATA_ADDR.
+#define PCACHE_BASE				0xF0000000
+#define PCACHE_PAGES			8192
+// Frames left free for everything else before the cache reuses its own pages
+#define PCACHE_MIN_FREE			256
+// Pages released at once when memory runs low
+#define PCACHE_RECLAIM_BATCH	32
+// Times pcache_map yields while another task fills the page
+#define PCACHE_MAP_TRIES		16
+
+// Index bits resolved by each level of the per-inode radix tree
+#define PCACHE_RADIX_SHIFT		6
+#define PCACHE_RADIX_SLOTS		(1<<PCACHE_RADIX_SHIFT)
+#define PCACHE_RADIX_MASK		(PCACHE_RADIX_SLOTS-1)
+
+// The page holds the file contents
+#define PCACHE_UPTODATE			((u32)(1<<0))
+// The file was written while the page was being filled
+#define PCACHE_STALE			((u32)(1<<1))
+
+struct inode;
+struct file;
+
+// Receives data handed over by pcache_splice or pipe_splice. Returns the
+// number of bytes taken (a short count stops the transfer) or an error.
+typedef ssize_t(*splice_actor_t)(void* ctx, const char* data, size_t count);
+
+typedef struct _pcache_node
+{
+	void*					slots[PCACHE_RADIX_SLOTS];	// child nodes, or pages at the lowest level
+	u32						count;						// slots in use
+} pcache_node_t;
+
+/* structure: pcache_tree_t
+ * purpose:
+ * 	the cached pages of an inode, indexed by page number within the
+ * 	file. A tree of height h holds the indices below 64^h.
+ */
+typedef struct _pcache_tree
+{
+	pcache_node_t*			root;		// top level node (NULL when empty)
+	u32						height;		// number of levels below root
+	list_t					pages;		// every page in the tree
+} pcache_tree_t;
+
+typedef struct _pcache_page
+{
+	struct inode*			p_inode;	// owning inode (NULL once detached)
+	u32						p_index;	// page number within the file
+	u32						p_flags;	// PCACHE_* flags
+	u32						p_count;	// users copying to or from the page
+	u32						p_frame;	// physical frame (0 while the slot is free)
+	list_t					p_lru;		// link in the LRU list (most recent first) or free list
+	list_t					p_link;		// link in the inode page list
+} pcache_page_t;
+
+typedef struct _pcache_stat
+{
+	u32 hits;			// pages found in the cache
+	u32 misses;			// pages read through the filesystem
+	u32 bypassed;		// pages read around the cache
+	u32 reclaimed;		// pages given back to the frame allocator
+	u32 npages;			// pages currently cached
+} pcache_stat_t;
+
+/* function: pcache_init
+ * purpose:
+ * 	set up the page cache, and register it with the frame allocator
+ * 	so it is shrunk when physical memory runs out.
+ */
+void pcache_init( void );
+/* function: pcache_read
+ * purpose:
+ * 	read `count` bytes at `offset` of a regular file through the page
+ * 	cache. Missing pages are filled with file->f_ops->readpage. The
+ * 	file offset is not changed.
+ * returns:
+ * 	the number of bytes read (short at the end of the file) or a
+ * 	negative error.
+ */
+ssize_t pcache_read(struct file* file, off_t offset, char* buffer, size_t count);
+/* function: pcache_splice
+ * purpose:
+ * 	like pcache_read, but pass the cached pages to `actor` in place
+ * 	instead of copying them to a buffer.
+ * returns:
+ * 	the number of bytes the actor took, or a negative error.
+ */
+ssize_t pcache_splice(struct file* file, off_t offset, size_t count, splice_actor_t actor, void* ctx);
+/* function: pcache_update
+ * purpose:
+ * 	copy data just written through the filesystem into any cached
+ * 	pages covering it.
+ */
+void pcache_update(struct inode* inode, off_t offset, const char* buffer, size_t count);
+/* function: pcache_truncate
+ * purpose:
+ * 	drop the cached pages past `size`, and clear the tail of the
+ * 	page holding the new end of file.
+ */
+void pcache_truncate(struct inode* inode, off_t size);
+/* function: pcache_release
+ * purpose:
+ * 	drop every cached page of an inode which is being freed.
+ */
+void pcache_release(struct inode* inode);
+/* function: pcache_reclaim
+ * purpose:
+ * 	give up to `count` of the least recently used pages back to the
+ * 	frame allocator. This is safe with interrupts disabled.
+ * returns:
+ * 	the number of pages released.
+ */
+u32 pcache_reclaim(u32 count);
+/* function: pcache_map
+ * purpose:
+ * 	point the page table entry `entry` at the cached frame holding page
+ * 	`index` of a regular file, reading it in if needed. Only the frame
+ * 	is set; the caller fills in the access rights. The entry holds a
+ * 	reference to the frame, and the page is not reclaimed while any
+ * 	entry does, so every mapping of the file offset shares it.
+ * returns:
+ * 	zero on success or a negative error.
+ */
+int pcache_map(struct file* file, u32 index, page_t* entry);
+/* function: pcache_stat
+ * purpose:
+ * 	retrieve a snapshot of the cache counters.
+ */
+void pcache_stat(pcache_stat_t* stat);
+
+#endif
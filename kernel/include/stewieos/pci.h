@@ -13,6 +13,12 @@ typedef u8 pci_byte_t;
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA 0xCFC
 
+// Configuration space command register and its flags
+#define PCI_COMMAND			0x04
+#define PCI_COMMAND_IO			0x0001
+#define PCI_COMMAND_MEMORY		0x0002
+#define PCI_COMMAND_BUS_MASTER		0x0004
+
 #define PCI_IS_MULTIFUNCTION(ht)	(((ht) & 0x80) > 0)
 
 typedef struct _pci_class
@@ -48,6 +54,8 @@ typedef struct _pci_address_limit_pair
 
 pci_dword_t pci_config_read_dword(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset);
 pci_word_t pci_config_read_word(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset);
+void pci_config_write_dword(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset, pci_dword_t value);
+void pci_config_write_word(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset, pci_word_t value);
 
 struct _pci_device;
 typedef struct _pci_device pci_device_t;
@@ -6,29 +6,53 @@
 #include "stewieos/spinlock.h"
 #include "stewieos/fs.h"
 #include "stewieos/linkedlist.h"
+#include "stewieos/sem.h"
 
-#define KERNEL_PIPE_LENGTH 1024
+// Default capacity of a pipe, and the limits for PIPE_SETSZ
+#define KERNEL_PIPE_LENGTH	4096
+#define PIPE_MIN_LENGTH		256
+#define PIPE_MAX_LENGTH		65536
+
+// ioctl requests to query and change the capacity of a pipe. The
+// argument points to an int.
+#define PIPE_GETSZ			0x7001
+#define PIPE_SETSZ			0x7002
 
 typedef struct _pipe
 {
-	char* buffer;
-	size_t length;
-	char* read;
-	char* write;
-	size_t nreaders;
-	size_t nwriters;
-	spinlock_t wrlock;
-	spinlock_t rdlock;
+	char* buffer;			// ring buffer
+	size_t length;			// capacity of the ring
+	size_t head;			// offset of the next byte to read
+	size_t count;			// bytes waiting to be read
+	size_t nreaders;		// open files which can read
+	size_t nwriters;		// open files which can write
+	int had_reader;			// a reader has opened the pipe at some point
+	spinlock_t lock;		// protects the ring and wait counts (taken with interrupts disabled)
+	sem_t* readable;		// signalled once for each reader waiting on data
+	sem_t* writable;		// signalled once for each writer waiting on room
+	size_t rwait;			// readers waiting on readable
+	size_t wwait;			// writers waiting on writable
+	mutex_t* rdmutex;		// held by the reader handing data out
+	int splicing;			// data is being handed out without the lock
 	struct inode* inode; // the inode which this pipe refers to on disk
-	struct task* reader;
 	list_t link;
 } pipe_t;
 
 int pipe_open(struct file* file, struct dentry* dentry, int mode);
 ssize_t pipe_read(struct file* pipe, char* buffer, size_t count);
 ssize_t pipe_write(struct file* pipe, const char* buffer, size_t count);
+/* function: pipe_splice
+ * purpose:
+ * 	pass up to `count` bytes waiting in the pipe to `actor` straight
+ * 	from the ring buffer. Only what the actor takes is consumed.
+ * returns:
+ * 	the number of bytes taken, 0 at the end of file, or a negative
+ * 	error.
+ */
+ssize_t pipe_splice(struct file* file, size_t count, splice_actor_t actor, void* ctx);
+int pipe_ioctl(struct file* file, int cmd, char* argp);
 int pipe_close(struct file* file, struct dentry* dentry);
 
 extern struct file_operations pipe_operations;
 
-#endif
\ No newline at end of file
+#endif
@@ -3,19 +3,41 @@
 
 #include "stewieos/kernel.h"
 #include "stewieos/paging.h"
+#include "stewieos/linkedlist.h"
 
 #define FRAME_TO_ADDR(frame) ((frame) << 12)
 #define ADDR_TO_FRAME(addr) ((addr) >> 12)
 
-u32 find_free_frame( void );					// Find the next free frame in memory
-void reserve_frame(u32 frame);					// Reserve a frame in memory
-void release_frame(u32 frame);					// Release a previously reserved frame
+// Largest buddy block is 2^PMM_MAX_ORDER frames (4MB)
+#define PMM_MAX_ORDER 10
+// Marks a frame which is not the head of a free buddy block
+#define PMM_ORDER_NONE 0xFF
+
+typedef struct pmm_stat
+{
+	u32 total;						// frames managed by the allocator
+	u32 free;						// frames currently free
+	u32 nfree[PMM_MAX_ORDER+1];		// free blocks of each order
+} pmm_stat_t;
+
+void reserve_frame(u32 frame);					// Reserve a frame in memory (boot time only)
+void release_frame(u32 frame);					// Release a previously reserved frame (boot time only)
+
+void init_frame_buddy( void );					// Allocate the buddy allocator structures
+void fill_frame_buddy( void );					// Hand every released frame to the buddy allocator
+u32 alloc_frames(u32 order);					// Allocate 2^order contiguous frames
+void free_frames(u32 frame, u32 order);				// Release 2^order contiguous frames
+void frame_stat(pmm_stat_t* stat);				// Retrieve the per-order free counts
+void frame_set_reclaim(u32(*reclaim)(u32));			// Register a function which frees frames when none are left
 
 void clone_frame(page_t* dest, page_t* src);			// Map a page to the same frame as antoher page
-void alloc_frame(page_t* page, int user, int rw);		// Allocate a frame for a virtual page
+void alloc_frame(page_t* page, int user, int rw);		// Allocate a frame for a virtual page (halts when out of memory)
+int try_alloc_frame(page_t* page, int user, int rw);		// Allocate a frame for a virtual page, or return -ENOMEM
 void free_frame(page_t* page);					// Release the frame which belongs to a virtual page
 
-void push_frame(u32 frame);					// push (free) a frame
-u32 pop_frame( void );						// pop (alloc) a frame
+void init_frame_refs( void );					// Allocate the frame reference counts
+u32 frame_refcount(u32 frame);					// Number of pages currently mapping a frame
+void frame_get(u32 frame);					// Take another reference to a frame
+void frame_put(u32 frame);					// Drop a reference, freeing the frame with the last one
 
-#endif
\ No newline at end of file
+#endif
@@ -4,10 +4,42 @@
 #include <sys/syscall.h>
 #include "stewieos/descriptor_tables.h"
 
+/* Calls the C library's sys/syscall.h does not number yet. They are
+ * numbered after its SYSCALL_COUNT, and SYSCALL_TABLE_SIZE covers both.
+ */
+#define SYSCALL_SYNC			(SYSCALL_COUNT+0)
+#define SYSCALL_FSYNC			(SYSCALL_COUNT+1)
+#define SYSCALL_MMAP			(SYSCALL_COUNT+2)
+#define SYSCALL_MUNMAP			(SYSCALL_COUNT+3)
+#define SYSCALL_MPROTECT		(SYSCALL_COUNT+4)
+#define SYSCALL_SENDFILE		(SYSCALL_COUNT+5)
+#define SYSCALL_READV			(SYSCALL_COUNT+6)
+#define SYSCALL_WRITEV			(SYSCALL_COUNT+7)
+#define SYSCALL_PREAD			(SYSCALL_COUNT+8)
+#define SYSCALL_PWRITE			(SYSCALL_COUNT+9)
+#define SYSCALL_MEMCTL			(SYSCALL_COUNT+10)
+#define SYSCALL_TABLE_SIZE		(SYSCALL_COUNT+11)
+
+/* System calls are made with int 0x80, with the number in eax and the
+ * arguments in ebx, ecx, edx, esi, edi and ebp, and the result in eax.
+ *
+ * Processors with sysenter may use it instead (CPUID.01H:EDX bit 11).
+ * It does not save the user stack or return address, so the caller
+ * pushes the third and then the second argument, and passes its stack
+ * pointer in ecx and the address to return to in edx:
+ * 
+ * 	push edx; push ecx; mov ecx,esp; mov edx,1f; sysenter
+ * 	1: pop ecx; pop edx
+ * 
+ * The other registers are the same as for int 0x80. If the stack cannot
+ * be read, the call fails with -EFAULT.
+ */
+
 typedef void(*syscall_handler_t)(struct regs* regs);
 
 #define DECL_SYSCALL(name) void name(struct regs* regs)
 
 void syscall_handler(struct regs* regs);
+void sysenter_handler(struct regs* regs);
 
 #endif
\ No newline at end of file
@@ -55,6 +55,9 @@
 #define TASK_STACK_INIT_SIZE	0x4000
 #define TASK_STACK_INIT_BASE	(KERNEL_VIRTUAL_BASE-TASK_STACK_INIT_SIZE)
 #define TASK_MAX_ARG_SIZE	(TASK_STACK_INIT_SIZE/2)
+// Addresses handed out by mmap when the caller does not pick one
+#define TASK_MMAP_BASE			0x80000000
+#define TASK_MMAP_END			0xB0000000
 
 #define TASK_MAX_OPEN_FILES 1024
 
@@ -67,6 +70,9 @@
 // unused anyway).
 #define schedule() task_preempt((struct regs*)(NULL))
 
+// Messages with at most this much data come from a fixed size cache
+#define MESG_CACHE_LENGTH 128
+
 typedef struct _message_container
 {
 	list_t link;
@@ -116,6 +122,7 @@ struct task
 	list_t				t_globlink;				// link in the global list
 	list_t				t_ttywait;				// link in the tty wait list
 	list_t				t_semlink;				// semaphore wait list
+	list_t				t_vmas;					// demand paged areas (see vm.h)
 	struct task*		t_parent;				// the parent of this task
 };
 
@@ -145,6 +152,9 @@ int sys_fork( void );
 void sys_exit( int result );
 pid_t sys_waitpid(pid_t pid, int* status, int options);
 
+void message_init( void );
+message_container_t* message_alloc(size_t length);
+void message_free(message_container_t* container);
 int sys_message_send(pid_t pid, unsigned int type, const char* what, size_t length);
 int sys_message_pop(message_t* message, unsigned int id, unsigned int flags);
 // Raise a signal for yourself or another process
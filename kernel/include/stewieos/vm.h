@@ -0,0 +1,118 @@
+#ifndef _VM_H_
+#define _VM_H_
+
+#include "stewieos/kernel.h"
+#include "stewieos/linkedlist.h"
+
+// Access rights of a virtual memory area
+#define VM_READ		((u32)(1<<0))
+#define VM_WRITE	((u32)(1<<1))
+#define VM_EXEC		((u32)(1<<2))
+// Writes to the area go back to the file (MAP_SHARED)
+#define VM_SHARED	((u32)(1<<3))
+
+// mmap protection and flags (the C library does not provide sys/mman.h)
+#ifndef PROT_READ
+#define PROT_NONE		0x0
+#define PROT_READ		0x1
+#define PROT_WRITE		0x2
+#define PROT_EXEC		0x4
+#endif
+#ifndef MAP_SHARED
+#define MAP_SHARED		0x01
+#define MAP_PRIVATE		0x02
+#define MAP_FIXED		0x10
+#define MAP_ANONYMOUS	0x20
+#endif
+#ifndef MAP_FAILED
+#define MAP_FAILED		((void*)-1)
+#endif
+
+struct task;
+struct file;
+
+/* structure: vm_area_t
+ * purpose:
+ * 	a range of a tasks address space which is populated on demand
+ * 	by the page fault handler. The bytes in [vm_filestart, vm_filestart+
+ * 	vm_filesz) are read from vm_file at vm_offset, and everything else
+ * 	in the area is zero filled.
+ */
+typedef struct _vm_area
+{
+	u32				vm_start;		// first page of the area
+	u32				vm_end;			// first page after the area
+	u32				vm_flags;		// VM_* access rights
+	struct file*	vm_file;		// backing file (or NULL for anonymous memory)
+	off_t			vm_offset;		// file offset of vm_filestart
+	u32				vm_filestart;	// first address backed by the file
+	size_t			vm_filesz;		// number of bytes backed by the file
+	list_t			vm_link;		// link in the task area list (sorted by address)
+} vm_area_t;
+
+/* function: vm_init
+ * purpose:
+ * 	create the vm_area object cache.
+ */
+void vm_init( void );
+/* function: vm_map
+ * purpose:
+ * 	add a demand paged area to a task. `start` and `end` are rounded
+ * 	out to page boundaries. The task takes its own reference to `file`.
+ * returns:
+ * 	zero on success or a negative error.
+ */
+int vm_map(struct task* task, u32 start, u32 end, u32 flags, struct file* file, off_t offset, u32 filestart, size_t filesz);
+/* function: vm_fault
+ * purpose:
+ * 	populate the page holding `address` if it belongs to one of the
+ * 	tasks areas and is not present yet.
+ * returns:
+ * 	zero if the page is present on return, -EFAULT if the address is
+ * 	not in any area, or another negative error if the read failed.
+ */
+int vm_fault(struct task* task, u32 address);
+/* function: vm_copy
+ * purpose:
+ * 	duplicate the area list of `src` into `dst` (used by fork).
+ * 	Each copy gets its own open file so the file offsets are
+ * 	not shared.
+ */
+int vm_copy(struct task* dst, struct task* src);
+/* function: vm_release
+ * purpose:
+ * 	remove every area from a task and drop the file references.
+ */
+void vm_release(struct task* task);
+/* function: vm_sync
+ * purpose:
+ * 	write the modified pages of shared file mappings in [start, end)
+ * 	back to their files. The task must be the current task.
+ */
+void vm_sync(struct task* task, u32 start, u32 end);
+/* function: vm_unmap
+ * purpose:
+ * 	remove the page aligned range [start, end) from the areas of the
+ * 	current task, splitting areas which only partly overlap it. Shared
+ * 	mappings are written back, and every page in the range is freed.
+ * returns:
+ * 	zero on success or a negative error.
+ */
+int vm_unmap(struct task* task, u32 start, u32 end);
+/* function: vm_protect
+ * purpose:
+ * 	change the VM_READ/VM_WRITE/VM_EXEC rights of the page aligned
+ * 	range [start, end) of the current task, including pages which
+ * 	are already present.
+ * returns:
+ * 	zero on success, -ENOMEM if part of the range is not mapped, or
+ * 	-EACCES if a shared mapping of a read only file would become
+ * 	writable.
+ */
+int vm_protect(struct task* task, u32 start, u32 end, u32 flags);
+
+void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+int sys_munmap(void* addr, size_t length);
+int sys_mprotect(void* addr, size_t length, int prot);
+
+#endif
@@ -2,6 +2,7 @@
 #include "kmem.h"
 #include "paging.h"
 #include "task.h"
+#include "kdata.h"
 #include "acpi/acpi.h"
 
 /* Map a physical address to a virtual one */
@@ -14,7 +15,7 @@ void *AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS PhysicalAddress,
 	}
 	
 	// Local Variables
-	u32 vaddr = 0xF0000000; // virtual address
+	u32 vaddr = KDATA_ADDR + 0x1000; // virtual address (above the page cache window and data page)
 	page_t* page = NULL; // page for the virtual address
 	u32 physical_page ATTR((unused)) = PhysicalAddress & 0xFFFFF000; // physical page address
 	u32 page_count = Length + (PhysicalAddress & 0xFFF); // page page
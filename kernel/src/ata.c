@@ -6,6 +6,10 @@
 #include "stewieos/timer.h"
 #include "stewieos/fs.h"
 #include "stewieos/block.h"
+#include "stewieos/kmem.h"
+#include "stewieos/paging.h"
+#include "stewieos/descriptor_tables.h"
+#include "stewieos/task.h"
 
 int ide_block_open(struct block_device* device, dev_t devid);
 int ide_block_close(struct block_device* device, dev_t devid);
@@ -24,6 +28,11 @@ struct block_operations ide_block_operations = {
 // Forward Declarations
 static inline void ata_wait( u8 channel );
 void ata_write_block(u8 channel, u8 reg, u8* buffer);
+static void ata_dma_complete(u8 channel);
+static void ata_irq_handler(struct regs* regs, void* context);
+static u8 ata_ready_status(u8 channel);
+static u32 ata_max_sectors(ide_device_t* dev);
+static void ata_load_taskfile(ide_device_t* dev, int lba48, u32 lba, u32 count);
 
 static const char* ATA_DEVICE_TYPE_NAME[2] = { "ATA", "ATAPI" };
 
@@ -53,6 +62,10 @@ int ide_load( void )
 		syslog(KERN_NOTIFY, "ide: registered block device under major number %d.\n", major);
 	}
 	
+	if( ATA_BENCHMARK_SECTORS != 0 ){
+		ide_benchmark(0, ATA_BENCHMARK_SECTORS);
+	}
+	
 	return 0;
 }
 
@@ -96,32 +109,47 @@ int ide_block_close(struct block_device* device, dev_t devid)
 	return 0;
 }
 
-int ide_block_read(struct block_device* device, dev_t devid, off_t lba, size_t count, char* buffer)
+// Split a request into commands the disk can handle
+static int ide_block_transfer(dev_t devid, u8 direction, off_t lba, size_t count, char* buffer)
 {
-	UNUSED(device);
 	u8 min = (u8)minor(devid);
 	u8 d = (min & 0x0f);
 	u8 p = ((min & 0xf0) >> 4);
+	ide_device_t* dev = &ide_device[d];
+	ata_partition_t* part = &dev->part[p];
 	
-	if( (lba+count) >= ide_device[d].part[p].lba_end ){
+	if( lba < 0 || ((u32)lba + count) > (part->lba_end - part->lba_start) ){
 		return -EFAULT;
 	}
 	
-	return ata_pio_transfer(ide_device[d].channel, ide_device[d].drive, ATA_PIO_READ, lba + ide_device[d].part[p].lba_start, (u8)count, buffer);
+	u32 sector = part->lba_start + (u32)lba;
+	u32 max = ata_max_sectors(dev);
+	
+	while( count != 0 )
+	{
+		u32 n = count < max ? (u32)count : max;
+		int error = ata_transfer(d, direction, sector, n, buffer);
+		if( error != 0 ){
+			return error;
+		}
+		sector += n;
+		count -= n;
+		buffer += ATA_SECTOR_TO_BYTE(n);
+	}
+	
+	return 0;
+}
+
+int ide_block_read(struct block_device* device, dev_t devid, off_t lba, size_t count, char* buffer)
+{
+	UNUSED(device);
+	return ide_block_transfer(devid, ATA_PIO_READ, lba, count, buffer);
 }
 
 int ide_block_write(struct block_device* device, dev_t devid, off_t lba, size_t count, const char* buffer)
 {
 	UNUSED(device);
-	u8 min = (u8)minor(devid);
-	u8 d = (min & 0x0f);
-	u8 p = ((min & 0xf0) >> 4);
-	
-	if( (lba+count) >= ide_device[d].part[p].lba_end ){
-		return -EFAULT;
-	}
-	
-	return ata_pio_transfer(ide_device[d].channel, ide_device[d].drive, ATA_PIO_WRITE, lba + ide_device[d].part[p].lba_start, (u8)count, (void*)buffer);
+	return ide_block_transfer(devid, ATA_PIO_WRITE, lba, count, (char*)buffer);
 }
 
 static inline void ata_wait( u8 channel )
@@ -181,8 +209,33 @@ int ide_initialize( void )
 	ata_write_reg(ATA_SECONDARY, ATA_REG_CONTROL, 0);
 	
 	// Disable IRQs
-	ata_write_reg(ATA_PRIMARY, ATA_REG_CONTROL, 2);
-	ata_write_reg(ATA_SECONDARY, ATA_REG_CONTROL, 2);
+	ata_disable_irq(ATA_PRIMARY);
+	ata_disable_irq(ATA_SECONDARY);
+	
+	// Channels in native mode use the PCI interrupt line, others
+	// use the legacy IRQ14/IRQ15 lines.
+	for(u8 channel = 0; channel < 2; ++channel)
+	{
+		if( device->class.progif & (1 << (channel*2)) ){
+			ide_channel[channel].irq = (u8)(IRQ0 + device->header.basic.interrupt_line);
+		} else {
+			ide_channel[channel].irq = (u8)(channel == ATA_PRIMARY ? IRQ14 : IRQ15);
+		}
+		ide_channel[channel].irq_pending = 0;
+		ide_channel[channel].waiter = NULL;
+		ide_channel[channel].lock = mutex_alloc();
+		if( ide_channel[channel].lock == NULL ){
+			syslog(KERN_PANIC, "ide: unable to allocate channel lock!\n");
+			return -ENOMEM;
+		}
+		register_interrupt_context(ide_channel[channel].irq, NULL, ata_irq_handler);
+		ata_enable_irq(channel);
+	}
+	
+	// Setup bus mastering if the controller supports it
+	if( ata_dma_initialize(device) != 0 ){
+		syslog(KERN_WARN, "ide: bus master dma unavailable. using pio mode.\n");
+	}
 	
 	for(int i = 0; i < 4; ++i)
 	{
@@ -218,9 +271,13 @@ int ide_initialize( void )
 			ide_device[ndevs].sig = *((u16*)(ide_buffer + ATA_IDENT_DEVICETYPE));
 			ide_device[ndevs].cap = *((u16*)(ide_buffer + ATA_IDENT_CAPABILITIES));
 			ide_device[ndevs].command_set = *((u32*)(ide_buffer + ATA_IDENT_COMMANDSETS));
+			ide_device[ndevs].dma = (u8)( ide_channel[channel].dma && type == ATA_TYPE_ATA && (ide_device[ndevs].cap & ATA_CAP_DMA) );
+			ide_device[ndevs].lba48 = (u8)( (ide_device[ndevs].command_set & ATA_CMDSET_LBA48) != 0 );
+			ide_device[ndevs].multiple = 0;
+			u8 max_multiple = ide_buffer[ATA_IDENT_MAX_MULTIPLE];
 			
 			// Get the size
-			if( ide_device[ndevs].command_set & (1<<26) ){
+			if( ide_device[ndevs].lba48 ){
 				ide_device[ndevs].size = *((u32*)(ide_buffer + ATA_IDENT_MAX_LBA_EXT));
 			} else {
 				ide_device[ndevs].size = *((u32*)(ide_buffer + ATA_IDENT_MAX_LBA));
@@ -250,7 +307,12 @@ int ide_initialize( void )
 			
 			if( ide_device[ndevs].type == ATA_TYPE_ATA )
 			{
-				int error = ata_pio_transfer(ide_device[ndevs].channel, ide_device[ndevs].drive, ATA_PIO_READ, 0, 1, ide_buffer);
+				// Move several sectors per interrupt in PIO mode
+				if( ata_set_multiple(&ide_device[ndevs], max_multiple) != 0 ){
+					syslog(KERN_WARN, "ide: device%d: set multiple mode failed. using single sector transfers.\n", ndevs);
+				}
+				
+				int error = ata_pio_transfer(&ide_device[ndevs], ATA_PIO_READ, 0, 1, ide_buffer);
 				if( error != 0 ){
 					syslog(KERN_ERR, "ide: unable to read MBR on device %d: %d", ndevs, error);
 				} else {
@@ -360,7 +422,7 @@ u8 ata_read_reg(u8 channel, u8 reg)
 {
 	u8 result;
 	if( reg > 0x07 && reg < 0x0C){
-		ata_write_reg(channel, ATA_REG_CONTROL, ATA_DEVICE_CONTROL(1, 0, ide_channel[channel].interrupt));
+		ata_write_reg(channel, ATA_REG_CONTROL, 0x80 | ide_channel[channel].interrupt);
 	}
 	if( reg < 0x08 ){
 		result = inb((u16)(ide_channel[channel].base + reg - 0x00));
@@ -440,12 +502,14 @@ void ata_write_block(u8 channel, u8 reg, u8* buffer)
 
 void ata_enable_irq(u8 channel)
 {
-	UNUSED(channel);
+	ide_channel[channel].interrupt = 0;
+	ata_write_reg(channel, ATA_REG_CONTROL, ide_channel[channel].interrupt);
 }
 
 void ata_disable_irq(u8 channel)
 {
-	UNUSED(channel);
+	ide_channel[channel].interrupt = ATA_DEVICE_CONTROL(0, 0, 1);
+	ata_write_reg(channel, ATA_REG_CONTROL, ide_channel[channel].interrupt);
 }
 
 int ata_error_handler(u8 channel ATTR((unused)), int drive ATTR((unused)), u8 status ATTR((unused)))
@@ -456,82 +520,515 @@ int ata_error_handler(u8 channel ATTR((unused)), int drive ATTR((unused)), u8 st
 	return -ENXIO;
 }
 
-// Read data from the hard disk using PIO mode
-int ata_pio_transfer(u8 channel, u8 drive, u8 direction, u32 lba, u8 count, void* location)
+// Load the task file for a command on `count` sectors at `lba`. With
+// lba48 the high order bytes go first, since those registers are two
+// deep. A count of 256 (65536 for lba48) is written as zero.
+static void ata_load_taskfile(ide_device_t* dev, int lba48, u32 lba, u32 count)
 {
-	u8 status = 0;
+	u8 channel = dev->channel;
+	u8 device_register = 0xA0; // some hosts do this, and the device ignores it... we'll go for it.
+	device_register |= (1 << 6); // we want LBA mode
+	device_register |= (u8)((dev->drive & 0x1) << 4); // slave/master device
 	
-	if( direction != ATA_PIO_READ && direction != ATA_PIO_WRITE ){
+	if( lba48 ){
+		ata_write_reg(channel, ATA_REG_HDDEVSEL, device_register);
+		ata_wait(channel);
+		ata_write_reg(channel, ATA_REG_SECCOUNT1, (u8)( (count >> 8) & 0xFF ));
+		ata_write_reg(channel, ATA_REG_LBA3, (u8)( (lba >> 24) & 0xFF ));
+		ata_write_reg(channel, ATA_REG_LBA4, 0);
+		ata_write_reg(channel, ATA_REG_LBA5, 0);
+	} else {
+		device_register |= (u8)((lba >> 24) & 0x0F); // the last 4 bits of the LBA
+		ata_write_reg(channel, ATA_REG_HDDEVSEL, device_register);
+		ata_wait(channel);
+	}
+	
+	ata_write_reg(channel, ATA_REG_SECCOUNT0, (u8)(count & 0xFF));
+	ata_write_reg(channel, ATA_REG_LBA0, (u8)(lba & 0xFF));
+	ata_write_reg(channel, ATA_REG_LBA1, (u8)( (lba >> 8) & 0xFF ));
+	ata_write_reg(channel, ATA_REG_LBA2, (u8)( (lba >> 16) & 0xFF ));
+}
+
+// Check that a request fits in a single command and decide whether it
+// needs the 48-bit form. Returns -E2BIG if the device can't address it.
+static int ata_check_request(ide_device_t* dev, u32 lba, u32 count, u32 max, int* lba48)
+{
+	if( count == 0 || count > max ){
 		return -EINVAL;
 	}
 	
-	// Largest 28-bit number
-	if( lba > 268435455 ){
+	u32 last = lba + count - 1;
+	if( last < lba ){
 		return -E2BIG;
 	}
 	
-	//ata_select_drive(channel, drive);
-	u8 device_register = 0xA0; // some hosts do this, and the device ignores it... we'll go for it.
-	device_register |= (1 << 6); // we want LBA mode
-	device_register |= (u8)((drive & 0x1) << 4); // slave/master device
-	device_register |= (u8)(lba >> 27); // the last 4 bits of the LBA, according to the read sector(s) command
-	ata_write_reg(channel, ATA_REG_HDDEVSEL, device_register);
+	*lba48 = ( last > ATA_LBA28_MAX || count > ATA_LBA28_MAX_SECTORS );
+	if( *lba48 && !dev->lba48 ){
+		return -E2BIG;
+	}
+	
+	return 0;
+}
+
+// Largest number of sectors a single command may move on this disk
+static u32 ata_max_sectors(ide_device_t* dev)
+{
+	if( dev->dma ){
+		return ATA_DMA_MAX_SECTORS;
+	}
+	return dev->lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+}
+
+/* function: ata_set_multiple
+ * parameters:
+ * 	dev - the device to configure
+ * 	max - the largest DRQ block the device reported in its identify data
+ * returns:
+ * 	zero on success or a negative error.
+ * description:
+ * 	Issues SET MULTIPLE MODE so that PIO transfers move several sectors
+ * 	per interrupt and DRQ handshake. The block size is the largest power
+ * 	of two the device allows, up to ATA_MULTIPLE_MAX.
+ */
+int ata_set_multiple(ide_device_t* dev, u8 max)
+{
+	u8 channel = dev->channel;
+	u8 block = 1;
+	
+	dev->multiple = 0;
+	if( max < 2 ){
+		return 0;
+	}
+	
+	while( (block << 1) <= max && (block << 1) <= ATA_MULTIPLE_MAX ){
+		block = (u8)(block << 1);
+	}
+	
+	ata_write_reg(channel, ATA_REG_HDDEVSEL, (u8)(0xA0 | ((dev->drive & 0x1) << 4)));
+	ata_wait(channel);
+	ata_write_reg(channel, ATA_REG_SECCOUNT0, block);
+	ide_channel[channel].irq_pending = 0;
+	ata_write_reg(channel, ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
 	ata_wait(channel);
+	ata_wait_irq(channel);
+	
+	u8 status = ata_ready_status(channel);
+	if( status & (ATA_SR_ERR | ATA_SR_DF) ){
+		return -EIO;
+	}
+	
+	dev->multiple = block;
+	
+	return 0;
+}
+
+// Read data from the hard disk using PIO mode
+int ata_pio_transfer(ide_device_t* dev, u8 direction, u32 lba, u32 count, void* location)
+{
+	u8 channel = dev->channel;
+	u8 status = 0;
+	u32 left = count;
+	u32 block = dev->multiple ? dev->multiple : 1; // sectors per DRQ block
+	int lba48 = 0;
+	u8 command;
+	
+	if( direction != ATA_PIO_READ && direction != ATA_PIO_WRITE ){
+		return -EINVAL;
+	}
+	
+	int error = ata_check_request(dev, lba, count, dev->lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS, &lba48);
+	if( error != 0 ){
+		return error;
+	}
 	
-	ata_write_reg(channel, ATA_REG_SECCOUNT0, count);
-	ata_write_reg(channel, ATA_REG_LBA0, (u8)(lba & 0xFF));
-	ata_write_reg(channel, ATA_REG_LBA1, (u8)( (lba >> 8) & 0xFF ));
-	ata_write_reg(channel, ATA_REG_LBA2, (u8)( (lba >> 16) & 0xFF ));
 	if( direction == ATA_PIO_READ ){
-		ata_write_reg(channel, ATA_REG_COMMAND, ATA_CMD_READ_SECTORS);
+		if( dev->multiple ){
+			command = lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+		} else {
+			command = lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_SECTORS;
+		}
 	} else {
-		ata_write_reg(channel, ATA_REG_COMMAND, ATA_CMD_WRITE_SECTORS);
+		if( dev->multiple ){
+			command = lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+		} else {
+			command = lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_SECTORS;
+		}
 	}
+	
+	ata_load_taskfile(dev, lba48, lba, count);
+	ide_channel[channel].irq_pending = 0;
+	ata_write_reg(channel, ATA_REG_COMMAND, command);
 	ata_wait(channel);
 	
-	while( 1 )
+	// The first block of a write is requested without an interrupt
+	// (ATA v6 Spec. pg. 333, HPIOO0)
+	if( direction == ATA_PIO_WRITE ){
+		status = ata_ready_status(channel);
+	}
+	
+	while( left != 0 )
 	{
-		// HPIOI1: Check_Status State (ATA v6 Spec. pg. 333)
-		while(1)
-		{
-			ata_wait(channel);
-			status = ata_read_reg(channel, ATA_REG_STATUS);
-			// Transition HPIOI1:HIO
-			if( !(status & ATA_SR_BSY) && !(status & ATA_SR_DRQ) ){
-				if( direction == ATA_PIO_READ ){
-					ata_error_handler(channel, (int)drive, status);
-					return -ENXIO;
-				} else {
-					return 0;
-				}
-				//return ata_error_handler(channel, (int)drive, status);
-			}
-			
-			// Transition HPIOI1:HPIOI1
-			if( (status & ATA_SR_BSY) ) continue;
-			// Transition HPIOI1:HPIOI2
-			if( !(status & ATA_SR_BSY) && (status & ATA_SR_DRQ) ){
-				break;
+		// HPIOI0: INTRQ_Wait State. The device interrupts once each
+		// block is ready to be read.
+		if( direction == ATA_PIO_READ ){
+			ata_wait_irq(channel);
+			status = ata_ready_status(channel);
+		}
+		
+		// Transition to HIO on an error or missing data request
+		if( (status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ) ){
+			ata_error_handler(channel, (int)dev->drive, status);
+			return -ENXIO;
+		}
+		
+		// HPIOI2: Transfer_Data State (ATA v6 Spec. pg. 334). The last
+		// block of a multiple command may be short.
+		u32 n = left < block ? left : block;
+		for(u32 i = 0; i < n; ++i){
+			if( direction == ATA_PIO_READ ){
+				ata_read_block(channel, ATA_REG_DATA, location);
+			} else {
+				ata_write_block(channel, ATA_REG_DATA, location);
 			}
+			location = (void*)( (char*)location + 512 );
 		}
+		left -= n;
 		
-		// HPIOI2: Transfer_Data State (ATA v6 Spec. pg. 334)
-		if( direction == ATA_PIO_READ ){
-			ata_read_block(channel, ATA_REG_DATA, location);
-		} else {
-			ata_write_block(channel, ATA_REG_DATA, location);
+		// HPIOO2: INTRQ_Wait State. The device interrupts after each
+		// written block, including the last.
+		if( direction == ATA_PIO_WRITE ){
+			ata_wait_irq(channel);
+			status = ata_ready_status(channel);
+		}
+	}
+	
+	if( status & (ATA_SR_ERR | ATA_SR_DF) ){
+		ata_error_handler(channel, (int)dev->drive, status);
+		return -ENXIO;
+	}
+	
+	return 0;
+}
+
+/* function: ata_dma_initialize
+ * parameters:
+ * 	device - the IDE controller found on the PCI bus
+ * returns:
+ * 	zero on success or a negative error if bus mastering is not possible.
+ * description:
+ * 	Enables bus mastering on the controller and allocates a descriptor
+ * 	table and bounce buffer for each channel.
+ * 	The descriptor addresses are filled in here, and only the sizes
+ * 	change per request.
+ */
+int ata_dma_initialize(pci_device_t* device)
+{
+	pci_dword_t bar4 = device->header.basic.bar[4];
+	
+	// The bus master registers must live in I/O space
+	if( !(bar4 & 1) || (bar4 & 0xFFFFFFFC) == 0 ){
+		return -ENXIO;
+	}
+	
+	pci_word_t command = pci_config_read_word(device->bus->id, device->dev_id, device->func_id, PCI_COMMAND);
+	command = (pci_word_t)(command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+	pci_config_write_word(device->bus->id, device->dev_id, device->func_id, PCI_COMMAND, command);
+	
+	for(u8 channel = 0; channel < 2; ++channel)
+	{
+		ide_channel_t* chan = &ide_channel[channel];
+		
+		chan->prdt = (ata_prd_t*)kmalloc_ap(sizeof(ata_prd_t)*ATA_DMA_PAGES, &chan->prdt_phys);
+		chan->dma_buffer = (u8*)kmalloc_a(ATA_DMA_BUFSZ);
+		if( chan->prdt == NULL || chan->dma_buffer == NULL ){
+			return -ENOMEM;
 		}
-		count = (u8)(count - 1);
-		location = (void*)( (char*)location + 512 );
 		
-		if( count == 0 && direction == ATA_PIO_READ ){
-			break;
+		// Each page of the bounce buffer gets its own descriptor, since
+		// the heap makes no promises about physical contiguity.
+		for(int i = 0; i < ATA_DMA_PAGES; ++i){
+			u32 phys = 0;
+			get_physical_addr(curdir, chan->dma_buffer + i*0x1000, &phys);
+			chan->prdt[i].addr = phys;
+			chan->prdt[i].size = 0x1000;
+			chan->prdt[i].flags = 0;
 		}
 		
-		// Transition HPIOI2:HPIOI1
+		chan->dma_active = 0;
+		chan->dma = 1;
+	}
+	
+	return 0;
+}
+
+// Finish a bus master transfer if the device has signaled completion
+static void ata_dma_complete(u8 channel)
+{
+	ide_channel_t* chan = &ide_channel[channel];
+	u32 eflags = disablei();
+	
+	if( !chan->dma_active ){
+		restore(eflags);
+		return;
+	}
+	
+	u8 status = inb((u16)(chan->bmide + ATA_BM_STATUS));
+	if( !(status & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR)) ){
+		restore(eflags);
+		return;
+	}
+	
+	// Stop the engine, and acknowledge the device and the controller
+	outb((u16)(chan->bmide + ATA_BM_COMMAND), 0);
+	chan->ata_status = ata_read_reg(channel, ATA_REG_STATUS);
+	outb((u16)(chan->bmide + ATA_BM_STATUS), (u8)(status | ATA_BM_SR_IRQ | ATA_BM_SR_ERR));
+	
+	chan->dma_status = status;
+	chan->dma_active = 0;
+	chan->irq_pending = 1;
+	
+	restore(eflags);
+}
+
+static void ata_irq_handler(struct regs* regs, void* context ATTR((unused)))
+{
+	for(u8 channel = 0; channel < 2; ++channel)
+	{
+		if( ide_channel[channel].irq != regs->intno ){
+			continue;
+		}
+		if( ide_channel[channel].dma_active ){
+			ata_dma_complete(channel);
+			// The bus master didn't raise this one
+			if( ide_channel[channel].dma_active ) continue;
+		} else {
+			// Reading the status register acknowledges the interrupt
+			ide_channel[channel].ata_status = ata_read_reg(channel, ATA_REG_STATUS);
+			ide_channel[channel].irq_pending = 1;
+		}
+		if( ide_channel[channel].waiter ){
+			task_wakeup(ide_channel[channel].waiter);
+		}
+	}
+}
+
+/* function: ata_wait_irq
+ * parameters:
+ * 	channel - the channel a command was issued on
+ * description:
+ * 	Puts the calling task to sleep until the channel interrupts (or
+ * 	its bus master transfer completes) so other tasks can run while
+ * 	the disk works. Before tasking is up, or with interrupts disabled
+ * 	on the channel, the device status is polled instead.
+ */
+void ata_wait_irq(u8 channel)
+{
+	ide_channel_t* chan = &ide_channel[channel];
+	u32 eflags = disablei();
+	
+	while( chan->dma_active || !chan->irq_pending )
+	{
+		if( current == NULL || chan->interrupt != 0 ){
+			if( chan->dma_active ){
+				ata_dma_complete(channel);
+			} else if( !(ata_read_reg(channel, ATA_REG_ALTSTATUS) & ATA_SR_BSY) ){
+				chan->irq_pending = 1;
+			}
+			continue;
+		}
+		chan->waiter = current;
+		task_waitio(current);
+		chan->waiter = NULL;
+	}
+	
+	chan->irq_pending = 0;
+	restore(eflags);
+}
+
+// Wait for the device to leave the busy state and return its status.
+// An interrupt left over from an earlier command may wake us early, so
+// the status is what really decides if the device is ready.
+static u8 ata_ready_status(u8 channel)
+{
+	u8 status = ata_read_reg(channel, ATA_REG_ALTSTATUS);
+	while( status & ATA_SR_BSY ){
+		status = ata_read_reg(channel, ATA_REG_ALTSTATUS);
+	}
+	return ata_read_reg(channel, ATA_REG_STATUS);
+}
+
+// Transfer data using the bus master of the channel
+int ata_dma_transfer(ide_device_t* dev, u8 direction, u32 lba, u32 count, void* location)
+{
+	u8 channel = dev->channel;
+	ide_channel_t* chan = &ide_channel[channel];
+	size_t length = ATA_SECTOR_TO_BYTE((size_t)count);
+	int lba48 = 0;
+	
+	if( !chan->dma ){
+		return -ENODEV;
+	}
+	
+	if( direction != ATA_PIO_READ && direction != ATA_PIO_WRITE ){
+		return -EINVAL;
+	}
+	
+	int error = ata_check_request(dev, lba, count, ATA_DMA_MAX_SECTORS, &lba48);
+	if( error != 0 ){
+		return error;
+	}
+	
+	if( direction == ATA_PIO_WRITE ){
+		memcpy(chan->dma_buffer, location, length);
+	}
+	
+	// Size the descriptors for this request
+	for(int i = 0; i < ATA_DMA_PAGES; ++i){
+		if( length <= (size_t)(i+1)*0x1000 ){
+			chan->prdt[i].size = (u16)(length - (size_t)i*0x1000);
+			chan->prdt[i].flags = ATA_PRD_EOT;
+			break;
+		}
+		chan->prdt[i].size = 0x1000;
+		chan->prdt[i].flags = 0;
+	}
+	
+	u8 bmcmd = (u8)(direction == ATA_PIO_READ ? ATA_BM_CMD_READ : 0);
+	
+	// Stop the engine, clear old status and point it at the table
+	outb((u16)(chan->bmide + ATA_BM_COMMAND), bmcmd);
+	outb((u16)(chan->bmide + ATA_BM_STATUS), (u8)(inb((u16)(chan->bmide + ATA_BM_STATUS)) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR));
+	outl((u16)(chan->bmide + ATA_BM_PRDT), chan->prdt_phys);
+	
+	ata_load_taskfile(dev, lba48, lba, count);
+	
+	chan->irq_pending = 0;
+	chan->dma_active = 1;
+	if( direction == ATA_PIO_READ ){
+		ata_write_reg(channel, ATA_REG_COMMAND, lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+	} else {
+		ata_write_reg(channel, ATA_REG_COMMAND, lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
 	}
 	
+	// Start the transfer
+	outb((u16)(chan->bmide + ATA_BM_COMMAND), (u8)(bmcmd | ATA_BM_CMD_START));
+	
+	// Sleep until the IRQ handler sees the bus master finish
+	ata_wait_irq(channel);
+	
+	if( (chan->dma_status & ATA_BM_SR_ERR) || (chan->ata_status & (ATA_SR_ERR | ATA_SR_DF)) ){
+		ata_error_handler(channel, (int)dev->drive, chan->ata_status);
+		return -EIO;
+	}
 	
+	if( direction == ATA_PIO_READ ){
+		memcpy(location, chan->dma_buffer, length);
+	}
 	
 	return 0;
 }
+
+/* function: ata_transfer
+ * parameters:
+ * 	disk - index into the ide device table
+ * 	direction - ATA_PIO_READ or ATA_PIO_WRITE
+ * 	lba - absolute sector address on the disk
+ * 	count - number of sectors to transfer
+ * 	location - buffer to transfer to or from
+ * returns:
+ * 	zero on success or a negative error.
+ * description:
+ * 	Transfers with the bus master whenever the disk supports it, and
+ * 	falls back to PIO otherwise. A disk whose DMA transfers fail is
+ * 	switched to PIO for good. Requests on the same channel wait for
+ * 	each other, since the buffer cache does not hold its lock across
+ * 	device i/o.
+ */
+int ata_transfer(u8 disk, u8 direction, u32 lba, u32 count, void* location)
+{
+	ide_device_t* dev = &ide_device[disk];
+	mutex_t* lock = ide_channel[dev->channel].lock;
+	int error;
+	
+	mutex_lock(lock, SEM_FOREVER);
+	
+	if( dev->dma && count != 0 && count <= ATA_DMA_MAX_SECTORS )
+	{
+		error = ata_dma_transfer(dev, direction, lba, count, location);
+		if( error == 0 || error == -E2BIG ){
+			mutex_unlock(lock);
+			return error;
+		}
+		syslog(KERN_WARN, "ide: dma transfer failed on device %d (%d). falling back to pio.\n", disk, error);
+		dev->dma = 0;
+	}
+	
+	error = ata_pio_transfer(dev, direction, lba, count, location);
+	
+	mutex_unlock(lock);
+	
+	return error;
+}
+
+/* function: ide_benchmark
+ * parameters:
+ * 	disk - index into the ide device table
+ * 	nsectors - number of sectors to read
+ * description:
+ * 	Reads the first `nsectors` sectors of a disk sequentially, first
+ * 	with PIO and then with the bus master, bypassing the buffer cache,
+ * 	and logs the throughput of each.
+ */
+void ide_benchmark(u8 disk, u32 nsectors)
+{
+	ide_device_t* dev = &ide_device[disk];
+	u8* buffer = (u8*)kmalloc(ATA_DMA_BUFSZ);
+	tick_t ticks[2] = { 0, 0 };
+	int error = 0;
+	
+	if( disk >= 4 || !dev->exist || dev->type != ATA_TYPE_ATA || buffer == NULL ){
+		kfree(buffer);
+		return;
+	}
+	
+	if( nsectors > dev->size ){
+		nsectors = dev->size;
+	}
+	
+	// The timer only advances with interrupts enabled
+	u32 eflags = enablei();
+	
+	for(int mode = 0; mode < 2 && error == 0; ++mode)
+	{
+		if( mode == 1 && !dev->dma ){
+			break;
+		}
+		tick_t start = timer_get_ticks();
+		for(u32 lba = 0; lba < nsectors && error == 0; lba += ATA_DMA_MAX_SECTORS)
+		{
+			u32 count = (nsectors - lba) < ATA_DMA_MAX_SECTORS ? (nsectors - lba) : ATA_DMA_MAX_SECTORS;
+			if( mode == 0 ){
+				error = ata_pio_transfer(dev, ATA_PIO_READ, lba, count, buffer);
+			} else {
+				error = ata_dma_transfer(dev, ATA_PIO_READ, lba, count, buffer);
+			}
+		}
+		ticks[mode] = timer_get_ticks() - start;
+		if( ticks[mode] == 0 ) ticks[mode] = 1;
+	}
+	
+	restore(eflags);
+	kfree(buffer);
+	
+	if( error != 0 ){
+		syslog(KERN_ERR, "ide: benchmark on device %d failed: %d\n", disk, error);
+		return;
+	}
+	
+	u32 kbytes = ATA_SECTOR_TO_BYTE(nsectors) / 1024;
+	u32 freq = timer_get_freq();
+	syslog(KERN_NOTIFY, "ide: device%d: sequential read of %dKB: pio %dms (%dKB/s)\n", disk, kbytes, ticks[0]*1000/freq, kbytes*freq/ticks[0]);
+	if( ticks[1] != 0 ){
+		syslog(KERN_NOTIFY, "ide: device%d: sequential read of %dKB: dma %dms (%dKB/s)\n", disk, kbytes, ticks[1]*1000/freq, kbytes*freq/ticks[1]);
+	}
+}
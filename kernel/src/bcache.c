@@ -0,0 +1,691 @@
+#include "stewieos/bcache.h"
+#include "stewieos/block.h"
+#include "stewieos/kmem.h"
+#include "stewieos/task.h"
+#include "stewieos/error.h"
+#include "stewieos/sem.h"
+
+static list_t bcache_hash[BCACHE_HASH_SIZE];	// hash chains keyed by (dev, lba)
+static list_t bcache_lru = LIST_INIT(bcache_lru);	// every buffer, most recently used first
+static mutex_t* bcache_lock;				// protects everything above (never held across device i/o)
+static sem_t* bcache_released;				// signalled once for each task waiting on a buffer
+static u32 bcache_waiters;					// tasks waiting on bcache_released
+static u32 bcache_pass;						// last write-back pass started
+static bcache_stat_t bcache_stats;			// hit/miss counters and sizing
+pid_t bcache_worker_pid;					// write-back worker
+
+// Readahead requests are queued here and filled in by the readahead worker
+typedef struct _bcache_ra
+{
+	struct block_device*	device;
+	dev_t					devid;
+	off_t					lba;
+	size_t					count;
+} bcache_ra_t;
+
+static bcache_ra_t bcache_ra_queue[BCACHE_RA_QUEUE];	// pending readahead requests
+static u32 bcache_ra_head, bcache_ra_tail;				// next request to fill/queue
+static spinlock_t bcache_ra_lock;						// protects the queue
+static sem_t* bcache_ra_pending;						// one unit for each queued request
+pid_t bcache_readahead_pid;								// readahead worker
+
+static void bcache_writeback(void* context);
+static void bcache_readahead(void* context);
+static void bcache_shutdown( void );
+
+// Nobody is using the buffer, so it may be owned, reused or released
+#define bcache_idle(buf) ( !((buf)->b_flags & BCACHE_BUSY) && (buf)->b_count == 0 )
+
+static inline list_t* bcache_chain(dev_t devid, off_t lba)
+{
+	return &bcache_hash[((u32)lba + (u32)devid*31) & (BCACHE_HASH_SIZE-1)];
+}
+
+void bcache_init( void )
+{
+	for(int i = 0; i < BCACHE_HASH_SIZE; ++i){
+		INIT_LIST(&bcache_hash[i]);
+	}
+	bcache_lock = mutex_alloc();
+	bcache_released = sem_alloc(0);
+	bcache_waiters = 0;
+	bcache_pass = 0;
+	bcache_ra_pending = sem_alloc(0);
+	spin_init(&bcache_ra_lock);
+
+	memset(&bcache_stats, 0, sizeof(bcache_stats));
+	bcache_stats.capacity = BCACHE_DEFAULT_CAPACITY;
+
+	// Make sure nothing is lost when the system goes down
+	register_shutdown_handler(bcache_shutdown);
+
+	bcache_worker_pid = worker_spawn(bcache_writeback, NULL);
+	bcache_readahead_pid = worker_spawn(bcache_readahead, NULL);
+}
+
+// Find a cached block and mark it as most recently used
+static bcache_buffer_t* bcache_find(dev_t devid, off_t lba)
+{
+	list_t* chain = bcache_chain(devid, lba);
+	list_t* item;
+	bcache_buffer_t* buf;
+
+	list_for_each_entry(item, chain, bcache_buffer_t, b_hash, buf){
+		if( buf->b_dev == devid && buf->b_lba == lba ){
+			list_rem(&buf->b_lru);
+			list_add(&buf->b_lru, &bcache_lru);
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+// Sleep until a buffer is released. The lock is dropped meanwhile, so
+// the caller has to look its buffer up again.
+static void bcache_sleep( void )
+{
+	bcache_waiters++;
+	mutex_unlock(bcache_lock);
+	sem_wait(bcache_released, SEM_FOREVER);
+	mutex_lock(bcache_lock, SEM_FOREVER);
+}
+
+static void bcache_wake( void )
+{
+	while( bcache_waiters != 0 ){
+		bcache_waiters--;
+		sem_signal(bcache_released);
+	}
+}
+
+// Take or give up ownership of a buffer
+static void bcache_own(bcache_buffer_t* buf)
+{
+	buf->b_flags |= BCACHE_BUSY;
+	buf->b_count++;
+}
+
+static void bcache_disown(bcache_buffer_t* buf)
+{
+	buf->b_flags &= ~BCACHE_BUSY;
+	buf->b_count--;
+	bcache_wake();
+}
+
+// Pin a buffer which is not busy, so it stays put while the lock is dropped
+static void bcache_pin(bcache_buffer_t* buf)
+{
+	buf->b_count++;
+}
+
+static void bcache_unpin(bcache_buffer_t* buf)
+{
+	if( --buf->b_count == 0 ){
+		bcache_wake();
+	}
+}
+
+// Write an idle, dirty buffer back to its device. The buffer is owned
+// while the lock is dropped for the write, so nothing changes it
+// before it is marked clean.
+static int bcache_flush_buffer(bcache_buffer_t* buf)
+{
+	if( !(buf->b_flags & BCACHE_DIRTY) ){
+		return 0;
+	}
+
+	bcache_own(buf);
+	mutex_unlock(bcache_lock);
+
+	int error = buf->b_device->ops->write(buf->b_device, buf->b_dev, buf->b_lba, 1, buf->b_data);
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	if( error != 0 ){
+		syslog(KERN_ERR, "bcache: write-back of block %d on device 0x%X failed: %d", buf->b_lba, buf->b_dev, error);
+	} else {
+		buf->b_flags &= ~BCACHE_DIRTY;
+		bcache_stats.ndirty--;
+		bcache_stats.writebacks++;
+	}
+
+	bcache_disown(buf);
+
+	return error;
+}
+
+// Remove an idle buffer from the cache and free it
+static void bcache_release(bcache_buffer_t* buf)
+{
+	if( buf->b_flags & BCACHE_DIRTY ){
+		bcache_stats.ndirty--;
+	}
+	list_rem(&buf->b_hash);
+	list_rem(&buf->b_lru);
+	kfree(buf->b_data);
+	kfree(buf);
+	bcache_stats.nbuffers--;
+}
+
+// Find a buffer to hold a new block. The least recently used idle, clean
+// buffer is reused once the cache is full. If there is none, the cache
+// grows past its capacity until bcache_trim catches up. The returned
+// buffer is owned and hashed under (devid, lba), but holds no data.
+static bcache_buffer_t* bcache_alloc(struct block_device* device, dev_t devid, off_t lba)
+{
+	bcache_buffer_t* buf = NULL;
+
+	if( bcache_stats.nbuffers >= bcache_stats.capacity )
+	{
+		list_t* item;
+		for(item = list_last(&bcache_lru); item != &bcache_lru; item = item->prev){
+			bcache_buffer_t* victim = list_entry(item, bcache_buffer_t, b_lru);
+			if( bcache_idle(victim) && !(victim->b_flags & BCACHE_DIRTY) ){
+				buf = victim;
+				break;
+			}
+		}
+		if( buf != NULL ){
+			list_rem(&buf->b_hash);
+			list_rem(&buf->b_lru);
+			bcache_stats.evictions++;
+			// Different devices may use different block sizes
+			if( buf->b_size != device->blksz ){
+				kfree(buf->b_data);
+				buf->b_data = NULL;
+			}
+		}
+	}
+
+	if( buf == NULL )
+	{
+		buf = (bcache_buffer_t*)kmalloc(sizeof(bcache_buffer_t));
+		if( buf == NULL ){
+			return NULL;
+		}
+		buf->b_data = NULL;
+		INIT_LIST(&buf->b_hash);
+		INIT_LIST(&buf->b_lru);
+		bcache_stats.nbuffers++;
+	}
+
+	if( buf->b_data == NULL )
+	{
+		buf->b_data = (char*)kmalloc(device->blksz);
+		if( buf->b_data == NULL ){
+			kfree(buf);
+			bcache_stats.nbuffers--;
+			return NULL;
+		}
+	}
+
+	buf->b_dev = devid;
+	buf->b_lba = lba;
+	buf->b_flags = 0;
+	buf->b_count = 0;
+	buf->b_pass = 0;
+	buf->b_size = device->blksz;
+	buf->b_device = device;
+	list_add(&buf->b_hash, bcache_chain(devid, lba));
+	list_add(&buf->b_lru, &bcache_lru);
+	bcache_own(buf);
+
+	return buf;
+}
+
+// Read the uncached block at `lba`, and as many of the up to `count`-1
+// uncached blocks following it as possible, into new buffers with one
+// device request. The lock is dropped during the read, while the new
+// buffers are owned. Returns the number of blocks read or an error.
+static int bcache_fill_run(struct block_device* device, dev_t devid, off_t lba, size_t count, int prefetch)
+{
+	bcache_buffer_t* bufs[BCACHE_MAX_RUN];
+	size_t blksz = device->blksz;
+	size_t run = 0;
+	char* scratch = NULL;
+
+	if( count > BCACHE_MAX_RUN ){
+		count = BCACHE_MAX_RUN;
+	}
+
+	while( run < count && (run == 0 || bcache_find(devid, lba+(off_t)run) == NULL) ){
+		bufs[run] = bcache_alloc(device, devid, lba+(off_t)run);
+		if( bufs[run] == NULL ) break;
+		run++;
+	}
+	if( run == 0 ){
+		return -ENOMEM;
+	}
+
+	// A run is read into one scratch buffer and then split up. Without
+	// the memory for it, just the first block is read.
+	if( run > 1 && (scratch = (char*)kmalloc(run*blksz)) == NULL ){
+		while( run > 1 ){
+			run--;
+			bcache_disown(bufs[run]);
+			bcache_release(bufs[run]);
+		}
+	}
+
+	mutex_unlock(bcache_lock);
+
+	int error = device->ops->read(device, devid, lba, run, scratch ? scratch : bufs[0]->b_data);
+	if( error == 0 && scratch != NULL ){
+		for(size_t i = 0; i < run; ++i){
+			memcpy(bufs[i]->b_data, scratch + i*blksz, blksz);
+		}
+	}
+	kfree(scratch);
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	// Tasks waiting on a block which could not be read try it themselves
+	for(size_t i = 0; i < run; ++i){
+		bcache_disown(bufs[i]);
+		if( error != 0 ){
+			bcache_release(bufs[i]);
+		}
+	}
+	if( error != 0 ){
+		return error;
+	}
+
+	if( prefetch ){
+		bcache_stats.prefetched += run;
+	} else {
+		bcache_stats.misses += run;
+	}
+
+	return (int)run;
+}
+
+// Release the least recently used idle buffers beyond the capacity,
+// writing them back first if needed. Called with the lock held.
+static void bcache_trim( void )
+{
+	u32 pass = ++bcache_pass;
+
+	while( bcache_stats.nbuffers > bcache_stats.capacity )
+	{
+		bcache_buffer_t* victim = NULL;
+		list_t* item;
+		for(item = list_last(&bcache_lru); item != &bcache_lru; item = item->prev){
+			bcache_buffer_t* buf = list_entry(item, bcache_buffer_t, b_lru);
+			if( bcache_idle(buf) && (!(buf->b_flags & BCACHE_DIRTY) || buf->b_pass != pass) ){
+				victim = buf;
+				break;
+			}
+		}
+		if( victim == NULL ){
+			break;
+		}
+
+		// the lock is dropped while writing, so look again afterwards
+		if( victim->b_flags & BCACHE_DIRTY ){
+			victim->b_pass = pass;
+			bcache_flush_buffer(victim);
+			continue;
+		}
+
+		bcache_release(victim);
+	}
+}
+
+ssize_t bcache_read(struct block_device* device, dev_t devid, off_t off, size_t count, char* buffer)
+{
+	size_t blksz = device->blksz;
+	off_t lba = (off_t)(off / blksz);
+	size_t skip = (size_t)(off % blksz);
+	size_t left = count;
+	int filled = 0;
+	bcache_buffer_t* buf;
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	while( left != 0 )
+	{
+		size_t len = (blksz - skip) < left ? (blksz - skip) : left;
+
+		buf = bcache_find(devid, lba);
+
+		// Read the missing block along with the uncached blocks after it
+		// which were asked for, then pick it up from the cache.
+		if( buf == NULL )
+		{
+			int error = bcache_fill_run(device, devid, lba, (skip + left + blksz - 1) / blksz, 0);
+			if( error < 0 ){
+				mutex_unlock(bcache_lock);
+				return (ssize_t)error;
+			}
+			filled = 1;
+			continue;
+		}
+
+		if( buf->b_flags & BCACHE_BUSY ){
+			bcache_sleep();
+			continue;
+		}
+
+		if( !filled ){
+			bcache_stats.hits++;
+		}
+		filled = 0;
+
+		// The copy may fault on the callers buffer and read the disk
+		bcache_pin(buf);
+		mutex_unlock(bcache_lock);
+		memcpy(buffer, buf->b_data + skip, len);
+		mutex_lock(bcache_lock, SEM_FOREVER);
+		bcache_unpin(buf);
+
+		lba++;
+		skip = 0;
+		buffer += len;
+		left -= len;
+	}
+
+	bcache_trim();
+
+	mutex_unlock(bcache_lock);
+
+	return (ssize_t)count;
+}
+
+ssize_t bcache_write(struct block_device* device, dev_t devid, off_t off, size_t count, const char* buffer)
+{
+	size_t blksz = device->blksz;
+	off_t lba = (off_t)(off / blksz);
+	size_t skip = (size_t)(off % blksz);
+	size_t left = count;
+	bcache_buffer_t* buf;
+
+	// The callers data is copied in before the lock is taken, since
+	// touching it may fault and read the disk
+	char* bounce = (char*)kmalloc(blksz);
+	if( bounce == NULL ){
+		return -ENOMEM;
+	}
+
+	while( left != 0 )
+	{
+		size_t len = (blksz - skip) < left ? (blksz - skip) : left;
+		int filled = 0;
+
+		memcpy(bounce, buffer, len);
+
+		mutex_lock(bcache_lock, SEM_FOREVER);
+
+		while( 1 )
+		{
+			buf = bcache_find(devid, lba);
+			if( buf == NULL && len != blksz ){
+				// Partial block writes need the rest of the block
+				int error = bcache_fill_run(device, devid, lba, 1, 0);
+				if( error < 0 ){
+					mutex_unlock(bcache_lock);
+					kfree(bounce);
+					return (ssize_t)error;
+				}
+				filled = 1;
+				continue;
+			}
+			if( buf == NULL ){
+				buf = bcache_alloc(device, devid, lba);
+				if( buf == NULL ){
+					mutex_unlock(bcache_lock);
+					kfree(bounce);
+					return -ENOMEM;
+				}
+				bcache_stats.misses++;
+				break;
+			}
+			if( !bcache_idle(buf) ){
+				bcache_sleep();
+				continue;
+			}
+			if( !filled ){
+				bcache_stats.hits++;
+			}
+			bcache_own(buf);
+			break;
+		}
+
+		memcpy(buf->b_data + skip, bounce, len);
+		if( !(buf->b_flags & BCACHE_DIRTY) ){
+			buf->b_flags |= BCACHE_DIRTY;
+			bcache_stats.ndirty++;
+		}
+		bcache_disown(buf);
+
+		mutex_unlock(bcache_lock);
+
+		lba++;
+		skip = 0;
+		buffer += len;
+		left -= len;
+	}
+
+	kfree(bounce);
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+	bcache_trim();
+	mutex_unlock(bcache_lock);
+
+	return (ssize_t)count;
+}
+
+int bcache_prefetch(struct block_device* device, dev_t devid, off_t lba, size_t count)
+{
+	if( count == 0 ){
+		return 0;
+	}
+	if( count > BCACHE_MAX_RUN ){
+		count = BCACHE_MAX_RUN;
+	}
+
+	u32 eflags = disablei();
+	spin_lock(&bcache_ra_lock);
+
+	// Readahead is only a hint, so drop it if the worker is behind
+	if( bcache_ra_tail - bcache_ra_head >= BCACHE_RA_QUEUE ){
+		spin_unlock(&bcache_ra_lock);
+		restore(eflags);
+		return -EAGAIN;
+	}
+
+	bcache_ra_t* req = &bcache_ra_queue[bcache_ra_tail % BCACHE_RA_QUEUE];
+	req->device = device;
+	req->devid = devid;
+	req->lba = lba;
+	req->count = count;
+	bcache_ra_tail++;
+
+	spin_unlock(&bcache_ra_lock);
+	restore(eflags);
+
+	sem_signal(bcache_ra_pending);
+
+	return 0;
+}
+
+// Read every uncached block of a readahead request into the cache.
+// Contiguous uncached blocks are read with a single device request.
+static void bcache_fill(bcache_ra_t* req)
+{
+	size_t i = 0;
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	while( i < req->count )
+	{
+		if( bcache_find(req->devid, req->lba+(off_t)i) != NULL ){
+			i++;
+			continue;
+		}
+
+		int run = bcache_fill_run(req->device, req->devid, req->lba+(off_t)i, req->count-i, 1);
+		if( run < 0 ){
+			break;
+		}
+
+		i += (size_t)run;
+	}
+
+	bcache_trim();
+
+	mutex_unlock(bcache_lock);
+}
+
+/* Write back the dirty buffers of a device (or of every device). The lock
+ * is dropped for each write, so the list is searched again every time,
+ * skipping buffers already tried on this pass. Buffers in use are waited
+ * for.
+ */
+static int bcache_flush_dirty(dev_t devid, int all)
+{
+	int result = 0;
+
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	u32 pass = ++bcache_pass;
+
+	while( bcache_stats.ndirty != 0 )
+	{
+		bcache_buffer_t* found = NULL;
+		int busy = 0;
+		list_t* item;
+		bcache_buffer_t* buf;
+
+		list_for_each_entry(item, &bcache_lru, bcache_buffer_t, b_lru, buf){
+			if( !all && buf->b_dev != devid ) continue;
+			if( !(buf->b_flags & BCACHE_DIRTY) || buf->b_pass == pass ) continue;
+			if( !bcache_idle(buf) ){
+				busy = 1;
+				continue;
+			}
+			found = buf;
+			break;
+		}
+
+		if( found == NULL ){
+			if( !busy ) break;
+			bcache_sleep();
+			continue;
+		}
+
+		found->b_pass = pass;
+		int error = bcache_flush_buffer(found);
+		if( error != 0 ) result = error;
+	}
+
+	mutex_unlock(bcache_lock);
+
+	return result;
+}
+
+int bcache_sync(dev_t devid)
+{
+	return bcache_flush_dirty(devid, 0);
+}
+
+int bcache_sync_all( void )
+{
+	return bcache_flush_dirty(0, 1);
+}
+
+void bcache_invalidate(dev_t devid)
+{
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	u32 pass = ++bcache_pass;
+
+	while( 1 )
+	{
+		bcache_buffer_t* found = NULL;
+		int busy = 0;
+		list_t* item;
+		bcache_buffer_t* buf;
+
+		list_for_each_entry(item, &bcache_lru, bcache_buffer_t, b_lru, buf){
+			if( major(buf->b_dev) != major(devid) ) continue;
+			if( !bcache_idle(buf) ){
+				busy = 1;
+				continue;
+			}
+			found = buf;
+			break;
+		}
+
+		if( found == NULL ){
+			if( !busy ) break;
+			bcache_sleep();
+			continue;
+		}
+
+		// Try to write it back once, and drop it either way
+		if( (found->b_flags & BCACHE_DIRTY) && found->b_pass != pass ){
+			found->b_pass = pass;
+			bcache_flush_buffer(found);
+			continue;
+		}
+
+		bcache_release(found);
+	}
+
+	mutex_unlock(bcache_lock);
+}
+
+void bcache_set_capacity(size_t nbuffers)
+{
+	mutex_lock(bcache_lock, SEM_FOREVER);
+
+	bcache_stats.capacity = nbuffers;
+
+	// Drop the least recently used buffers over the limit
+	bcache_trim();
+
+	mutex_unlock(bcache_lock);
+}
+
+void bcache_stat(bcache_stat_t* stat)
+{
+	mutex_lock(bcache_lock, SEM_FOREVER);
+	memcpy(stat, &bcache_stats, sizeof(bcache_stats));
+	mutex_unlock(bcache_lock);
+}
+
+// Periodically push dirty buffers out to disk
+static void bcache_writeback(void* context ATTR((unused)))
+{
+	while( 1 )
+	{
+		task_sleep(current, BCACHE_WRITEBACK_DELAY);
+		bcache_sync_all();
+	}
+}
+
+// Fill queued readahead requests in the background
+static void bcache_readahead(void* context ATTR((unused)))
+{
+	bcache_ra_t req;
+
+	while( 1 )
+	{
+		sem_wait(bcache_ra_pending, SEM_FOREVER);
+
+		u32 eflags = disablei();
+		spin_lock(&bcache_ra_lock);
+		req = bcache_ra_queue[bcache_ra_head % BCACHE_RA_QUEUE];
+		bcache_ra_head++;
+		spin_unlock(&bcache_ra_lock);
+		restore(eflags);
+
+		bcache_fill(&req);
+	}
+}
+
+static void bcache_shutdown( void )
+{
+	bcache_sync_all();
+}
@@ -6,6 +6,7 @@
 #include "sys/types.h"
 #include <errno.h>
 #include "stewieos/spinlock.h"
+#include "stewieos/bcache.h"
 
 typedef struct {
 	char*  block;
@@ -25,6 +26,8 @@ static int block_file_ioctl(struct file*, int, char*);
 static int block_file_fstat(struct file*, struct stat*);
 static ssize_t block_file_read(struct file*, char*, size_t);
 static ssize_t block_file_write(struct file*, const char*, size_t);
+static ssize_t block_file_readv(struct file*, const struct iovec*, int, off_t*);
+static ssize_t block_file_writev(struct file*, const struct iovec*, int, off_t*);
 
 struct block_device* vfs_dev[256];
 struct file_operations block_device_fops = {
@@ -32,6 +35,8 @@ struct file_operations block_device_fops = {
 	.close = block_file_close,
 	.read = block_file_read,
 	.write = block_file_write,
+	.readv = block_file_readv,
+	.writev = block_file_writev,
 	.ioctl = block_file_ioctl,
 	.fstat = block_file_fstat
 };
@@ -85,6 +90,10 @@ int unregister_block_device(unsigned int major)
 	}
 	
 	struct block_device* dev = vfs_dev[major];
+	
+	// Nothing cached for this device may outlive the driver
+	bcache_invalidate(makedev(major,0));
+	
 	vfs_dev[major] = NULL;
 	
 	int result = block_detach(makedev(major,0));
@@ -139,12 +148,20 @@ int block_detach(dev_t devid)
 	return 0;
 }
 
+/* function: block_read
+ * purpose: read bytes from a block device through the buffer cache.
+ * 		The offset and count need not be block aligned.
+ * parameters:
+ * 	devid - the device to read from
+ * 	off - the byte offset on the device
+ * 	count - the number of bytes to read
+ * 	buffer - where to store the data
+ * returns:
+ * 	The number of bytes read or an error value.
+ */
 ssize_t block_read(dev_t devid, off_t off, size_t count, char* buffer)
 {
 	struct block_device* device = get_block_device(devid);
-	int error = 0;
-	off_t lba, end_lba;
-	size_t requested_count = count; // count is decremented throughout the process
 	
 	if( !device ) return -ENODEV;
 	
@@ -152,156 +169,72 @@ ssize_t block_read(dev_t devid, off_t off, size_t count, char* buffer)
 		return -ENOSYS;
 	}
 	
-	// Aqcuire the data lock
-	//spin_lock(&device->lock);
-	
-	// calculate the LBA values
-	lba = (off_t)(off / device->blksz);
-	end_lba = lba + (count / device->blksz);
-	if( (count % device->blksz) != 0 ){
-		end_lba++;
-	}
-	
-	if( (off % device->blksz) != 0 )
-	{
-		error = device->ops->read(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		if( count > (device->blksz - (off % device->blksz)) )
-		{
-			memcpy(buffer, &device->block[off%device->blksz], device->blksz - (off%device->blksz));
-			buffer = buffer + (device->blksz - (off%device->blksz));
-			count -= (device->blksz - (off%device->blksz));
-		} else {
-			memcpy(buffer, &device->block[off%device->blksz], count);
-			spin_unlock(&device->lock);
-			return (ssize_t)count;
-		}
-		lba++;
-		off = lba*device->blksz;
-	}
-	
-	if( count >= device->blksz )
-	{
-		error = device->ops->read(device, devid, lba, count / device->blksz, buffer);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		lba += count / device->blksz;
-		buffer = buffer + ((size_t)(count / device->blksz))*device->blksz;
-		count -= ((size_t)(count / device->blksz))*device->blksz;
-	}
-	
-	if( count != 0 )
-	{
-		error = device->ops->read(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		memcpy(buffer, device->block, count);
+	if( count == 0 ){
+		return 0;
 	}
 	
-	spin_unlock(&device->lock);
-	
-	return (ssize_t)requested_count;
+	return bcache_read(device, devid, off, count, buffer);
 }
 
+/* function: block_write
+ * purpose: write bytes to a block device through the buffer cache.
+ * 		The data is written back to the device later by the
+ * 		cache (see bcache_sync).
+ * parameters:
+ * 	devid - the device to write to
+ * 	off - the byte offset on the device
+ * 	count - the number of bytes to write
+ * 	buffer - the data to write
+ * returns:
+ * 	The number of bytes written or an error value.
+ */
 int block_write(dev_t devid, off_t off, size_t count, const char* buffer)
 {
 	struct block_device* device = get_block_device(devid);
-	int error = 0;
-	off_t lba, end_lba;
-	size_t requested_count = count; // count is decremented throughout the process
 	
 	if( !device ) return -ENODEV;
 	
-	if( !device->ops->write ){
+	if( !device->ops->write || !device->ops->read ){
 		return -ENOSYS;
 	}
 	
-	// Aqcuire the data lock
-	//spin_lock(&device->lock);
-	
 	if( count == 0 ){
-		spin_unlock(&device->lock);
 		return 0;
 	}
 	
-	lba = (off_t)(off / device->blksz);
-	end_lba = lba + (count / device->blksz);
-	if( (count % device->blksz) != 0 ){
-		end_lba++;
-	}
+	return (int)bcache_write(device, devid, off, count, buffer);
+}
+
+/* function: block_prefetch
+ * purpose: ask the buffer cache to read a range of a block device in
+ * 		the background, so a later block_read finds it cached.
+ * parameters:
+ * 	devid - the device to read from
+ * 	off - the byte offset on the device
+ * 	count - the number of bytes to read ahead
+ * returns:
+ * 	Zero if the request was queued or an error value.
+ */
+int block_prefetch(dev_t devid, off_t off, size_t count)
+{
+	struct block_device* device = get_block_device(devid);
 	
-	// We need to modify a piece of a block
-	if( (off % device->blksz) != 0 )
-	{
-		// read in the entire block
-		error = device->ops->read(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		// Copy the data into the block
-		if( count > (device->blksz - (off % device->blksz)) )
-		{
-			// we are writing more than just this block
-			memcpy(&device->block[off%device->blksz], buffer, device->blksz - (off%device->blksz));
-			buffer = buffer + (device->blksz - (off%device->blksz));
-			count -= (device->blksz - (off%device->blksz));
-		} else {
-			// we are only writing within this block
-			memcpy(&device->block[off%device->blksz], buffer, count);
-			count = 0;
-		}
-		// write the whole back to disk
-		error = device->ops->write(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		lba++;
-		off = lba*device->blksz;
-	}
+	if( !device ) return -ENODEV;
 	
-	// do we have block aligned writes to do? (that's prefered...)
-	if( count >= device->blksz )
-	{
-		error = device->ops->write(device, devid, lba, count / device->blksz, buffer);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		lba += count / device->blksz;
-		buffer = buffer + ((size_t)(count / device->blksz))*device->blksz;
-		count -= ((size_t)(count / device->blksz))*device->blksz;
+	if( !device->ops->read ){
+		return -ENOSYS;
 	}
 	
-	if( count != 0 )
-	{
-		error = device->ops->read(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
-		memcpy(device->block, buffer, count);
-		error = device->ops->write(device, devid, lba, 1, device->block);
-		if( error != 0 ){
-			spin_unlock(&device->lock);
-			return (ssize_t)error;
-		}
+	if( count == 0 ){
+		return 0;
 	}
 	
-	spin_unlock(&device->lock);
+	off_t first = (off_t)(off / device->blksz);
+	off_t last = (off_t)((off + count - 1) / device->blksz);
 	
-	return (ssize_t)requested_count;
+	return bcache_prefetch(device, devid, first, (size_t)(last - first + 1));
 }
 
-
 int block_ioctl(dev_t devid, int cmd, char* argp)
 {
 	struct block_device* device = get_block_device(devid);
@@ -409,4 +342,63 @@ ssize_t block_file_write(struct file* file, const char* buffer, size_t count)
 	}
 	
 	return result;
-}
\ No newline at end of file
+}
+/* function: block_file_readv
+ * purpose: read a block device into a vector of buffers at *pos
+ * parameters:
+ * 	file - the file we are reading from
+ * 	iov - the buffers to read into
+ * 	iovcnt - the number of buffers
+ * 	pos - the byte offset to read from, advanced past the data read
+ * returns:
+ * 	The number of bytes successfully read or an error value.
+ */
+ssize_t block_file_readv(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos)
+{
+	dev_t devid = file->f_path.p_dentry->d_inode->i_dev;
+	ssize_t done = 0;
+	
+	for(int i = 0; i < iovcnt; ++i)
+	{
+		ssize_t result = block_read(devid, *pos, iov[i].iov_len, (char*)iov[i].iov_base);
+		if( result < 0 ){
+			if( done == 0 ) done = result;
+			break;
+		}
+		*pos += result;
+		done += result;
+		if( (size_t)result < iov[i].iov_len ) break;
+	}
+	
+	return done;
+}
+
+/* function: block_file_writev
+ * purpose: write a vector of buffers to a block device at *pos
+ * parameters:
+ * 	file - the file we are writing to
+ * 	iov - the buffers to write
+ * 	iovcnt - the number of buffers
+ * 	pos - the byte offset to write at, advanced past the data written
+ * returns:
+ * 	The number of bytes successfully written or an error value.
+ */
+ssize_t block_file_writev(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos)
+{
+	dev_t devid = file->f_path.p_dentry->d_inode->i_dev;
+	ssize_t done = 0;
+	
+	for(int i = 0; i < iovcnt; ++i)
+	{
+		ssize_t result = block_write(devid, *pos, iov[i].iov_len, (const char*)iov[i].iov_base);
+		if( result < 0 ){
+			if( done == 0 ) done = result;
+			break;
+		}
+		*pos += result;
+		done += result;
+		if( (size_t)result < iov[i].iov_len ) break;
+	}
+	
+	return done;
+}
@@ -3,6 +3,58 @@
 #include "stewieos/kmem.h"		/* kmalloc/kfree declerations */
 #include "stewieos/kernel.h"		/* basic kernel definitions */
 #include "stewieos/error.h"
+#include "stewieos/kmem_cache.h"
+
+static list_t		 dentry_hash[DENTRY_HASH_SIZE];			// hashed dentries keyed by (parent, name)
+static list_t		 dentry_lru = LIST_INIT(dentry_lru);		// unreferenced dentries, most recently used first
+static size_t		 dentry_lru_count = 0;				// number of dentries in dentry_lru
+static size_t		 dentry_lru_limit = DENTRY_CACHE_DEFAULT;	// maximum length of dentry_lru
+static int		 dentry_hash_ready = 0;
+
+static u32 d_namehash(const char* name)
+{
+	u32 hash = 5381;
+	while( *name ){
+		hash = hash*33 + (u8)(*name++);
+	}
+	return hash;
+}
+
+static inline list_t* d_chain(struct dentry* parent, u32 namehash)
+{
+	if( !dentry_hash_ready ){
+		for(int i = 0; i < DENTRY_HASH_SIZE; ++i){
+			INIT_LIST(&dentry_hash[i]);
+		}
+		dentry_hash_ready = 1;
+	}
+	return &dentry_hash[(namehash ^ ((u32)parent >> 4)) & (DENTRY_HASH_SIZE-1)];
+}
+
+// Find a hashed child of `parent` (positive or negative)
+static struct dentry* d_hash_find(struct dentry* parent, const char* name, u32 namehash)
+{
+	list_t* chain = d_chain(parent, namehash);
+	list_t* iter;
+	struct dentry* entry;
+	
+	list_for_each_entry(iter, chain, struct dentry, d_hash, entry){
+		if( entry->d_parent == parent && entry->d_namehash == namehash && strcmp(entry->d_name, name) == 0 ){
+			return entry;
+		}
+	}
+	
+	return NULL;
+}
+
+// Release unused dentries until the cache is back under its limit
+static void d_lru_trim( void )
+{
+	while( dentry_lru_count > dentry_lru_limit ){
+		struct dentry* victim = list_entry(list_last(&dentry_lru), struct dentry, d_lru);
+		d_free(victim);
+	}
+}
 
 /*
  * function: d_free
@@ -19,6 +71,11 @@ void d_free(struct dentry* dentry)
 {	
 	list_rem(&dentry->d_fslink); // remove from the superblock list
 	list_rem(&dentry->d_sibling); // remove from the d_parent children list
+	if( list_inserted(&dentry->d_lru) ){
+		list_rem(&dentry->d_lru);
+		dentry_lru_count--;
+	}
+	d_drop(dentry); // remove from the lookup hash
 	// we should not have children, because refs should be zero
 	// we should also not have a mountpoint because refs is zero
 	
@@ -29,7 +86,7 @@ void d_free(struct dentry* dentry)
 	d_put(dentry->d_parent);
 	
 	// free the dentry structure
-	kfree(dentry);
+	kmem_cache_free(dentry_cache, dentry);
 }
 
 /*
@@ -49,13 +106,14 @@ void d_free(struct dentry* dentry)
 struct dentry* d_alloc(const char* name, struct dentry* parent)
 {
 	
-	struct dentry* dentry = (struct dentry*)(kmalloc(sizeof(struct dentry)));
+	struct dentry* dentry = (struct dentry*)(kmem_cache_alloc(dentry_cache));
 	if( !dentry ){
 		return dentry;
 	}
 	
 	memset(dentry, 0, sizeof(struct dentry));
 	strncpy(dentry->d_name, name, MAXNAMELEN);
+	dentry->d_namehash = d_namehash(dentry->d_name);
 	
 	dentry->d_parent = d_get(parent);
 	dentry->d_ref = 1; // initialize the references to 1 (this reference/the one we return)
@@ -63,6 +121,8 @@ struct dentry* d_alloc(const char* name, struct dentry* parent)
 	INIT_LIST(&dentry->d_fslink);
 	INIT_LIST(&dentry->d_sibling);
 	INIT_LIST(&dentry->d_children);
+	INIT_LIST(&dentry->d_hash);
+	INIT_LIST(&dentry->d_lru);
 	
 	if( dentry->d_parent )
 	{
@@ -119,6 +179,11 @@ struct dentry* d_alloc_root(struct inode* inode)
 struct dentry* d_get(struct dentry* dentry)
 {
 	if(!dentry) return NULL;
+	// Take it back out of the unused list
+	if( dentry->d_ref == 0 && list_inserted(&dentry->d_lru) ){
+		list_rem(&dentry->d_lru);
+		dentry_lru_count--;
+	}
 	dentry->d_ref++;
 	return dentry;
 }
@@ -126,9 +191,10 @@ struct dentry* d_get(struct dentry* dentry)
 /*
  * function: d_put
  * purpose:
- * 		to decrement the reference count of a directory entry
- * 		and free the directory entry if the reference count
- * 		reaches zero.
+ * 		to decrement the reference count of a directory entry.
+ * 		When the last reference is dropped, a hashed entry is
+ * 		kept on the unused list for later lookups, and anything
+ * 		else is freed.
  * parameters:
  * 		dentry: the directory entry to decrement
  * return value:
@@ -138,11 +204,116 @@ struct dentry* d_get(struct dentry* dentry)
  */
 void d_put(struct dentry* dentry)
 {
-	if( dentry->d_ref == 1 ){
+	if( dentry->d_ref != 1 ){
+		dentry->d_ref--;
+		return;
+	}
+	
+	if( !(dentry->d_flags & DF_HASHED) || dentry_lru_limit == 0 ){
 		d_free(dentry);
 		return;
 	}
-	dentry->d_ref--;
+	
+	dentry->d_ref = 0;
+	list_add(&dentry->d_lru, &dentry_lru);
+	dentry_lru_count++;
+	
+	d_lru_trim();
+}
+
+/*
+ * function: d_drop
+ * purpose:
+ * 		remove a directory entry from the lookup hash. It is
+ * 		freed once the last reference is gone, and later
+ * 		lookups of the name go back to the filesystem.
+ * parameters:
+ * 		dentry: the directory entry to drop
+ * return value:
+ * 		none.
+ */
+void d_drop(struct dentry* dentry)
+{
+	if( dentry->d_flags & DF_HASHED ){
+		list_rem(&dentry->d_hash);
+		dentry->d_flags &= ~DF_HASHED;
+	}
+	// An unused entry no longer reachable from the hash is useless
+	if( dentry->d_ref == 0 && list_inserted(&dentry->d_lru) ){
+		d_free(dentry);
+	}
+}
+
+/*
+ * function: d_invalidate
+ * purpose:
+ * 		forget any cached negative entry for `name` in `dir`.
+ * 		This must be called before creating a new name.
+ * parameters:
+ * 		dir: the parent directory entry
+ * 		name: the name being created
+ * return value:
+ * 		none.
+ */
+void d_invalidate(struct dentry* dir, const char* name)
+{
+	struct dentry* entry = d_hash_find(dir, name, d_namehash(name));
+	if( entry != NULL && (entry->d_flags & DF_NEGATIVE) ){
+		d_drop(entry);
+	}
+}
+
+// The superblock a dentry belongs to (negative entries use their parent)
+static struct superblock* d_super(struct dentry* dentry)
+{
+	if( dentry->d_inode ){
+		return dentry->d_inode->i_super;
+	} else if( dentry->d_parent && dentry->d_parent->d_inode ){
+		return dentry->d_parent->d_inode->i_super;
+	}
+	return NULL;
+}
+
+/*
+ * function: d_prune
+ * purpose:
+ * 		free every unused cached dentry belonging to a
+ * 		superblock, so it can be unmounted.
+ * parameters:
+ * 		super: the superblock to prune
+ * return value:
+ * 		none.
+ */
+void d_prune(struct superblock* super)
+{
+	list_t* iter = list_first(&dentry_lru);
+	while( iter != &dentry_lru ){
+		struct dentry* entry = list_entry(iter, struct dentry, d_lru);
+		if( d_super(entry) == super ){
+			// Freeing may release the parent onto the list as well,
+			// so start over from the top.
+			d_free(entry);
+			iter = list_first(&dentry_lru);
+		} else {
+			iter = iter->next;
+		}
+	}
+}
+
+/*
+ * function: d_set_cache_limit
+ * purpose:
+ * 		change the number of unused dentries kept in memory.
+ * 		Zero disables the cache.
+ * parameters:
+ * 		count: the new limit
+ * return value:
+ * 		none.
+ */
+void d_set_cache_limit(size_t count)
+{
+	dentry_lru_limit = count;
+	d_lru_trim();
 }
 
 /*
@@ -161,16 +332,21 @@ void d_put(struct dentry* dentry)
 struct dentry* d_lookup(struct dentry* dir, const char* name)
 {
 	struct dentry		*entry = NULL;			// The entry we find to return
-	list_t			*iter = NULL;			// the iterator in the list of children
+	struct dentry		*other = NULL;			// an entry hashed while we were reading
+	u32			 hash = d_namehash(name);	// hash of the name
 	int			 error = 0;			// error return value
 	
 	// check if the entry is already in memory
-	list_for_each(iter, &dir->d_children)
+	entry = d_hash_find(dir, name, hash);
+	if( entry != NULL )
 	{
-		entry = list_entry(iter, struct dentry, d_sibling);
-		if( strcmp(name, entry->d_name) == 0 ){
-			return d_get(entry);
+		if( entry->d_flags & DF_NEGATIVE ){
+			// Known not to exist. Keep it warm in the cache.
+			list_rem(&entry->d_lru);
+			list_add(&entry->d_lru, &dentry_lru);
+			return ERR_PTR(-ENOENT);
 		}
+		return d_get(entry);
 	}
 	// the entry is not in memory, we need to read it from the inode
 	
@@ -186,19 +362,38 @@ struct dentry* d_lookup(struct dentry* dir, const char* name)
 	// allocate a directory entry in the right place with the right name
 	entry = d_alloc(name, dir);
 	// check if the allocation went okay
-	if( IS_ERR(entry) ){
-		return entry;
+	if( IS_ERR(entry) || entry == NULL ){
+		return entry ? entry : ERR_PTR(-ENOMEM);
 	}
 
 
 	// attempt read the inode from the filesystem
 	error = dir->d_inode->i_ops->lookup(dir->d_inode, entry);
 	
+	// The lookup may have slept, someone else may have found it first
+	other = d_hash_find(dir, name, hash);
+	if( other != NULL ){
+		d_put(entry);
+		if( other->d_flags & DF_NEGATIVE ){
+			return ERR_PTR(-ENOENT);
+		}
+		return d_get(other);
+	}
+	
 	// check for an error while reading
 	if( error != 0 ){
+		// Remember names which don't exist
+		if( error == -ENOENT ){
+			entry->d_inode = NULL;
+			entry->d_flags |= DF_NEGATIVE | DF_HASHED;
+			list_add(&entry->d_hash, d_chain(dir, hash));
+		}
 		d_put(entry);
 		return ERR_PTR(error);
 	}
+	
+	entry->d_flags |= DF_HASHED;
+	list_add(&entry->d_hash, d_chain(dir, hash));
 
 	return entry;
-}
\ No newline at end of file
+}
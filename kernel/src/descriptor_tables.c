@@ -10,6 +10,7 @@ static void gdt_set_gate(int n, u32 base, u32 limit, u8 access, u8 granularity);
 static void idt_set_gate(uint n, void(*base)(void), u16 selector, u8 flags); // set an idt entry
 static int initialize_gdt(void);
 static int initialize_idt(void);
+static void initialize_sysenter(void);
 
 #define GDT_SIZE 6
 
@@ -41,6 +42,7 @@ int initialize_descriptor_tables()
 	printk("installing interrupt descriptor table... ");
 	initialize_idt();
 	printk("done.\n");
+	initialize_sysenter();
 	
 	u32 eflags = disablei();
 	eflags = eflags & ~(1 << 12);
@@ -172,6 +174,29 @@ static int initialize_idt( void )
 	return 0;
 }
 
+/* function: initialize_sysenter
+ * purpose:
+ * 	point the sysenter instruction at sysenter_entry. Every task has its
+ * 	kernel stack at the same address, so like the TSS esp0 this is set
+ * 	once. Processors without sysenter only have the int 0x80 path.
+ */
+static void initialize_sysenter( void )
+{
+	u32 eax, edx;
+	
+	cpuid(CPUID_GETFEATURES, &eax, &edx);
+	
+	// Early Pentium Pros report SEP without implementing it
+	if( !(edx & CPUID_FEAT_EDX_SEP) || ((eax & 0xFFF) < 0x633 && ((eax >> 8) & 0xF) == 6) ){
+		printk("sysenter is not supported; using int 0x80 only.\n");
+		return;
+	}
+	
+	wrmsr(MSR_SYSENTER_CS, 0x08, 0);
+	wrmsr(MSR_SYSENTER_ESP, TASK_KSTACK_ADDR+TASK_KSTACK_SIZE, 0);
+	wrmsr(MSR_SYSENTER_EIP, (u32)sysenter_entry, 0);
+}
+
 static void idt_set_gate(uint n, void(*base)(void), u16 sel, u8 flags)
 {
 	if( n >= 256 ) return;
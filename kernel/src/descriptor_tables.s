@@ -107,6 +107,77 @@ syscall_intr:
 	push dword 0x00000080
 	jmp irq_stub
 
+;
+; Function: sysenter_entry
+; Parameters:
+;	eax -- the system call number
+;	ecx -- the user stack, holding the second and third arguments
+;	edx -- the user address to return to
+;	ebx, esi, edi, ebp -- the remaining arguments
+; Purpose:
+;	Fast system call entry (see syscall.h). Build the same frame an
+;	int 0x80 would, so syscall_handler, fork and signals see no
+;	difference, and return with sysexit. If the return address in the
+;	frame was changed (e.g. by execve), return with iret instead.
+;	sysenter_handler fetches the arguments on the user stack, since
+;	touching user memory here could fault with interrupts disabled.
+;
+[global sysenter_entry]
+[extern sysenter_handler]
+sysenter_entry:
+	; The processor only loaded cs, ss, esp and eip
+	push dword 0x23		; user ss
+	push ecx		; user esp
+	pushfd			; user flags (sysenter cleared IF)
+	or dword [esp],0x200
+	push dword 0x1B		; user cs
+	push edx		; user eip
+	push edx		; return address, where int 0x80 has its error code
+	push dword 0x00000080
+	
+	pusha		; Push all common registers
+	
+	xor eax,eax
+	mov ax,ds	; we save the data segment through eax
+	push eax
+	
+	; Load kernel segment selectors
+	mov ax,0x10
+	mov ds,ax
+	mov es,ax
+	mov fs,ax
+	mov gs,ax
+	
+	mov eax,esp	; sysenter_handler takes a pointer to the frame
+	push eax
+	call sysenter_handler
+	add esp,4
+	
+	; Is the task still returning to where it came from?
+	mov eax,[esp+40]	; return address
+	cmp eax,[esp+44]	; eip
+	
+	; Restore old segment selectors
+	pop eax
+	mov ds,ax
+	mov es,ax
+	mov fs,ax
+	mov gs,ax
+	
+	; Restore common registers
+	popa
+	; Remove ISR # and error code from the stack
+	lea esp,[esp+8]		; (lea leaves the flags alone)
+	jne .slow
+	
+	; sysexit takes the user eip in edx and esp in ecx
+	mov edx,[esp]
+	mov ecx,[esp+12]
+	sti		; takes effect after sysexit
+	sysexit
+.slow:
+	iret		; Pops CS, EIP, EFLGS, SS, ESP
+
 ; This makes it easier to define the irq functions
 ; it simply pushes the interrupt number and calls the
 ; stub
@@ -9,6 +9,8 @@
 #include "stewieos/multiboot.h"
 #include "stewieos/dentry.h"
 #include "stewieos/paging.h"
+#include "stewieos/task.h"
+#include "stewieos/vm.h"
 
 // The kernel section header and accompanying information
 Elf32_Word g_shdr_num = 0;
@@ -116,17 +118,18 @@ int elf_load_exec(exec_t* exec)
 	{
 		if( phdr[i].p_type == PT_LOAD )
 		{
-			// Allocate the virtual pages for this program segment
-			elf_allocate_range(phdr[i].p_vaddr & 0xFFFFF000, (phdr[i].p_vaddr + phdr[i].p_memsz) & 0xFFFFF000, 1, 1);
-			// Read in the segment
-			file_seek(exec->file, phdr[i].p_offset, SEEK_SET);
-			file_read(exec->file, (void*)phdr[i].p_vaddr, phdr[i].p_filesz);
-			// Clear extra "uninitialized" memory
-			if( (phdr[i].p_memsz - phdr[i].p_filesz) > 0  ) {
-				memset((void*)( phdr[i].p_vaddr + phdr[i].p_filesz ), 0, phdr[i].p_memsz - phdr[i].p_filesz);
+			// Record the segment, it is read in by the page fault handler
+			// on first touch. Anything past p_filesz (.bss) is zero filled.
+			u32 flags = 0;
+			if( phdr[i].p_flags & PF_R ) flags |= VM_READ;
+			if( phdr[i].p_flags & PF_W ) flags |= VM_WRITE;
+			if( phdr[i].p_flags & PF_X ) flags |= VM_EXEC;
+			int error = vm_map(current, phdr[i].p_vaddr, phdr[i].p_vaddr + phdr[i].p_memsz, flags,
+					exec->file, (off_t)phdr[i].p_offset, phdr[i].p_vaddr, phdr[i].p_filesz);
+			if( error != 0 ){
+				kfree(phdr);
+				return error;
 			}
-			elf_modify_range(phdr[i].p_vaddr & 0xfffff000, (phdr[i].p_vaddr+phdr[i].p_memsz)&0xfffff000,
-				( (phdr[i].p_flags & PF_R) != 0 ), ( (phdr[i].p_flags & PF_W) != 0 ));
 			// we need to tell the kernel where the end of the executable is for sbrk stuff
 			if( (u32)exec->bssend < (phdr[i].p_vaddr+phdr[i].p_memsz) ){
 				exec->bssend = (void*)(phdr[i].p_vaddr+phdr[i].p_memsz);
@@ -137,6 +140,8 @@ int elf_load_exec(exec_t* exec)
 	
 	exec->entry = (void*)ehdr->e_entry;
 	
+	kfree(phdr);
+	
 	return 0;
 }
 
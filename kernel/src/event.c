@@ -4,15 +4,23 @@
 #include "stewieos/kmem.h"
 #include "stewieos/task.h"
 #include "stewieos/sem.h"
+#include "stewieos/kmem_cache.h"
 
 //static spinlock_t event_lock = 0;
 static list_t event_handlers = LIST_INIT(event_handlers);
 static list_t event_list = LIST_INIT(event_list);
 mutex_t* event_mutex = NULL, *event_handler_mutex = NULL;
 pid_t event_monitor_pid;
+static kmem_cache_t* event_cache = NULL;
 
 int event_init( void )
 {
+	// create the event object cache
+	event_cache = kmem_cache_create("event", sizeof(event_t), NULL);
+	if( event_cache == NULL ){
+		return -ENOMEM;
+	}
+	
 	// create the event mutex
 	event_mutex = mutex_alloc();
 	if( event_mutex == NULL ){
@@ -74,7 +82,7 @@ void event_monitor(void* data ATTR((unused)))
 		mutex_unlock(event_handler_mutex);
 
 		// Release the event structure
-		kfree(event);
+		kmem_cache_free(event_cache, event);
 
 	}
 
@@ -87,7 +95,7 @@ int event_raise(u32 type, u32 event_code, u32 value)
 	}
 	
 	// construct the event
-	event_t* event = kernel_alloc(event_t);
+	event_t* event = (event_t*)kmem_cache_alloc(event_cache);
 	if( event == NULL ){
 		syslog(KERN_ERR, "out of memory for event allocation!");
 		return -ENOMEM;
@@ -10,6 +10,7 @@
 #include "stewieos/paging.h"
 #include "stewieos/task.h"
 #include "stewieos/ksignal.h"
+#include "stewieos/vm.h"
 
 exec_type_t* g_exec_type = NULL;
 list_t g_module_list = LIST_INIT(g_module_list);
@@ -171,19 +172,25 @@ int sys_execve(const char* filename, char** argv, char** envp)
 	}
 	
 	// Create an empty page directory and free the old one (there's no going back from here...)
+	vm_sync(current, 0, KERNEL_VIRTUAL_BASE);
 	strip_page_dir(curdir);
+	vm_release(current);
 	signal_init(current);
 
-	// Allocate the signal stack
+	// Allocate the signal stack and the new tasks user stack space. The
+	// old image is gone, so without them the task can only exit.
+	int stack_error = 0;
 	for( u32 addr = TASK_SIGNAL_STACK-TASK_SIGNAL_STACK_SIZE;
-			addr < TASK_SIGNAL_STACK; addr += 0x1000 ){
-		alloc_page(curdir, (void*)addr, 1, 1);
+			addr < TASK_SIGNAL_STACK && stack_error == 0; addr += 0x1000 ){
+		stack_error = alloc_page(curdir, (void*)addr, 1, 1);
 	}
-	
-	// Allocate the new tasks user stack space
-	for(u32 addr = TASK_STACK_INIT_BASE; addr < TASK_STACK_START; addr += 0x1000)
+	for(u32 addr = TASK_STACK_INIT_BASE; addr < TASK_STACK_START && stack_error == 0; addr += 0x1000)
 	{
-		alloc_page(curdir, (void*)addr, 1, 1);
+		stack_error = alloc_page(curdir, (void*)addr, 1, 1);
+	}
+	if( stack_error != 0 ){
+		syslog(KERN_ERR, "process[%d]: unable to allocate the stack for %s: %d", current->t_pid, filename, stack_error);
+		sys_exit(-1);
 	}
 	
 	// Calculate argument and environment pointers within the users stack
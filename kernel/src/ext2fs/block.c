@@ -16,100 +16,313 @@ int e2_write_block(struct superblock* sb, u32 block, size_t count, const char* b
 	return (int)block_write(sb->s_dev, block*sb->s_blocksize, count*sb->s_blocksize, buffer);
 }
 
-/* Allocate a new block of data on the disk and return its index */
-u32 e2_alloc_block(struct superblock* sb)
+/* Number of bits used in the given bitmap of a block group */
+static u32 e2_bitmap_size(struct superblock* sb, int which, u32 bg)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	
+	if( which == EXT2_INODE_BITMAP ){
+		return e2fs->super.s_inodes_per_group;
+	}
+	
+	// the last group may be cut short
+	u32 first = e2fs->super.s_first_data_block + bg*e2fs->super.s_blocks_per_group;
+	if( e2fs->super.s_blocks_count - first < e2fs->super.s_blocks_per_group ){
+		return e2fs->super.s_blocks_count - first;
+	}
+	return e2fs->super.s_blocks_per_group;
+}
+
+/* Retrieve a group bitmap, reading it from disk the first time */
+static e2_bitmap_t* e2_bitmap_get(struct superblock* sb, int which, u32 bg)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	e2_bitmap_t* bitmap = &e2fs->bitmap[which][bg];
+	
+	if( bitmap->map != NULL ){
+		return bitmap;
+	}
+	
+	u32* map = (u32*)kmalloc(sb->s_blocksize);
+	if( !map ){
+		return NULL;
+	}
+	
+	u32 location = (which == EXT2_INODE_BITMAP) ? e2fs->bgtable[bg].bg_inode_bitmap : e2fs->bgtable[bg].bg_block_bitmap;
+	if( e2_read_block(sb, location, 1, (char*)map) < 0 ){
+		kfree(map);
+		return NULL;
+	}
+	
+	bitmap->map = map;
+	bitmap->cursor = 0;
+	bitmap->dirty = 0;
+	
+	return bitmap;
+}
+
+/* Find the first clear bit from `start` up to `end`. Returns `end` if
+ * every bit is set.
+ */
+static u32 e2_bitmap_scan(const u32* map, u32 start, u32 end)
+{
+	if( start >= end ){
+		return end;
+	}
+	
+	u32 word = start / 32;
+	u32 bits = ~map[word] & (0xFFFFFFFF << (start % 32));
+	
+	while( bits == 0 ){
+		if( (++word)*32 >= end ){
+			return end;
+		}
+		bits = ~map[word];
+	}
+	
+	u32 bit = word*32 + (u32)__builtin_ctz(bits);
+	return bit < end ? bit : end;
+}
+
+int e2_bitmap_alloc(struct superblock* sb, int which, u32 bg, u32* bit)
+{
+	e2_bitmap_t* bitmap = e2_bitmap_get(sb, which, bg);
+	if( bitmap == NULL ){
+		return -EIO;
+	}
+	
+	u32 size = e2_bitmap_size(sb, which, bg);
+	u32 found = e2_bitmap_scan(bitmap->map, bitmap->cursor, size);
+	
+	// Nothing below the cursor should be free, but don't trust it
+	// if the group counts say otherwise
+	if( found == size ){
+		u32 limit = bitmap->cursor < size ? bitmap->cursor : size;
+		found = e2_bitmap_scan(bitmap->map, 0, limit);
+		if( found == limit ){
+			return -ENOSPC;
+		}
+	}
+	
+	bitmap->map[found/32] |= 1u << (found%32);
+	bitmap->cursor = found + 1;
+	bitmap->dirty = 1;
+	*bit = found;
+	
+	return 0;
+}
+
+int e2_bitmap_free(struct superblock* sb, int which, u32 bg, u32 bit)
+{
+	e2_bitmap_t* bitmap = e2_bitmap_get(sb, which, bg);
+	if( bitmap == NULL ){
+		return -EIO;
+	}
+	
+	bitmap->map[bit/32] &= ~(1u << (bit%32));
+	if( bit < bitmap->cursor ){
+		bitmap->cursor = bit;
+	}
+	bitmap->dirty = 1;
+	
+	return 0;
+}
+
+/* Write a bitmap back from a copy taken under the superblock lock. The
+ * write may sleep, and anything allocated or freed meanwhile marks the
+ * bitmap dirty again for the next flush.
+ */
+static int e2_bitmap_write(struct superblock* sb, e2_bitmap_t* bitmap, u32 location, char* snapshot)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	
+	spin_lock(&e2fs->rw_lock);
+	int dirty = bitmap->dirty;
+	if( dirty ){
+		memcpy(snapshot, bitmap->map, sb->s_blocksize);
+		bitmap->dirty = 0;
+	}
+	spin_unlock(&e2fs->rw_lock);
+	
+	if( !dirty ){
+		return 0;
+	}
+	
+	int error = e2_write_block(sb, location, 1, snapshot);
+	if( error < 0 ){
+		spin_lock(&e2fs->rw_lock);
+		bitmap->dirty = 1;
+		spin_unlock(&e2fs->rw_lock);
+		return error;
+	}
+	
+	return 0;
+}
+
+/* Write every modified bitmap back to disk */
+int e2_bitmap_flush(struct superblock* sb)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	int result = 0;
+	
+	char* snapshot = (char*)kmalloc(sb->s_blocksize);
+	if( snapshot == NULL ){
+		return -ENOMEM;
+	}
+	
+	for(u32 bg = 0; bg < EXT2_BGCOUNT(sb); ++bg)
+	{
+		int error = e2_bitmap_write(sb, &e2fs->bitmap[EXT2_BLOCK_BITMAP][bg], e2fs->bgtable[bg].bg_block_bitmap, snapshot);
+		if( error < 0 ) result = error;
+		error = e2_bitmap_write(sb, &e2fs->bitmap[EXT2_INODE_BITMAP][bg], e2fs->bgtable[bg].bg_inode_bitmap, snapshot);
+		if( error < 0 ) result = error;
+	}
+	
+	kfree(snapshot);
+	
+	return result;
+}
+
+/* Free the cached bitmaps. They should be flushed first. */
+void e2_bitmap_release(struct superblock* sb)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	
+	for(int which = EXT2_BLOCK_BITMAP; which <= EXT2_INODE_BITMAP; ++which)
+	{
+		if( e2fs->bitmap[which] == NULL ) continue;
+		for(u32 bg = 0; bg < EXT2_BGCOUNT(sb); ++bg){
+			kfree(e2fs->bitmap[which][bg].map);
+		}
+		kfree(e2fs->bitmap[which]);
+		e2fs->bitmap[which] = NULL;
+	}
+}
+
+/* Allocate a run of up to `*count` contiguous blocks, as close after `goal`
+ * as possible. The groups are searched starting with the one holding the
+ * goal. On success, the first block is returned and `*count` is set to the
+ * length of the run. Returns 0 if the disk is full.
+ */
+u32 e2_alloc_blocks(struct superblock* sb, u32 goal, u32* count)
 {
 	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	u32 first = e2fs->super.s_first_data_block;
+	u32 ngroups = EXT2_BGCOUNT(sb);
 	u32 block = 0;
 	
 	// Check if there are any free blocks
-	if( e2fs->super.s_free_blocks_count == 0 ){
+	if( e2fs->super.s_free_blocks_count == 0 || *count == 0 ){
 		return 0;
 	}
 	
-	// Allocate a temporary bitmap structure
-	u32* bitmap = (u32*)kmalloc(sb->s_blocksize);
-	if(!bitmap){
-		return -ENOMEM;
+	if( goal < first || goal >= e2fs->super.s_blocks_count ){
+		goal = first;
 	}
+	u32 goal_bg = (goal - first) / e2fs->super.s_blocks_per_group;
 	
 	// Lock the private data
 	spin_lock(&e2fs->rw_lock);
 	
-	// Iterate over every block group
-	for(u32 bg = 0; bg < EXT2_BGCOUNT(sb); ++bg)
+	for(u32 i = 0; i < ngroups; ++i)
 	{
+		u32 bg = (goal_bg + i) % ngroups;
+		
 		// Check if there are any free blocks
 		if( e2fs->bgtable[bg].bg_free_blocks_count == 0 ) continue;
 		
-		// read in the block group block bitmap
-		e2_read_block(sb, e2fs->bgtable[bg].bg_block_bitmap, 1, (char*)bitmap);
+		e2_bitmap_t* bitmap = e2_bitmap_get(sb, EXT2_BLOCK_BITMAP, bg);
+		if( bitmap == NULL ) continue;
+		u32 size = e2_bitmap_size(sb, EXT2_BLOCK_BITMAP, bg);
+		
+		// Start at the goal within its own group, and at the cursor elsewhere
+		u32 from = bitmap->cursor;
+		if( i == 0 && (goal - first) % e2fs->super.s_blocks_per_group > from ){
+			from = (goal - first) % e2fs->super.s_blocks_per_group;
+		}
+		
+		if( from > size ) from = size;
+		
+		u32 bit = e2_bitmap_scan(bitmap->map, from, size);
+		if( bit == size ){
+			// wrap around to the cursor
+			bit = e2_bitmap_scan(bitmap->map, bitmap->cursor, from);
+			if( bit == from ) continue;
+		}
 		
-		// Iterate over every block in the group
-		for(u32 b = 0; b < e2fs->super.s_blocks_per_group; ++b)
-		{
-			// check if it's free
-			if( !(bitmap[b/32] & (1<<(b%32))) ){
-				bitmap[b/32] |= (1<<(b%32)); // reserve it
-				// write the bitmap back to disk
-				e2_write_block(sb, e2fs->bgtable[bg].bg_block_bitmap, 1, (char*)bitmap);
-				// Adjust account parameters
-				e2fs->bgtable[bg].bg_free_blocks_count--;
-				e2fs->super.s_free_blocks_count--;
-				// Notify the system that the super block is dirty
-				e2fs->dirty = 1;
-				// Calculate the block index
-				block = b + (bg*e2fs->super.s_blocks_per_group);
-				// Unlock and return
-				spin_unlock(&e2fs->rw_lock);
-				kfree(bitmap);
-				return block;
-			}
+		// Extend the run as far as we were asked to
+		u32 run = 1;
+		while( run < *count && bit+run < size && !(bitmap->map[(bit+run)/32] & (1u << ((bit+run)%32))) ){
+			run++;
 		}
 		
+		for(u32 b = bit; b < bit+run; ++b){
+			bitmap->map[b/32] |= 1u << (b%32);
+		}
+		if( bit == bitmap->cursor ){
+			bitmap->cursor = bit + run;
+		}
+		bitmap->dirty = 1;
+		
+		// Adjust account parameters
+		e2fs->bgtable[bg].bg_free_blocks_count = (u16)(e2fs->bgtable[bg].bg_free_blocks_count - run);
+		e2fs->super.s_free_blocks_count -= run;
+		// Notify the system that the super block is dirty
+		e2fs->dirty = 1;
+		
+		block = first + bg*e2fs->super.s_blocks_per_group + bit;
+		*count = run;
+		break;
 	}
 	
-	
-	// Unlock, free and return
+	// Unlock and return
 	spin_unlock(&e2fs->rw_lock);
 	
-	kfree(bitmap);
-	
-	return 0;
+	return block;
 }
 
-/* Free a block of data from the disk */
-int e2_free_block(struct superblock* sb, u32 block)
+/* Allocate a new block of data on the disk and return its index */
+u32 e2_alloc_block(struct superblock* sb)
+{
+	u32 count = 1;
+	return e2_alloc_blocks(sb, EXT2_SUPER(sb)->super.s_first_data_block, &count);
+}
+
+/* Free a run of blocks from the disk */
+int e2_free_blocks(struct superblock* sb, u32 block, u32 count)
 {
 	e2_super_private_t* e2fs = EXT2_SUPER(sb);
-	
-	// Allocate a temporary buffer
-	u32* bitmap = (u32*)kmalloc(sb->s_blocksize);
-	if(!bitmap){
-		return -ENOMEM;
-	}
+	int result = 0;
 	
 	// lock the private data
 	spin_lock(&e2fs->rw_lock);
 	
-	// Calculate indices
-	u32 bg = block / e2fs->super.s_blocks_per_group;
-	u32 local = block % e2fs->super.s_blocks_per_group;
-	
-	// Read in the bitmap, modify, and write it again
-	e2_read_block(sb, e2fs->bgtable[bg].bg_block_bitmap, 1, (char*)bitmap);
-	bitmap[local/32] &= ~(1<<(local%32));
-	e2_write_block(sb, e2fs->bgtable[bg].bg_block_bitmap, 1, (char*)bitmap);
-	
-	// Adjust accounting details
-	e2fs->super.s_free_blocks_count++;
-	e2fs->bgtable[bg].bg_free_blocks_count++;
-	e2fs->dirty = 1;
+	for(u32 i = 0; i < count; ++i)
+	{
+		// Calculate indices
+		u32 bg = (block + i - e2fs->super.s_first_data_block) / e2fs->super.s_blocks_per_group;
+		u32 local = (block + i - e2fs->super.s_first_data_block) % e2fs->super.s_blocks_per_group;
+		
+		// Clear the bit in the cached bitmap
+		result = e2_bitmap_free(sb, EXT2_BLOCK_BITMAP, bg, local);
+		if( result < 0 ){
+			break;
+		}
+		
+		// Adjust accounting details
+		e2fs->super.s_free_blocks_count++;
+		e2fs->bgtable[bg].bg_free_blocks_count++;
+		e2fs->dirty = 1;
+	}
 	
-	// unlock free and return
+	// unlock and return
 	spin_unlock(&e2fs->rw_lock);
 	
-	kfree(bitmap);
-	
-	return 0;
-}
\ No newline at end of file
+	return result;
+}
+
+/* Free a block of data from the disk */
+int e2_free_block(struct superblock* sb, u32 block)
+{
+	return e2_free_blocks(sb, block, 1);
+}
@@ -0,0 +1,359 @@
+#include "error.h"
+#include "ext2fs/ext2.h"
+#include "kmem.h"
+
+/* Logical to physical block mapping
+ *
+ * The block tree of an inode is walked on demand instead of being read
+ * into memory in full when the inode is loaded. Each inode keeps the few
+ * indirect blocks it used most recently, so sequential access only reads
+ * an indirect block once for every s_blocksize/4 data blocks.
+ *
+ * Looking a block up can sleep reading an indirect block, so the cache and
+ * the tree are protected by the inode's bmap_lock mutex. e2_bmap_find and
+ * e2_bmap_set expect the caller to hold it; everything else takes it.
+ */
+
+/* Find a cached indirect block, or a slot to load one into */
+static e2_indirect_t* e2_indirect_slot(struct inode* inode, u32 block, int* hit)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	e2_indirect_t* victim = &priv->indirect[0];
+
+	for(int i = 0; i < EXT2_INDIRECT_CACHE; ++i)
+	{
+		e2_indirect_t* entry = &priv->indirect[i];
+		if( entry->block == block && entry->data != NULL ){
+			entry->stamp = ++priv->indirect_stamp;
+			*hit = 1;
+			return entry;
+		}
+		if( entry->data == NULL || (victim->data != NULL && entry->stamp < victim->stamp) ){
+			victim = entry;
+		}
+	}
+
+	// write back the least recently used block before reusing it
+	if( victim->dirty ){
+		if( e2_write_block(inode->i_super, victim->block, 1, (char*)victim->data) < 0 ){
+			return NULL;
+		}
+		victim->dirty = 0;
+	}
+
+	if( victim->data == NULL ){
+		victim->data = (u32*)kmalloc(inode->i_super->s_blocksize);
+		if( victim->data == NULL ){
+			return NULL;
+		}
+	}
+
+	// the caller sets the block number once the contents are valid
+	victim->block = 0;
+	victim->stamp = ++priv->indirect_stamp;
+	*hit = 0;
+
+	return victim;
+}
+
+/* Retrieve the contents of an indirect block */
+static e2_indirect_t* e2_indirect_get(struct inode* inode, u32 block)
+{
+	int hit;
+	e2_indirect_t* entry = e2_indirect_slot(inode, block, &hit);
+
+	if( entry != NULL && !hit ){
+		if( e2_read_block(inode->i_super, block, 1, (char*)entry->data) < 0 ){
+			return NULL;
+		}
+		entry->block = block;
+	}
+
+	return entry;
+}
+
+/* Start a freshly allocated indirect block with no entries */
+static e2_indirect_t* e2_indirect_new(struct inode* inode, u32 block)
+{
+	int hit;
+	e2_indirect_t* entry = e2_indirect_slot(inode, block, &hit);
+
+	if( entry != NULL ){
+		memset(entry->data, 0, inode->i_super->s_blocksize);
+		entry->block = block;
+		entry->dirty = 1;
+	}
+
+	return entry;
+}
+
+/* Drop an indirect block from the cache without writing it */
+static void e2_indirect_forget(struct inode* inode, u32 block)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+
+	for(int i = 0; i < EXT2_INDIRECT_CACHE; ++i){
+		if( priv->indirect[i].block == block ){
+			priv->indirect[i].block = 0;
+			priv->indirect[i].dirty = 0;
+		}
+	}
+}
+
+int e2_indirect_flush(struct inode* inode)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	int result = 0;
+
+	mutex_lock(priv->bmap_lock, SEM_FOREVER);
+	for(int i = 0; i < EXT2_INDIRECT_CACHE; ++i)
+	{
+		e2_indirect_t* entry = &priv->indirect[i];
+		if( !entry->dirty ) continue;
+		int error = e2_write_block(inode->i_super, entry->block, 1, (char*)entry->data);
+		if( error < 0 ) result = error;
+		else entry->dirty = 0;
+	}
+	mutex_unlock(priv->bmap_lock);
+
+	return result;
+}
+
+void e2_indirect_release(struct inode* inode)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+
+	for(int i = 0; i < EXT2_INDIRECT_CACHE; ++i){
+		kfree(priv->indirect[i].data);
+		memset(&priv->indirect[i], 0, sizeof(e2_indirect_t));
+	}
+}
+
+/* Split a logical block number into the index used at each level of the
+ * block tree. Returns the number of indirect levels, or -EFBIG.
+ */
+static int e2_bmap_path(struct superblock* sb, u32 lblock, u32* offsets)
+{
+	u32 ptrs = sb->s_blocksize / 4;
+
+	if( lblock < 12 ){
+		offsets[0] = lblock;
+		return 0;
+	}
+	lblock -= 12;
+
+	if( lblock < ptrs ){
+		offsets[0] = 12;
+		offsets[1] = lblock;
+		return 1;
+	}
+	lblock -= ptrs;
+
+	if( lblock < ptrs*ptrs ){
+		offsets[0] = 13;
+		offsets[1] = lblock / ptrs;
+		offsets[2] = lblock % ptrs;
+		return 2;
+	}
+	lblock -= ptrs*ptrs;
+
+	offsets[0] = 14;
+	offsets[1] = lblock / (ptrs*ptrs);
+	offsets[2] = (lblock / ptrs) % ptrs;
+	offsets[3] = lblock % ptrs;
+	if( offsets[1] >= ptrs ){
+		return -EFBIG;
+	}
+
+	return 3;
+}
+
+/* Remove whole blocks from the inode block count */
+static void e2_inode_sub_blocks(struct inode* inode, u32 count)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	u32 sectors = count * (inode->i_super->s_blocksize/512);
+
+	priv->inode->i_blocks = (priv->inode->i_blocks > sectors) ? priv->inode->i_blocks - sectors : 0;
+	e2_inode_dirty(inode);
+}
+
+/* Map a logical block of the inode to a block on disk (0 for a hole).
+ * The caller holds bmap_lock.
+ */
+int e2_bmap_find(struct inode* inode, u32 lblock, u32* block)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	u32 offsets[4];
+
+	int depth = e2_bmap_path(inode->i_super, lblock, offsets);
+	if( depth < 0 ){
+		return depth;
+	}
+
+	*block = priv->inode->i_block[offsets[0]];
+	for(int i = 1; i <= depth && *block != 0; ++i)
+	{
+		e2_indirect_t* entry = e2_indirect_get(inode, *block);
+		if( entry == NULL ){
+			return -EIO;
+		}
+		*block = entry->data[offsets[i]];
+	}
+
+	return 0;
+}
+
+int e2_inode_bmap(struct inode* inode, u32 lblock, u32* block)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+
+	mutex_lock(priv->bmap_lock, SEM_FOREVER);
+	int result = e2_bmap_find(inode, lblock, block);
+	mutex_unlock(priv->bmap_lock);
+
+	return result;
+}
+
+/* Point a logical block of the inode at a block on disk. Missing indirect
+ * blocks on the way are allocated, and counted in i_blocks. The data block
+ * itself is the callers to account for. The caller holds bmap_lock.
+ */
+int e2_bmap_set(struct inode* inode, u32 lblock, u32 pblock)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	struct superblock* sb = inode->i_super;
+	e2_indirect_t* entry = NULL;
+	u32 offsets[4];
+
+	int depth = e2_bmap_path(sb, lblock, offsets);
+	if( depth < 0 ){
+		return depth;
+	}
+
+	u32* slot = &priv->inode->i_block[offsets[0]];
+	e2_inode_dirty(inode);
+
+	for(int i = 1; i <= depth; ++i)
+	{
+		if( *slot == 0 )
+		{
+			// nothing to clear inside a hole
+			if( pblock == 0 ){
+				return 0;
+			}
+			// keep the indirect block close to the data it maps
+			u32 count = 1;
+			u32 fresh = e2_alloc_blocks(sb, pblock, &count);
+			if( fresh == 0 ){
+				return -ENOSPC;
+			}
+			*slot = fresh;
+			if( entry ) entry->dirty = 1;
+			priv->inode->i_blocks += sb->s_blocksize/512;
+			entry = e2_indirect_new(inode, fresh);
+		} else {
+			entry = e2_indirect_get(inode, *slot);
+		}
+		if( entry == NULL ){
+			return -EIO;
+		}
+		slot = &entry->data[offsets[i]];
+	}
+
+	*slot = pblock;
+	if( entry ) entry->dirty = 1;
+
+	return 0;
+}
+
+/* Free every block below an indirect block which maps logical blocks at
+ * or after `from`. `base` is the first logical block mapped through it, and
+ * `depth` the number of levels below it. Returns 1 if the indirect block
+ * itself was freed.
+ */
+static int e2_bmap_free_tree(struct inode* inode, u32 block, int depth, u32 base, u32 from)
+{
+	struct superblock* sb = inode->i_super;
+	u32 ptrs = sb->s_blocksize / 4;
+	u32 span = 1;
+
+	for(int i = 1; i < depth; ++i){
+		span *= ptrs;
+	}
+
+	for(u32 i = 0; i < ptrs; ++i)
+	{
+		u32 start = base + i*span;
+		if( start + span <= from ) continue;
+
+		// the cached copy may have been replaced by a lower level
+		e2_indirect_t* entry = e2_indirect_get(inode, block);
+		if( entry == NULL ){
+			return 0;
+		}
+
+		u32 child = entry->data[i];
+		if( child == 0 ) continue;
+
+		if( depth == 1 ){
+			e2_free_block(sb, child);
+			e2_inode_sub_blocks(inode, 1);
+		} else if( !e2_bmap_free_tree(inode, child, depth-1, start, from) ){
+			continue;
+		}
+
+		entry = e2_indirect_get(inode, block);
+		if( entry == NULL ){
+			return 0;
+		}
+		entry->data[i] = 0;
+		entry->dirty = 1;
+	}
+
+	// nothing below this block is in use anymore
+	if( base >= from ){
+		e2_indirect_forget(inode, block);
+		e2_free_block(sb, block);
+		e2_inode_sub_blocks(inode, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Free every block of the inode at or after logical block `from`, along
+ * with any indirect blocks left empty.
+ */
+void e2_inode_truncate_blocks(struct inode* inode, u32 from)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	u32 ptrs = inode->i_super->s_blocksize / 4;
+	u32 base = 12;
+	u32 cover = ptrs;
+
+	mutex_lock(priv->bmap_lock, SEM_FOREVER);
+
+	for(u32 i = from; i < 12; ++i){
+		if( priv->inode->i_block[i] != 0 ){
+			e2_free_block(inode->i_super, priv->inode->i_block[i]);
+			e2_inode_sub_blocks(inode, 1);
+			priv->inode->i_block[i] = 0;
+		}
+	}
+
+	for(int level = 1; level <= 3; ++level)
+	{
+		u32* slot = &priv->inode->i_block[11+level];
+		if( *slot != 0 && base + cover > from ){
+			if( e2_bmap_free_tree(inode, *slot, level, base, from) ){
+				*slot = 0;
+			}
+		}
+		base += cover;
+		cover *= ptrs;
+	}
+	mutex_unlock(priv->bmap_lock);
+
+	e2_inode_dirty(inode);
+}
@@ -5,17 +5,102 @@
 #include "dentry.h"
 #include "task.h"
 
-int e2_file_open(struct file* file ATTR((unused)), struct dentry* dentry ATTR((unused)), int mode ATTR((unused)))
+int e2_file_open(struct file* file, struct dentry* dentry ATTR((unused)), int mode ATTR((unused)))
 {
-	 return 0;
+	e2_readahead_t* ra = (e2_readahead_t*)kmalloc(sizeof(e2_readahead_t));
+	if( ra == NULL ){
+		return -ENOMEM;
+	}
+	
+	// A reader starting at the beginning of the file counts as sequential
+	memset(ra, 0, sizeof(e2_readahead_t));
+	file->f_private = ra;
+	
+	return 0;
 }
 
-int e2_file_close(struct file* file ATTR((unused)), struct dentry* dentry ATTR((unused)))
+int e2_file_close(struct file* file, struct dentry* dentry ATTR((unused)))
 {
-	file_flush(file);
+	// Give back any blocks preallocated while writing the file
+	e2_inode_discard_prealloc(file_inode(file));
+	kfree(file->f_private);
+	file->f_private = NULL;
 	return 0;
 }
 
+/* Track the access pattern of a file, and queue the blocks a sequential
+ * reader will want next for the buffer cache to read in the background.
+ * The window doubles with each sequential read up to EXT2_RA_MAX, and a
+ * read anywhere else drops it, so random access never pays for readahead.
+ */
+static void e2_file_readahead(struct file* file, off_t offset, size_t count)
+{
+	e2_readahead_t* ra = (e2_readahead_t*)file->f_private;
+	struct inode* inode = file_inode(file);
+	struct superblock* sb = inode->i_super;
+	
+	if( ra == NULL || count == 0 ){
+		return;
+	}
+	
+	u32 first = (u32)(offset / sb->s_blocksize);
+	u32 last = (u32)((offset + count - 1) / sb->s_blocksize);
+	int sequential = (first == ra->next);
+	
+	ra->next = (u32)((offset + count) / sb->s_blocksize);
+	
+	if( !sequential ){
+		ra->window = 0;
+		ra->ahead = 0;
+		return;
+	}
+	
+	if( ra->window == 0 ){
+		ra->window = EXT2_RA_MIN;
+	} else if( ra->window < EXT2_RA_MAX ){
+		ra->window *= 2;
+	}
+	
+	// Top the window up once the reader has used half of it
+	u32 start = ra->ahead > last + 1 ? ra->ahead : last + 1;
+	if( start - (last + 1) > ra->window / 2 ){
+		return;
+	}
+	
+	u32 end = last + 1 + ra->window;
+	u32 nblocks = (u32)EXT2_NBLOCKS(sb, EXT2_INODE(inode));
+	if( end > nblocks ){
+		end = nblocks;
+	}
+	if( start >= end ){
+		return;
+	}
+	ra->ahead = end;
+	
+	// Queue contiguous runs of disk blocks as single requests
+	u32 run_start = 0, run = 0;
+	for(u32 lblock = start; lblock < end; ++lblock)
+	{
+		u32 block;
+		if( e2_inode_bmap(inode, lblock, &block) < 0 ){
+			break;
+		}
+		if( run != 0 && block == run_start + run ){
+			run++;
+			continue;
+		}
+		if( run != 0 ){
+			block_prefetch(sb->s_dev, run_start*sb->s_blocksize, run*sb->s_blocksize);
+		}
+		// holes have nothing to read
+		run_start = block;
+		run = (block != 0);
+	}
+	if( run != 0 ){
+		block_prefetch(sb->s_dev, run_start*sb->s_blocksize, run*sb->s_blocksize);
+	}
+}
+
 ssize_t e2_file_read(struct file* file, char* buffer, size_t count)
 {
 	struct inode* inode = file_inode(file); // get the inode
@@ -26,15 +111,33 @@ ssize_t e2_file_read(struct file* file, char* buffer, size_t count)
 		return result;
 	}
 	
-	// Increment the offset
-	file->f_off += result;
+	// Start reading what comes next while the caller uses this
+	e2_file_readahead(file, file->f_off, (size_t)result);
 	
-	file_flush(file);
+	// Increment the offset (the inode is written back later)
+	file->f_off += result;
 	
 	// return byte count
 	return result;
 }
 
+/* Fill a page of the page cache. The caller zeroed it, so only the part
+ * before the end of the file is read.
+ */
+int e2_file_readpage(struct file* file, off_t offset, char* page)
+{
+	struct inode* inode = file_inode(file);
+	
+	ssize_t result = e2_inode_io(inode, EXT2_READ, offset, PAGE_SIZE, page);
+	if( result < 0 ){
+		return (int)result;
+	}
+	
+	e2_file_readahead(file, offset, (size_t)result);
+	
+	return (int)result;
+}
+
 ssize_t e2_file_write(struct file* file, const char* buffer, size_t count)
 {
 	struct inode* inode = file_inode(file); // get the inode
@@ -45,15 +148,83 @@ ssize_t e2_file_write(struct file* file, const char* buffer, size_t count)
 		return result;
 	}
 	
-	// Increment the offset
+	// Increment the offset (the inode is written back later)
 	file->f_off += result;
 	
-	file_flush(file);
-	
 	// return byte count
 	return result;
 }
 
+/* Write a vector of buffers at *pos. Small segments are gathered into one
+ * buffer of up to EXT2_IOV_MAX bytes, so each run of them costs a single
+ * e2_inode_io call and contiguous blocks go to the device in one request.
+ */
+ssize_t e2_file_writev(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos)
+{
+	struct inode* inode = file_inode(file);
+	ssize_t completed = 0;
+	char* gather = NULL;
+	int i = 0;
+	
+	while( i < iovcnt )
+	{
+		const char* data = (const char*)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		
+		// Large segments (and lone ones) need no copy
+		if( len < EXT2_IOV_MAX && i+1 < iovcnt && iov[i+1].iov_len < EXT2_IOV_MAX )
+		{
+			if( gather == NULL && (gather = (char*)kmalloc(EXT2_IOV_MAX)) == NULL ){
+				return completed ? completed : -ENOMEM;
+			}
+			len = 0;
+			while( i < iovcnt && len + iov[i].iov_len <= EXT2_IOV_MAX ){
+				memcpy(gather+len, iov[i].iov_base, iov[i].iov_len);
+				len += iov[i].iov_len;
+				i++;
+			}
+			data = gather;
+		} else {
+			i++;
+		}
+		
+		if( len == 0 ){
+			continue;
+		}
+		
+		ssize_t result = e2_inode_io(inode, EXT2_WRITE, *pos, len, (char*)data);
+		if( result < 0 ){
+			if( completed == 0 ) completed = result;
+			break;
+		}
+		
+		*pos += result;
+		completed += result;
+		if( (size_t)result < len ) break;
+	}
+	
+	if( gather ){
+		kfree(gather);
+	}
+	
+	return completed;
+}
+
+/* Write the file inode and any accounting changes made for it back to the
+ * buffer cache right away.
+ */
+int e2_file_fsync(struct file* file)
+{
+	struct inode* inode = file_inode(file);
+	
+	int result = e2_inode_flush(inode);
+	if( result < 0 ){
+		return result;
+	}
+	
+	return e2_super_flush(inode->i_super);
+}
+
 int e2_file_readdir(struct file* file, struct dirent* dirent, size_t count)
 {
 	struct inode* inode = file_inode(file);
@@ -64,10 +235,8 @@ int e2_file_readdir(struct file* file, struct dirent* dirent, size_t count)
 	{
 		ssize_t nread = e2_inode_io(inode, EXT2_READ, file->f_off, 264, (char*)e2ent);
 		if( nread == 0 ){
-			file_flush(file);
 			return (int)i;
 		} else if( nread < 0 ){
-			file_flush(file);
 			return (int)nread;
 		} else if( e2ent->inode != 0 ) {
 			dirent[i].d_ino = (ino_t)e2ent->inode;
@@ -80,7 +249,5 @@ int e2_file_readdir(struct file* file, struct dirent* dirent, size_t count)
 		file->f_off += e2ent->rec_len;
 	}
 	
-	file_flush(file);
-	
 	return count;
 }
\ No newline at end of file
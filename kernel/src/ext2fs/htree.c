@@ -0,0 +1,887 @@
+#include "error.h"
+#include "ext2fs/ext2.h"
+#include "kmem.h"
+
+/* Directory hash index (htree) support
+ *
+ * An indexed directory is still a valid linear directory. The first block
+ * holds "." and a ".." entry spanning the rest of the block, which hides
+ * the index root behind it. Lower index blocks start with an empty entry
+ * covering the whole block. Every other block is an ordinary leaf, and
+ * each leaf holds the names whose hash falls in the range given by the
+ * index entry pointing at it.
+ */
+
+/* One level of a walk through the index */
+typedef struct _e2_dx_frame
+{
+	char* buf; // contents of the index block
+	u32 block; // logical block number within the directory
+	e2_dx_entry_t* entries; // first entry (its hash field holds the limit and count)
+	e2_dx_entry_t* at; // entry followed to the next level
+} e2_dx_frame_t;
+
+/* Sort key for splitting a leaf */
+typedef struct _e2_dx_map
+{
+	u32 hash;
+	u32 offs;
+} e2_dx_map_t;
+
+#define dx_limit(entries) ((e2_dx_limit_t*)(entries))
+#define dx_block(entry) ((entry)->block & EXT2_DX_BLOCK_MASK)
+#define dx_rol(x, s) (((x) << (s)) | ((x) >> (32-(s))))
+
+/* The original ext3 directory hash */
+static u32 dx_hack_hash(const char* name, size_t len, int unsig)
+{
+	u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	while( len-- ){
+		int c = unsig ? (int)(unsigned char)*name++ : (int)(signed char)*name++;
+		hash = hash1 + (hash0 ^ (u32)(c * 7152373));
+		if( hash & 0x80000000 ) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+
+	return hash0 << 1;
+}
+
+/* Pack up to num*4 characters of the name into words, padded with the length */
+static void dx_str2hashbuf(const char* msg, size_t len, u32* buf, int num, int unsig)
+{
+	u32 pad = (u32)len | ((u32)len << 8);
+	u32 val;
+
+	pad |= pad << 16;
+	val = pad;
+	if( len > (size_t)num*4 ) len = (size_t)num*4;
+
+	for(size_t i = 0; i < len; ++i){
+		int c = unsig ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = (u32)c + (val << 8);
+		if( (i % 4) == 3 ){
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+
+	if( --num >= 0 ) *buf++ = val;
+	while( --num >= 0 ) *buf++ = pad;
+}
+
+static void dx_tea_transform(u32* buf, const u32* in)
+{
+	u32 sum = 0;
+	u32 b0 = buf[0], b1 = buf[1];
+	u32 a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for(int n = 0; n < 16; ++n){
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4)+a) ^ (b1+sum) ^ ((b1 >> 5)+b);
+		b1 += ((b0 << 4)+c) ^ (b0+sum) ^ ((b0 >> 5)+d);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = dx_rol(a, s))
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+static void dx_half_md4_transform(u32* buf, const u32* in)
+{
+	u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+	MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+	MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+	MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+	MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+	MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* Hash a name the way the given hash version does. The low bit is
+ * always clear, since index entries use it to mark hash collisions
+ * continuing from the previous leaf.
+ */
+static u32 dx_hash(struct superblock* sb, int version, const char* name, size_t len)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	u32 in[8];
+	u32 hash = 0;
+
+	// Use the filesystem seed unless it is all zero
+	for(int i = 0; i < 4; ++i){
+		if( ((u32*)e2fs->super.s_hash_seed)[i] != 0 ){
+			memcpy(buf, e2fs->super.s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch( version )
+	{
+		case DX_HASH_LEGACY:
+		case DX_HASH_LEGACY_UNSIGNED:
+			hash = dx_hack_hash(name, len, version == DX_HASH_LEGACY_UNSIGNED);
+			break;
+		case DX_HASH_HALF_MD4:
+		case DX_HASH_HALF_MD4_UNSIGNED:
+			for(size_t left = len; ; left -= 32, name += 32){
+				dx_str2hashbuf(name, left, in, 8, version == DX_HASH_HALF_MD4_UNSIGNED);
+				dx_half_md4_transform(buf, in);
+				if( left <= 32 ) break;
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+		case DX_HASH_TEA_UNSIGNED:
+			for(size_t left = len; ; left -= 16, name += 16){
+				dx_str2hashbuf(name, left, in, 4, version == DX_HASH_TEA_UNSIGNED);
+				dx_tea_transform(buf, in);
+				if( left <= 16 ) break;
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1u;
+	// The largest hash is reserved as an end-of-directory marker
+	if( hash == 0xFFFFFFFE ){
+		hash = 0xFFFFFFFC;
+	}
+
+	return hash;
+}
+
+/* The hash version to use for names in this directory */
+static int dx_hash_version(struct superblock* sb, e2_dx_root_t* root)
+{
+	int version = root->hash_version;
+	if( EXT2_SUPER(sb)->super.s_flags & EXT2_FLAGS_UNSIGNED_HASH ){
+		version += DX_HASH_LEGACY_UNSIGNED;
+	}
+	return version;
+}
+
+/* Find the entry with the given name in a directory block */
+static e2_dirent_t* dx_find_dirent(char* block, size_t blocksize, const char* name)
+{
+	size_t len = strlen(name);
+	e2_dirent_t* iter = (e2_dirent_t*)block;
+
+	while( (u32)iter < ((u32)block + blocksize) )
+	{
+		if( iter->inode != 0 && iter->name_len == len && strncmp(iter->name, name, len) == 0 ){
+			return iter;
+		}
+		if( iter->rec_len == 0 ) break;
+		iter = (e2_dirent_t*)( (u32)iter + iter->rec_len );
+	}
+
+	return NULL;
+}
+
+/* Carve space for a new name out of a directory block. The returned entry
+ * has its record length set, and the rest is left for the caller.
+ */
+static e2_dirent_t* dx_insert_dirent(char* block, size_t blocksize, const char* name)
+{
+	u32 needed = EXT2_DIRENT_LEN(strlen(name));
+	e2_dirent_t* iter = (e2_dirent_t*)block;
+
+	while( (u32)iter < ((u32)block + blocksize) )
+	{
+		u32 used = iter->inode ? EXT2_DIRENT_LEN(iter->name_len) : 0;
+		if( iter->rec_len == 0 ) break;
+		if( (u32)iter->rec_len >= used + needed )
+		{
+			if( used == 0 ){
+				// keep whatever we don't need as an empty entry
+				if( (u32)iter->rec_len >= needed + EXT2_DIRENT_LEN(1) ){
+					e2_dirent_t* rest = (e2_dirent_t*)( (u32)iter + needed );
+					rest->rec_len = (u16)(iter->rec_len - needed);
+					rest->inode = 0;
+					iter->rec_len = (u16)needed;
+				}
+				return iter;
+			}
+			// split the slack at the end of a live entry
+			e2_dirent_t* fresh = (e2_dirent_t*)( (u32)iter + used );
+			fresh->rec_len = (u16)(iter->rec_len - used);
+			fresh->inode = 0;
+			iter->rec_len = (u16)used;
+			return fresh;
+		}
+		iter = (e2_dirent_t*)( (u32)iter + iter->rec_len );
+	}
+
+	return NULL;
+}
+
+/* Copy the given entries tightly packed into a block. The last one
+ * takes up the rest of the block.
+ */
+static void dx_pack(char* dst, const char* src, e2_dx_map_t* map, u32 count, size_t blocksize)
+{
+	e2_dirent_t* last = NULL;
+	u32 off = 0;
+
+	for(u32 i = 0; i < count; ++i)
+	{
+		e2_dirent_t* ent = (e2_dirent_t*)(src + map[i].offs);
+		u32 len = EXT2_DIRENT_LEN(ent->name_len);
+		memcpy(dst + off, ent, len);
+		last = (e2_dirent_t*)(dst + off);
+		last->rec_len = (u16)len;
+		off += len;
+	}
+
+	if( last == NULL ){
+		last = (e2_dirent_t*)dst;
+		last->inode = 0;
+		last->rec_len = 0;
+	}
+	last->rec_len = (u16)(last->rec_len + blocksize - off);
+}
+
+/* Forget the index of a directory. What is left is still a valid linear
+ * directory, so this is how we fall back when the index can not be used
+ * or grown any further.
+ */
+static void dx_drop(struct inode* dir)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+
+	if( priv->inode->i_flags & EXT2_INDEX_FL ){
+		syslog(KERN_WARN, "ext2fs: dropping hash index of directory %d on device 0x%X\n", dir->i_ino, dir->i_super->s_dev);
+		priv->inode->i_flags &= ~EXT2_INDEX_FL;
+		e2_inode_dirty(dir);
+	}
+}
+
+static char* dx_alloc_frames(struct superblock* sb, e2_dx_frame_t* frames)
+{
+	char* buf = (char*)kmalloc(sb->s_blocksize * EXT2_DX_MAX_LEVELS);
+	if( buf == NULL ){
+		return NULL;
+	}
+
+	for(int i = 0; i < EXT2_DX_MAX_LEVELS; ++i){
+		frames[i].buf = buf + i*sb->s_blocksize;
+	}
+
+	return buf;
+}
+
+/* Walk the index from the root down to the leaf which should hold the given
+ * name. Returns the depth of the index, or a negative error. -EAGAIN means
+ * the index is not something we understand.
+ */
+static int dx_probe(struct inode* dir, const char* name, e2_dx_frame_t* frames, u32* hash, int* version)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+	struct superblock* sb = dir->i_super;
+	u32 nblocks = priv->inode->i_size / sb->s_blocksize;
+	int result;
+
+	frames[0].block = 0;
+	result = e2_inode_block_io(dir, EXT2_READ, 0, frames[0].buf);
+	if( result < 0 ){
+		return result;
+	}
+
+	e2_dx_root_t* root = (e2_dx_root_t*)(frames[0].buf + EXT2_DX_ROOT_INFO);
+	if( root->hash_version > DX_HASH_TEA || root->info_length != sizeof(e2_dx_root_t) || root->indirect_levels >= EXT2_DX_MAX_LEVELS ){
+		return -EAGAIN;
+	}
+
+	int levels = root->indirect_levels;
+	*version = dx_hash_version(sb, root);
+	*hash = dx_hash(sb, *version, name, strlen(name));
+
+	e2_dx_entry_t* entries = (e2_dx_entry_t*)( (u32)root + root->info_length );
+	for(int level = 0; ; ++level)
+	{
+		u32 limit = (sb->s_blocksize - ((u32)entries - (u32)frames[level].buf)) / sizeof(e2_dx_entry_t);
+		u32 count = dx_limit(entries)->count;
+		if( dx_limit(entries)->limit != limit || count == 0 || count > limit ){
+			return -EAGAIN;
+		}
+
+		// find the last entry whose hash is not above ours. The first
+		// entry has no hash, and covers everything below the second.
+		e2_dx_entry_t* p = entries + 1;
+		e2_dx_entry_t* q = entries + count - 1;
+		while( p <= q ){
+			e2_dx_entry_t* m = p + (q - p)/2;
+			if( m->hash > *hash ) q = m - 1;
+			else p = m + 1;
+		}
+
+		frames[level].entries = entries;
+		frames[level].at = p - 1;
+
+		if( dx_block(frames[level].at) >= nblocks ){
+			return -EAGAIN;
+		}
+		if( level == levels ){
+			return levels;
+		}
+
+		frames[level+1].block = dx_block(frames[level].at);
+		result = e2_inode_block_io(dir, EXT2_READ, frames[level+1].block, frames[level+1].buf);
+		if( result < 0 ){
+			return result;
+		}
+		entries = (e2_dx_entry_t*)(frames[level+1].buf + EXT2_DX_NODE_ENTRIES);
+	}
+}
+
+/* Move on to the next leaf if the names with this hash continue there.
+ * Returns 1 if we moved, 0 if there is nowhere else to look, or a
+ * negative error.
+ */
+static int dx_next_leaf(struct inode* dir, e2_dx_frame_t* frames, int levels, u32 hash)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+	struct superblock* sb = dir->i_super;
+	int level = levels;
+	int result;
+
+	// find the deepest level with another entry to follow
+	while( frames[level].at + 1 >= frames[level].entries + dx_limit(frames[level].entries)->count ){
+		if( level == 0 ) return 0;
+		level--;
+	}
+	frames[level].at++;
+
+	// a continued range has the low bit set on its starting hash
+	if( (frames[level].at->hash & 1) == 0 || (frames[level].at->hash & ~1u) != hash ){
+		return 0;
+	}
+
+	// reload the index blocks below with their first entries
+	while( level < levels )
+	{
+		frames[level+1].block = dx_block(frames[level].at);
+		if( frames[level+1].block >= priv->inode->i_size / sb->s_blocksize ){
+			return -EAGAIN;
+		}
+		result = e2_inode_block_io(dir, EXT2_READ, frames[level+1].block, frames[level+1].buf);
+		if( result < 0 ){
+			return result;
+		}
+		level++;
+		frames[level].entries = (e2_dx_entry_t*)(frames[level].buf + EXT2_DX_NODE_ENTRIES);
+		frames[level].at = frames[level].entries;
+	}
+
+	return 1;
+}
+
+/* Add a block to the end of a directory. Its contents are left to the
+ * caller.
+ */
+static int dx_append_block(struct inode* dir, u32* block)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+	struct superblock* sb = dir->i_super;
+	u32 fresh = priv->inode->i_size / sb->s_blocksize;
+
+	if( e2_inode_resize(dir, priv->inode->i_size + sb->s_blocksize) < 0 || priv->inode->i_size / sb->s_blocksize != fresh + 1 ){
+		return -ENOSPC;
+	}
+
+	*block = fresh;
+	return 0;
+}
+
+/* Start an empty index node, hidden behind an unused entry spanning the
+ * whole block.
+ */
+static e2_dx_entry_t* dx_init_node(char* node, size_t blocksize)
+{
+	e2_dirent_t* hide = (e2_dirent_t*)node;
+	e2_dx_entry_t* entries = (e2_dx_entry_t*)(node + EXT2_DX_NODE_ENTRIES);
+
+	memset(node, 0, blocksize);
+	hide->rec_len = (u16)blocksize;
+	dx_limit(entries)->limit = (u16)((blocksize - EXT2_DX_NODE_ENTRIES) / sizeof(e2_dx_entry_t));
+
+	return entries;
+}
+
+/* Make room for one more entry in the deepest index node. Full index nodes
+ * are split in half, starting from the lowest level which still has room.
+ * If every level is full, the root entries move down into a new index node
+ * and the index grows a level. The frames are kept pointing at whichever
+ * nodes cover the current leaf, and `levels` is updated to the new depth.
+ * Returns -ENOSPC if the index is already as deep as we allow.
+ */
+static int dx_grow(struct inode* dir, e2_dx_frame_t* frames, int* levels)
+{
+	struct superblock* sb = dir->i_super;
+	int level = *levels;
+	u32 fresh;
+	int result;
+
+	while( level >= 0 && dx_limit(frames[level].entries)->count >= dx_limit(frames[level].entries)->limit ){
+		level--;
+	}
+	if( level == *levels ){
+		return 0;
+	}
+
+	char* node = (char*)kmalloc(sb->s_blocksize);
+	if( node == NULL ){
+		return -ENOMEM;
+	}
+
+	if( level < 0 )
+	{
+		if( *levels + 1 >= EXT2_DX_MAX_LEVELS ){
+			syslog(KERN_WARN, "ext2fs: hash index of directory %d on device 0x%X is full\n", dir->i_ino, sb->s_dev);
+			kfree(node);
+			return -ENOSPC;
+		}
+
+		result = dx_append_block(dir, &fresh);
+		if( result < 0 ){
+			kfree(node);
+			return result;
+		}
+
+		// move every root entry down into the new node
+		u32 count = dx_limit(frames[0].entries)->count;
+		e2_dx_entry_t* entries = dx_init_node(node, sb->s_blocksize);
+		memcpy(entries + 1, frames[0].entries + 1, (count - 1)*sizeof(e2_dx_entry_t));
+		entries[0].block = frames[0].entries[0].block;
+		dx_limit(entries)->count = (u16)count;
+
+		result = e2_inode_block_io(dir, EXT2_WRITE, fresh, node);
+		if( result < 0 ){
+			kfree(node);
+			return result;
+		}
+
+		// the root keeps a single entry pointing at the new node
+		e2_dx_root_t* root = (e2_dx_root_t*)(frames[0].buf + EXT2_DX_ROOT_INFO);
+		u32 at = (u32)(frames[0].at - frames[0].entries);
+		frames[0].entries[0].block = fresh;
+		dx_limit(frames[0].entries)->count = 1;
+		root->indirect_levels++;
+
+		result = e2_inode_block_io(dir, EXT2_WRITE, 0, frames[0].buf);
+		if( result < 0 ){
+			kfree(node);
+			return result;
+		}
+
+		// the frames below the root move down a level, and the spare
+		// buffer past the old depth holds the new node
+		char* spare = frames[*levels + 1].buf;
+		for(int i = *levels; i > 0; --i){
+			frames[i+1] = frames[i];
+		}
+		memcpy(spare, node, sb->s_blocksize);
+		frames[1].buf = spare;
+		frames[1].block = fresh;
+		frames[1].entries = (e2_dx_entry_t*)(spare + EXT2_DX_NODE_ENTRIES);
+		frames[1].at = frames[1].entries + at;
+		frames[0].at = frames[0].entries;
+
+		*levels += 1;
+		level = 1;
+	} else {
+		level++;
+	}
+
+	// split each full node below the last one with room
+	for(; level <= *levels; ++level)
+	{
+		e2_dx_frame_t* frame = &frames[level];
+		e2_dx_frame_t* parent = &frames[level-1];
+		u32 count = dx_limit(frame->entries)->count;
+		u32 split = count/2;
+
+		if( dx_limit(frame->entries)->count < dx_limit(frame->entries)->limit ){
+			continue;
+		}
+
+		result = dx_append_block(dir, &fresh);
+		if( result < 0 ){
+			kfree(node);
+			return result;
+		}
+
+		// the first entry of the new node keeps no hash, so the split
+		// hash moves up into the parent
+		u32 split_hash = frame->entries[split].hash;
+		e2_dx_entry_t* entries = dx_init_node(node, sb->s_blocksize);
+		memcpy(entries + 1, frame->entries + split + 1, (count - split - 1)*sizeof(e2_dx_entry_t));
+		entries[0].block = frame->entries[split].block;
+		dx_limit(entries)->count = (u16)(count - split);
+		dx_limit(frame->entries)->count = (u16)split;
+
+		u32 pcount = dx_limit(parent->entries)->count;
+		e2_dx_entry_t* at = parent->at + 1;
+		memmove(at + 1, at, (u32)(parent->entries + pcount - at)*sizeof(e2_dx_entry_t));
+		at->hash = split_hash;
+		at->block = fresh;
+		dx_limit(parent->entries)->count = (u16)(pcount + 1);
+
+		// write the new node before anything points at it
+		result = e2_inode_block_io(dir, EXT2_WRITE, fresh, node);
+		if( result >= 0 ) result = e2_inode_block_io(dir, EXT2_WRITE, frame->block, frame->buf);
+		if( result >= 0 ) result = e2_inode_block_io(dir, EXT2_WRITE, parent->block, parent->buf);
+		if( result < 0 ){
+			kfree(node);
+			return result;
+		}
+
+		if( frame->at >= frame->entries + split ){
+			u32 offs = (u32)(frame->at - (frame->entries + split));
+			memcpy(frame->buf, node, sb->s_blocksize);
+			frame->block = fresh;
+			frame->at = frame->entries + offs;
+			parent->at = at;
+		}
+	}
+
+	kfree(node);
+	return 0;
+}
+
+/* Split a full leaf in half by hash, adding an index entry for the upper
+ * half. On success, `leaf` and `block` hold whichever half now covers
+ * `hash`.
+ */
+static int dx_split_leaf(struct inode* dir, e2_dx_frame_t* frame, int version, char* leaf, u32* block, u32 hash)
+{
+	struct superblock* sb = dir->i_super;
+	u32 count = dx_limit(frame->entries)->count;
+	u32 n = 0;
+
+	// dx_grow should have made room for another index entry
+	if( count >= dx_limit(frame->entries)->limit ){
+		return -ENOSPC;
+	}
+
+	e2_dx_map_t* map = (e2_dx_map_t*)kmalloc(sizeof(e2_dx_map_t)*(sb->s_blocksize/EXT2_DIRENT_LEN(1)));
+	char* lower = (char*)kmalloc(sb->s_blocksize*2);
+	if( map == NULL || lower == NULL ){
+		kfree(map);
+		kfree(lower);
+		return -ENOMEM;
+	}
+	char* upper = lower + sb->s_blocksize;
+
+	// collect the live entries, sorted by hash
+	for(e2_dirent_t* iter = (e2_dirent_t*)leaf;
+		(u32)iter < ((u32)leaf + sb->s_blocksize) && iter->rec_len != 0;
+		iter = (e2_dirent_t*)( (u32)iter + iter->rec_len ))
+	{
+		if( iter->inode == 0 ) continue;
+		u32 h = dx_hash(sb, version, iter->name, iter->name_len);
+		u32 i = n++;
+		while( i > 0 && map[i-1].hash > h ){
+			map[i] = map[i-1];
+			i--;
+		}
+		map[i].hash = h;
+		map[i].offs = (u32)iter - (u32)leaf;
+	}
+
+	if( n < 2 ){
+		kfree(map);
+		kfree(lower);
+		return -EAGAIN;
+	}
+
+	// the upper half starts at the middle hash. If that hash also ends
+	// the lower half, mark the range as continued.
+	u32 split = n/2;
+	u32 split_hash = map[split].hash;
+	u32 continued = (map[split-1].hash == split_hash) ? 1 : 0;
+
+	// add a block to the directory for the upper half
+	u32 fresh;
+	int result = dx_append_block(dir, &fresh);
+	if( result < 0 ){
+		kfree(map);
+		kfree(lower);
+		return result;
+	}
+
+	dx_pack(lower, leaf, map, split, sb->s_blocksize);
+	dx_pack(upper, leaf, map + split, n - split, sb->s_blocksize);
+
+	// insert the new index entry right after the one for the old leaf
+	e2_dx_entry_t* at = frame->at + 1;
+	memmove(at + 1, at, (u32)(frame->entries + count - at)*sizeof(e2_dx_entry_t));
+	at->hash = split_hash | continued;
+	at->block = fresh;
+	dx_limit(frame->entries)->count = (u16)(count + 1);
+
+	// write the new leaf before anything points at it
+	result = e2_inode_block_io(dir, EXT2_WRITE, fresh, upper);
+	if( result >= 0 ) result = e2_inode_block_io(dir, EXT2_WRITE, frame->block, frame->buf);
+	if( result >= 0 ) result = e2_inode_block_io(dir, EXT2_WRITE, *block, lower);
+	if( result < 0 ){
+		kfree(map);
+		kfree(lower);
+		return result;
+	}
+
+	if( hash >= split_hash ){
+		memcpy(leaf, upper, sb->s_blocksize);
+		*block = fresh;
+	} else {
+		memcpy(leaf, lower, sb->s_blocksize);
+	}
+
+	kfree(map);
+	kfree(lower);
+
+	return 0;
+}
+
+int e2_dx_indexed(struct inode* dir)
+{
+	e2_super_private_t* e2fs = EXT2_SUPER(dir->i_super);
+	return (e2fs->super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) && (EXT2_INODE(dir)->inode->i_flags & EXT2_INDEX_FL);
+}
+
+/* Look up a name using the directory index. The leaf holding the entry is
+ * read into `leaf`, and its logical block number stored in `block`.
+ * Returns ERR_PTR(-EAGAIN) if the directory must be searched linearly.
+ */
+e2_dirent_t* e2_dx_search(struct inode* dir, const char* name, char* leaf, u32* block)
+{
+	struct superblock* sb = dir->i_super;
+	e2_dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+	e2_dirent_t* dirent = NULL;
+	u32 hash;
+	int version;
+	int result;
+
+	if( !e2_dx_indexed(dir) ){
+		return ERR_PTR(-EAGAIN);
+	}
+
+	char* buf = dx_alloc_frames(sb, frames);
+	if( buf == NULL ){
+		return ERR_PTR(-ENOMEM);
+	}
+
+	int levels = dx_probe(dir, name, frames, &hash, &version);
+	if( levels < 0 ){
+		kfree(buf);
+		return ERR_PTR(levels);
+	}
+
+	do
+	{
+		*block = dx_block(frames[levels].at);
+		result = e2_inode_block_io(dir, EXT2_READ, *block, leaf);
+		if( result < 0 ) break;
+		dirent = dx_find_dirent(leaf, sb->s_blocksize, name);
+		if( dirent != NULL ) break;
+		result = dx_next_leaf(dir, frames, levels, hash);
+	} while( result > 0 );
+
+	kfree(buf);
+
+	if( dirent == NULL ){
+		return ERR_PTR(result < 0 ? result : -ENOENT);
+	}
+
+	return dirent;
+}
+
+/* Add a name to an indexed directory. The caller holds the read/write
+ * buffer lock of both inodes. Returns -EAGAIN after dropping the index if
+ * the name should be added linearly instead.
+ */
+int e2_dx_add(struct inode* dir, const char* name, struct inode* inode)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+	struct superblock* sb = dir->i_super;
+	e2_dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+	u32 hash;
+	u32 block;
+	int version;
+
+	if( !e2_dx_indexed(dir) ){
+		dx_drop(dir);
+		return -EAGAIN;
+	}
+
+	char* buf = dx_alloc_frames(sb, frames);
+	if( buf == NULL ){
+		return -ENOMEM;
+	}
+
+	int levels = dx_probe(dir, name, frames, &hash, &version);
+	int result = levels;
+	if( levels < 0 ){
+		goto out;
+	}
+
+	block = dx_block(frames[levels].at);
+	result = e2_inode_block_io(dir, EXT2_READ, block, priv->rw);
+	if( result < 0 ){
+		goto out;
+	}
+
+	e2_dirent_t* dirent = dx_insert_dirent(priv->rw, sb->s_blocksize, name);
+	if( dirent == NULL )
+	{
+		// the deepest index level gets the entry for the new leaf
+		result = dx_grow(dir, frames, &levels);
+		if( result < 0 ){
+			goto out;
+		}
+		result = dx_split_leaf(dir, &frames[levels], version, priv->rw, &block, hash);
+		if( result < 0 ){
+			goto out;
+		}
+		dirent = dx_insert_dirent(priv->rw, sb->s_blocksize, name);
+		if( dirent == NULL ){
+			result = -EAGAIN;
+			goto out;
+		}
+	}
+
+	e2_dirent_fill(dirent, name, inode);
+	result = e2_inode_block_io(dir, EXT2_WRITE, block, priv->rw);
+
+out:
+	kfree(buf);
+	if( result == -EAGAIN ){
+		dx_drop(dir);
+	}
+	return result < 0 ? result : 0;
+}
+
+/* Convert a full, single block directory into an indexed one. The entries
+ * after "." and ".." move to a new leaf, and the first block becomes the
+ * index root. Returns -EAGAIN if the directory can't be indexed.
+ */
+int e2_dx_build(struct inode* dir)
+{
+	e2_inode_private_t* priv = EXT2_INODE(dir);
+	struct superblock* sb = dir->i_super;
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
+	u32 n = 0;
+	int result;
+
+	if( !(e2fs->super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || (priv->inode->i_flags & EXT2_INDEX_FL) || priv->inode->i_size != sb->s_blocksize ){
+		return -EAGAIN;
+	}
+
+	char* root = (char*)kmalloc(sb->s_blocksize*2);
+	e2_dx_map_t* map = (e2_dx_map_t*)kmalloc(sizeof(e2_dx_map_t)*(sb->s_blocksize/EXT2_DIRENT_LEN(1)));
+	if( root == NULL || map == NULL ){
+		kfree(root);
+		kfree(map);
+		return -ENOMEM;
+	}
+	char* leaf = root + sb->s_blocksize;
+
+	result = e2_inode_block_io(dir, EXT2_READ, 0, root);
+	if( result < 0 ){
+		goto out;
+	}
+
+	// the root must start with "." and ".." where the index expects them
+	e2_dirent_t* dot = (e2_dirent_t*)root;
+	e2_dirent_t* dotdot = (e2_dirent_t*)(root + EXT2_DIRENT_LEN(1));
+	if( dot->rec_len != EXT2_DIRENT_LEN(1) || dot->name_len != 1 || dot->name[0] != '.' ||
+		dotdot->name_len != 2 || strncmp(dotdot->name, "..", 2) != 0 || dotdot->rec_len < EXT2_DIRENT_LEN(2) ){
+		result = -EAGAIN;
+		goto out;
+	}
+
+	// everything else moves to the new leaf
+	for(e2_dirent_t* iter = (e2_dirent_t*)( (u32)dotdot + dotdot->rec_len );
+		(u32)iter < ((u32)root + sb->s_blocksize) && iter->rec_len != 0;
+		iter = (e2_dirent_t*)( (u32)iter + iter->rec_len ))
+	{
+		if( iter->inode == 0 ) continue;
+		map[n].hash = 0;
+		map[n].offs = (u32)iter - (u32)root;
+		n++;
+	}
+	dx_pack(leaf, root, map, n, sb->s_blocksize);
+
+	if( e2_inode_resize(dir, 2*sb->s_blocksize) < 0 || priv->inode->i_size != 2*sb->s_blocksize ){
+		result = -ENOSPC;
+		goto out;
+	}
+
+	result = e2_inode_block_io(dir, EXT2_WRITE, 1, leaf);
+	if( result < 0 ){
+		goto out;
+	}
+
+	// ".." now hides the rest of the block, which holds the index root
+	dotdot->rec_len = (u16)(sb->s_blocksize - EXT2_DIRENT_LEN(1));
+	memset(root + EXT2_DX_ROOT_INFO, 0, sb->s_blocksize - EXT2_DX_ROOT_INFO);
+
+	e2_dx_root_t* info = (e2_dx_root_t*)(root + EXT2_DX_ROOT_INFO);
+	info->hash_version = e2fs->super.s_def_hash_version <= DX_HASH_TEA ? e2fs->super.s_def_hash_version : DX_HASH_HALF_MD4;
+	info->info_length = sizeof(e2_dx_root_t);
+	info->indirect_levels = 0;
+
+	e2_dx_entry_t* entries = (e2_dx_entry_t*)(root + EXT2_DX_ROOT_INFO + sizeof(e2_dx_root_t));
+	dx_limit(entries)->limit = (u16)((sb->s_blocksize - EXT2_DX_ROOT_INFO - sizeof(e2_dx_root_t)) / sizeof(e2_dx_entry_t));
+	dx_limit(entries)->count = 1;
+	entries[0].block = 1;
+
+	result = e2_inode_block_io(dir, EXT2_WRITE, 0, root);
+	if( result < 0 ){
+		goto out;
+	}
+
+	priv->inode->i_flags |= EXT2_INDEX_FL;
+	e2_inode_dirty(dir);
+
+out:
+	kfree(map);
+	kfree(root);
+	return result < 0 ? result : 0;
+}
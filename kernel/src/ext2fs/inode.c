@@ -39,8 +39,18 @@ int e2_read_inode(struct superblock* sb, struct inode* inode)
 		return -ENOMEM;
 	}
 	
-	// Initialize the lock
+	// Initialize the locks
 	spin_init(&priv->rw_lock);
+	priv->bmap_lock = mutex_alloc();
+	if( !priv->bmap_lock ){
+		kfree(priv->rw);
+		kfree(priv);
+		return -ENOMEM;
+	}
+	
+	// Not waiting for write-back yet
+	priv->ino = inode->i_ino;
+	INIT_LIST(&priv->dirty_link);
 	
 	// calculate the block group number and local inode number
 	bg = (inode->i_ino-1) / e2fs->super.s_inodes_per_group;
@@ -52,16 +62,12 @@ int e2_read_inode(struct superblock* sb, struct inode* inode)
 	// Read the inode from disk
 	result = block_read(sb->s_dev, location, e2fs->super.s_inode_size, priv->inode_data);
 	if( result < 0 ){
+		mutex_free(priv->bmap_lock);
+		kfree(priv->rw);
 		kfree(priv);
 		return (int)result;
 	}
 	
-	priv->block = (u32*)kmalloc(4 * priv->inode->i_blocks);
-	if( !priv->block && priv->inode->i_blocks ){
-		kfree(priv);
-		return -ENOMEM;
-	}
-	
 	// Copy some important information
 	inode->i_mode = priv->inode->i_mode;
 	inode->i_uid = priv->inode->i_uid;
@@ -83,8 +89,6 @@ int e2_read_inode(struct superblock* sb, struct inode* inode)
 	inode->i_ops = &e2_inode_operations;
 	inode->i_default_fops = &e2_default_file_operations;
 	
-	e2_inode_read_block_map(inode, priv->block);
-	
 	// Success
 	return 0;
 }
@@ -94,15 +98,21 @@ void e2_put_inode(struct superblock* sb ATTR((unused)), struct inode* inode)
 {
 	e2_inode_private_t* priv = EXT2_INODE(inode);
 	
+	// Release whatever the inode had set aside for growing
+	e2_inode_discard_prealloc(inode);
+	
 	if( priv->inode->i_links_count == 0 ){
 		// Free the inode blocks if it's not longer linked to
 		e2_free_inode(sb, inode);
+		// write out the emptied inode, and leave the write-back list
+		e2_inode_flush(inode);
 	} else {
 		// If it has links left, sync any changes we've made.
 		e2_inode_flush(inode);
 	}
 	
-	kfree(priv->block);
+	e2_indirect_release(inode);
+	mutex_free(priv->bmap_lock);
 	kfree(priv->rw);
 	kfree(priv);
 	inode->i_private = NULL;
@@ -113,11 +123,23 @@ int e2_inode_lookup(struct inode* inode, struct dentry* dentry)
 {
 	e2_inode_private_t* priv = EXT2_INODE(inode);
 	struct superblock* sb = inode->i_super;
-	u32 nblocks = (priv->inode->i_blocks*512)/sb->s_blocksize;
+	u32 nblocks = EXT2_NBLOCKS(sb, priv);
+	e2_dirent_t* found = NULL;
+	u32 block;
 	
 	spin_lock(&priv->rw_lock);
 	
-	for(u32 i = 0; i < nblocks; ++i)
+	// Indexed directories only need the leaf that the name hashes to
+	found = e2_dx_search(inode, dentry->d_name, priv->rw, &block);
+	if( IS_ERR(found) ){
+		if( PTR_ERR(found) != -EAGAIN ){
+			spin_unlock(&priv->rw_lock);
+			return PTR_ERR(found);
+		}
+		found = NULL;
+	}
+	
+	for(u32 i = 0; i < nblocks && found == NULL; ++i)
 	{
 		e2_inode_io(inode, EXT2_READ, i*sb->s_blocksize, sb->s_blocksize, priv->rw);
 		e2_dirent_t* iter = (e2_dirent_t*)priv->rw;
@@ -125,16 +147,8 @@ int e2_inode_lookup(struct inode* inode, struct dentry* dentry)
 		{
 			if( iter->inode != 0 && strlen(dentry->d_name) == iter->name_len && strncmp(dentry->d_name, iter->name, iter->name_len) == 0 )
 			{
-				dentry->d_inode = i_get(inode->i_super, (ino_t)iter->inode);
-				if( !IS_ERR(dentry->d_inode) ){
-					dentry->d_ino = (ino_t)iter->inode;
-					spin_unlock(&priv->rw_lock);
-					return 0;
-				} else { // this means the filesystem if FUCKED up... -_-
-					spin_unlock(&priv->rw_lock);
-					dentry->d_inode = NULL;
-					return -EIO;
-				}
+				found = iter;
+				break;
 			}
 			// This was happening for some reason...
 			if( iter->rec_len == 0 ){
@@ -144,9 +158,22 @@ int e2_inode_lookup(struct inode* inode, struct dentry* dentry)
 		}
 	}
 	
+	if( found == NULL ){
+		spin_unlock(&priv->rw_lock);
+		return -ENOENT;
+	}
+	
+	dentry->d_inode = i_get(inode->i_super, (ino_t)found->inode);
+	if( IS_ERR(dentry->d_inode) ){ // this means the filesystem if FUCKED up... -_-
+		spin_unlock(&priv->rw_lock);
+		dentry->d_inode = NULL;
+		return -EIO;
+	}
+	
+	dentry->d_ino = (ino_t)found->inode;
 	spin_unlock(&priv->rw_lock);
 	
-	return -ENOENT;
+	return 0;
 }
 
 int e2_inode_mknod(struct inode* parent, const char* name, mode_t mode, dev_t dev)
@@ -181,15 +208,29 @@ int e2_inode_mknod(struct inode* parent, const char* name, mode_t mode, dev_t de
 		return result;
 	}
 	
-	e2_inode_flush(parent);
-	e2_inode_flush(inode);
-	
 	// release our reference to the inode
 	i_put(inode);
 	
 	return 0;
 }
 
+/* Mark the inode as changed. It is written back by the write-back worker,
+ * or earlier by an explicit flush, instead of after every change.
+ */
+void e2_inode_dirty(struct inode* inode)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	e2_super_private_t* e2fs = EXT2_SUPER(inode->i_super);
+	
+	priv->dirty = 1;
+	
+	spin_lock(&e2fs->dirty_lock);
+	if( !list_inserted(&priv->dirty_link) ){
+		list_add_before(&priv->dirty_link, &e2fs->dirty_inodes);
+	}
+	spin_unlock(&e2fs->dirty_lock);
+}
+
 int e2_inode_flush(struct inode* inode)
 {
 	e2_inode_private_t* priv = EXT2_INODE(inode);
@@ -197,17 +238,16 @@ int e2_inode_flush(struct inode* inode)
 	e2_super_private_t* e2fs = EXT2_SUPER(inode->i_super);
 	ssize_t result;
 
-	if( !priv->dirty ) return 0;
+	// write back any indirect blocks we changed
+	e2_indirect_flush(inode);
 	
-	// flush the new block map to the disk
-	e2_inode_write_block_map(inode, priv->block);
+	// nothing is left for the write-back worker to do
+	spin_lock(&e2fs->dirty_lock);
+	list_rem(&priv->dirty_link);
+	spin_unlock(&e2fs->dirty_lock);
+	
+	if( !priv->dirty ) return 0;
 	
-	// Flush the superblock first
-	result = (ssize_t)e2_super_flush(sb);
-	if( result < 0 ){
-		return (int)result;
-	}
-
 	priv->dirty =0;
 	
 	// Calculate related indices for location
@@ -217,8 +257,9 @@ int e2_inode_flush(struct inode* inode)
 	u32 location = e2fs->bgtable[bg].bg_inode_table*sb->s_blocksize + local*e2fs->super.s_inode_size;
 	// Attemp to write the inode back to disk
 	result = block_write(sb->s_dev, location, e2fs->super.s_inode_size, priv->inode_data);
-	// Check for failure
+	// Check for failure (and try again on the next pass)
 	if( result < 0 ){
+		e2_inode_dirty(inode);
 		return (int)result;
 	}
 	
@@ -229,17 +270,12 @@ ino_t e2_alloc_inode(struct superblock* sb, e2_inode_t* data)
 {
 	e2_super_private_t* e2fs = EXT2_SUPER(sb);
 	u32 bg = 0;
-	int idx = 0;
-	int bit = 0;
+	u32 bit = 0;
 	
 	if( e2fs->super.s_free_inodes_count == 0 ){
 		return EXT2_BAD_INO;
 	}
 	
-	// Calculate the size of the bitmap
-	size_t bitmap_size = e2fs->super.s_inodes_per_group / 8;
-	if( e2fs->super.s_inodes_per_group % 8 ) bitmap_size++;
-	
 	spin_lock(&e2fs->rw_lock);
 	
 	// look for a block group with free inodes
@@ -254,55 +290,15 @@ ino_t e2_alloc_inode(struct superblock* sb, e2_inode_t* data)
 		return EXT2_BAD_INO;
 	}
 	
-	// Allocate space for the inode bitmap
-	u8* bitmap = (u8*)kmalloc(sb->s_blocksize);
-	if( bitmap == 0 ){
-		spin_unlock(&e2fs->rw_lock);
-		return EXT2_BAD_INO;
-	}
-	
-	// Read inode bitmap from disk
-	e2_read_block(sb, e2fs->bgtable[bg].bg_inode_bitmap, 1, (char*)bitmap);
-// 	ssize_t io_res = block_read(sb->s_dev, e2fs->bgtable[bg].bg_inode_bitmap*sb->s_blocksize, bitmap_size, (char*)bitmap);
-// 	if( io_res < 0 ){
-// 		kfree(bitmap);
-// 		spin_unlock(&e2fs->rw_lock);
-// 		return EXT2_BAD_INO;
-// 	}
-	
-	// Iterate over each by in the bitmap
-	for(idx = 0; idx < (int)(bitmap_size); ++idx)
-	{
-		// discard full bytes
-		if( bitmap[idx] == 0xFF ) continue;
-		// iterate over each bit
-		for(bit = 0; bit < 8; ++bit){
-			if( !(bitmap[idx] & (1<<bit)) ){ // break early for empty bit
-				break;
-			}
-		}
-		if( bit != 8 ) break; // if we broke early in the previous loop, break early here
-	}
-	
-	// This shouldn't happen. This is a sign of a corrupt file system (bad inode counts)
-	if( idx == ((int)(bitmap_size)) ){
-		kfree(bitmap);
+	// Claim the first free inode after the group cursor in the cached bitmap.
+	// Failure is a sign of a corrupt file system (bad inode counts)
+	if( e2_bitmap_alloc(sb, EXT2_INODE_BITMAP, bg, &bit) < 0 ){
 		spin_unlock(&e2fs->rw_lock);
 		debug_message("corrupt filesystem on device 0x%X. invalid free inode counts.", sb->s_dev);
 		return EXT2_BAD_INO;
 	}
 	
-	ino_t ino = (ino_t)(bg*e2fs->super.s_inodes_per_group + idx*8 + bit + 1);
-	
-	// Allocate the inode in the bitmap, and sync it with the disk
-	bitmap[idx] = (u8)(bitmap[idx] | (1<<bit));
-	e2_write_block(sb, e2fs->bgtable[bg].bg_inode_bitmap, 1, (char*)bitmap);
-// 	io_res = block_write(sb->s_dev, e2fs->bgtable[bg].bg_inode_bitmap*sb->s_blocksize, bitmap_size, (char*)bitmap);
-// 	if( io_res < 0 ){
-// 		kfree(bitmap);
-// 		spin_unlock(&e2fs->rw_lock);
-// 		return EXT2_BAD_INO;
-// 	}
+	ino_t ino = (ino_t)(bg*e2fs->super.s_inodes_per_group + bit + 1);
 	
 	//debug_message("allocated inode #%d with mod 0x%X", ino, data->i_mode);
 	
@@ -315,18 +311,12 @@ ino_t e2_alloc_inode(struct superblock* sb, e2_inode_t* data)
 	data->i_extra_isize = 28;
 	
 	// Write the inode data to disk
-	block_write(sb->s_dev, e2fs->bgtable[bg].bg_inode_table*sb->s_blocksize + e2fs->super.s_inode_size*(idx*8 + bit), 
+	block_write(sb->s_dev, e2fs->bgtable[bg].bg_inode_table*sb->s_blocksize + e2fs->super.s_inode_size*bit, 
 		    sizeof(e2_inode_t), (char*)data);
 	
-	// Free the bitmap data
-	kfree(bitmap);
-	
-	// Unlock the superblock
+	// Unlock the superblock (the accounting goes out with the next write-back)
 	spin_unlock(&e2fs->rw_lock);
 	
-	// Flush accounting changes to disk
-	e2_super_flush(sb);
-	
 	return ino;
 }
 
@@ -338,16 +328,9 @@ int e2_free_inode(struct superblock* sb, struct inode* inode)
 	u32 bg = (inode->i_ino-1) / e2fs->super.s_inodes_per_group;
 	u32 local = (inode->i_ino-1) % e2fs->super.s_inodes_per_group;
 	
-	// Allocate a bitmap buffer
-	u32* bitmap = (u32*)kmalloc(e2fs->super.s_inodes_per_group/8);
-	if(!bitmap){
-		return -ENOMEM;
-	}
-	
 	// free all the inode data blocks
 	int result = e2_inode_resize(inode, 0);
 	if( result < 0 ){
-		kfree(bitmap);
 		return result;
 	}
 	
@@ -355,9 +338,11 @@ int e2_free_inode(struct superblock* sb, struct inode* inode)
 	spin_lock(&e2fs->rw_lock);
 	
 	// Fix the inode bitmap
-	block_read(sb->s_dev, e2fs->bgtable[bg].bg_inode_bitmap*sb->s_blocksize, e2fs->super.s_inodes_per_group/8, (char*)bitmap);
-	bitmap[local/32] &= ~(1 << (local % 32));
-	block_write(sb->s_dev, e2fs->bgtable[bg].bg_inode_bitmap*sb->s_blocksize, e2fs->super.s_inodes_per_group/8, (char*)bitmap);
+	result = e2_bitmap_free(sb, EXT2_INODE_BITMAP, bg, local);
+	if( result < 0 ){
+		spin_unlock(&e2fs->rw_lock);
+		return result;
+	}
 	
 	// Fix reference counts in the superblock/block group
 	e2fs->bgtable[bg].bg_free_inodes_count++;
@@ -367,524 +352,238 @@ int e2_free_inode(struct superblock* sb, struct inode* inode)
 	// Unlock the data
 	spin_unlock(&e2fs->rw_lock);
 	
-	// Flush the superblock
-	e2_super_flush(sb);
-	
 	return 0;
 	
 }
 
-/* Read in the entire block map for the inode
- * 	map must be inode->i_private->inode->i_blocks*4 bytes long!
- */
-int e2_inode_read_block_map(struct inode* inode, u32* map)
+int e2_inode_truncate(struct inode* inode)
 {
-	e2_inode_private_t* priv = EXT2_INODE(inode);
-	u32 idx = 0;
-	u32 nblocks = (priv->inode->i_blocks * 512) / inode->i_super->s_blocksize;
-	
-	// if there are no blocks, don't continue
-	if( nblocks == 0 ){
-		if( map ) map[0] = 0;
-		return 0;
-	}
-	
-	// grab the first twelve direct blocks
-	for(int i = 0; i < 12 && idx < nblocks; ++i,++idx){
-		map[idx] = priv->inode->i_block[i];
-	}
-	
-	// are we done?
-	if( idx == nblocks ){
-		return 0;
-	}
-	
-	// We now need the private buffer, so we lock the internal data spinlock
-	spin_lock(&priv->rw_lock);
-	
-	// an easier typed pointer to the buffer
-	u32* buffer = (u32*)priv->rw;
-	
-	// read the indirect layer
-	e2_read_block(inode->i_super, priv->inode->i_block[12], 1, priv->rw);
-	
-	// copy the block addresses
-	for(u32 i = 0; i < (inode->i_super->s_blocksize/4) && idx < nblocks; ++i,++idx){
-		map[idx] = buffer[i];
-	}
-	
-	// are we done?
-	if( idx == nblocks ){
-		spin_unlock(&priv->rw_lock);
-		return 0;
-	}
-	
-	// We need a second buffer for the indirect levels within the doubly indirect layer
-	u32* indirect = (u32*)kmalloc(inode->i_super->s_blocksize);
-	if( !indirect ){
-		spin_unlock(&priv->rw_lock);
-		return -ENOMEM;
-	}
-	
-	// read the doubly indirect layer
-	e2_read_block(inode->i_super, priv->inode->i_block[13], 1, priv->rw);
-	
-	// iterate over each indirect layer within the doubly indirect
-	for(u32 d = 0; d < (inode->i_super->s_blocksize/4) && idx < nblocks; ++d)
-	{
-		// read in the indirect layer
-		e2_read_block(inode->i_super, buffer[d], 1, (char*)indirect);
-		// copy the direct blocks
-		for(u32 i = 0; i < (inode->i_super->s_blocksize/4) && idx < nblocks; ++i, ++idx)
-		{
-			map[idx] = indirect[i];
-		}
-	}
-	
-	// Are we done?
-	if( idx == nblocks ){
-		kfree(indirect);
-		spin_unlock(&priv->rw_lock);
-		return 0;
-	}
-	
-	// We need, yet another, buffer for the doubly indirect levels within the triply indirect layers
-	u32* doubly = (u32*)kmalloc(inode->i_super->s_blocksize);
-	if( !indirect ){
-		kfree(indirect);
-		spin_unlock(&priv->rw_lock);
-		return -ENOMEM;
-	}
-	
-	// read in the triply indirect layer
-	e2_read_block(inode->i_super, priv->inode->i_block[14], 1, priv->rw);
-	
-	// iterate over each double indirect layer
-	for(u32 t = 0; t < (inode->i_super->s_blocksize/4) && idx < nblocks; ++t)
-	{
-		// read in doubly indirect layer
-		e2_read_block(inode->i_super, buffer[t], 1, (char*)doubly);
-		// iterate over each indirect layer
-		for(u32 d = 0; d < (inode->i_super->s_blocksize/4) && idx < nblocks; ++d)
-		{
-			// read in indirect layer
-			e2_read_block(inode->i_super, buffer[d], 1, (char*)indirect);
-			// iterate over each direct block
-			for(u32 i = 0; i < (inode->i_super->s_blocksize/4) && idx < nblocks; ++i, ++idx)
-			{
-				map[idx] = indirect[i];
-			}
-		}
-	}
-	
-	// free the extra memory
-	kfree(doubly);
-	kfree(indirect);
-	
-	// unlock the buffer
-	spin_unlock(&priv->rw_lock);
-	
+	e2_inode_resize(inode, 0);
+	e2_inode_dirty(inode);
 	return 0;
 }
 
-int e2_inode_write_block_map(struct inode* inode, u32* map)
+/* Give the preallocation window back (caller holds bmap_lock) */
+static void e2_prealloc_discard(struct inode* inode)
 {
 	e2_inode_private_t* priv = EXT2_INODE(inode);
-	u32 idx = 0;
-	u32 nblocks = (priv->inode->i_blocks * 512) / inode->i_super->s_blocksize;
-	
-	if( S_ISBLK(priv->inode->i_mode) || S_ISCHR(priv->inode->i_mode) || S_ISFIFO(priv->inode->i_mode) ){
-		return 0;
-	}
 	
-	// if there are no blocks, don't continue
-	if( nblocks == 0 ){
-		memset(priv->inode->i_block, 0, 4*15);
-		return 0;
+	if( priv->prealloc_count != 0 ){
+		e2_free_blocks(inode->i_super, priv->prealloc, priv->prealloc_count);
+		priv->prealloc = 0;
+		priv->prealloc_count = 0;
 	}
+}
+
+/* Allocate up to `*count` blocks continuing the file at `goal`. Blocks come
+ * from the preallocation window when it lines up with the goal, otherwise
+ * a new run is allocated with some extra blocks set aside in the window
+ * for the next time the file grows.
+ */
+static u32 e2_inode_alloc_run(struct inode* inode, u32 goal, u32* count)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	e2_super_private_t* e2fs = EXT2_SUPER(inode->i_super);
+	u32 window = 0;
 	
-	// grab the first twelve direct blocks
-	for(int i = 0; i < 12 && idx < nblocks; ++i,++idx){
-		priv->inode->i_block[i] = map[idx];
-	}
-	
-	priv->dirty = 1;
-	
-	// are we done?
-	if( idx == nblocks ){
-		priv->inode->i_block[12] = 0;
-		priv->inode->i_block[13] = 0;
-		priv->inode->i_block[14] = 0;
-		return 0;
+	if( priv->prealloc_count != 0 && priv->prealloc == goal )
+	{
+		u32 start = priv->prealloc;
+		if( *count > priv->prealloc_count ) *count = priv->prealloc_count;
+		priv->prealloc += *count;
+		priv->prealloc_count -= *count;
+		return start;
 	}
 	
-	// We now need the private buffer, so we lock the internal data spinlock
-	spin_lock(&priv->rw_lock);
+	// the window doesn't continue the file anymore
+	e2_prealloc_discard(inode);
 	
-	// if we recently resized the inode, the indirect blocks may not be allocated
-	if( priv->inode->i_block[12] == 0 ){
-		priv->inode->i_block[12] = e2_alloc_block(inode->i_super);
+	if( S_ISREG(inode->i_mode) ){
+		window = e2fs->super.s_prealloc_blocks ? e2fs->super.s_prealloc_blocks : EXT2_PREALLOC_DEFAULT;
+	} else if( S_ISDIR(inode->i_mode) && (e2fs->super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC) ){
+		window = e2fs->super.s_prealloc_dir_blocks;
 	}
 	
-	// an easier typed pointer to the buffer
-	u32* buffer = (u32*)priv->rw;
-	
-	e2_write_block(inode->i_super, priv->inode->i_block[12], 1, (char*)&map[idx]);
-	idx += inode->i_super->s_blocksize/4;
-	
-	// are we done?
-	if( idx >= nblocks ){
-		spin_unlock(&priv->rw_lock);
+	u32 want = *count + window;
+	u32 start = e2_alloc_blocks(inode->i_super, goal, &want);
+	if( start == 0 ){
 		return 0;
 	}
 	
-	// We need a second buffer for the indirect levels within the doubly indirect layer
-	u32* indirect = (u32*)kmalloc(inode->i_super->s_blocksize);
-	if( !indirect ){
-		spin_unlock(&priv->rw_lock);
-		return -ENOMEM;
-	}
-	
-	if( priv->inode->i_block[13] == 0 ){
-		// allocate a new double indirect block and clear the buffer
-		if( (priv->inode->i_block[13] = e2_alloc_block(inode->i_super)) == 0 ){
-			kfree(indirect);
-			spin_unlock(&priv->rw_lock);
-			return -ENOSPC;
-		}
-		memset(priv->rw, 0, inode->i_super->s_blocksize);
+	if( want > *count ){
+		priv->prealloc = start + *count;
+		priv->prealloc_count = want - *count;
 	} else {
-		// read the doubly indirect layer
-		e2_read_block(inode->i_super, priv->inode->i_block[13], 1, priv->rw);
+		*count = want;
 	}
 	
-	// iterate over each indirect layer within the doubly indirect
-	for(u32 d = 0; d < (inode->i_super->s_blocksize/4) && idx < nblocks; ++d)
-	{
-		// allocate a new indirect block if needed
-		if( buffer[d] == 0 ){
-			if( (buffer[d] = e2_alloc_block(inode->i_super)) == 0 ){
-				kfree(indirect);
-				spin_unlock(&priv->rw_lock);
-				return -ENOSPC;
-			}
-		}
-		e2_write_block(inode->i_super, buffer[d], 1, (char*)&map[idx]);
-		idx += inode->i_super->s_blocksize/4;
-	}
-	
-	// rewrite the doubly indirect as it may have been altered
-	e2_write_block(inode->i_super, priv->inode->i_block[13], 1, priv->rw);
-	
-	// Are we done?
-	if( idx == nblocks ){
-		kfree(indirect);
-		spin_unlock(&priv->rw_lock);
-		return 0;
-	}
+	return start;
+}
+
+void e2_inode_discard_prealloc(struct inode* inode)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
 	
-	// We need, yet another, buffer for the doubly indirect levels within the triply indirect layers
-	u32* doubly = (u32*)kmalloc(inode->i_super->s_blocksize);
-	if( !indirect ){
-		kfree(indirect);
-		spin_unlock(&priv->rw_lock);
-		return -ENOMEM;
-	}
+	// another descriptor of the file may be allocating from the window
+	mutex_lock(priv->bmap_lock, SEM_FOREVER);
+	e2_prealloc_discard(inode);
+	mutex_unlock(priv->bmap_lock);
+}
+
+ssize_t e2_inode_resize(struct inode* inode, size_t newsize)
+{
+	e2_inode_private_t* priv = EXT2_INODE(inode);
+	struct superblock* sb = inode->i_super;
+	e2_super_private_t* e2fs = EXT2_SUPER(sb);
 	
-	if( priv->inode->i_block[14] == 0 ) {
-		// allocate the new triply indirect block
-		if( (priv->inode->i_block[14] = e2_alloc_block(inode->i_super)) == 0 ){
-			kfree(doubly);
-			kfree(indirect);
-			spin_unlock(&priv->rw_lock);
-			return -ENOSPC;
-		}
-		memset(priv->rw, 0, inode->i_super->s_blocksize);
+	u32 nblocks = EXT2_NBLOCKS(sb, priv);
+	u32 new_nblocks = newsize / sb->s_blocksize;
+	if( newsize % sb->s_blocksize ) new_nblocks++;
+
+	// that's dumb...
+	if( newsize == priv->inode->i_size ){
+		return newsize;
+	} else if( new_nblocks == nblocks ){
+		priv->inode->i_size = newsize;
+		inode->i_size = (off_t)priv->inode->i_size;
+		e2_inode_dirty(inode);
+		return newsize;
+	} else if( new_nblocks < nblocks ) { // less than old size
+		// nothing past the new end should stay reserved
+		e2_inode_discard_prealloc(inode);
+		
+		// free the old blocks that aren't needed anymore
+		e2_inode_truncate_blocks(inode, new_nblocks);
+		
+		priv->inode->i_size = newsize;
+		inode->i_size = (off_t)priv->inode->i_size;
+		e2_inode_dirty(inode);
+		
 	} else {
-		// read in the triply indirect layer
-		e2_read_block(inode->i_super, priv->inode->i_block[14], 1, priv->rw);
-	}
-	
-	// iterate over each double indirect layer
-	for(u32 t = 0; t < (inode->i_super->s_blocksize/4) && idx < nblocks; ++t)
-	{
-		// allocate the doubly indirect block if needed
-		if( buffer[t] == 0 ){
-			buffer[t] = e2_alloc_block(inode->i_super);
-			if( buffer[t] == 0 ){
-				kfree(doubly);
-				kfree(indirect);
-				spin_unlock(&priv->rw_lock);
+		e2_inode_dirty(inode);
+		
+		mutex_lock(priv->bmap_lock, SEM_FOREVER);
+		while( nblocks < new_nblocks )
+		{
+			// continue after the last block, or start in the inode's group
+			u32 goal = e2fs->super.s_first_data_block + ((inode->i_ino-1)/e2fs->super.s_inodes_per_group)*e2fs->super.s_blocks_per_group;
+			if( nblocks != 0 ){
+				int error = e2_bmap_find(inode, nblocks-1, &goal);
+				if( error < 0 ){
+					mutex_unlock(priv->bmap_lock);
+					return error;
+				}
+				goal++;
+			}
+			
+			u32 count = new_nblocks - nblocks;
+			u32 start = e2_inode_alloc_run(inode, goal, &count);
+			if( start == 0 ){
+				mutex_unlock(priv->bmap_lock);
 				return -ENOSPC;
 			}
-			memset(doubly, 0 , inode->i_super->s_blocksize);
-		} else {
-			// read in doubly indirect layer
-			e2_read_block(inode->i_super, buffer[t], 1, (char*)doubly);
-		}
-		// iterate over each indirect layer
-		for(u32 d = 0; d < (inode->i_super->s_blocksize/4) && idx < nblocks; ++d)
-		{
-			// allocate the indirect block if needed
-			if( buffer[d] == 0 ){
-				if( (buffer[d] = e2_alloc_block(inode->i_super)) == 0 ){
-					kfree(doubly);
-					kfree(indirect);
-					spin_unlock(&priv->rw_lock);
-					return -ENOSPC;
+			
+			// map the new blocks and update block and byte count
+			for(u32 i = 0; i < count; ++i, ++nblocks){
+				int error = e2_bmap_set(inode, nblocks, start + i);
+				if( error < 0 ){
+					e2_free_blocks(sb, start + i, count - i);
+					mutex_unlock(priv->bmap_lock);
+					return error;
 				}
+				priv->inode->i_blocks += sb->s_blocksize/512;
+				priv->inode->i_size = (nblocks+1)*sb->s_blocksize;
+				inode->i_size = (off_t)priv->inode->i_size;
 			}
-			e2_write_block(inode->i_super, buffer[d], 1, (char*)&map[idx]);
-			idx += inode->i_super->s_blocksize/4;
 		}
-		// write the doubly indirect block back to disk (probably modified)
-		e2_write_block(inode->i_super, buffer[t], 1, (char*)doubly);
+		mutex_unlock(priv->bmap_lock);
+		// correct size
+		priv->inode->i_size = newsize;
+		inode->i_size = (off_t)priv->inode->i_size;
 	}
-	
-	// write the triply indirect block back to disk (probably modified)
-	e2_write_block(inode->i_super, priv->inode->i_block[14], 1, priv->rw);
-	
-	// free the extra memory
-	kfree(doubly);
-	kfree(indirect);
-	
-	// unlock the buffer
-	spin_unlock(&priv->rw_lock);
+		
 	
 	return 0;
 }
 
-static void e2_release_singly_indirect(struct inode* inode, u32 blocknr)
+/* Find the disk block behind a logical block for e2_inode_io. Holes read
+ * back as zeros, and writing to one fills it with a new, zeroed block. The
+ * lookup and allocation happen under bmap_lock, so two writers of the same
+ * hole don't both allocate it.
+ */
+static int e2_inode_io_map(struct inode* inode, u32 lblock, int cmd, u32* block)
 {
+	e2_inode_private_t* priv = EXT2_INODE(inode);
 	struct superblock* sb = inode->i_super;
-	e2_inode_private_t* priv = (e2_inode_private_t*)inode->i_private;
+	int result;
 	
-	// Allocate a block for the singly indirect map
-	u32* block = kmalloc(sb->s_blocksize);
-	if( block == NULL ){
-		syslog(KERN_ERR, "unable to allocate singly indirect block!\n");
-		return;
-	}
+	mutex_lock(priv->bmap_lock, SEM_FOREVER);
 	
-	// Read in the indirect map
-	e2_read_block(sb, blocknr, 1, (void*)block);
-	
-	// Free each block in the map
-	for(u32 i = 0; i < (sb->s_blocksize/4); ++i){
-		if( block[i] != 0 ){
-			e2_free_block(sb, block[i]);
-			if( priv->inode->i_size < sb->s_blocksize )
-				priv->inode->i_size = 0;
-			else
-				priv->inode->i_size -= sb->s_blocksize;
-			priv->inode->i_blocks -= (sb->s_blocksize/512);
-		} else {
-			break;
-		}
+	result = e2_bmap_find(inode, lblock, block);
+	if( result < 0 || *block != 0 || cmd == EXT2_READ ){
+		mutex_unlock(priv->bmap_lock);
+		return result;
 	}
 	
-	// Free the block buffer
-	kfree(block);
-	
-	// Free the indirect block
-	e2_free_block(sb, blocknr);
-	
-	return;
-}
-
-static void e2_release_doubly_indirect(struct inode* inode, u32 blocknr)
-{
-	struct superblock* sb = inode->i_super;
-	
-	// Allocate a block for the doubly indirect map
-	u32* block = kmalloc(sb->s_blocksize);
-	if( block == NULL ){
-		syslog(KERN_ERR, "unable to allocate doubly indirect block!\n");
-		return;
+	u32 count = 1;
+	u32 goal = 0;
+	if( lblock != 0 && (result = e2_bmap_find(inode, lblock-1, &goal)) < 0 ){
+		mutex_unlock(priv->bmap_lock);
+		return result;
 	}
-	
-	// Read in the indirect map
-	e2_read_block(sb, blocknr, 1, (void*)block);
-	
-	// Free each singly indirect block in the map and the block in the map
-	for(u32 i = 0; i < (sb->s_blocksize/4); ++i){
-		if( block[i] != 0 ){
-			// release all the indirect blocks
-			e2_release_singly_indirect(inode, block[i]);
-		} else {
-			break;
-		}
+	*block = e2_inode_alloc_run(inode, goal ? goal+1 : 0, &count);
+	if( *block == 0 ){
+		mutex_unlock(priv->bmap_lock);
+		return -ENOSPC;
 	}
 	
-	// Free the block buffer
-	kfree(block);
-	
-	// Free the indirect block
-	e2_free_block(sb, blocknr);
-	
-	return;
-}
-
-static void e2_release_triply_indirect(struct inode* inode, u32 blocknr)
-{
-	struct superblock* sb = inode->i_super;
-	
-	// Allocate a block for the triply indirect map
-	u32* block = kmalloc(sb->s_blocksize);
-	if( block == NULL ){
-		syslog(KERN_ERR, "unable to allocate doubly indirect block!\n");
-		return;
+	char* zero = (char*)kmalloc(sb->s_blocksize);
+	if( zero == NULL ){
+		result = -ENOMEM;
+	} else {
+		// the block holds zeros before anything can find it
+		memset(zero, 0, sb->s_blocksize);
+		result = e2_write_block(sb, *block, 1, zero);
+		kfree(zero);
 	}
-	
-	// Read in the indirect map
-	e2_read_block(sb, blocknr, 1, (void*)block);
-	
-	// Delete everything!
-	for(u32 i = 0; i < (sb->s_blocksize/4); ++i){
-		if( block[i] != 0 ){
-			e2_release_doubly_indirect(inode, block[i]);
-		} else {
-			break;
-		}
+	if( result >= 0 ){
+		result = e2_bmap_set(inode, lblock, *block);
+	}
+	if( result < 0 ){
+		e2_free_block(sb, *block);
+		*block = 0;
+		mutex_unlock(priv->bmap_lock);
+		return result;
 	}
 	
-	// Free the block buffer
-	kfree(block);
-	
-	// Free the indirect block
-	e2_free_block(sb, blocknr);
+	priv->inode->i_blocks += sb->s_blocksize/512;
+	e2_inode_dirty(inode);
 	
-	return;
-}
-
-/* truncate a given inode (resize to zero) */
-int e2_inode_truncate(struct inode* inode)
-{
-	struct superblock* sb = inode->i_super;
-	e2_inode_private_t* priv = (e2_inode_private_t*)inode->i_private;
-	
-	if( 1 )
-	{
-		e2_inode_resize(inode, 0);
-	} else {
-		
-		// Free each block in the map
-		for(u32 i = 0; i < 12; ++i){
-			if( priv->inode->i_block[i] != 0 ){
-				e2_free_block(sb, priv->inode->i_block[i]);
-				if( priv->inode->i_size < sb->s_blocksize )
-					priv->inode->i_size = 0;
-				else
-					priv->inode->i_size -= sb->s_blocksize;
-				priv->inode->i_blocks -= (sb->s_blocksize/512);
-				priv->inode->i_block[i] = 0;
-			}
-		}
-		
-		if( priv->inode->i_block[12] ){
-			e2_release_singly_indirect(inode, priv->inode->i_block[12]);
-			priv->inode->i_block[12] = 0;
-		}
-		if( priv->inode->i_block[13] ){
-			e2_release_doubly_indirect(inode, priv->inode->i_block[13]);
-			priv->inode->i_block[13] = 0;
-		}
-		if( priv->inode->i_block[14] ){
-			e2_release_triply_indirect(inode, priv->inode->i_block[14]);
-			priv->inode->i_block[14] = 0;
-		}
-	}
+	mutex_unlock(priv->bmap_lock);
 	
-	priv->dirty = 1;
-	e2_inode_flush(inode);
 	return 0;
 }
 
-ssize_t e2_inode_resize(struct inode* inode, size_t newsize)
+/* Read or write one whole block of a directory. Directories have no holes,
+ * so finding one means the directory is damaged.
+ */
+int e2_inode_block_io(struct inode* inode, int cmd, u32 lblock, char* buffer)
 {
-	e2_inode_private_t* priv = EXT2_INODE(inode);
-	struct superblock* sb = inode->i_super;
+	u32 block;
 	
-	u32 nblocks = (priv->inode->i_blocks * 512)/sb->s_blocksize;
-
-	// that's dumb...
-	if( newsize == priv->inode->i_size ){
-		return newsize;
-	} else if( newsize < priv->inode->i_size ) { // less than old size
-		u32 new_nblocks = newsize / sb->s_blocksize;
-		if( newsize % sb->s_blocksize ) new_nblocks++;
-		
-		if( new_nblocks == nblocks ){
-			priv->inode->i_size = newsize;
-			priv->dirty = 1;
-			e2_inode_flush(inode);
-			return newsize;
-		}
-		
-		// realloc the new block structure for the new blocks
-		u32* newblock;
-		u32 newblock_length = new_nblocks*4;
-		if( new_nblocks < 15 ) newblock_length = 15*4;
-		newblock = (u32*)kmalloc(newblock_length);
-		if( newblock == NULL ){
-			return -ENOMEM;
-		} else {
-			memset(newblock, 0, newblock_length);
-		}
-		
-		memcpy(newblock, priv->block, new_nblocks*4);
-		
-		// free the old blocks that aren't needed anymore
-		for( u32 b = new_nblocks; b < nblocks; ++b){
-			e2_free_block(sb, priv->block[b]);
-		}
-		kfree(priv->block);
-		priv->block = newblock;
-		
-		// Update reference counting
-		priv->dirty = 1;
-		priv->inode->i_size = newsize;
-		priv->inode->i_blocks = (new_nblocks*sb->s_blocksize)/512;
-		e2_inode_flush(inode);
-		
-	} else if( (u32)(priv->inode->i_size/sb->s_blocksize) == (u32)(newsize/sb->s_blocksize) && priv->inode->i_size != 0){
-		priv->inode->i_size = newsize;
-		priv->dirty = 1;
-		e2_inode_flush(inode);
-		return newsize;
-	} else if( newsize > priv->inode->i_size ){
-		u32 extra_blocks = (newsize - priv->inode->i_size)/sb->s_blocksize;
-		if( ((newsize-priv->inode->i_size)%sb->s_blocksize) ) extra_blocks++;
-		
-		// realloc the block structure to accomadate the new blocks
-		u32* newblock = (u32*)kmalloc((nblocks+extra_blocks)*4);
-		if( newblock == NULL ){
-			return -ENOMEM;
-		}
-		memcpy(newblock, priv->block, nblocks*4);
-		kfree(priv->block);
-		priv->block = newblock;
-		
-		priv->dirty = 1;
-		
-		for(u32 i = nblocks; i < (nblocks+extra_blocks); ++i){
-			priv->block[i] = e2_alloc_block(sb);
-			if( priv->block[i] == 0 ){
-				e2_inode_flush(inode);
-				return priv->inode->i_size;
-			}
-			// update block and byte count
-			priv->inode->i_blocks += sb->s_blocksize/512;
-			priv->inode->i_size += sb->s_blocksize;
-		}
-		// correct size
-		priv->inode->i_size = newsize;
-		
-		e2_inode_flush(inode);
+	int result = e2_inode_bmap(inode, lblock, &block);
+	if( result < 0 ){
+		return result;
+	}
+	if( block == 0 ){
+		return -EIO;
 	}
-		
 	
-	return 0;
+	if( cmd == EXT2_READ ){
+		return e2_read_block(inode->i_super, block, 1, buffer);
+	} else {
+		return e2_write_block(inode->i_super, block, 1, buffer);
+	}
 }
 
 ssize_t e2_inode_io(struct inode* inode, int cmd, off_t offset, size_t size, char* buffer)
@@ -892,6 +591,7 @@ ssize_t e2_inode_io(struct inode* inode, int cmd, off_t offset, size_t size, cha
 	e2_inode_private_t* priv = EXT2_INODE(inode);
 	struct superblock* sb = inode->i_super;
 	ssize_t completed = 0;
+	int result;
 	
 	//spin_lock(&priv->rw_lock);
 	
@@ -913,73 +613,79 @@ ssize_t e2_inode_io(struct inode* inode, int cmd, off_t offset, size_t size, cha
 		}
 	}
 	
-	// Read/Write initial partial block
-	if( offset % sb->s_blocksize )
+	while( size != 0 )
 	{
-		// No matter read or write, we need to read this block first
-		e2_read_block(sb, priv->block[offset/sb->s_blocksize], 1, priv->rw);
-		// if we only wanted to read/write less than a block
-		if( size <= (sb->s_blocksize-(offset%sb->s_blocksize)) )
+		u32 lblock = offset / sb->s_blocksize;
+		u32 skip = offset % sb->s_blocksize;
+		
+		// Read/Write partial blocks through the inode buffer
+		if( skip != 0 || size < sb->s_blocksize )
 		{
-			// do the read/write
-			if( cmd == EXT2_READ ){
-				memcpy(buffer, priv->rw+(offset%sb->s_blocksize), size);
-			} else {
-				memcpy(priv->rw+(offset%sb->s_blocksize), buffer, size);
-				e2_write_block(sb, priv->block[offset/sb->s_blocksize], 1, priv->rw);
+			u32 len = sb->s_blocksize - skip;
+			if( len > size ) len = size;
+			
+			u32 block;
+			result = e2_inode_io_map(inode, lblock, cmd, &block);
+			if( result < 0 ){
+				return completed ? completed : result;
 			}
-			// unlock and return
-			//spin_unlock(&priv->rw_lock);
-			return size;
-		} else {
-			// we wanted more than this block
-			// do the read/write
-			if( cmd == EXT2_READ ){
-				memcpy(buffer, priv->rw+(offset%sb->s_blocksize), sb->s_blocksize-(offset%sb->s_blocksize));
+			
+			if( block == 0 ){
+				memset(buffer, 0, len);
 			} else {
-				memcpy(priv->rw+(offset%sb->s_blocksize), buffer, sb->s_blocksize-(offset%sb->s_blocksize));
-				e2_write_block(sb, priv->block[offset/sb->s_blocksize], 1, priv->rw);
+				// No matter read or write, we need to read this block first
+				result = e2_read_block(sb, block, 1, priv->rw);
+				if( result < 0 ){
+					return completed ? completed : result;
+				}
+				if( cmd == EXT2_READ ){
+					memcpy(buffer, priv->rw+skip, len);
+				} else {
+					memcpy(priv->rw+skip, buffer, len);
+					e2_write_block(sb, block, 1, priv->rw);
+				}
 			}
+			
 			// update counters
-			completed += sb->s_blocksize-(offset%sb->s_blocksize);
-			buffer += sb->s_blocksize-(offset%sb->s_blocksize);
-			size -= sb->s_blocksize-(offset%sb->s_blocksize);
-			offset += sb->s_blocksize-(offset%sb->s_blocksize);
+			completed += len;
+			buffer += len;
+			size -= len;
+			offset += len;
+			continue;
 		}
-	}
-	
-	// Transfer any (if any) block sized chunks
-	if( (u32)(size / sb->s_blocksize) != 0 )
-	{
+		
+		// Whole blocks go straight to or from the callers buffer. Blocks
+		// which are contiguous on disk are transferred with one request.
 		u32 nblocks = size / sb->s_blocksize;
-		for(u32 i = 0; i < nblocks; ++i)
-		{
-			// do the read/write
+		u32 first, next;
+		u32 run = 1;
+		
+		result = e2_inode_io_map(inode, lblock, cmd, &first);
+		if( result < 0 ){
+			return completed ? completed : result;
+		}
+		
+		if( first == 0 ){
+			// a run of holes reads as zeros
+			while( run < nblocks && e2_inode_bmap(inode, lblock+run, &next) == 0 && next == 0 ) run++;
+			memset(buffer, 0, run*sb->s_blocksize);
+		} else {
+			while( run < nblocks && e2_inode_io_map(inode, lblock+run, cmd, &next) == 0 && next == first+run ) run++;
 			if( cmd == EXT2_READ ){
-				e2_read_block(sb, priv->block[offset/sb->s_blocksize], 1, buffer);
+				result = e2_read_block(sb, first, run, buffer);
 			} else {
-				e2_write_block(sb, priv->block[offset/sb->s_blocksize], 1, buffer);
+				result = e2_write_block(sb, first, run, buffer);
+			}
+			if( result < 0 ){
+				return completed ? completed : result;
 			}
-			// update counters
-			completed += sb->s_blocksize;
-			offset += sb->s_blocksize;
-			buffer += sb->s_blocksize;
-			size -= sb->s_blocksize;
-		}
-	}
-	
-	// transfer any partial block pieces
-	if( size != 0 )
-	{
-		// it's a partial block so we need to read the whole thing for both read and write
-		e2_read_block(sb, priv->block[offset/sb->s_blocksize], 1, priv->rw);
-		if( cmd == EXT2_READ ){
-			memcpy(buffer, priv->rw, size);
-		} else {
-			memcpy(priv->rw, buffer, size);
-			e2_write_block(sb, priv->block[offset/sb->s_blocksize], 1, priv->rw);
 		}
-		completed += size;
+		
+		// update counters
+		completed += run*sb->s_blocksize;
+		offset += run*sb->s_blocksize;
+		buffer += run*sb->s_blocksize;
+		size -= run*sb->s_blocksize;
 	}
 	
 	return completed;
@@ -992,6 +698,7 @@ int e2_inode_link(struct inode* parent, const char* name, struct inode* inode)
 	e2_dirent_t* dirent = NULL;
 	u32 dirent_block = 0;
 	struct superblock* sb = parent->i_super;
+	int result = -EAGAIN;
 	
 	// parent must be a directory
 	if( !S_ISDIR(parent->i_mode) ){
@@ -1006,28 +713,47 @@ int e2_inode_link(struct inode* parent, const char* name, struct inode* inode)
 	spin_lock(&parent_priv->rw_lock);
 	spin_lock(&inode_priv->rw_lock);
 	
-	u32 nblocks = (parent_priv->inode->i_blocks*512)/parent->i_super->s_blocksize;
+	// indexed directories keep each name in the leaf its hash points to
+	if( parent_priv->inode->i_flags & EXT2_INDEX_FL ){
+		result = e2_dx_add(parent, name, inode);
+		if( result != -EAGAIN ){
+			goto linked;
+		}
+	}
+	
+	u32 nblocks = EXT2_NBLOCKS(parent->i_super, parent_priv);
 	
 	// search every dirent in every block for an unused one that can fit our name
 	for( u32 b = 0; b < nblocks && dirent == NULL; ++b)
 	{
-		e2_read_block(parent->i_super, parent_priv->block[b], 1, parent_priv->rw);
+		if( e2_inode_block_io(parent, EXT2_READ, b, parent_priv->rw) < 0 ){
+			continue;
+		}
 		e2_dirent_t* iter = (e2_dirent_t*)parent_priv->rw;
 		while( ((u32)iter) < ((u32)parent_priv->rw + parent->i_super->s_blocksize) )
 		{
 			if( iter->inode == 0 && (u32)(iter->rec_len-8) >= strlen(name)) {
 				dirent = iter;
-				dirent_block = parent_priv->block[b];
+				dirent_block = b;
 				break;
 			}
 			iter = (e2_dirent_t*)( (u32)iter + iter->rec_len );
 		}
 	}
 	
+	// a full single block directory gets an index instead of a second
+	// linear block, if the filesystem supports it
+	if( dirent == NULL && e2_dx_build(parent) == 0 ){
+		result = e2_dx_add(parent, name, inode);
+		if( result != -EAGAIN ){
+			goto linked;
+		}
+	}
+	
 	// no space in already allocated blocks, allocate a new block!
 	if( dirent == NULL ){
-		ssize_t result = e2_inode_resize(parent, parent_priv->inode->i_size + sb->s_blocksize);
-		if( result < 0 ){
+		ssize_t error = e2_inode_resize(parent, parent_priv->inode->i_size + sb->s_blocksize);
+		if( error < 0 ){
 			spin_unlock(&inode_priv->rw_lock);
 			spin_unlock(&parent_priv->rw_lock);
 			return -ENOSPC;
@@ -1037,18 +763,14 @@ int e2_inode_link(struct inode* parent, const char* name, struct inode* inode)
 		dirent = (e2_dirent_t*)parent_priv->rw;
 		dirent->rec_len = (u16)sb->s_blocksize;
 		dirent->inode = 0;
-		// we will then write this block to disk later
-		dirent_block = parent_priv->block[nblocks]; // nblocks was the size, now it is the last index (we increased size by 1)
-		e2_inode_flush(parent);
+		// we will then write this block to disk later (it is the last one now)
+		dirent_block = parent_priv->inode->i_size/sb->s_blocksize - 1;
 	}
 	
 	e2_dirent_t* split = NULL;
 	
 	// needed size, aligned to 4 byte boundary
-	u32 needed_size = 8 + strlen(name);
-	if( (needed_size % 4) ){
-		needed_size = (needed_size & ~3) + 4;
-	}
+	u32 needed_size = EXT2_DIRENT_LEN(strlen(name));
 	
 	// split the dirent into two if possible
 	if( (dirent->rec_len - needed_size) > 8 ){
@@ -1059,6 +781,26 @@ int e2_inode_link(struct inode* parent, const char* name, struct inode* inode)
 	}
 	
 	// Fill in the dirent data
+	e2_dirent_fill(dirent, name, inode);
+	
+	// write the block that contains this dirent back to the disk
+	result = e2_inode_block_io(parent, EXT2_WRITE, dirent_block, parent_priv->rw);
+	
+linked:
+	if( result == 0 ){
+		// we have another link!
+		inode_priv->inode->i_links_count++;
+		e2_inode_dirty(inode);
+	}
+	
+	spin_unlock(&inode_priv->rw_lock);
+	spin_unlock(&parent_priv->rw_lock);
+	
+	return result;	
+}
+
+void e2_dirent_fill(e2_dirent_t* dirent, const char* name, struct inode* inode)
+{
 	dirent->inode = inode->i_ino;
 #ifdef EXT2_HAS_DYNAMIC_REV
 	dirent->name_len = (u8)strlen(name);
@@ -1083,86 +825,81 @@ int e2_inode_link(struct inode* parent, const char* name, struct inode* inode)
 #else
 	dirent->name_len = (u16)strlen(name);
 #endif
-	// Copy the name string
-	strcpy(dirent->name, name);
-	
-	// we have another link!
-	inode_priv->inode->i_links_count++;
-	inode_priv->dirty = 1;
-	
-	// write the block that contains this dirent back to the disk
-	e2_write_block(sb, dirent_block, 1, parent_priv->rw);
-	
-	spin_unlock(&inode_priv->rw_lock);
-	spin_unlock(&parent_priv->rw_lock);
-	
-	e2_inode_flush(inode);
-	e2_inode_flush(parent);
-	
-	return 0;	
+	// Copy the name string (not terminated if it fills the record)
+	memcpy(dirent->name, name, strlen(name));
 }
 
 int e2_inode_unlink(struct inode* parent, struct dentry* entry)
 {
 	e2_inode_private_t* parent_priv = EXT2_INODE(parent);
 	e2_inode_private_t* child_priv = NULL;
+	e2_dirent_t* found = NULL;
+	u32 block = 0;
 	
 	// lock the parent
 	spin_lock(&parent_priv->rw_lock);
 	
 	// calculate number of fs blocks and length of the name
-	u32 nblocks = (parent_priv->inode->i_blocks*512)/parent->i_super->s_blocksize;
+	u32 nblocks = EXT2_NBLOCKS(parent->i_super, parent_priv);
 	size_t name_len = strlen(entry->d_name);
 	
+	// indexed directories only need the leaf that the name hashes to
+	found = e2_dx_search(parent, entry->d_name, parent_priv->rw, &block);
+	if( IS_ERR(found) ){
+		if( PTR_ERR(found) != -EAGAIN ){
+			spin_unlock(&parent_priv->rw_lock);
+			return PTR_ERR(found);
+		}
+		found = NULL;
+	}
+	
 	// search every dirent in every block for the given name
-	for( u32 b = 0; b < nblocks; ++b)
+	for( u32 b = 0; b < nblocks && found == NULL; ++b)
 	{
 		// read in the block
-		e2_read_block(parent->i_super, parent_priv->block[b], 1, parent_priv->rw);
+		if( e2_inode_block_io(parent, EXT2_READ, b, parent_priv->rw) < 0 ){
+			continue;
+		}
 		for( e2_dirent_t* iter = (e2_dirent_t*)parent_priv->rw;
 			 (u32)iter < ((u32)parent_priv->rw + parent->i_super->s_blocksize);
 			 iter = (e2_dirent_t*)( (u32)iter + iter->rec_len) )
 		{
-			if( iter->inode == 0 ) continue;
-			if( name_len != iter->name_len ) continue;
-			if( strncmp(entry->d_name, iter->name, name_len) == 0 )
-			{
-				// Reset the entry and rewrite it back to the drive
-				iter->inode = 0;
-				e2_write_block(parent->i_super, parent_priv->block[b], 1, parent_priv->rw);
-				
-				// lock the child
-				child_priv = EXT2_INODE(entry->d_inode);
-				spin_lock(&child_priv->rw_lock);
-				
-				// decremeent reference count
-				child_priv->inode->i_links_count--;
-				child_priv->dirty = 1;
-				
-				// unlock the child
-				spin_unlock(&child_priv->rw_lock);
-				
-				// Flush the updated inode to disk
-				e2_inode_flush(entry->d_inode);
-
-				// Unlock the parent				
-				spin_unlock(&parent_priv->rw_lock);
-				
-				// Flush the parent
-				e2_inode_flush(parent);
-				
-				// At this point, the inode is unlinked, but it's blocks are
-				// still allocated (even if links_count is 0). It will be freed
-				// when all system references to it are released (e.g. at i_put).
-				return 0;
+			if( iter->inode != 0 && name_len == iter->name_len && strncmp(entry->d_name, iter->name, name_len) == 0 ){
+				found = iter;
+				block = b;
+				break;
 			}
 			// Don't know why this would happen, but it does.
 			if( iter->rec_len == 0 ) break;
 		}
 	}
 	
-	// unlock the parent
+	if( found == NULL ){
+		// unlock the parent
+		spin_unlock(&parent_priv->rw_lock);
+		return -ENOENT;
+	}
+	
+	// Reset the entry and rewrite it back to the drive
+	found->inode = 0;
+	e2_inode_block_io(parent, EXT2_WRITE, block, parent_priv->rw);
+	
+	// lock the child
+	child_priv = EXT2_INODE(entry->d_inode);
+	spin_lock(&child_priv->rw_lock);
+	
+	// decremeent reference count
+	child_priv->inode->i_links_count--;
+	e2_inode_dirty(entry->d_inode);
+	
+	// unlock the child
+	spin_unlock(&child_priv->rw_lock);
+
+	// Unlock the parent				
 	spin_unlock(&parent_priv->rw_lock);
 	
-	return -ENOENT;
+	// At this point, the inode is unlinked, but it's blocks are
+	// still allocated (even if links_count is 0). It will be freed
+	// when all system references to it are released (e.g. at i_put).
+	return 0;
 }
\ No newline at end of file
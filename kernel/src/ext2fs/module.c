@@ -19,10 +19,12 @@ struct inode_operations e2_inode_operations = {
 struct file_operations e2_default_file_operations = {
 	.open = e2_file_open, .close = e2_file_close, 
 	.read = e2_file_read, .write = e2_file_write,
-	.readdir = e2_file_readdir
+	.readdir = e2_file_readdir, .fsync = e2_file_fsync,
+	.readpage = e2_file_readpage, .writev = e2_file_writev,
 };
 struct superblock_operations e2_superblock_ops = {
 	.read_inode = e2_read_inode, .put_inode = e2_put_inode,
+	.sync = e2_super_sync,
 };
 struct filesystem_operations e2_filesystem_ops = {
 	.read_super = e2_read_super, .put_super = e2_put_super,
@@ -44,6 +46,7 @@ int ext2fs_load(module_t* module ATTR((unused)))
 		info_message("unable to register filesystem. error code %d", result);
 		return result;
 	}
+	e2_writeback_init();
 	return 0;
 }
 
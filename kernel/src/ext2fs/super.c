@@ -1,8 +1,17 @@
+#include "error.h"
 #include "ext2fs/ext2.h"
 #include "kmem.h"
 #include "dentry.h"
 #include <errno.h>
 #include "block.h"
+#include "task.h"
+#include "sem.h"
+
+static list_t e2_mount_list = LIST_INIT(e2_mount_list);	// every mounted ext2 filesystem
+static mutex_t* e2_mount_lock;							// protects the list (held during write-back)
+pid_t e2_writeback_pid;									// metadata write-back worker
+
+static void e2_writeback(void* context);
 
 /* Read in the super block structure and initial internal data structures */
 int e2_read_super(struct filesystem* fs ATTR((unused)), struct superblock* sb, dev_t devid,
@@ -18,6 +27,10 @@ int e2_read_super(struct filesystem* fs ATTR((unused)), struct superblock* sb, d
 	// reset the memory
 	memset(e2sup, 0, sizeof(*e2sup));
 	spin_init(&e2sup->rw_lock);
+	spin_init(&e2sup->dirty_lock);
+	INIT_LIST(&e2sup->dirty_inodes);
+	INIT_LIST(&e2sup->link);
+	e2sup->sb = sb;
 	
 	// Read the superblock structure from disk
 	ssize_t rdresult = block_read(devid, 1024, sizeof(e2sup->super), (void*)&e2sup->super);
@@ -66,6 +79,19 @@ int e2_read_super(struct filesystem* fs ATTR((unused)), struct superblock* sb, d
 	
 	block_read(sb->s_dev, start_block*sb->s_blocksize, table_size, (void*)e2sup->bgtable);
 	
+	// Bitmaps are cached per group as they are used
+	e2sup->bitmap[EXT2_BLOCK_BITMAP] = (e2_bitmap_t*)kmalloc(sizeof(e2_bitmap_t)*EXT2_BGCOUNT(sb));
+	e2sup->bitmap[EXT2_INODE_BITMAP] = (e2_bitmap_t*)kmalloc(sizeof(e2_bitmap_t)*EXT2_BGCOUNT(sb));
+	if( !e2sup->bitmap[EXT2_BLOCK_BITMAP] || !e2sup->bitmap[EXT2_INODE_BITMAP] ){
+		kfree(e2sup->bitmap[EXT2_BLOCK_BITMAP]);
+		kfree(e2sup->bitmap[EXT2_INODE_BITMAP]);
+		kfree(e2sup->bgtable);
+		kfree(e2sup);
+		return -ENOMEM;
+	}
+	memset(e2sup->bitmap[EXT2_BLOCK_BITMAP], 0, sizeof(e2_bitmap_t)*EXT2_BGCOUNT(sb));
+	memset(e2sup->bitmap[EXT2_INODE_BITMAP], 0, sizeof(e2_bitmap_t)*EXT2_BGCOUNT(sb));
+	
 // 	// Read in the blocks
 // 	if( e2_read_block(sb, start_block, table_size / sb->s_blocksize, (void*)e2sup->bgtable) < 0 ){
 // 		kfree(e2sup);
@@ -77,6 +103,11 @@ int e2_read_super(struct filesystem* fs ATTR((unused)), struct superblock* sb, d
 	sb->s_root = d_alloc_root(root);
 	i_put(root);
 	
+	// Changes are written back in the background from now on
+	mutex_lock(e2_mount_lock, SEM_FOREVER);
+	list_add(&e2sup->link, &e2_mount_list);
+	mutex_unlock(e2_mount_lock);
+	
 	return 0;
 }
 
@@ -85,10 +116,14 @@ int e2_put_super(struct filesystem* fs ATTR((unused)), struct superblock* sb)
 {
 	e2_super_private_t* e2sup = EXT2_SUPER(sb);
 	
-	// Flush any pending changes
-	e2_super_flush(sb);
+	// Stop the background write-back, and flush any pending changes
+	mutex_lock(e2_mount_lock, SEM_FOREVER);
+	list_rem(&e2sup->link);
+	mutex_unlock(e2_mount_lock);
+	e2_super_sync(sb);
 	
 	// Free internal data structures
+	e2_bitmap_release(sb);
 	kfree(e2sup->bgtable);
 	kfree(e2sup);
 	
@@ -106,6 +141,12 @@ int e2_super_flush(struct superblock* sb)
 		e2sup->dirty = 0;
 	}
 	
+	// Bitmap changes are held back until the accounting goes out with them.
+	// Bitmaps which could not be written are tried again next time.
+	if( e2_bitmap_flush(sb) < 0 ){
+		e2sup->dirty = 1;
+	}
+	
 	// Write the superblock to disk
 	block_write(sb->s_dev, 1024, sizeof(e2sup->super), (void*)&e2sup->super);
 	
@@ -122,3 +163,74 @@ int e2_super_flush(struct superblock* sb)
 	return 0;
 }
 
+/* Write back every inode waiting on the dirty list, followed by the
+ * superblock and block group table. The inodes are looked up again by
+ * number, since they may have been released since they were queued.
+ */
+int e2_super_sync(struct superblock* sb)
+{
+	e2_super_private_t* e2sup = EXT2_SUPER(sb);
+	int result = 0;
+	
+	while( 1 )
+	{
+		spin_lock(&e2sup->dirty_lock);
+		if( list_empty(&e2sup->dirty_inodes) ){
+			spin_unlock(&e2sup->dirty_lock);
+			break;
+		}
+		e2_inode_private_t* priv = list_entry(list_first(&e2sup->dirty_inodes), e2_inode_private_t, dirty_link);
+		ino_t ino = priv->ino;
+		list_rem(&priv->dirty_link);
+		spin_unlock(&e2sup->dirty_lock);
+		
+		struct inode* inode = i_get(sb, ino);
+		if( IS_ERR(inode) ){
+			result = PTR_ERR(inode);
+			continue;
+		}
+		
+		int error = e2_inode_flush(inode);
+		i_put(inode);
+		if( error < 0 ){
+			// it was queued again for the next pass
+			result = error;
+			break;
+		}
+	}
+	
+	int error = e2_super_flush(sb);
+	if( error < 0 ){
+		result = error;
+	}
+	
+	return result;
+}
+
+void e2_writeback_init( void )
+{
+	if( e2_mount_lock != NULL ){
+		return;
+	}
+	
+	e2_mount_lock = mutex_alloc();
+	e2_writeback_pid = worker_spawn(e2_writeback, NULL);
+}
+
+// Periodically push dirty inodes and superblocks into the buffer cache
+static void e2_writeback(void* context ATTR((unused)))
+{
+	list_t* item;
+	e2_super_private_t* e2sup;
+	
+	while( 1 )
+	{
+		task_sleep(current, EXT2_WRITEBACK_DELAY);
+		
+		mutex_lock(e2_mount_lock, SEM_FOREVER);
+		list_for_each_entry(item, &e2_mount_list, e2_super_private_t, link, e2sup){
+			e2_super_sync(e2sup->sb);
+		}
+		mutex_unlock(e2_mount_lock);
+	}
+}
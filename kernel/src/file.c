@@ -11,6 +11,8 @@
 #include <unistd.h>
 #include "stewieos/block.h"
 #include "stewieos/pipe.h"
+#include "stewieos/kmem_cache.h"
+#include "stewieos/bcache.h"
 
 struct file* file_open(struct path* path, int flags)
 {
@@ -64,7 +66,7 @@ struct file* file_open(struct path* path, int flags)
 		}
 	}
 	
-	file = (struct file*)kmalloc(sizeof(struct file));
+	file = (struct file*)kmem_cache_alloc(file_cache);
 	if(!file) {
 		return ERR_PTR(-ENOMEM);
 	}
@@ -87,7 +89,7 @@ struct file* file_open(struct path* path, int flags)
 	if( file->f_ops == NULL )
 	{
 		path_put(&file->f_path);
-		kfree(file);
+		kmem_cache_free(file_cache, file);
 		return ERR_PTR(-ENXIO);
 	}
 	
@@ -95,7 +97,7 @@ struct file* file_open(struct path* path, int flags)
 		result = file->f_ops->open(file, file->f_path.p_dentry, flags);
 		if( result != 0 ){
 			path_put(&file->f_path);
-			kfree(file);
+			kmem_cache_free(file_cache, file);
 			return ERR_PTR(result);
 		}
 	}
@@ -117,6 +119,29 @@ int file_flush(struct file* file)
 	return 0;
 }
 
+int file_sync(struct file* file)
+{
+	struct inode* inode = file_inode(file);
+	int result;
+	
+	// Let the filesystem write back what it is holding for this file
+	if( file->f_ops->fsync ){
+		result = file->f_ops->fsync(file);
+	} else {
+		result = file_flush(file);
+	}
+	if( result != 0 ){
+		return result;
+	}
+	
+	// Then push it from the buffer cache to the device
+	if( inode->i_super->s_dev != 0 ){
+		return bcache_sync(inode->i_super->s_dev);
+	}
+	
+	return 0;
+}
+
 struct file* file_get(struct file* file)
 {
 	if( file == NULL ) return file;
@@ -141,7 +166,7 @@ int file_close(struct file* file)
 	}
 	
 	path_put(&file->f_path);
-	kfree(file);
+	kmem_cache_free(file_cache, file);
 	
 	return 0;
 }
@@ -156,6 +181,16 @@ ssize_t file_read(struct file* file, void* buf, size_t count)
 		return -EINVAL;
 	}
 	
+	// Regular file contents go through the page cache
+	if( file->f_ops->readpage && S_ISREG(file_inode(file)->i_mode) )
+	{
+		ssize_t result = pcache_read(file, file->f_off, (char*)buf, count);
+		if( result > 0 ){
+			file->f_off += result;
+		}
+		return result;
+	}
+	
 	return file->f_ops->read(file,(char*)buf, count);
 }
 
@@ -193,8 +228,14 @@ ssize_t file_write(struct file* file, const void* buf, size_t count)
 		file->f_off = (off_t)(file->f_path.p_dentry->d_inode->i_size);
 	}
 	
+	off_t pos = file->f_off;
 	result = file->f_ops->write(file, (const char*)buf, count);
 	
+	// Keep cached pages in line with what was written
+	if( result > 0 ){
+		pcache_update(file_inode(file), pos, (const char*)buf, (size_t)result);
+	}
+	
 	if( ((file->f_status+1) & O_APPEND) ){
 		file->f_off = old_pos;
 	}
@@ -202,6 +243,247 @@ ssize_t file_write(struct file* file, const void* buf, size_t count)
 	return result;
 }
 
+/* Total length of a vector, or -EINVAL if it is too long to report */
+static ssize_t iov_length(const struct iovec* iov, int iovcnt)
+{
+	size_t total = 0;
+	
+	if( iovcnt <= 0 || iovcnt > IOV_MAX ){
+		return -EINVAL;
+	}
+	
+	for(int i = 0; i < iovcnt; ++i){
+		if( iov[i].iov_len > (size_t)0x7FFFFFFF - total ){
+			return -EINVAL;
+		}
+		total += iov[i].iov_len;
+	}
+	
+	return (ssize_t)total;
+}
+
+/* Copy `count` bytes just written from a vector at `pos` into the cache */
+static void file_iov_update(struct inode* inode, off_t pos, const struct iovec* iov, int iovcnt, size_t count)
+{
+	for(int i = 0; i < iovcnt && count != 0; ++i){
+		size_t len = iov[i].iov_len < count ? iov[i].iov_len : count;
+		pcache_update(inode, pos, (const char*)iov[i].iov_base, len);
+		pos += (off_t)len;
+		count -= len;
+	}
+}
+
+/* Transfer a vector one segment at a time at the file offset, through the
+ * plain read operation or file_write. Positional transfers need a readv or
+ * writev operation, so they never come through here.
+ * Reads from anything but a regular file stop once some data has arrived,
+ * since asking a pipe or terminal for more could block.
+ */
+static ssize_t file_iov_loop(struct file* file, const struct iovec* iov, int iovcnt, int write)
+{
+	int regular = S_ISREG(file_inode(file)->i_mode);
+	ssize_t done = 0;
+	
+	for(int i = 0; i < iovcnt; ++i)
+	{
+		ssize_t result;
+		if( write ){
+			result = file_write(file, iov[i].iov_base, iov[i].iov_len);
+		} else {
+			result = file->f_ops->read(file, (char*)iov[i].iov_base, iov[i].iov_len);
+		}
+		if( result < 0 ){
+			if( done == 0 ) done = result;
+			break;
+		}
+		done += result;
+		if( (size_t)result < iov[i].iov_len ) break;
+		if( !write && !regular && done > 0 ) break;
+	}
+	
+	return done;
+}
+
+/* Read into a vector of buffers at *pos, or at the file offset if pos is
+ * NULL. Regular files are read from the page cache segment by segment,
+ * and other files through their readv operation if they have one. A
+ * positional read of a file with neither fails with -ESPIPE.
+ */
+ssize_t file_readv(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos)
+{
+	ssize_t total = iov_length(iov, iovcnt);
+	if( total < 0 ){
+		return total;
+	}
+	
+	if( !((file->f_status+1) & _FREAD) || !file->f_ops->read ){
+		return -EINVAL;
+	}
+	
+	if( pos && S_ISFIFO(file_inode(file)->i_mode) ){
+		return -ESPIPE;
+	}
+	
+	if( file->f_ops->readpage && S_ISREG(file_inode(file)->i_mode) )
+	{
+		off_t off = pos ? *pos : file->f_off;
+		ssize_t done = 0;
+		for(int i = 0; i < iovcnt; ++i)
+		{
+			ssize_t result = pcache_read(file, off, (char*)iov[i].iov_base, iov[i].iov_len);
+			if( result < 0 ){
+				if( done == 0 ) done = result;
+				break;
+			}
+			off += result;
+			done += result;
+			if( (size_t)result < iov[i].iov_len ) break;
+		}
+		if( done > 0 && pos ){
+			*pos = off;
+		} else if( done > 0 ){
+			file->f_off = off;
+		}
+		return done;
+	}
+	
+	if( file->f_ops->readv ){
+		return file->f_ops->readv(file, iov, iovcnt, pos ? pos : &file->f_off);
+	}
+	
+	if( pos ){
+		return -ESPIPE;
+	}
+	
+	return file_iov_loop(file, iov, iovcnt, 0);
+}
+
+/* Write a vector of buffers at *pos, or at the file offset if pos is
+ * NULL. Filesystems with a writev operation get the whole vector at once.
+ * Without one, the vector is written segment by segment through
+ * file_write, and a positional write fails with -ESPIPE.
+ */
+ssize_t file_writev(struct file* file, const struct iovec* iov, int iovcnt, off_t* pos)
+{
+	off_t append;
+	
+	ssize_t total = iov_length(iov, iovcnt);
+	if( total < 0 ){
+		return total;
+	}
+	
+	if( !((file->f_status+1) & _FWRITE) || !file->f_ops->write ){
+		return -EINVAL;
+	}
+	
+	if( pos && S_ISFIFO(file_inode(file)->i_mode) ){
+		return -ESPIPE;
+	}
+	
+	if( file->f_ops->writev )
+	{
+		// Like file_write, appending leaves the file offset where it was
+		if( !pos && ((file->f_status+1) & O_APPEND) ){
+			append = file_inode(file)->i_size;
+			pos = &append;
+		}
+		
+		off_t start = pos ? *pos : file->f_off;
+		ssize_t result = file->f_ops->writev(file, iov, iovcnt, pos ? pos : &file->f_off);
+		if( result > 0 ){
+			file_iov_update(file_inode(file), start, iov, iovcnt, (size_t)result);
+		}
+		return result;
+	}
+	
+	if( pos ){
+		return -ESPIPE;
+	}
+	
+	return file_iov_loop(file, iov, iovcnt, 1);
+}
+
+static ssize_t file_splice_actor(void* ctx, const char* data, size_t count)
+{
+	return file_write((struct file*)ctx, data, count);
+}
+
+/* Move up to `count` bytes from `in` to `out` inside the kernel. Cached
+ * file pages and pipe buffers are written to `out` in place, and anything
+ * else goes through a page of kernel memory. If `offset` is given, it is
+ * used and updated instead of the input file offset.
+ */
+ssize_t file_splice(struct file* out, struct file* in, off_t* offset, size_t count)
+{
+	ssize_t result = 0;
+	
+	if( !((in->f_status+1) & _FREAD) || !((out->f_status+1) & _FWRITE) ){
+		return -EBADF;
+	}
+	
+	if( !in->f_ops->read || !out->f_ops->write ){
+		return -EINVAL;
+	}
+	
+	if( in->f_ops->readpage && S_ISREG(file_inode(in)->i_mode) )
+	{
+		// a page would be written onto itself
+		if( file_inode(in) == file_inode(out) ){
+			return -EINVAL;
+		}
+		
+		off_t pos = offset ? *offset : in->f_off;
+		result = pcache_splice(in, pos, count, file_splice_actor, out);
+		if( result > 0 && offset ){
+			*offset += result;
+		} else if( result > 0 ){
+			in->f_off += result;
+		}
+		return result;
+	}
+	
+	// Pipes and devices have no offset to read at
+	if( offset != NULL ){
+		return -ESPIPE;
+	}
+	
+	if( in->f_ops == &pipe_operations ){
+		// the writer would wait for room only this read can make
+		if( out->f_ops == &pipe_operations && out->f_private == in->f_private ){
+			return -EINVAL;
+		}
+		return pipe_splice(in, count, file_splice_actor, out);
+	}
+	
+	char* buffer = (char*)kmalloc(PAGE_SIZE);
+	if( buffer == NULL ){
+		return -ENOMEM;
+	}
+	
+	// Stop after a short read, since the next one could block
+	size_t done = 0;
+	while( done < count )
+	{
+		size_t chunk = (count - done) < PAGE_SIZE ? (count - done) : PAGE_SIZE;
+		ssize_t nread = file_read(in, buffer, chunk);
+		if( nread <= 0 ){
+			result = nread;
+			break;
+		}
+		ssize_t nwritten = file_write(out, buffer, (size_t)nread);
+		if( nwritten < 0 ){
+			result = nwritten;
+			break;
+		}
+		done += (size_t)nwritten;
+		if( nwritten < nread || (size_t)nread < chunk ) break;
+	}
+	
+	kfree(buffer);
+	
+	return done ? (ssize_t)done : result;
+}
+
 off_t file_seek(struct file* file, off_t offset, int whence)
 {
 	// Just change the file offset if it is not implemented by the driver
@@ -6,6 +6,8 @@
 #include "stewieos/testfs.h"
 #include "stewieos/task.h"
 #include "stewieos/kernel.h"
+#include "stewieos/bcache.h"
+#include "stewieos/kmem_cache.h"
 #include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -14,6 +16,12 @@
 static list_t			 vfs_filesystem_list = LIST_INIT(vfs_filesystem_list);		// A list of filesystem structures (filesystem types)
 static list_t			 vfs_mount_list = LIST_INIT(vfs_mount_list);			// A list of mounts to check a device against currently
 static struct dentry		*vfs_root = NULL;						// root directory entry for the entire filesystem
+kmem_cache_t			*inode_cache = NULL;					// object cache for struct inode
+kmem_cache_t			*dentry_cache = NULL;					// object cache for struct dentry
+kmem_cache_t			*file_cache = NULL;						// object cache for struct file
+static list_t			 inode_lru = LIST_INIT(inode_lru);				// unreferenced inodes, most recently used first
+static size_t			 inode_lru_count = 0;					// number of inodes in inode_lru
+static size_t			 inode_lru_limit = INODE_CACHE_DEFAULT;		// maximum length of inode_lru
 
 // internal function prototypes
 void i_free(struct inode* inode); // free an inode with no more references
@@ -178,6 +186,10 @@ struct filesystem* get_filesystem(const char* id)
  */
 void initialize_filesystem( void )
 {
+	inode_cache = kmem_cache_create("inode", sizeof(struct inode), NULL);
+	dentry_cache = kmem_cache_create("dentry", sizeof(struct dentry), NULL);
+	file_cache = kmem_cache_create("file", sizeof(struct file), NULL);
+	
 	vfs_root = d_alloc("", NULL);
 	if( IS_ERR(vfs_root) ){
 		printk("%2Vvfs: error: unable to allocate root directory entry!\n");
@@ -518,6 +530,9 @@ int sys_mount(const char* source_name, const char* target_name, const char* file
 	
 	INIT_LIST(&super->s_inode_list);
 	INIT_LIST(&super->s_dentry_list);
+	for(int i = 0; i < INODE_HASH_SIZE; ++i){
+		INIT_LIST(&super->s_inode_hash[i]);
+	}
 	
 	// read the superblock
 	super->s_fs = filesystem;
@@ -612,6 +627,9 @@ int sys_unlink(const char* pathname)
 		path_put(&path);
 		return result;
 	}
+	
+	// The name is gone, make sure lookups don't find it in the cache
+	d_drop(path.p_dentry);
 
 	path_put(&path);
 	return 0;
@@ -667,6 +685,10 @@ int sys_umount(const char* target_name, int flags)
 		return -EBUSY;
 	}
 	
+	// Unused dentries and inodes kept in the cache still reference the superblock
+	d_prune(super);
+	i_prune(super);
+	
 	// The superblock still has the root node open, so there should be one reference
 	if( super->s_refs != 1 ){
 		return -EBUSY;
@@ -680,6 +702,9 @@ int sys_umount(const char* target_name, int flags)
 		}
 	}
 	
+	// Push anything the filesystem left in the buffer cache to disk
+	bcache_sync(super->s_dev);
+	
 	// Remove the mount from its lists
 	list_rem(&mount->m_mplink);
 	list_rem(&mount->m_globlink);
@@ -746,6 +771,9 @@ int create_file(const char* filename, mode_t mode, struct path* filepath)
 		return -EACCES;
 	}
 	
+	// Forget any cached lookup failure for this name
+	d_invalidate(dir.p_dentry, name);
+	
 	// Tell the filesystem to create the new file
 	result = dir.p_dentry->d_inode->i_ops->creat(dir.p_dentry->d_inode,\
 							name, mode,\
@@ -793,6 +821,9 @@ int sys_mknod(const char* path, mode_t mode, dev_t dev)
 		return -EPERM;
 	}
 	
+	// Forget any cached lookup failure for this name
+	d_invalidate(parent.p_dentry, basename(path));
+	
 	// All the nitty-gritty is done by the filesystem driver.
 	error = parent.p_dentry->d_inode->i_ops->mknod(parent.p_dentry->d_inode, basename(path), mode, dev);
 	
@@ -809,7 +840,12 @@ int inode_trunc(struct inode* inode)
 		return -EACCES;
 	}
 	
-	return inode->i_ops->truncate(inode);
+	int result = inode->i_ops->truncate(inode);
+	if( result == 0 ){
+		pcache_truncate(inode, inode->i_size);
+	}
+	
+	return result;
 }
 
 int sys_resfd( void )
@@ -1037,6 +1073,156 @@ off_t sys_lseek(int fd, off_t offset, int whence)
 	return file_seek(file, offset, whence);
 }
 
+/* function: sys_fsync
+ * purpose:
+ * 	write every change made to an open file through to its device
+ * parameters:
+ * 	fd - the open file descriptor
+ * return value:
+ * 	zero on success or a negative error value.
+ */
+int sys_fsync(int fd)
+{
+	if( !FD_VALID(fd) ){
+		return -EBADF;
+	}
+	
+	struct file* file = current->t_vfs.v_openvect[fd].file;
+	
+	return file_sync(file);
+}
+
+/* function: sys_sync
+ * purpose:
+ * 	write the held back changes of every mounted filesystem, and
+ * 	then every dirty buffer in the block cache, to disk.
+ */
+void sys_sync( void )
+{
+	list_t* iter;
+	struct mount* mount;
+	
+	list_for_each_entry(iter, &vfs_mount_list, struct mount, m_globlink, mount){
+		struct superblock* super = mount->m_super;
+		if( super->s_ops && super->s_ops->sync ){
+			super->s_ops->sync(super);
+		}
+	}
+	
+	bcache_sync_all();
+}
+
+/* function: sys_sendfile
+ * purpose:
+ * 	move data from one open file to another without passing it
+ * 	through user memory
+ * parameters:
+ * 	out_fd - the file descriptor to write to
+ * 	in_fd - the file descriptor to read from
+ * 	offset - where to read in_fd (updated), or NULL to use and
+ * 			advance its file offset
+ * 	count - the most bytes to move
+ * return value:
+ * 	the number of bytes moved or a negative error value.
+ */
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t* offset, size_t count)
+{
+	if( !FD_VALID(out_fd) || !FD_VALID(in_fd) ){
+		return -EBADF;
+	}
+	
+	struct file* out = current->t_vfs.v_openvect[out_fd].file;
+	struct file* in = current->t_vfs.v_openvect[in_fd].file;
+	
+	return file_splice(out, in, offset, count);
+}
+
+/* function: sys_readv
+ * purpose:
+ * 	read from an open file descriptor into several buffers
+ * parameters:
+ * 	fd - the open file descriptor
+ * 	iov - the buffers to fill, in order
+ * 	iovcnt - the number of buffers (at most IOV_MAX)
+ * return value:
+ * 	the number of bytes read or a negative error value.
+ */
+ssize_t sys_readv(int fd, const struct iovec* iov, int iovcnt)
+{
+	if( !FD_VALID(fd) ){
+		return -EBADF;
+	}
+	
+	struct file* file = current->t_vfs.v_openvect[fd].file;
+	
+	return file_readv(file, iov, iovcnt, NULL);
+}
+
+/* function: sys_writev
+ * purpose:
+ * 	write several buffers to an open file descriptor in one call
+ * parameters:
+ * 	fd - the open file descriptor
+ * 	iov - the buffers to write, in order
+ * 	iovcnt - the number of buffers (at most IOV_MAX)
+ * return value:
+ * 	the number of bytes written or a negative error value.
+ */
+ssize_t sys_writev(int fd, const struct iovec* iov, int iovcnt)
+{
+	if( !FD_VALID(fd) ){
+		return -EBADF;
+	}
+	
+	struct file* file = current->t_vfs.v_openvect[fd].file;
+	
+	return file_writev(file, iov, iovcnt, NULL);
+}
+
+/* function: sys_pread
+ * purpose:
+ * 	read from a given offset of an open file without moving its
+ * 	file offset
+ * return value:
+ * 	the number of bytes read or a negative error value.
+ */
+ssize_t sys_pread(int fd, void* buf, size_t count, off_t offset)
+{
+	if( !FD_VALID(fd) ){
+		return -EBADF;
+	}
+	if( offset < 0 ){
+		return -EINVAL;
+	}
+	
+	struct file* file = current->t_vfs.v_openvect[fd].file;
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	
+	return file_readv(file, &iov, 1, &offset);
+}
+
+/* function: sys_pwrite
+ * purpose:
+ * 	write at a given offset of an open file without moving its
+ * 	file offset
+ * return value:
+ * 	the number of bytes written or a negative error value.
+ */
+ssize_t sys_pwrite(int fd, const void* buf, size_t count, off_t offset)
+{
+	if( !FD_VALID(fd) ){
+		return -EBADF;
+	}
+	if( offset < 0 ){
+		return -EINVAL;
+	}
+	
+	struct file* file = current->t_vfs.v_openvect[fd].file;
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = count };
+	
+	return file_writev(file, &iov, 1, &offset);
+}
+
 int sys_dup(int old_fd)
 {
 	if( !FD_VALID(old_fd) ){
@@ -1109,6 +1295,8 @@ int sys_link(const char* old_path, const char* new_path)
 		return -EPERM;
 	}
 	
+	d_invalidate(newp.p_dentry, new_base);
+	
 	result = newp.p_dentry->d_inode->i_ops->link(newp.p_dentry->d_inode, new_base, oldp.p_dentry->d_inode);
 	
 	path_put(&newp);
@@ -1472,18 +1660,23 @@ struct inode* i_get(struct superblock* super, ino_t ino)
 	struct inode		*inode = NULL;			// the inode structure
 	int			 error = 0;			// the return error value
 	list_t			*iter = NULL;
+	list_t			*chain = &super->s_inode_hash[inode_hashfn(ino)];
 	
 	// check if it is already loaded
-	list_for_each(iter, &super->s_inode_list)
+	list_for_each_entry(iter, chain, struct inode, i_hash, inode)
 	{
-		inode = list_entry(iter, struct inode, i_sblink);
 		if( inode->i_ino == ino ){
+			// Revive an unused inode from the cache
+			if( inode->i_ref == 0 ){
+				list_rem(&inode->i_lru);
+				inode_lru_count--;
+			}
 			return i_getref(inode);
 		}
 	}
 	
 	// allocate the inode structure and clear its contents
-	inode = (struct inode*)kmalloc(sizeof(struct inode));
+	inode = (struct inode*)kmem_cache_alloc(inode_cache);
 	memset(inode, 0, sizeof(struct inode));
 	
 	// fill in the information we know
@@ -1491,7 +1684,10 @@ struct inode* i_get(struct superblock* super, ino_t ino)
 	inode->i_super = super_get(super);
 	inode->i_ref = 1;
 	INIT_LIST(&inode->i_sblink);
+	INIT_LIST(&inode->i_hash);
+	INIT_LIST(&inode->i_lru);
 	INIT_LIST(&inode->i_dentries);
+	INIT_LIST(&inode->i_pages.pages);
 	
 	// ask the filesystem for the inode
 	error = super->s_ops->read_inode(super, inode);
@@ -1499,12 +1695,13 @@ struct inode* i_get(struct superblock* super, ino_t ino)
 	// check if the filesystem had an error
 	if( error != 0 )
 	{
-		kfree(inode);
+		kmem_cache_free(inode_cache, inode);
 		return ERR_PTR(error);
 	}
 	
-	// add it to the superblock list
+	// add it to the superblock list and hash
 	list_add(&inode->i_sblink, &super->s_inode_list);
+	list_add(&inode->i_hash, chain);
 	
 	return inode;
 }
@@ -1540,12 +1737,18 @@ struct inode* i_getref(struct inode* inode)
  */
 void i_free(struct inode* inode)
 {
+	pcache_release(inode);
 	if( inode->i_super->s_ops->put_inode ){
 		inode->i_super->s_ops->put_inode(inode->i_super, inode);
 	}
 	list_rem(&inode->i_sblink);
+	list_rem(&inode->i_hash);
+	if( list_inserted(&inode->i_lru) ){
+		list_rem(&inode->i_lru);
+		inode_lru_count--;
+	}
 	super_put(inode->i_super);
-	kfree(inode);
+	kmem_cache_free(inode_cache, inode);
 }
 
 /*
@@ -1553,20 +1756,77 @@ void i_free(struct inode* inode)
  * description:
  * 		decrements the reference count of the inode.
  * 		if the inode is at a reference count of 1
- * 		upon entering the function, i_put will also
- * 		free the inode (using i_free).
+ * 		upon entering the function, it is moved to the
+ * 		unused inode list so a later i_get can find it
+ * 		again. The least recently used inodes beyond the
+ * 		cache limit are freed (using i_free).
  * parameters:
  * 		inode: pointer to the inode you no longer need
  * return value:
  * 		none.
  * notes:
- *
+ * 		Inodes with no links left are freed immediately so
+ * 		the filesystem can release their data.
  */
 void i_put(struct inode* inode)
 {
-	if( inode->i_ref == 1 ){
+	if( inode->i_ref != 1 ){
+		inode->i_ref--;
+		return;
+	}
+	
+	if( inode->i_nlinks == 0 || inode_lru_limit == 0 ){
 		i_free(inode);
 		return;
 	}
-	inode->i_ref--;
+	
+	inode->i_ref = 0;
+	list_add(&inode->i_lru, &inode_lru);
+	inode_lru_count++;
+	
+	// Trim the cache back down to size
+	while( inode_lru_count > inode_lru_limit ){
+		i_free(list_entry(list_last(&inode_lru), struct inode, i_lru));
+	}
+}
+
+/*
+ * function: i_prune
+ * description:
+ * 		free every unused inode cached for a superblock.
+ * 		This is needed before a superblock can be released.
+ * parameters:
+ * 		super: the superblock to prune
+ * return value:
+ * 		none.
+ */
+void i_prune(struct superblock* super)
+{
+	list_t* iter = list_first(&inode_lru);
+	while( iter != &inode_lru ){
+		struct inode* inode = list_entry(iter, struct inode, i_lru);
+		iter = iter->next;
+		if( inode->i_super == super ){
+			i_free(inode);
+		}
+	}
+}
+
+/*
+ * function: i_set_cache_limit
+ * description:
+ * 		change the number of unused inodes kept in memory.
+ * 		Zero disables the cache. Inodes beyond the new limit
+ * 		are freed immediately.
+ * parameters:
+ * 		count: the new limit
+ * return value:
+ * 		none.
+ */
+void i_set_cache_limit(size_t count)
+{
+	inode_lru_limit = count;
+	while( inode_lru_count > inode_lru_limit ){
+		i_free(list_entry(list_last(&inode_lru), struct inode, i_lru));
+	}
 }
\ No newline at end of file
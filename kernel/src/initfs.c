@@ -6,6 +6,7 @@
 #include <sys/fcntl.h>
 #include "stewieos/error.h"
 #include "stewieos/dentry.h"
+#include "stewieos/paging.h"
 
 // inode operations
 int initfs_inode_lookup(struct inode* inode, struct dentry* dentry);
@@ -15,6 +16,7 @@ int initfs_inode_node_unlink(struct inode* parent, struct dentry* name);
 int initfs_file_open(struct file* file, struct dentry* dentry, int flags);
 int initfs_file_close(struct file* file, struct dentry* dentry);
 ssize_t initfs_file_read(struct file* file, char* buffer, size_t count);
+int initfs_file_readpage(struct file* file, off_t offset, char* page);
 //int initfs_file_readdir(struct file* file, struct dirent* dirent);
 off_t initfs_file_lseek(struct file* file, off_t offset, int whence);
 int initfs_file_ioctl(struct file* file, int cmd, char* argp);
@@ -51,6 +53,7 @@ struct file_operations initfs_file_ops = {
 	.open = initfs_file_open,
 	.close = initfs_file_close,
 	.read = initfs_file_read,
+	.readpage = initfs_file_readpage,
 //	.lseek = initfs_file_lseek,
 //	.fstat = initfs_file_lstat,
 //	.ioctl = initfs_file_ioctl
@@ -316,6 +319,25 @@ ssize_t initfs_file_read(struct file* file, char* buffer, size_t count)
 	return count;
 }
 
+int initfs_file_readpage(struct file* file, off_t offset, char* page)
+{
+	multiboot_module_t* module = (multiboot_module_t*)(file->f_private);
+	u32 size = module->mod_end - module->mod_start;
+	u32 count = PAGE_SIZE;
+	
+	// the rest of the page was zeroed by the caller
+	if( (u32)offset >= size ){
+		return 0;
+	}
+	if( size - (u32)offset < count ){
+		count = size - (u32)offset;
+	}
+	
+	memcpy(page, (void*)( module->mod_start + (u32)offset ), count);
+	
+	return (int)count;
+}
+
 //int initfs_file_readdir(struct file* file, struct dirent* dirent);
 //off_t initfs_file_lseek(struct file* file, off_t offset, int whence);
 //int initfs_file_ioctl(struct file* file, int cmd, char* argp);
@@ -0,0 +1,42 @@
+#include "stewieos/kdata.h"
+#include "stewieos/paging.h"
+
+// The page itself lives in the kernel image, where the kernel can write it.
+// It fills a whole page so nothing else in the image becomes visible.
+static union
+{
+	kdata_t		data;
+	char		page[PAGE_SIZE];
+} kdata_page ATTR((aligned(PAGE_SIZE))) = {
+	.data = { .k_version = KDATA_VERSION },
+};
+
+void kdata_init( void )
+{
+	u32 phys = (u32)&kdata_page - KERNEL_VIRTUAL_BASE;
+
+	// Readable from user mode, never writable through this mapping
+	map_page(kerndir, (void*)KDATA_ADDR, phys, 1, 0);
+}
+
+void kdata_timer(tick_t tick, time_t time, unsigned int freq)
+{
+	kdata_t* kdata = &kdata_page.data;
+
+	kdata->k_seq++;
+	asm volatile("" ::: "memory");
+	if( kdata->k_time != time ){
+		kdata->k_time = time;
+		kdata->k_time_tick = tick;
+	}
+	kdata->k_tick = tick;
+	kdata->k_freq = freq;
+	asm volatile("" ::: "memory");
+	kdata->k_seq++;
+}
+
+void kdata_switch(pid_t pid)
+{
+	// A single word; readers need not check the sequence for it
+	kdata_page.data.k_pid = pid;
+}
@@ -21,7 +21,12 @@ void heap_init(heap_t* heap, void* start, void* end)
 	heap->memend = start;
 	heap->memmax = end;
 	spin_init(&heap->lock);
-	INIT_LIST(&heap->holes);
+	for(u32 i = 0; i < KHEAP_NBINS; ++i){
+		INIT_LIST(&heap->bins[i]);
+	}
+	heap->binmap = 0;
+	heap->nholes = 0;
+	heap->free = 0;
 
 	// This will expand by the minimum amount (PAGE_SIZE, likely)
 	heap_expand(heap, 1);
@@ -65,8 +70,8 @@ header_t* heap_expand(heap_t* heap, size_t ammnt)
 	}
 
 	// We can only go to memmax
-	if( ((size_t)heap->memstart + ammnt) > (size_t)heap->memmax ){
-		ammnt = (size_t)heap->memmax - (size_t)heap->memstart;
+	if( ((size_t)heap->memend + ammnt) > (size_t)heap->memmax ){
+		ammnt = (size_t)heap->memmax - (size_t)heap->memend;
 	}
 
 	// Allocate the amount memory we need, in pages (possible extra)
@@ -109,44 +114,68 @@ header_t* heap_expand(heap_t* heap, size_t ammnt)
 
 }
 
-// Locate a free block to hold the specified size
-header_t* heap_locate(heap_t* heap, size_t reqd, int align)
+// Search the bins for a hole which can hold `reqd` bytes. Bins are
+// sorted by size, so the first hole which fits is the best fit. The
+// bin holding `reqd` may only partially fit, but every hole in a
+// larger bin does, so the search only ever walks one bin unless an
+// aligned request can't be split out of the holes it finds.
+static header_t* heap_search(heap_t* heap, size_t reqd, int align)
 {
-	list_t* item;
-	header_t* head;
-	list_for_each_entry(item, &heap->holes, header_t, link, head) {
-		// Check for broken blocks
-		if( head->magic != KHEAP_MAGIC || heap_foot(head)->magic != KHEAP_MAGIC ){
-			syslog(KERN_ERR, "heap: memory corruption at %p", head);
-			list_rem(item);
-			return heap_locate(heap, reqd, align);
-		}
-		// Big enough?
-		if( head->size >= (reqd + KHEAP_OVHD) ){
+	size_t need = reqd + KHEAP_OVHD;
+	u32 bin = heap_bin_index(need);
+	u32 map = heap->binmap & ~((1u << bin) - 1);
+
+	while( map != 0 )
+	{
+		bin = (u32)__builtin_ctz(map);
+		map &= ~(1u << bin);
+
+		list_t* item = list_first(&heap->bins[bin]);
+		while( item != &heap->bins[bin] )
+		{
+			header_t* head = list_entry(item, header_t, link);
+			item = item->next;
+			// Check for broken blocks
+			if( head->magic != KHEAP_MAGIC || heap_foot(head)->magic != KHEAP_MAGIC ){
+				syslog(KERN_ERR, "heap: memory corruption at %p", head);
+				// The size can't be trusted, so don't account for it
+				list_rem(&head->link);
+				heap->nholes--;
+				if( list_empty(&heap->bins[bin]) ){
+					heap->binmap &= ~(1u << bin);
+				}
+				continue;
+			}
+			// Big enough?
+			if( head->size < need ){
+				continue;
+			}
 			// attempt to align/trim
 			header_t* temp = heap_trim(heap, head, reqd, align);
 			// unsuccessfull -> couldn't align, keep looking
-			if( temp == NULL ){
-				//item = &heap->holes;
-				continue;
-			} else {
+			if( temp != NULL ){
 				return temp;
 			}
+			// heap_trim leaves the bins untouched on failure, so we
+			// can keep walking this one.
 		}
 	}
 
-	// Try and aquire more memory
-	head = heap_expand(heap, reqd+KHEAP_OVHD);
-	if( head == NULL || head->size < (reqd + KHEAP_OVHD) ){
-		return NULL;
-	}
+	return NULL;
+}
 
-	return heap_locate(heap, reqd, align);
+// Locate a free block to hold the specified size
+header_t* heap_locate(heap_t* heap, size_t reqd, int align)
+{
+	header_t* head;
 
-	// Attempt to trim
-	head = heap_trim(heap, head, reqd, align);
-	if( head == NULL ){
-		return NULL;
+	while( (head = heap_search(heap, reqd, align)) == NULL )
+	{
+		// Try and aquire more memory (aligned requests may need an extra page to split)
+		head = heap_expand(heap, reqd + KHEAP_OVHD + (align ? PAGE_SIZE : 0));
+		if( head == NULL ){
+			return NULL;
+		}
 	}
 
 	return head;
@@ -187,7 +216,7 @@ header_t* heap_trim(heap_t* heap, header_t* head, size_t reqd, int align)
 		// heap_foot(temp)->header = temp;
 
 		// Resize and remove the header
-		list_rem(&head->link);
+		heap_rem_hole(heap, head);
 		head_init(head, (size_t)temp - (size_t)head);
 		// head->size = ((size_t)temp - (size_t)head);
 		// heap_foot(head)->magic = KHEAP_MAGIC;
@@ -218,7 +247,7 @@ header_t* heap_trim(heap_t* heap, header_t* head, size_t reqd, int align)
 	// heap_foot(temp)->header = temp;
 
 	// Trim the block
-	list_rem(&head->link);
+	heap_rem_hole(heap, head);
 	head_init(head, reqd + KHEAP_OVHD);
 	// head->size = reqd + KHEAP_OVHD;
 	// heap_foot(head)->magic = KHEAP_MAGIC;
@@ -241,12 +270,13 @@ void* heap_alloc(heap_t* heap, size_t reqd, int align)
 	// Find a block big enough for us that is aligned
 	header_t* head = heap_locate(heap, reqd, align);
 	if( head == NULL ){
+		spin_unlock(&heap->lock);
 		syslog(KERN_PANIC, "out of memory!");
 		return NULL;
 	}
 
 	// Remove from the hole list
-	list_rem(&head->link);
+	heap_rem_hole(heap, head);
 
 	// Unlock the heap
 	spin_unlock(&heap->lock);
@@ -276,7 +306,7 @@ void heap_free_nolock(heap_t* heap, void* addr)
 	{
 		//syslog(KERN_WARN, "merging backwards");
 		header_t* prev = head_prev(head);
-		list_rem(&prev->link);
+		heap_rem_hole(heap, prev);
 		head_init(prev, prev->size + head->size);
 		head = prev;
 	}
@@ -286,7 +316,7 @@ void heap_free_nolock(heap_t* heap, void* addr)
 	{
 		//syslog(KERN_WARN, "merging forwards");
 		header_t* next = head_next(head);
-		list_rem(&next->link);
+		heap_rem_hole(heap, next);
 		head_init(head, head->size + next->size);
 	}
 
@@ -340,4 +370,28 @@ int heap_compare_headers(list_t* v1, list_t* v2)
 	if( list_entry(v1, header_t, link)->size < list_entry(v2, header_t, link)->size ) return -1;
 	else if( list_entry(v1, header_t, link)->size == list_entry(v2, header_t, link)->size ) return 0;
 	else return 1;
-}
\ No newline at end of file
+}
+
+void heap_stat(heap_t* heap, heap_stat_t* stat)
+{
+	spin_lock(&heap->lock);
+
+	stat->size = (size_t)heap->memend - (size_t)heap->memstart;
+	stat->free = heap->free;
+	stat->nholes = heap->nholes;
+	stat->largest = 0;
+
+	// The largest hole is at the end of the highest non-empty bin
+	if( heap->binmap != 0 ){
+		u32 bin = heap_bin_index(heap->binmap);
+		stat->largest = list_entry(list_last(&heap->bins[bin]), header_t, link)->size;
+	}
+
+	spin_unlock(&heap->lock);
+
+	if( stat->free == 0 ){
+		stat->fragmentation = 0;
+	} else {
+		stat->fragmentation = (u32)(100 - (u32)(((unsigned long long)stat->largest * 100) / stat->free));
+	}
+}
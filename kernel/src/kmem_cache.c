@@ -0,0 +1,250 @@
+#include "stewieos/kmem_cache.h"
+#include "stewieos/kheap.h"
+#include "stewieos/kmem.h"
+#include "stewieos/paging.h"
+#include "stewieos/error.h"
+
+/* Each object slot is preceded by a bufctl pointing back at its slab.
+ * Free slots are chained through the bufctl, so the object itself keeps
+ * its constructed state while it sits in the cache.
+ */
+typedef struct _kmem_bufctl
+{
+	struct _kmem_slab*		slab;		// slab holding this slot
+	struct _kmem_bufctl*	next;		// next free slot in the slab
+} kmem_bufctl_t;
+
+typedef struct _kmem_slab
+{
+	list_t				link;		// link in the cache partial/full/empty list
+	kmem_cache_t*		cache;		// owning cache
+	u32					inuse;		// objects allocated from this slab
+	kmem_bufctl_t*		free;		// free slots
+} kmem_slab_t;
+
+#define kmem_slot(slab, cache, i) ((kmem_bufctl_t*)( (u32)(slab) + sizeof(kmem_slab_t) + (i)*(cache)->slotsize ))
+#define kmem_object(ctl) ((void*)( (u32)(ctl) + sizeof(kmem_bufctl_t) ))
+#define kmem_bufctl(obj) ((kmem_bufctl_t*)( (u32)(obj) - sizeof(kmem_bufctl_t) ))
+
+static list_t kmem_cache_list = LIST_INIT(kmem_cache_list);
+static spinlock_t kmem_cache_list_lock;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, kmem_ctor_t ctor)
+{
+	kmem_cache_t* cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+	if( cache == NULL ){
+		return NULL;
+	}
+
+	memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->objsize = size;
+	cache->slotsize = (sizeof(kmem_bufctl_t) + size + 7) & ~((size_t)7);
+	cache->ctor = ctor;
+
+	// Slabs (with the heap's own header and footer) are whole pages
+	// holding at least KMEM_SLAB_MIN_OBJECTS
+	cache->slabsize = sizeof(kmem_slab_t) + cache->slotsize*KMEM_SLAB_MIN_OBJECTS + KHEAP_OVHD;
+	if( PAGE_OFFSET(cache->slabsize) != 0 ){
+		cache->slabsize = PAGE_ALIGN(cache->slabsize) + PAGE_SIZE;
+	}
+	cache->slabsize -= KHEAP_OVHD;
+	cache->perslab = (u32)((cache->slabsize - sizeof(kmem_slab_t)) / cache->slotsize);
+
+	INIT_LIST(&cache->partial);
+	INIT_LIST(&cache->full);
+	INIT_LIST(&cache->empty);
+	INIT_LIST(&cache->link);
+	spin_init(&cache->lock);
+
+	u32 eflags = disablei();
+	spin_lock(&kmem_cache_list_lock);
+	list_add(&cache->link, &kmem_cache_list);
+	spin_unlock(&kmem_cache_list_lock);
+	restore(eflags);
+
+	return cache;
+}
+
+// Allocate and carve up a new slab. Called without the cache lock,
+// since the constructor may allocate memory itself.
+static kmem_slab_t* kmem_slab_create(kmem_cache_t* cache)
+{
+	kmem_slab_t* slab = (kmem_slab_t*)heap_alloc(&kernel_heap, cache->slabsize, 0);
+	if( slab == NULL ){
+		return NULL;
+	}
+
+	INIT_LIST(&slab->link);
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+
+	// Build the free list back to front so objects are handed out in
+	// address order
+	for(u32 i = cache->perslab; i > 0; --i){
+		kmem_bufctl_t* ctl = kmem_slot(slab, cache, i-1);
+		ctl->slab = slab;
+		ctl->next = slab->free;
+		slab->free = ctl;
+		if( cache->ctor ){
+			cache->ctor(kmem_object(ctl));
+		}
+	}
+
+	return slab;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+	kmem_slab_t* slab = NULL;
+	u32 eflags = disablei();
+	spin_lock(&cache->lock);
+
+	if( !list_empty(&cache->partial) ){
+		slab = list_entry(list_first(&cache->partial), kmem_slab_t, link);
+	} else if( !list_empty(&cache->empty) ){
+		slab = list_entry(list_first(&cache->empty), kmem_slab_t, link);
+		cache->nempty--;
+	} else {
+		spin_unlock(&cache->lock);
+		restore(eflags);
+
+		kmem_slab_t* fresh = kmem_slab_create(cache);
+		if( fresh == NULL ){
+			return NULL;
+		}
+
+		eflags = disablei();
+		spin_lock(&cache->lock);
+		cache->nslabs++;
+		slab = fresh;
+	}
+
+	kmem_bufctl_t* ctl = slab->free;
+	slab->free = ctl->next;
+	slab->inuse++;
+
+	// Move the slab to the list matching its new state
+	list_rem(&slab->link);
+	if( slab->free == NULL ){
+		list_add(&slab->link, &cache->full);
+	} else {
+		list_add(&slab->link, &cache->partial);
+	}
+
+	cache->nactive++;
+	cache->nallocs++;
+
+	spin_unlock(&cache->lock);
+	restore(eflags);
+
+	return kmem_object(ctl);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object)
+{
+	kmem_slab_t* release = NULL;
+
+	if( object == NULL ){
+		return;
+	}
+
+	kmem_bufctl_t* ctl = kmem_bufctl(object);
+	kmem_slab_t* slab = ctl->slab;
+
+	if( slab == NULL || slab->cache != cache ){
+		syslog(KERN_ERR, "kmem_cache: %s: freeing foreign object %p", cache->name, object);
+		return;
+	}
+
+	u32 eflags = disablei();
+	spin_lock(&cache->lock);
+
+	ctl->next = slab->free;
+	slab->free = ctl;
+	slab->inuse--;
+
+	list_rem(&slab->link);
+	if( slab->inuse == 0 ){
+		// Keep a few free slabs around, return the rest to the heap
+		if( cache->nempty < KMEM_CACHE_MAX_EMPTY ){
+			list_add(&slab->link, &cache->empty);
+			cache->nempty++;
+		} else {
+			cache->nslabs--;
+			release = slab;
+		}
+	} else {
+		list_add(&slab->link, &cache->partial);
+	}
+
+	cache->nactive--;
+	cache->nfrees++;
+
+	spin_unlock(&cache->lock);
+	restore(eflags);
+
+	if( release ){
+		heap_free(&kernel_heap, release);
+	}
+}
+
+void kmem_cache_shrink(kmem_cache_t* cache)
+{
+	list_t empty;
+	INIT_LIST(&empty);
+
+	u32 eflags = disablei();
+	spin_lock(&cache->lock);
+
+	// Move the free slabs aside so they can be released unlocked
+	while( !list_empty(&cache->empty) ){
+		list_t* item = list_first(&cache->empty);
+		list_rem(item);
+		list_add(item, &empty);
+		cache->nslabs--;
+	}
+	cache->nempty = 0;
+
+	spin_unlock(&cache->lock);
+	restore(eflags);
+
+	while( !list_empty(&empty) ){
+		kmem_slab_t* slab = list_entry(list_first(&empty), kmem_slab_t, link);
+		list_rem(&slab->link);
+		heap_free(&kernel_heap, slab);
+	}
+}
+
+void kmem_cache_reap( void )
+{
+	list_t* item;
+	kmem_cache_t* cache;
+
+	u32 eflags = disablei();
+	spin_lock(&kmem_cache_list_lock);
+	list_for_each_entry(item, &kmem_cache_list, kmem_cache_t, link, cache){
+		kmem_cache_shrink(cache);
+	}
+	spin_unlock(&kmem_cache_list_lock);
+	restore(eflags);
+}
+
+int kmem_cache_destroy(kmem_cache_t* cache)
+{
+	if( cache->nactive != 0 ){
+		return -EBUSY;
+	}
+
+	u32 eflags = disablei();
+	spin_lock(&kmem_cache_list_lock);
+	list_rem(&cache->link);
+	spin_unlock(&kmem_cache_list_lock);
+	restore(eflags);
+
+	kmem_cache_shrink(cache);
+	kfree(cache);
+
+	return 0;
+}
@@ -29,6 +29,8 @@
 #include "acpi/acpi.h"
 #include "stewieos/shebang.h"
 #include "stewieos/event.h"
+#include "stewieos/bcache.h"
+#include "stewieos/kdata.h"
 
 int initfs_install(multiboot_info_t* mb);
 
@@ -50,6 +52,9 @@ int kmain( multiboot_info_t* mb )
 	// initialize the page tables and enable paging
 	printk("Initializing paging... \n");
 	init_paging(mb);
+	
+	// Share the kernel data page with every task created from here on
+	kdata_init();
 
 	// Grab the CPU Vendor String
 	// This isn't useful, but it is interesting, I guess...
@@ -69,6 +74,12 @@ int kmain( multiboot_info_t* mb )
 	printk("Initializing event subsystem...\n");
 	event_init();
 	
+	printk("Initializing block buffer cache...\n");
+	bcache_init();
+	
+	printk("Initializing page cache...\n");
+	pcache_init();
+	
 	printk("Initializing PS/2 Layer...\n");
 	ps2_init();
 	
@@ -0,0 +1,39 @@
+#include "stewieos/memctl.h"
+#include "stewieos/pmm.h"
+#include "stewieos/kheap.h"
+#include "stewieos/bcache.h"
+#include "stewieos/fs.h"
+#include "stewieos/dentry.h"
+#include "stewieos/error.h"
+
+int sys_memctl(int cmd, void* arg)
+{
+	switch( cmd )
+	{
+		case MEMCTL_FRAME_STAT:
+			if( arg == NULL ) return -EFAULT;
+			frame_stat((pmm_stat_t*)arg);
+			return 0;
+		case MEMCTL_HEAP_STAT:
+			if( arg == NULL ) return -EFAULT;
+			heap_stat(&kernel_heap, (heap_stat_t*)arg);
+			return 0;
+		case MEMCTL_BCACHE_STAT:
+			if( arg == NULL ) return -EFAULT;
+			bcache_stat((bcache_stat_t*)arg);
+			return 0;
+		case MEMCTL_BCACHE_CAPACITY:
+			// the cache needs a few buffers to make any progress
+			if( (size_t)arg < BCACHE_MAX_RUN ) return -EINVAL;
+			bcache_set_capacity((size_t)arg);
+			return 0;
+		case MEMCTL_INODE_LIMIT:
+			i_set_cache_limit((size_t)arg);
+			return 0;
+		case MEMCTL_DENTRY_LIMIT:
+			d_set_cache_limit((size_t)arg);
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
@@ -2,6 +2,40 @@
 #include "stewieos/spinlock.h"
 #include "stewieos/linkedlist.h"
 #include "stewieos/error.h"
+#include "stewieos/kmem_cache.h"
+
+static kmem_cache_t* message_cache = NULL; // containers for messages up to MESG_CACHE_LENGTH
+
+void message_init( void )
+{
+	message_cache = kmem_cache_create("message", sizeof(message_container_t) + MESG_CACHE_LENGTH, NULL);
+}
+
+message_container_t* message_alloc(size_t length)
+{
+	message_container_t* container;
+	
+	if( length <= MESG_CACHE_LENGTH ){
+		container = (message_container_t*)kmem_cache_alloc(message_cache);
+	} else {
+		container = (message_container_t*)kmalloc(sizeof(message_container_t) + length);
+	}
+	
+	if( container != NULL ){
+		container->message.length = length;
+	}
+	
+	return container;
+}
+
+void message_free(message_container_t* container)
+{
+	if( container->message.length <= MESG_CACHE_LENGTH ){
+		kmem_cache_free(message_cache, container);
+	} else {
+		kfree(container);
+	}
+}
 
 int sys_message_send(pid_t pid, unsigned int type, const char* what, size_t length)
 {
@@ -17,7 +51,7 @@ int sys_message_send(pid_t pid, unsigned int type, const char* what, size_t leng
 	}
 	
 	// allocate a new message and container
-	message_container_t* container = (message_container_t*)kmalloc(sizeof(message_container_t) + length);
+	message_container_t* container = message_alloc(length);
 	if( container == NULL ){
 		return -ENOMEM;
 	}
@@ -75,7 +109,7 @@ int sys_message_pop(message_t* message, unsigned int id, unsigned int flags)
 			// Remove the message unless told otherwise
 			if( !(flags & MESG_POP_LEAVE) ){
 				list_rem(&container->link);
-				kfree(container);
+				message_free(container);
 			}
 			// unlock the queue
 			spin_unlock(&current->t_mesgq.lock);
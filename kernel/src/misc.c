@@ -26,4 +26,8 @@ u32 cpuid_string(int code, char* s)
 	u32 max_code = 0;
 	asm volatile("cpuid":"=a"(max_code), "=b"(*((u32*)(s+0))), "=d"(*((u32*)(s+4))), "=c"(*((u32*)(s+8))):"a"(code));
 	return max_code;
+}
+void wrmsr(u32 msr, u32 lo, u32 hi)
+{
+	asm volatile("wrmsr"::"c"(msr),"a"(lo),"d"(hi));
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "elf/elf32.h"
 #include "stewieos/task.h"
 #include "stewieos/error.h"
+#include "stewieos/vm.h"
+#include "stewieos/pcache.h"
 
 page_dir_t* kerndir = NULL;
 page_dir_t* curdir = NULL;
@@ -13,6 +15,12 @@ extern u32 placement_address;
 
 void initial_switch_dir(void* cr3);
 
+// Reload CR3, flushing every non-global TLB entry
+static inline void flush_tlb(void)
+{
+	asm volatile("movl %%cr3,%%eax; movl %%eax,%%cr3" : : : "eax", "memory");
+}
+
 /* function: init_paging
  * parameters:
  * 	none.
@@ -56,8 +64,10 @@ void init_paging( multiboot_info_t* mb )
 	}
 	
 	physical_frame_count = memory_size / 0x1000; // number of frames
-	physical_frame = kmalloc((size_t)(physical_frame_count / 8));
-	memset(physical_frame, (int)0xFFFFFFFF, physical_frame_count/8);
+	physical_frame = kmalloc((size_t)((physical_frame_count+31) / 32) * 4);
+	memset(physical_frame, (int)0xFFFFFFFF, ((physical_frame_count+31) / 32) * 4);
+	init_frame_refs();
+	init_frame_buddy();
 	
 	if( !(mb->flags & MULTIBOOT_INFO_MEM_MAP) ) {
 		printk("\nerror: no memory map included from the bootloader! Unable to boot...\n");
@@ -91,6 +101,10 @@ void init_paging( multiboot_info_t* mb )
 	for( u32 a = 0xD0000000; a < 0xF0000000; a += 0x1000 ){
 		get_page((void*)a, 1, kerndir);
 	}
+	// and for the page cache window, so it is shared by every directory
+	for( u32 a = PCACHE_BASE; a < PCACHE_BASE + PCACHE_PAGES*0x1000; a += 0x1000 ){
+		get_page((void*)a, 1, kerndir);
+	}
 	
 	u32 i = KERNEL_VIRTUAL_BASE;
 	while( i < placement_address )
@@ -100,8 +114,8 @@ void init_paging( multiboot_info_t* mb )
 		page_t* page_low = get_page((void*)(i-KERNEL_VIRTUAL_BASE), 1, kerndir);
 		reserve_frame(ADDR_TO_FRAME(i-KERNEL_VIRTUAL_BASE));
 		page_hi->present = 1;
-		page_hi->user = 1;
-		page_hi->rw = 0;
+		page_hi->user = 0;
+		page_hi->rw = 1;
 		page_hi->frame = ((i-KERNEL_VIRTUAL_BASE) / 0x1000) & 0x000FFFFF;
 		memcpy(page_low, page_hi, sizeof(page_t));
 		i+=0x1000;
@@ -113,12 +127,22 @@ void init_paging( multiboot_info_t* mb )
 	// 	alloc_frame(page, 0, 1);
 	// }
 	
+	// Everything reserved at boot is known, so build the buddy free lists
+	fill_frame_buddy();
+	
 	register_interrupt(0xE, page_fault);
 	 
 	//switch_page_dir(curdir);
 	
 	initial_switch_dir((void*)curdir->phys);
 	
+	// Enable supervisor write protection. Copy-on-write relies on the
+	// kernel faulting when it writes to a shared user frame as well.
+	u32 cr0;
+	asm volatile("mov %%cr0,%0" : "=r"(cr0));
+	cr0 |= 0x00010000;
+	asm volatile("mov %0,%%cr0" : : "r"(cr0) : "memory");
+	
 // 	for( u32 a = 0x00100000; a < KERNEL_VIRTUAL_BASE; a += 0x1000){
 // 		u32 dir_idx = (a >> 22) & 0x3FF;
 		
@@ -148,7 +172,7 @@ void init_paging( multiboot_info_t* mb )
  * 	user		- should this page be marked as user?
  * 	rw		- Should this page be read/write?
  * returns:
- * 	0 on success or a negative error value.
+ * 	0 on success or -ENOMEM if no page table or frame is left.
  * description:
  * 	allocates a new physical page to the virtual address.
  * 	If there is already a page allocated to the address,
@@ -161,16 +185,22 @@ int alloc_page(page_dir_t* dir, void* addr, int user, int rw)
 	}
 	
 	page_t* page = get_page(addr, 1, dir);
+	if( page == NULL ){
+		return -ENOMEM;
+	}
 
 	if( page->present != 0 ){
+		// Writable mappings of a shared frame need their own copy first
+		if( page->cow && rw > 0 ){
+			page_resolve_cow(dir, addr);
+		}
+		page->cow = 0;
 		page->rw = (rw > 0);
 		page->user = (user > 0);
 		return 0;
 	}
 	
-	alloc_frame(page, user, rw);
-	
-	return 0;
+	return try_alloc_frame(page, user, rw);
 }
 
 /* function: get_page
@@ -204,6 +234,9 @@ page_t* get_page(void* vpaddress, int make, page_dir_t* dir)
 	{
 		u32 tmp;
 		dir->table[dir_idx] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &tmp);
+		if( dir->table[dir_idx] == NULL ){
+			return NULL;
+		}
 		memset((void*)dir->table[dir_idx], 0, sizeof(page_table_t));
 		dir->tablePhys[dir_idx] = (u32)(tmp | 0x7); // The address + PRESENT, RW, US
 		return &dir->table[dir_idx]->page[tbl_idx];
@@ -273,6 +306,10 @@ void* temporary_map(u32 addr, page_dir_t* dir)
 	
 	// grab the source page frame address
 	page_t* src_page = &dir->table[tbl]->page[pge];
+	// we are about to write through this mapping, so it can't be shared
+	if( src_page->cow ){
+		page_resolve_cow(dir, (void*)addr);
+	}
 	// grab the destination page frame (calculate table, and page on the fly)
 	// this is always the same page. We are just remapping it.
 	page_t* dst_page = &curdir->table[(0xFFFFF000>>22)&0x3ff]->page[(0xFFFFF000>>12)&0x3ff];
@@ -364,6 +401,16 @@ void page_fault(struct regs* regs)
 		return;
 	}
 
+	// First touch of a demand paged area (e.g. an executable segment)
+	if( !present && current && vm_fault(current, address) == 0 ){
+		return;
+	}
+
+	// Write to a frame shared by fork. Give this task its own copy.
+	if( present && ro && page_resolve_cow(curdir, (void*)address) == 0 ){
+		return;
+	}
+
 	syslog(KERN_ERR, "process[%d]: SEGFAULT: addr %p ip %p sp %p flags (%s%s on %s in %s).",
 		pid, address, regs->eip, regs->esp, 
 		present ? "protected" : "not-present",
@@ -401,6 +448,47 @@ void page_fault(struct regs* regs)
 	while(1) asm volatile("hlt");
 }
 
+/* function: page_resolve_cow
+ * parameters:
+ * 	dir	- the directory containing the page
+ * 	virt	- the faulting virtual address
+ * returns:
+ * 	0 on success or -EFAULT if the page is not copy-on-write.
+ * description:
+ * 	Breaks the sharing of a copy-on-write page. If this is the
+ * 	last reference to the frame, it is simply made writable again.
+ * 	Otherwise a new frame is allocated and only this page is copied.
+ */
+int page_resolve_cow(page_dir_t* dir, void* virt)
+{
+	page_t* page = get_page(virt, 0, dir);
+	if( page == NULL || !page->present || !page->cow ){
+		return -EFAULT;
+	}
+	
+	u32 eflags = disablei();
+	
+	if( frame_refcount(page->frame) > 1 )
+	{
+		page_t copy;
+		memset(&copy, 0, sizeof(copy));
+		alloc_frame(&copy, page->user, 1);
+		copy_physical_frame((u32)(copy.frame << 12), (u32)(page->frame << 12));
+		// drop our reference to the shared frame
+		free_frame(page);
+		*page = copy;
+	}
+	
+	page->rw = 1;
+	page->cow = 0;
+	
+	invalidate_page((u32*)PAGE_ALIGN((u32)virt));
+	
+	restore(eflags);
+	
+	return 0;
+}
+
 /*
  * function: copy_page_table
  * parameters:
@@ -412,6 +500,11 @@ void page_fault(struct regs* regs)
  * description:
  * 	This function copies a table and its contents over into a new directory
  * 	The new table has the saame content and permissions as the old table.
+ * 	User frames are shared copy-on-write rather than copied. Writable pages
+ * 	become read-only in both directories until page_fault resolves them.
+ * 	Pages of MAP_SHARED file mappings stay writable and shared.
+ * 	Only the kernel stack (and anything above it) is copied immediately,
+ * 	since we can't take a page fault on our own stack.
  * 
  * 	If the table in dstdir does not exist, this function will create it.
  */
@@ -443,6 +536,21 @@ int copy_page_table(page_dir_t* dstdir, page_dir_t* srcdir, int t)
 		if( !src->present ){
 			continue; // ignore this page
 		}
+		// Shared file mappings keep sharing the page cache frame
+		if( src->shared ){
+			clone_frame(dst, src);
+			dst->shared = 1;
+			continue;
+		}
+		// Share the frame. Writable pages are marked copy-on-write.
+		if( (u32)VADDR(t,p,0) < TASK_KSTACK_ADDR ){
+			if( src->rw ){
+				src->rw = 0;
+				src->cow = 1;
+			}
+			clone_frame(dst, src);
+			continue;
+		}
 		// Allocate a new frame, and use the same security settings
 		// as the old frame
 		alloc_frame(dst, src->user, src->rw);
@@ -515,6 +623,12 @@ page_dir_t* copy_page_dir(page_dir_t* src)
 
 	spin_unlock(&src->lock);
 	spin_unlock(&dst->lock);
+	
+	// Pages in the source directory may have just become read-only
+	if( src == curdir ){
+		flush_tlb();
+	}
+	
 	restore(flags);
 	
 	return dst;
@@ -537,7 +651,7 @@ int strip_page_dir(page_dir_t* dir)
 				erase_table = 0;
 				continue;
 			}
-			if( VADDR(t,p,0) >= (TASK_STACK_START-TASK_STACK_INIT_BASE) && VADDR(t,p,0) < TASK_STACK_START ){
+			if( VADDR(t,p,0) >= TASK_STACK_INIT_BASE && VADDR(t,p,0) < TASK_STACK_START ){
 				erase_table = 0;
 				continue;
 			}
@@ -552,6 +666,11 @@ int strip_page_dir(page_dir_t* dir)
 
 	spin_unlock(&dir->lock);
 
+	// Don't leave stale translations to the frames we just released
+	if( dir == curdir ){
+		flush_tlb();
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,603 @@
+#include "stewieos/pcache.h"
+#include "stewieos/fs.h"
+#include "stewieos/dentry.h"
+#include "stewieos/pmm.h"
+#include "stewieos/paging.h"
+#include "stewieos/kmem.h"
+#include "stewieos/kmem_cache.h"
+#include "stewieos/spinlock.h"
+#include "stewieos/error.h"
+#include "stewieos/task.h"
+
+static pcache_page_t* pcache_pages = NULL;				// one descriptor for each window slot
+static list_t pcache_lru = LIST_INIT(pcache_lru);		// slots holding a frame, most recently used first
+static list_t pcache_free = LIST_INIT(pcache_free);		// slots without a frame
+static spinlock_t pcache_lock;							// protects everything above and the inode trees
+static kmem_cache_t* pcache_node_cache = NULL;			// radix tree nodes
+static pcache_stat_t pcache_stats;						// hit/miss counters
+
+// The lock is taken with interrupts disabled, since the frame allocator
+// may reclaim pages from under any caller. Nothing allocates while
+// holding it.
+#define pcache_lock_irq(eflags) do{ (eflags) = disablei(); spin_lock(&pcache_lock); }while(0)
+#define pcache_unlock_irq(eflags) do{ spin_unlock(&pcache_lock); restore(eflags); }while(0)
+
+#define pcache_addr(page) ((char*)(PCACHE_BASE + (u32)((page) - pcache_pages)*PAGE_SIZE))
+
+// The cache holds one reference to each of its frames, and every task
+// mapping the page (see pcache_map) holds another. A mapped page stays
+// in the cache, so every mapping of the file shares the one frame.
+#define pcache_mapped(page) (frame_refcount((page)->p_frame) > 1)
+
+void pcache_init( void )
+{
+	pcache_pages = (pcache_page_t*)kmalloc(sizeof(pcache_page_t)*PCACHE_PAGES);
+	if( pcache_pages == NULL ){
+		syslog(KERN_ERR, "pcache: unable to allocate page descriptors. file data will not be cached.");
+		return;
+	}
+	memset(pcache_pages, 0, sizeof(pcache_page_t)*PCACHE_PAGES);
+
+	for(u32 i = 0; i < PCACHE_PAGES; ++i){
+		INIT_LIST(&pcache_pages[i].p_link);
+		list_add_before(&pcache_pages[i].p_lru, &pcache_free);
+	}
+
+	pcache_node_cache = kmem_cache_create("pcache_node", sizeof(pcache_node_t), NULL);
+	spin_init(&pcache_lock);
+	memset(&pcache_stats, 0, sizeof(pcache_stats));
+
+	// Cached pages are the first thing to go when memory runs out
+	frame_set_reclaim(pcache_reclaim);
+}
+
+// Can a tree of the given height hold the index?
+static inline int pcache_radix_fits(u32 height, u32 index)
+{
+	return height*PCACHE_RADIX_SHIFT >= 32 || (index >> (height*PCACHE_RADIX_SHIFT)) == 0;
+}
+
+static pcache_page_t* pcache_radix_lookup(pcache_tree_t* tree, u32 index)
+{
+	pcache_node_t* node = tree->root;
+
+	if( node == NULL || !pcache_radix_fits(tree->height, index) ){
+		return NULL;
+	}
+
+	for(u32 level = tree->height; level > 1; --level){
+		node = (pcache_node_t*)node->slots[(index >> ((level-1)*PCACHE_RADIX_SHIFT)) & PCACHE_RADIX_MASK];
+		if( node == NULL ){
+			return NULL;
+		}
+	}
+
+	return (pcache_page_t*)node->slots[index & PCACHE_RADIX_MASK];
+}
+
+// Take a node from `spare` to grow the tree
+static pcache_node_t* pcache_radix_node(pcache_node_t** spare)
+{
+	pcache_node_t* node = *spare;
+	*spare = NULL;
+	memset(node, 0, sizeof(pcache_node_t));
+	return node;
+}
+
+// Insert a page into the tree, using `*spare` for a missing node. Returns
+// -EAGAIN when another node is needed, or -EEXIST if the index is taken.
+// Nodes added before running out are kept, so the caller simply retries.
+static int pcache_radix_insert(pcache_tree_t* tree, u32 index, pcache_page_t* page, pcache_node_t** spare)
+{
+	// Add levels on top until the tree covers the index
+	while( tree->root == NULL || !pcache_radix_fits(tree->height, index) )
+	{
+		if( *spare == NULL ){
+			return -EAGAIN;
+		}
+		pcache_node_t* node = pcache_radix_node(spare);
+		if( tree->root != NULL ){
+			node->slots[0] = tree->root;
+			node->count = 1;
+		}
+		tree->root = node;
+		tree->height++;
+	}
+
+	pcache_node_t* node = tree->root;
+	for(u32 level = tree->height; level > 1; --level)
+	{
+		void** slot = &node->slots[(index >> ((level-1)*PCACHE_RADIX_SHIFT)) & PCACHE_RADIX_MASK];
+		if( *slot == NULL ){
+			if( *spare == NULL ){
+				return -EAGAIN;
+			}
+			*slot = pcache_radix_node(spare);
+			node->count++;
+		}
+		node = (pcache_node_t*)*slot;
+	}
+
+	void** slot = &node->slots[index & PCACHE_RADIX_MASK];
+	if( *slot != NULL ){
+		return -EEXIST;
+	}
+	*slot = page;
+	node->count++;
+
+	return 0;
+}
+
+// Empty nodes are left in place, and freed along with the whole tree
+static void pcache_radix_delete(pcache_tree_t* tree, u32 index)
+{
+	pcache_node_t* node = tree->root;
+
+	if( node == NULL || !pcache_radix_fits(tree->height, index) ){
+		return;
+	}
+
+	for(u32 level = tree->height; level > 1; --level){
+		node = (pcache_node_t*)node->slots[(index >> ((level-1)*PCACHE_RADIX_SHIFT)) & PCACHE_RADIX_MASK];
+		if( node == NULL ){
+			return;
+		}
+	}
+
+	if( node->slots[index & PCACHE_RADIX_MASK] != NULL ){
+		node->slots[index & PCACHE_RADIX_MASK] = NULL;
+		node->count--;
+	}
+}
+
+// Free a detached tree (called without the lock)
+static void pcache_radix_free(pcache_node_t* node, u32 height)
+{
+	if( node == NULL ){
+		return;
+	}
+	if( height > 1 ){
+		for(u32 i = 0; i < PCACHE_RADIX_SLOTS; ++i){
+			pcache_radix_free((pcache_node_t*)node->slots[i], height-1);
+		}
+	}
+	kmem_cache_free(pcache_node_cache, node);
+}
+
+// Take a page out of its inode. A page still in use is freed by the
+// last pcache_put, and must not be marked up to date by its filler.
+static void pcache_detach(pcache_page_t* page)
+{
+	pcache_radix_delete(&page->p_inode->i_pages, page->p_index);
+	list_rem(&page->p_link);
+	page->p_inode = NULL;
+	if( page->p_count != 0 ){
+		page->p_flags |= PCACHE_STALE;
+	}
+	pcache_stats.npages--;
+}
+
+// Give the frame of a detached, unused page back and free its slot
+static void pcache_free_slot(pcache_page_t* page)
+{
+	unmap_page(kerndir, pcache_addr(page));
+	// a page truncated while mapped keeps its frame until it is unmapped
+	frame_put(page->p_frame);
+	page->p_frame = 0;
+	page->p_flags = 0;
+	list_rem(&page->p_lru);
+	list_add(&page->p_lru, &pcache_free);
+}
+
+// Release a page pinned by pcache_get or pcache_alloc
+static void pcache_put(pcache_page_t* page)
+{
+	u32 eflags;
+
+	pcache_lock_irq(eflags);
+	if( --page->p_count == 0 && page->p_inode == NULL ){
+		pcache_free_slot(page);
+	}
+	pcache_unlock_irq(eflags);
+}
+
+u32 pcache_reclaim(u32 count)
+{
+	u32 freed = 0;
+	u32 eflags = disablei();
+
+	// The frame allocator may call in while the cache itself is busy
+	if( pcache_pages == NULL || !spin_try_lock(&pcache_lock) ){
+		restore(eflags);
+		return 0;
+	}
+
+	list_t* item = list_last(&pcache_lru);
+	while( freed < count && item != &pcache_lru )
+	{
+		pcache_page_t* page = list_entry(item, pcache_page_t, p_lru);
+		item = item->prev;
+		if( page->p_count != 0 || pcache_mapped(page) ) continue;
+		if( page->p_inode != NULL ){
+			pcache_detach(page);
+		}
+		pcache_free_slot(page);
+		freed++;
+	}
+	pcache_stats.reclaimed += freed;
+
+	pcache_unlock_irq(eflags);
+
+	return freed;
+}
+
+// Find a slot with a mapped frame for a new page. It is returned pinned
+// and detached. Once every slot is used, the least recently used page
+// is taken over.
+static pcache_page_t* pcache_alloc( void )
+{
+	pcache_page_t* page = NULL;
+	pmm_stat_t stat;
+	u32 eflags;
+
+	// Leave some memory for everything else
+	frame_stat(&stat);
+	if( stat.free < PCACHE_MIN_FREE ){
+		pcache_reclaim(PCACHE_RECLAIM_BATCH);
+	}
+
+	pcache_lock_irq(eflags);
+
+	if( list_empty(&pcache_free) )
+	{
+		list_t* item;
+		for(item = list_last(&pcache_lru); item != &pcache_lru; item = item->prev){
+			pcache_page_t* victim = list_entry(item, pcache_page_t, p_lru);
+			if( victim->p_count == 0 && !pcache_mapped(victim) ){
+				page = victim;
+				break;
+			}
+		}
+		if( page != NULL ){
+			if( page->p_inode != NULL ){
+				pcache_detach(page);
+			}
+			page->p_flags = 0;
+			page->p_count = 1;
+			list_rem(&page->p_lru);
+			list_add(&page->p_lru, &pcache_lru);
+		}
+		pcache_unlock_irq(eflags);
+		return page;
+	}
+
+	page = list_entry(list_first(&pcache_free), pcache_page_t, p_lru);
+	list_rem(&page->p_lru);
+
+	pcache_unlock_irq(eflags);
+
+	u32 frame = alloc_frames(0);
+
+	pcache_lock_irq(eflags);
+	if( frame == (u32)-1 ){
+		list_add(&page->p_lru, &pcache_free);
+		pcache_unlock_irq(eflags);
+		return NULL;
+	}
+	frame_get(frame);
+	page->p_frame = frame;
+	page->p_flags = 0;
+	page->p_count = 1;
+	map_page(kerndir, pcache_addr(page), FRAME_TO_ADDR(frame), 0, 1);
+	list_add(&page->p_lru, &pcache_lru);
+	pcache_unlock_irq(eflags);
+
+	return page;
+}
+
+// Find the page at `index` of the file, reading it in if needed. The page
+// is returned pinned. NULL means the page could not be cached (no memory,
+// or another task is filling it) and should be read around the cache.
+static pcache_page_t* pcache_get(struct file* file, u32 index)
+{
+	struct inode* inode = file_inode(file);
+	pcache_node_t* spare = NULL;
+	pcache_page_t* page;
+	int error;
+	u32 eflags;
+
+	if( pcache_pages == NULL ){
+		return NULL;
+	}
+
+	pcache_lock_irq(eflags);
+	page = pcache_radix_lookup(&inode->i_pages, index);
+	if( page != NULL ){
+		if( page->p_flags & PCACHE_UPTODATE ){
+			page->p_count++;
+			list_rem(&page->p_lru);
+			list_add(&page->p_lru, &pcache_lru);
+			pcache_stats.hits++;
+		} else {
+			page = NULL;
+		}
+		pcache_unlock_irq(eflags);
+		return page;
+	}
+	pcache_unlock_irq(eflags);
+
+	page = pcache_alloc();
+	if( page == NULL ){
+		return NULL;
+	}
+
+	// Insert the page, allocating tree nodes without the lock held
+	while( 1 )
+	{
+		pcache_lock_irq(eflags);
+		error = pcache_radix_insert(&inode->i_pages, index, page, &spare);
+		if( error == 0 ){
+			page->p_inode = inode;
+			page->p_index = index;
+			list_add(&page->p_link, &inode->i_pages.pages);
+			pcache_stats.npages++;
+			pcache_stats.misses++;
+		} else if( error != -EAGAIN ){
+			// someone else got here first
+			page->p_count = 0;
+			pcache_free_slot(page);
+		}
+		pcache_unlock_irq(eflags);
+
+		if( error != -EAGAIN ) break;
+
+		spare = (pcache_node_t*)kmem_cache_alloc(pcache_node_cache);
+		if( spare == NULL ){
+			pcache_lock_irq(eflags);
+			page->p_count = 0;
+			pcache_free_slot(page);
+			pcache_unlock_irq(eflags);
+			return NULL;
+		}
+	}
+
+	kmem_cache_free(pcache_node_cache, spare);
+
+	if( error != 0 ){
+		return NULL;
+	}
+
+	// Past the end of the file, the page reads as zeros
+	memset(pcache_addr(page), 0, PAGE_SIZE);
+	int result = file->f_ops->readpage(file, (off_t)(index*PAGE_SIZE), pcache_addr(page));
+
+	pcache_lock_irq(eflags);
+	if( result < 0 || (page->p_flags & PCACHE_STALE) ){
+		if( page->p_inode != NULL ){
+			pcache_detach(page);
+		}
+		if( --page->p_count == 0 ){
+			pcache_free_slot(page);
+		}
+		pcache_unlock_irq(eflags);
+		return result < 0 ? (pcache_page_t*)ERR_PTR(result) : NULL;
+	}
+	page->p_flags |= PCACHE_UPTODATE;
+	pcache_unlock_irq(eflags);
+
+	return page;
+}
+
+// Hand part of a page to the actor straight from the filesystem
+static ssize_t pcache_splice_around(struct file* file, u32 index, size_t skip, size_t len, splice_actor_t actor, void* ctx)
+{
+	char* tmp = (char*)kmalloc(PAGE_SIZE);
+	if( tmp == NULL ){
+		return -ENOMEM;
+	}
+
+	memset(tmp, 0, PAGE_SIZE);
+	ssize_t result = file->f_ops->readpage(file, (off_t)(index*PAGE_SIZE), tmp);
+	if( result >= 0 ){
+		result = actor(ctx, tmp + skip, len);
+	}
+	kfree(tmp);
+
+	pcache_stats.bypassed++;
+
+	return result;
+}
+
+ssize_t pcache_splice(struct file* file, off_t offset, size_t count, splice_actor_t actor, void* ctx)
+{
+	struct inode* inode = file_inode(file);
+	size_t done = 0;
+
+	if( offset < 0 ){
+		return -EINVAL;
+	}
+	if( offset >= inode->i_size ){
+		return 0;
+	}
+	if( count > (size_t)(inode->i_size - offset) ){
+		count = (size_t)(inode->i_size - offset);
+	}
+
+	while( done < count )
+	{
+		u32 index = (u32)(offset + done) / PAGE_SIZE;
+		size_t skip = (u32)(offset + done) % PAGE_SIZE;
+		size_t len = (PAGE_SIZE - skip) < (count - done) ? (PAGE_SIZE - skip) : (count - done);
+		ssize_t result;
+
+		pcache_page_t* page = pcache_get(file, index);
+		if( IS_ERR(page) ){
+			return done ? (ssize_t)done : (ssize_t)PTR_ERR(page);
+		}
+
+		if( page == NULL ){
+			result = pcache_splice_around(file, index, skip, len, actor, ctx);
+		} else {
+			result = actor(ctx, pcache_addr(page) + skip, len);
+			pcache_put(page);
+		}
+
+		if( result < 0 ){
+			return done ? (ssize_t)done : result;
+		}
+		done += (size_t)result;
+
+		// the actor can not take any more
+		if( (size_t)result < len ) break;
+	}
+
+	return (ssize_t)done;
+}
+
+static ssize_t pcache_copy_actor(void* ctx, const char* data, size_t count)
+{
+	char** buffer = (char**)ctx;
+	memcpy(*buffer, data, count);
+	*buffer += count;
+	return (ssize_t)count;
+}
+
+ssize_t pcache_read(struct file* file, off_t offset, char* buffer, size_t count)
+{
+	return pcache_splice(file, offset, count, pcache_copy_actor, &buffer);
+}
+
+void pcache_update(struct inode* inode, off_t offset, const char* buffer, size_t count)
+{
+	size_t done = 0;
+	u32 eflags;
+
+	if( pcache_pages == NULL || list_empty(&inode->i_pages.pages) ){
+		return;
+	}
+
+	while( done < count )
+	{
+		u32 index = (u32)(offset + done) / PAGE_SIZE;
+		size_t skip = (u32)(offset + done) % PAGE_SIZE;
+		size_t len = (PAGE_SIZE - skip) < (count - done) ? (PAGE_SIZE - skip) : (count - done);
+
+		pcache_lock_irq(eflags);
+		pcache_page_t* page = pcache_radix_lookup(&inode->i_pages, index);
+		if( page != NULL && !(page->p_flags & PCACHE_UPTODATE) ){
+			// the filler may have read the old data
+			page->p_flags |= PCACHE_STALE;
+			page = NULL;
+		} else if( page != NULL ){
+			page->p_count++;
+		}
+		pcache_unlock_irq(eflags);
+
+		if( page != NULL ){
+			memcpy(pcache_addr(page) + skip, buffer + done, len);
+			pcache_put(page);
+		}
+
+		done += len;
+	}
+}
+
+void pcache_truncate(struct inode* inode, off_t size)
+{
+	pcache_tree_t* tree = &inode->i_pages;
+	pcache_node_t* root = NULL;
+	u32 height = 0;
+	u32 first = (u32)(size + PAGE_SIZE - 1) / PAGE_SIZE;
+	u32 eflags;
+
+	if( pcache_pages == NULL ){
+		return;
+	}
+
+	pcache_lock_irq(eflags);
+
+	list_t* item = list_first(&tree->pages);
+	while( item != &tree->pages )
+	{
+		pcache_page_t* page = list_entry(item, pcache_page_t, p_link);
+		item = item->next;
+		if( page->p_index < first ) continue;
+		pcache_detach(page);
+		if( page->p_count == 0 ){
+			pcache_free_slot(page);
+		}
+	}
+
+	// The rest of the last page must read back as zeros
+	if( (u32)size % PAGE_SIZE ){
+		pcache_page_t* page = pcache_radix_lookup(tree, (u32)size / PAGE_SIZE);
+		if( page != NULL && (page->p_flags & PCACHE_UPTODATE) ){
+			memset(pcache_addr(page) + (u32)size % PAGE_SIZE, 0, PAGE_SIZE - (u32)size % PAGE_SIZE);
+		}
+	}
+
+	// Nothing is left, so the nodes can go as well
+	if( list_empty(&tree->pages) ){
+		root = tree->root;
+		height = tree->height;
+		tree->root = NULL;
+		tree->height = 0;
+	}
+
+	pcache_unlock_irq(eflags);
+
+	pcache_radix_free(root, height);
+}
+
+void pcache_release(struct inode* inode)
+{
+	pcache_truncate(inode, 0);
+}
+
+int pcache_map(struct file* file, u32 index, page_t* entry)
+{
+	pcache_page_t* page;
+	page_t frame;
+	u32 eflags;
+
+	if( pcache_pages == NULL || file->f_ops->readpage == NULL ){
+		return -ENODEV;
+	}
+
+	// NULL means the page is being filled by another task or memory is
+	// short. A private copy would not be shared, so wait a while instead.
+	for(u32 tries = 0; (page = pcache_get(file, index)) == NULL; ++tries){
+		if( tries == PCACHE_MAP_TRIES ){
+			return -ENOMEM;
+		}
+		schedule();
+	}
+	if( IS_ERR(page) ){
+		return PTR_ERR(page);
+	}
+
+	memset(&frame, 0, sizeof(frame));
+	frame.frame = page->p_frame;
+
+	pcache_lock_irq(eflags);
+	clone_frame(entry, &frame);
+	pcache_unlock_irq(eflags);
+
+	pcache_put(page);
+
+	return 0;
+}
+
+void pcache_stat(pcache_stat_t* stat)
+{
+	u32 eflags;
+
+	if( pcache_pages == NULL ){
+		memset(stat, 0, sizeof(*stat));
+		return;
+	}
+
+	pcache_lock_irq(eflags);
+	memcpy(stat, &pcache_stats, sizeof(pcache_stats));
+	pcache_unlock_irq(eflags);
+}
@@ -39,6 +39,44 @@ pci_dword_t pci_config_read_dword(pci_dword_t bus, pci_dword_t slot, pci_dword_t
 	return (pci_dword_t)inl(PCI_CONFIG_DATA);
 }
 
+void pci_config_write_word(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset, pci_word_t value)
+{
+	// Configuration space is only addressable by dword, so we read
+	// the whole dword back and replace the requested word.
+	u32 address = (offset & 0xFC)| 			// Register number/offset
+			((func & 0x7) << 8) | 		// Function
+			((slot & 0x1f) << 11) | 	// Device
+			((bus & 0xFF) << 16) | 		// Bus
+			0x80000000;			// Enable Bit
+	u32 shift = (offset & 2) * 8;
+	
+	outl(PCI_CONFIG_ADDRESS, address);
+	u32 data = inl(PCI_CONFIG_DATA);
+	
+	data = (data & ~(0xFFFFu << shift)) | ((u32)value << shift);
+	
+	// Writing back the status word we read would clear whatever error
+	// bits were set in it, so leave it alone when setting the command.
+	if( (offset & 0xFC) == PCI_COMMAND && (offset & 2) == 0 ){
+		data &= 0xFFFF;
+	}
+	
+	outl(PCI_CONFIG_ADDRESS, address);
+	outl(PCI_CONFIG_DATA, data);
+}
+
+void pci_config_write_dword(pci_dword_t bus, pci_dword_t slot, pci_dword_t func, pci_dword_t offset, pci_dword_t value)
+{
+	u32 address = (offset & 0xFC)| 			// Register number/offset
+			((func & 0x7) << 8) | 		// Function
+			((slot & 0x1f) << 11) | 	// Device
+			((bus & 0xFF) << 16) | 		// Bus
+			0x80000000;			// Enable Bit
+	
+	outl(PCI_CONFIG_ADDRESS, address);
+	outl(PCI_CONFIG_DATA, value);
+}
+
 pci_word_t pci_get_vendor(pci_byte_t bus, pci_byte_t dev, pci_byte_t func)
 {
 	return pci_config_read_word(bus, dev, func, 0);
@@ -8,6 +8,7 @@
 struct file_operations pipe_operations = {
 	.open = pipe_open, .close = pipe_close,
 	.read = pipe_read, .write = pipe_write,
+	.ioctl = pipe_ioctl,
 };
 
 static list_t pipe_list = LIST_INIT(pipe_list);
@@ -24,6 +25,73 @@ static pipe_t* find_open_pipe(struct inode* inode)
 	return NULL;
 }
 
+static void pipe_free(pipe_t* pipe)
+{
+	if( pipe->readable ) sem_free(pipe->readable);
+	if( pipe->writable ) sem_free(pipe->writable);
+	if( pipe->rdmutex ) mutex_free(pipe->rdmutex);
+	kfree(pipe->buffer);
+	kfree(pipe);
+}
+
+/* Wake every task counted in `waiting`. Called with the pipe lock held. */
+static void pipe_wake(size_t* waiting, sem_t* sem)
+{
+	while( *waiting != 0 ){
+		(*waiting)--;
+		sem_signal(sem);
+	}
+}
+
+/* Sleep until the next pipe_wake on `sem`. The pipe lock is dropped while
+ * waiting, and held again on return. A wakeup between dropping the lock
+ * and sleeping is kept by the semaphore, so it is never lost.
+ */
+static u32 pipe_sleep(pipe_t* pipe, size_t* waiting, sem_t* sem, u32 eflags)
+{
+	(*waiting)++;
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	sem_wait(sem, SEM_FOREVER);
+	
+	eflags = disablei();
+	spin_lock(&pipe->lock);
+	return eflags;
+}
+
+/* Copy bytes out of the ring. At most two copies are needed, one up to
+ * the end of the buffer and one from its start.
+ */
+static void pipe_copy_out(pipe_t* pipe, char* buffer, size_t count)
+{
+	size_t first = pipe->length - pipe->head;
+	if( first > count ){
+		first = count;
+	}
+	
+	memcpy(buffer, pipe->buffer + pipe->head, first);
+	memcpy(buffer + first, pipe->buffer, count - first);
+	
+	pipe->head = (pipe->head + count) % pipe->length;
+	pipe->count -= count;
+}
+
+/* Copy bytes into the free part of the ring */
+static void pipe_copy_in(pipe_t* pipe, const char* buffer, size_t count)
+{
+	size_t tail = (pipe->head + pipe->count) % pipe->length;
+	size_t first = pipe->length - tail;
+	if( first > count ){
+		first = count;
+	}
+	
+	memcpy(pipe->buffer + tail, buffer, first);
+	memcpy(pipe->buffer, buffer + first, count - first);
+	
+	pipe->count += count;
+}
+
 int pipe_open(struct file* file, struct dentry* dentry ATTR((unused)), int mode)
 {
 	pipe_t* pipe = find_open_pipe(file_inode(file));
@@ -38,22 +106,18 @@ int pipe_open(struct file* file, struct dentry* dentry ATTR((unused)), int mode)
 		memset(pipe, 0, sizeof(*pipe));
 
 		pipe->buffer = (char*)kmalloc(KERNEL_PIPE_LENGTH);
-		if( pipe->buffer == NULL ){
-			kfree(pipe);
+		pipe->readable = sem_alloc(0);
+		pipe->writable = sem_alloc(0);
+		pipe->rdmutex = mutex_alloc();
+		if( pipe->buffer == NULL || pipe->readable == NULL || pipe->writable == NULL || pipe->rdmutex == NULL ){
+			pipe_free(pipe);
 			return -ENOMEM;
 		}
 
 		pipe->length = KERNEL_PIPE_LENGTH;
-
-		pipe->read = pipe->buffer;
-		pipe->write = pipe->buffer;
-		pipe->nreaders = 0;
-		pipe->nwriters = 0;
 		pipe->inode = file_inode(file);
-		spin_init(&pipe->wrlock);
-		spin_init(&pipe->rdlock);
+		spin_init(&pipe->lock);
 		INIT_LIST(&pipe->link);
-		pipe->reader = NULL;
 
 		list_add(&pipe->link, &pipe_list);
 	}
@@ -61,12 +125,22 @@ int pipe_open(struct file* file, struct dentry* dentry ATTR((unused)), int mode)
 	// save the pipe pointer
 	file->f_private = pipe;
 	
-	if( (mode & O_RDONLY) || (mode & O_RDWR) ){
+	u32 eflags = disablei();
+	spin_lock(&pipe->lock);
+	if( (mode+1) & _FREAD ){
 		pipe->nreaders++;
+		// writers which opened a FIFO first have been waiting for us
+		if( !pipe->had_reader ){
+			pipe->had_reader = 1;
+			pipe_wake(&pipe->wwait, pipe->writable);
+		}
 	}
-	if( (mode & O_WRONLY) || (mode & O_RDWR) ){
+	if( (mode+1) & _FWRITE ){
 		pipe->nwriters++;
 	}
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
 	return 0;
 }
 
@@ -74,88 +148,251 @@ int pipe_close(struct file* file, struct dentry* dentry ATTR((unused)))
 {
 	pipe_t* pipe = (pipe_t*)(file->f_private);
 	
-	if( (file->f_status & O_RDONLY) || (file->f_status & O_RDWR) ){
+	u32 eflags = disablei();
+	spin_lock(&pipe->lock);
+	
+	if( (file->f_status+1) & _FREAD ){
 		pipe->nreaders--;
 	}
-	
-	if( (file->f_status & O_WRONLY) || (file->f_status & O_RDWR) ){
+	if( (file->f_status+1) & _FWRITE ){
 		pipe->nwriters--;
 	}
 	
-	if( (pipe->nwriters == 0) && (pipe->nreaders == 0) )
-	{
+	// Waiting readers now see the end of file, and writers a broken pipe
+	if( pipe->nwriters == 0 ){
+		pipe_wake(&pipe->rwait, pipe->readable);
+	}
+	if( pipe->nreaders == 0 ){
+		pipe_wake(&pipe->wwait, pipe->writable);
+	}
+	
+	int unused = (pipe->nwriters == 0) && (pipe->nreaders == 0);
+	if( unused ){
 		list_rem(&pipe->link);
-		kfree(pipe->buffer);
-		kfree(pipe);
+	}
+	
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	if( unused ){
+		pipe_free(pipe);
 	}
 	
 	return 0;
 }
 
-ssize_t pipe_read(struct file* file, char* buffer, size_t count)
+/* Wait for at least one byte unless the file is non-blocking, then hand
+ * the data to the actor. The reader mutex keeps other readers from
+ * consuming the same bytes, so the ring is read without the lock held
+ * and the actor may sleep (e.g. writing to a file).
+ */
+ssize_t pipe_splice(struct file* file, size_t count, splice_actor_t actor, void* ctx)
 {
 	pipe_t* pipe = (pipe_t*)file->f_private;
-	ssize_t n = 0;
 	
-	spin_lock(&pipe->rdlock);
-	pipe->reader = current;
+	if( count == 0 ){
+		return 0;
+	}
+	
+	mutex_lock(pipe->rdmutex, SEM_FOREVER);
+	
+	u32 eflags = disablei();
+	spin_lock(&pipe->lock);
 	
-	while( n < (ssize_t)count ){
+	while( pipe->count == 0 )
+	{
 		// are all the writers closed? if so, there isn't going to be any more data
-		if( pipe->nwriters == 0 && pipe->read == pipe->write ){
-			spin_unlock(&pipe->rdlock);
-			// if we never got any bytes at all, this is the EOF
-			if( n == 0 ){
-				return -1;
-			} else {
-				return n;
-			}
+		if( pipe->nwriters == 0 || (file->f_status & O_NONBLOCK) ){
+			int eof = (pipe->nwriters == 0);
+			spin_unlock(&pipe->lock);
+			restore(eflags);
+			mutex_unlock(pipe->rdmutex);
+			return eof ? 0 : -EAGAIN;
 		}
+		// other readers may go first while we wait
+		pipe->rwait++;
+		spin_unlock(&pipe->lock);
+		restore(eflags);
+		mutex_unlock(pipe->rdmutex);
 		
-		// wait for data from the pipe
-		if( pipe->read == pipe->write ){
-			task_wait(current, TF_WAITIO);
-		}
+		sem_wait(pipe->readable, SEM_FOREVER);
 		
-		// read as many bytes as possible/wanted
-		while( pipe->read != pipe->write && (size_t)n < count){
-			*buffer = *pipe->read;
-			pipe->read++;
-			buffer++;
-			n++;
-			// wrap the buffer
-			if( pipe->read == &pipe->buffer[pipe->length] ){
-				pipe->read = pipe->buffer;
-			}
-		}
+		mutex_lock(pipe->rdmutex, SEM_FOREVER);
+		eflags = disablei();
+		spin_lock(&pipe->lock);
+	}
+	
+	// Writers only add after the data, and the ring is not resized
+	// while splicing is set
+	size_t avail = count < pipe->count ? count : pipe->count;
+	size_t head = pipe->head;
+	size_t first = pipe->length - head < avail ? pipe->length - head : avail;
+	char* ring = pipe->buffer;
+	pipe->splicing = 1;
+	
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	ssize_t result = actor(ctx, ring + head, first);
+	if( result == (ssize_t)first && avail > first ){
+		ssize_t more = actor(ctx, ring, avail - first);
+		if( more > 0 ) result += more;
+	}
+	
+	eflags = disablei();
+	spin_lock(&pipe->lock);
+	
+	pipe->splicing = 0;
+	if( result > 0 ){
+		pipe->head = (pipe->head + (size_t)result) % pipe->length;
+		pipe->count -= (size_t)result;
+		// there is room for the writers now
+		pipe_wake(&pipe->wwait, pipe->writable);
 	}
 	
-	pipe->reader = NULL;
-	spin_unlock(&pipe->rdlock);
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	mutex_unlock(pipe->rdmutex);
 	
-	return n;
+	return result;
+}
+
+static ssize_t pipe_copy_actor(void* ctx, const char* data, size_t count)
+{
+	char** buffer = (char**)ctx;
+	memcpy(*buffer, data, count);
+	*buffer += count;
+	return (ssize_t)count;
 }
 
+/* Read whatever is in the pipe, up to `count` bytes */
+ssize_t pipe_read(struct file* file, char* buffer, size_t count)
+{
+	if( count == 0 ){
+		return 0;
+	}
+	
+	// read has always reported the end of file as -1
+	ssize_t result = pipe_splice(file, count, pipe_copy_actor, &buffer);
+	return result == 0 ? -1 : result;
+}
+
+/* Write the whole buffer, waiting for readers to make room as needed.
+ * A blocking writer on a FIFO which no reader has opened yet waits for
+ * one, as POSIX asks of open; once readers have come and gone, writing
+ * fails with EPIPE.
+ * Non-blocking writers (like the kernel log) never wait; whatever does not
+ * fit is dropped instead of overwriting unread data. They may also fill
+ * the pipe before any reader has opened it.
+ */
 ssize_t pipe_write(struct file* file, const char* buffer, size_t count)
 {
 	pipe_t* pipe = (pipe_t*)file->f_private;
-	ssize_t n = 0;
+	int nonblock = (file->f_status & O_NONBLOCK) != 0;
+	size_t n = 0;
 	
-	spin_lock(&pipe->wrlock);
+	u32 eflags = disablei();
+	spin_lock(&pipe->lock);
 	
-	for(; n < (ssize_t)count; ++n){
-		*pipe->write = buffer[n];
-		pipe->write++;
-		if( pipe->write == &pipe->buffer[pipe->length] ){
-			pipe->write = pipe->buffer;
+	while( n < count )
+	{
+		// a FIFO nobody has opened for reading yet; wait for the reader
+		if( pipe->nreaders == 0 && !pipe->had_reader && !nonblock ){
+			eflags = pipe_sleep(pipe, &pipe->wwait, pipe->writable, eflags);
+			continue;
 		}
+		
+		// nobody is ever going to read the rest
+		if( pipe->nreaders == 0 && !nonblock ){
+			spin_unlock(&pipe->lock);
+			restore(eflags);
+			return n ? (ssize_t)n : -EPIPE;
+		}
+		
+		size_t room = pipe->length - pipe->count;
+		if( room == 0 ){
+			if( nonblock ) break;
+			eflags = pipe_sleep(pipe, &pipe->wwait, pipe->writable, eflags);
+			continue;
+		}
+		
+		if( room > count - n ){
+			room = count - n;
+		}
+		pipe_copy_in(pipe, buffer + n, room);
+		n += room;
+		
+		pipe_wake(&pipe->rwait, pipe->readable);
+	}
+	
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	if( n == 0 && count != 0 ){
+		return -EAGAIN;
+	}
+	
+	return (ssize_t)n;
+}
+
+/* Move the contents of the pipe into a ring of a new size */
+static int pipe_resize(pipe_t* pipe, int size)
+{
+	if( size < PIPE_MIN_LENGTH || size > PIPE_MAX_LENGTH ){
+		return -EINVAL;
+	}
+	
+	char* buffer = (char*)kmalloc((size_t)size);
+	if( buffer == NULL ){
+		return -ENOMEM;
 	}
 	
-	spin_unlock(&pipe->wrlock);
+	u32 eflags = disablei();
+	spin_lock(&pipe->lock);
 	
-	if( pipe->reader && T_WAITING(pipe->reader) ){
-		task_wakeup(pipe->reader);
+	// the data waiting in the pipe has to fit, and nobody may be reading
+	// straight from the old ring
+	if( pipe->count > (size_t)size || pipe->splicing ){
+		spin_unlock(&pipe->lock);
+		restore(eflags);
+		kfree(buffer);
+		return -EBUSY;
 	}
 	
-	return n;
-}
\ No newline at end of file
+	char* old = pipe->buffer;
+	size_t count = pipe->count;
+	pipe_copy_out(pipe, buffer, count);
+	
+	pipe->buffer = buffer;
+	pipe->length = (size_t)size;
+	pipe->head = 0;
+	pipe->count = count;
+	
+	// a larger ring may have room for blocked writers
+	pipe_wake(&pipe->wwait, pipe->writable);
+	
+	spin_unlock(&pipe->lock);
+	restore(eflags);
+	
+	kfree(old);
+	
+	return 0;
+}
+
+int pipe_ioctl(struct file* file, int cmd, char* argp)
+{
+	pipe_t* pipe = (pipe_t*)file->f_private;
+	int* size = (int*)argp;
+	
+	switch( cmd )
+	{
+		case PIPE_GETSZ:
+			*size = (int)pipe->length;
+			return 0;
+		case PIPE_SETSZ:
+			return pipe_resize(pipe, *size);
+		default:
+			return -ENOTTY;
+	}
+}
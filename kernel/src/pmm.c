@@ -1,62 +1,235 @@
 
 #include "stewieos/pmm.h"
+#include "stewieos/kmem.h"
+#include "stewieos/error.h"
 
 u32* physical_frame = NULL;
 u32 physical_frame_count = 0;
+// Number of page mappings referencing each frame (for copy-on-write)
+u16* physical_frame_refs = NULL;
 
-// The starting address of the stack
-u16* phys_stack = NULL;
-// the size of the stack
-u32 phys_stack_size = 0;
-// The current stack pointer
-u16* phys_stack_ptr = NULL;
+// Buddy allocator state. Each free block is linked through the entry
+// of its first frame, which also records the order of the block.
+static list_t* frame_link = NULL;
+static u8* frame_order = NULL;
+static list_t frame_free[PMM_MAX_ORDER+1];
+static u32 frame_free_count[PMM_MAX_ORDER+1];
+static u32 frame_free_total = 0;
+// Called to give memory back when no block is free (e.g. the page cache)
+static u32(*frame_reclaim)(u32) = NULL;
+static int frame_reclaiming = 0;
 
-void push_frame(u32 frame)
+static inline u32 frame_index(list_t* link)
 {
-	if( phys_stack_ptr == phys_stack ){
-		printk("%2Verror: physical frame allocator stack overflow!\n");
-		asm volatile ("cli; hlt");
+	return (u32)(link - frame_link);
+}
+
+static void buddy_insert(u32 frame, u32 order)
+{
+	frame_order[frame] = (u8)order;
+	list_add(&frame_link[frame], &frame_free[order]);
+	frame_free_count[order]++;
+}
+
+static void buddy_remove(u32 frame, u32 order)
+{
+	list_rem(&frame_link[frame]);
+	frame_order[frame] = PMM_ORDER_NONE;
+	frame_free_count[order]--;
+}
+
+/* function: init_frame_buddy
+ * purpose:
+ * 	allocate the per-frame buddy links. This must happen before the
+ * 	kernel image is mapped, since it uses the placement allocator.
+ */
+void init_frame_buddy( void )
+{
+	frame_link = (list_t*)kmalloc(physical_frame_count * sizeof(list_t));
+	frame_order = (u8*)kmalloc(physical_frame_count);
+	memset(frame_order, PMM_ORDER_NONE, physical_frame_count);
+	for(u32 i = 0; i < physical_frame_count; ++i){
+		INIT_LIST(&frame_link[i]);
 	}
-	
-	*(--phys_stack_ptr) = ((u16)(frame / 0x1000));
+	for(u32 o = 0; o <= PMM_MAX_ORDER; ++o){
+		INIT_LIST(&frame_free[o]);
+		frame_free_count[o] = 0;
+	}
+	frame_free_total = 0;
 }
 
-u32 pop_frame( void )
+/* function: fill_frame_buddy
+ * purpose:
+ * 	build the free lists from the frame bitmap once every boot time
+ * 	reservation is done. Frame zero is never handed out.
+ */
+void fill_frame_buddy( void )
 {
-	if( phys_stack_ptr == ((u16*)( (u32)phys_stack + phys_stack_size )) ){
-		printk("%2Verror: out of physical memory!\n");
-		asm volatile ("cli; hlt");
+	for(u32 i = 1; i < physical_frame_count; ++i){
+		if( !(physical_frame[i/32] & (1u << (i%32))) ){
+			reserve_frame(i);
+			free_frames(i, 0);
+		}
 	}
-	
-	return (u32)(*(phys_stack_ptr++)) * 0x1000;
 }
 
+/* function: frame_set_reclaim
+ * purpose:
+ * 	register a function which releases up to the given number of
+ * 	frames. It is called with interrupts disabled when an allocation
+ * 	finds no free block, and must not allocate frames itself.
+ */
+void frame_set_reclaim(u32(*reclaim)(u32))
+{
+	frame_reclaim = reclaim;
+}
 
-u32 find_free_frame( void )
+/* function: alloc_frames
+ * purpose:
+ * 	allocate a physically contiguous, naturally aligned block of
+ * 	2^order frames. If none is free, the reclaim function is asked
+ * 	for memory once before giving up.
+ * returns:
+ * 	the index of the first frame, or (u32)-1 if no block is free.
+ */
+u32 alloc_frames(u32 order)
 {
-	for(u32 i = 0; i < (physical_frame_count/32); ++i)
+	u32 o = order;
+	u32 frame;
+
+	if( order > PMM_MAX_ORDER ){
+		return (u32)-1;
+	}
+
+	u32 eflags = disablei();
+
+	// Smallest order with a free block
+	while( o <= PMM_MAX_ORDER && list_empty(&frame_free[o]) ) o++;
+	if( o > PMM_MAX_ORDER && frame_reclaim != NULL && !frame_reclaiming ){
+		frame_reclaiming = 1;
+		frame_reclaim(1u << order);
+		frame_reclaiming = 0;
+		for(o = order; o <= PMM_MAX_ORDER && list_empty(&frame_free[o]); ++o);
+	}
+	if( o > PMM_MAX_ORDER ){
+		restore(eflags);
+		return (u32)-1;
+	}
+
+	frame = frame_index(list_first(&frame_free[o]));
+	buddy_remove(frame, o);
+
+	// Split off the upper halves until the block is the right size
+	while( o > order ){
+		o--;
+		buddy_insert(frame + (1u << o), o);
+	}
+
+	for(u32 i = 0; i < (1u << order); ++i){
+		reserve_frame(frame + i);
+	}
+	frame_free_total -= 1u << order;
+
+	restore(eflags);
+
+	return frame;
+}
+
+/* function: free_frames
+ * purpose:
+ * 	release a block of 2^order frames, merging it with its buddy
+ * 	for as long as the buddy is also free. A block which is not
+ * 	aligned to its order, or which holds a frame that is already
+ * 	free, is refused and logged instead of corrupting the free lists.
+ */
+void free_frames(u32 frame, u32 order)
+{
+	if( order > PMM_MAX_ORDER || (frame & ((1u << order) - 1)) != 0 || frame + (1u << order) > physical_frame_count ){
+		syslog(KERN_ERR, "pmm: refusing to free frame 0x%X with bad order %d\n", frame, order);
+		return;
+	}
+
+	u32 eflags = disablei();
+
+	for(u32 i = 0; i < (1u << order); ++i){
+		if( !(physical_frame[(frame+i)/32] & (1u << ((frame+i) % 32))) || frame_order[frame+i] != PMM_ORDER_NONE ){
+			restore(eflags);
+			syslog(KERN_ERR, "pmm: refusing to free frame 0x%X (order %d): frame 0x%X is already free\n", frame, order, frame+i);
+			return;
+		}
+	}
+
+	for(u32 i = 0; i < (1u << order); ++i){
+		release_frame(frame + i);
+	}
+	frame_free_total += 1u << order;
+
+	while( order < PMM_MAX_ORDER )
 	{
-		if( physical_frame[i] == 0xFFFFFFFF ) continue;
-		for(u32 m = 0; m < 32; m++){
-			if( i == 0 && m == 0 ) continue;
-			if( !(physical_frame[i] & (u32)(1<<m)) ){
-				return i*32 + m;
-			}
+		u32 buddy = frame ^ (1u << order);
+		if( buddy >= physical_frame_count || frame_order[buddy] != order ){
+			break;
 		}
+		buddy_remove(buddy, order);
+		if( buddy < frame ) frame = buddy;
+		order++;
+	}
+
+	buddy_insert(frame, order);
+
+	restore(eflags);
+}
+
+void frame_stat(pmm_stat_t* stat)
+{
+	u32 eflags = disablei();
+	stat->total = physical_frame_count;
+	stat->free = frame_free_total;
+	for(u32 o = 0; o <= PMM_MAX_ORDER; ++o){
+		stat->nfree[o] = frame_free_count[o];
 	}
-	return (u32)-1;
+	restore(eflags);
+}
+
+void init_frame_refs( void )
+{
+	physical_frame_refs = (u16*)kmalloc(physical_frame_count * sizeof(u16));
+	memset(physical_frame_refs, 0, physical_frame_count * sizeof(u16));
+}
+
+u32 frame_refcount(u32 idx)
+{
+	if( idx >= physical_frame_count ) return 0;
+	return physical_frame_refs[idx];
 }
 
 void reserve_frame(u32 idx)
 {
 	//idx /= 0x1000; // get a frame index instead of a frame address
-	physical_frame[(int)(idx/32)] |= (u32)(1 << (idx % 32));
+	physical_frame[(int)(idx/32)] |= 1u << (idx % 32);
 }
 
 void release_frame(u32 idx)
 {
 	//idx /= 0x1000; // get a frame index instead of a frame address
-	physical_frame[(int)(idx/32)] &= (u32)(~(1 << (idx % 32)));
+	physical_frame[(int)(idx/32)] &= ~(1u << (idx % 32));
+}
+
+int try_alloc_frame(page_t* page, int user, int rw)
+{
+	u32 flags = disablei();
+	u32 idx = alloc_frames(0);
+	if( idx == (u32)-1 ){
+		restore(flags);
+		return -ENOMEM;
+	}
+	physical_frame_refs[idx] = 1;
+	page->present = 1;
+	page->user = user ? 1 : 0;
+	page->rw = rw ? 1 : 0;
+	page->frame = (idx & 0x000FFFFF);
+	restore(flags);
+	return 0;
 }
 
 void alloc_frame(page_t* page, int user, int rw)
@@ -69,20 +242,32 @@ void alloc_frame(page_t* page, int user, int rw)
 		return;
 	}
 	
-	u32 flags = disablei();
-	u32 idx = find_free_frame();
-	if( idx == (u32)-1 ){
+	if( try_alloc_frame(page, user, rw) != 0 ){
 		printk("%2VOUT OF MEMORY!\n");
 		asm volatile ("cli; hlt");
 		while(1);
 	}
-	reserve_frame(idx);
-	page->present = 1;
-	page->user = user ? 1 : 0;
-	page->rw = rw ? 1 : 0;
-	page->frame = (idx & 0x000FFFFF);
-	restore(flags);
-	return;
+}
+
+void frame_get(u32 idx)
+{
+	if( idx < physical_frame_count && physical_frame_refs[idx] != 0xFFFF ){
+		physical_frame_refs[idx]++;
+	}
+}
+
+void frame_put(u32 idx)
+{
+	if( idx == 0 || idx >= physical_frame_count ) return;
+
+	// Only release the frame once the last reference is gone. A saturated
+	// count can no longer be trusted, so that frame is simply never freed.
+	if( physical_frame_refs[idx] > 1 ){
+		if( physical_frame_refs[idx] != 0xFFFF ) physical_frame_refs[idx]--;
+	} else {
+		physical_frame_refs[idx] = 0;
+		free_frames(idx, 0);
+	}
 }
 
 void clone_frame(page_t* dst, page_t* src)
@@ -90,14 +275,19 @@ void clone_frame(page_t* dst, page_t* src)
 	dst->present = 1;
 	dst->user = src->user;
 	dst->rw = src->rw;
+	dst->cow = src->cow;
 	dst->frame = src->frame;
+	// The frame is now shared, and must outlive both pages
+	frame_get(src->frame);
 }
 
 void free_frame(page_t* page) 
 {
 	if( !page->present || page->frame == 0 ) return;
 	
-	release_frame(page->frame);
+	frame_put(page->frame);
 	page->frame = 0;
 	page->present = 0;
+	page->cow = 0;
+	page->shared = 0;
 }
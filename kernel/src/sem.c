@@ -57,6 +57,9 @@ tick_t sem_timeout(tick_t now, struct regs* regs ATTR((unused)), sem_t* sem)
 		}
 	}
 	
+	// the callback is rescheduled (or cancelled) with the next expiry
+	sem->earliest_timeout = earliest;
+	
 	spin_unlock(&sem->lock);
 	
 	if( earliest == 0xFFFFFFFF ){
@@ -69,24 +72,43 @@ tick_t sem_timeout(tick_t now, struct regs* regs ATTR((unused)), sem_t* sem)
 /* Wait for an open unit on the semaphore for up to 'timeout' ticks */
 int sem_wait(sem_t* sem, tick_t timeout)
 {
+	// The lock is also taken by sem_timeout from the timer interrupt,
+	// and a wakeup must not slip in between unlocking and sleeping.
+	u32 eflags = disablei();
 	spin_lock(&sem->lock);
 	
 	// we don't have anymore units. we'll wait.
 	if( sem->units == 0 ){
-		if( timeout == 0 ) return -ETIMEDOUT;
+		if( timeout == SEM_NOWAIT ){
+			spin_unlock(&sem->lock);
+			restore(eflags);
+			return -ETIMEDOUT;
+		}
 		
 		list_add_before(&current->t_semlink, &sem->tasks);
-		current->t_timeout = timer_get_ticks() + timeout;
 		
-		// setup a callback for the timeout
-		if( sem->earliest_timeout > current->t_timeout ){
-			syslog(KERN_WARN, "sem_wait: setting timer callback for %d..", current->t_timeout);
-			sem->earliest_timeout = current->t_timeout;
-			timer_callback(sem->earliest_timeout, sem, (timer_callback_t)sem_timeout);
+		if( timeout == SEM_FOREVER ){
+			// sem_timeout will never see this as expired
+			current->t_timeout = SEM_FOREVER;
+		} else {
+			current->t_timeout = timer_get_ticks() + timeout;
+			// setup a callback for the timeout
+			if( sem->earliest_timeout > current->t_timeout ){
+				syslog(KERN_WARN, "sem_wait: setting timer callback for %d..", current->t_timeout);
+				sem->earliest_timeout = current->t_timeout;
+				timer_callback(sem->earliest_timeout, sem, (timer_callback_t)sem_timeout);
+			}
 		}
 		
 		spin_unlock(&sem->lock);
-		task_waitio(current);
+		
+		// sem_signal removes us from the wait list before waking us, so
+		// anything else that wakes us (e.g. a signal) goes back to sleep
+		while( list_inserted(&current->t_semlink) ){
+			task_waitio(current);
+		}
+		
+		restore(eflags);
 		
 		// check if we timed out or if we aquired the semaphore
 		if( current->t_timeout == 1 ){
@@ -100,6 +122,7 @@ int sem_wait(sem_t* sem, tick_t timeout)
 	sem->units--;
 	
 	spin_unlock(&sem->lock);
+	restore(eflags);
 	
 	return 0;
 }
@@ -107,12 +130,14 @@ int sem_wait(sem_t* sem, tick_t timeout)
 /* Release a unit from the semaphore */
 void sem_signal(sem_t* sem)
 {
+	u32 eflags = disablei();
 	spin_lock(&sem->lock);
 	
 	// if there are no waiting tasks, just increase the units and return
 	if( list_empty(&sem->tasks) ){
 		sem->units++;
 		spin_unlock(&sem->lock);
+		restore(eflags);
 		return;
 	}
 	
@@ -123,6 +148,7 @@ void sem_signal(sem_t* sem)
 	task_wakeup(task);
 	
 	spin_unlock(&sem->lock);
+	restore(eflags);
 	
 	return;
-}
\ No newline at end of file
+}
@@ -6,6 +6,9 @@
 #include <fcntl.h>
 #include "stewieos/error.h"
 #include <dirent.h>
+#include "stewieos/vm.h"
+#include "stewieos/paging.h"
+#include "stewieos/memctl.h"
 
 DECL_SYSCALL(syscall_exit);
 DECL_SYSCALL(syscall_open);
@@ -40,8 +43,19 @@ DECL_SYSCALL(syscall_signal);
 DECL_SYSCALL(syscall_sigret);
 DECL_SYSCALL(syscall_setsigret);
 DECL_SYSCALL(syscall_kill);
-
-syscall_handler_t syscall[SYSCALL_COUNT] = {
+DECL_SYSCALL(syscall_sync);
+DECL_SYSCALL(syscall_fsync);
+DECL_SYSCALL(syscall_mmap);
+DECL_SYSCALL(syscall_munmap);
+DECL_SYSCALL(syscall_mprotect);
+DECL_SYSCALL(syscall_sendfile);
+DECL_SYSCALL(syscall_readv);
+DECL_SYSCALL(syscall_writev);
+DECL_SYSCALL(syscall_pread);
+DECL_SYSCALL(syscall_pwrite);
+DECL_SYSCALL(syscall_memctl);
+
+syscall_handler_t syscall[SYSCALL_TABLE_SIZE] = {
 	[SYSCALL_EXIT] = syscall_exit,
 	[SYSCALL_OPEN] = syscall_open,
 	[SYSCALL_CLOSE] = syscall_close,
@@ -74,18 +88,54 @@ syscall_handler_t syscall[SYSCALL_COUNT] = {
 	[SYSCALL_SIGNAL] = syscall_signal,
 	[SYSCALL_SIGRET] = syscall_sigret,
 	[SYSCALL_SETSIGRET] = syscall_setsigret,
-	[SYSCALL_KILL] = syscall_kill
+	[SYSCALL_KILL] = syscall_kill,
+	[SYSCALL_SYNC] = syscall_sync,
+	[SYSCALL_FSYNC] = syscall_fsync,
+	[SYSCALL_MMAP] = syscall_mmap,
+	[SYSCALL_MUNMAP] = syscall_munmap,
+	[SYSCALL_MPROTECT] = syscall_mprotect,
+	[SYSCALL_SENDFILE] = syscall_sendfile,
+	[SYSCALL_READV] = syscall_readv,
+	[SYSCALL_WRITEV] = syscall_writev,
+	[SYSCALL_PREAD] = syscall_pread,
+	[SYSCALL_PWRITE] = syscall_pwrite,
+	[SYSCALL_MEMCTL] = syscall_memctl,
 };
 
 void syscall_handler(struct regs* regs)
 {
-	if( regs->eax >= SYSCALL_COUNT ){
+	if( regs->eax >= SYSCALL_TABLE_SIZE ){
 		regs->eax = (u32)-ENOSYS;
 		return;
 	}
 	syscall[regs->eax](regs);
 }
 
+/* Make sure a user address can be read, faulting it in if needed */
+static int sysenter_readable(u32 address)
+{
+	if( address >= KERNEL_VIRTUAL_BASE || vm_fault(current, address) != 0 ){
+		return 0;
+	}
+	page_t* page = get_page((void*)PAGE_ALIGN(address), 0, current->t_dir);
+	return page != NULL && page->present && page->user;
+}
+
+void sysenter_handler(struct regs* regs)
+{
+	u32 stack = regs->useresp;
+	
+	// The second and third arguments wait on the user stack
+	if( stack > KERNEL_VIRTUAL_BASE-8 || !sysenter_readable(stack) || !sysenter_readable(stack+7) ){
+		regs->eax = (u32)-EFAULT;
+		return;
+	}
+	regs->ecx = ((u32*)stack)[0];
+	regs->edx = ((u32*)stack)[1];
+	
+	syscall_handler(regs);
+}
+
 void syscall_exit(struct regs* regs)
 {
 	sys_exit((int)regs->ebx);
@@ -275,4 +325,61 @@ void syscall_kill(struct regs* regs)
 	}
 
 	regs->eax = (u32)signal_kill(task, (int)regs->ecx);
-}
\ No newline at end of file
+}
+
+void syscall_sync(struct regs* regs)
+{
+	sys_sync();
+	regs->eax = 0;
+}
+
+void syscall_fsync(struct regs* regs)
+{
+	regs->eax = (u32)sys_fsync((int)regs->ebx);
+}
+
+// The sixth argument (the file offset) is passed in ebp
+void syscall_mmap(struct regs* regs)
+{
+	regs->eax = (u32)sys_mmap((void*)regs->ebx, (size_t)regs->ecx, (int)regs->edx, (int)regs->esi, (int)regs->edi, (off_t)regs->ebp);
+}
+
+void syscall_munmap(struct regs* regs)
+{
+	regs->eax = (u32)sys_munmap((void*)regs->ebx, (size_t)regs->ecx);
+}
+
+void syscall_mprotect(struct regs* regs)
+{
+	regs->eax = (u32)sys_mprotect((void*)regs->ebx, (size_t)regs->ecx, (int)regs->edx);
+}
+
+void syscall_sendfile(struct regs* regs)
+{
+	regs->eax = (u32)sys_sendfile((int)regs->ebx, (int)regs->ecx, (off_t*)regs->edx, (size_t)regs->esi);
+}
+
+void syscall_readv(struct regs* regs)
+{
+	regs->eax = (u32)sys_readv((int)regs->ebx, (const struct iovec*)regs->ecx, (int)regs->edx);
+}
+
+void syscall_writev(struct regs* regs)
+{
+	regs->eax = (u32)sys_writev((int)regs->ebx, (const struct iovec*)regs->ecx, (int)regs->edx);
+}
+
+void syscall_pread(struct regs* regs)
+{
+	regs->eax = (u32)sys_pread((int)regs->ebx, (void*)regs->ecx, (size_t)regs->edx, (off_t)regs->esi);
+}
+
+void syscall_pwrite(struct regs* regs)
+{
+	regs->eax = (u32)sys_pwrite((int)regs->ebx, (const void*)regs->ecx, (size_t)regs->edx, (off_t)regs->esi);
+}
+
+void syscall_memctl(struct regs* regs)
+{
+	regs->eax = (u32)sys_memctl((int)regs->ebx, (void*)regs->ecx);
+}
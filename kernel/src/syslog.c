@@ -38,8 +38,9 @@ int begin_syslog_daemon(const char* syslog_device ATTR((unused)))
 		return result;
 	}
 	
-	// open the file for the syslog function
-	syslog_pipe = file_open(&path, O_WRONLY);
+	// open the file for the syslog function (non-blocking, since syslog
+	// may be called with interrupts disabled and must never sleep)
+	syslog_pipe = file_open(&path, O_WRONLY | O_NONBLOCK);
 	// that's not needed anymore
 	path_put(&path);
 	// Check for an error
@@ -1,4 +1,8 @@
 #include "stewieos/task.h"
+#include "stewieos/kmem_cache.h"
+#include "stewieos/vm.h"
+#include "stewieos/kdata.h"
+#include "stewieos/error.h"
 #include <errno.h>
 
 typedef struct _sleep_data
@@ -17,6 +21,11 @@ spinlock_t		task_sleeplock;		// Lock for the sleeping list
 //struct task		*ready_tasks;		// list of ready tasks
 pid_t			next_pid = 0;		// the next process id
 pid_t			foreground_pid = 0;	// The foreground task
+static kmem_cache_t*	task_cache = NULL;	// task structures
+static kmem_cache_t*	sleep_cache = NULL;	// sleep_data_t structures for task_sleep
+static struct task*	idle_task = NULL;	// runs when no other task is ready
+
+static void task_idle(void* context);
 char			g_fpu_state[512] __attribute__((aligned(16))); // fpu state
 
 /* function: sys_getpid
@@ -70,8 +79,14 @@ void task_init( void )
 	INIT_LIST(&ready_tasks);
 	INIT_LIST(&task_globlist);
 	
+	// create the object caches for task related structures
+	task_cache = kmem_cache_create("task", sizeof(struct task), NULL);
+	sleep_cache = kmem_cache_create("sleep_data", sizeof(sleep_data_t), NULL);
+	message_init();
+	vm_init();
+	
 	// allocate the initial
-	init = (struct task*)kmalloc(sizeof(struct task));
+	init = (struct task*)kmem_cache_alloc(task_cache);
 	if(!init){
 		printk("%2Verror: unable to allocate initial task structure!\n");
 		return;
@@ -91,6 +106,7 @@ void task_init( void )
 	INIT_LIST(&init->t_ttywait);
 	INIT_LIST(&init->t_mesgq.queue);
 	INIT_LIST(&init->t_semlink);
+	INIT_LIST(&init->t_vmas);
 	spin_init(&init->t_mesgq.lock);
 	//printk("%2Vtask_init: init->t_dir=%08X\n", init->t_dir);
 	//while(1);
@@ -139,6 +155,32 @@ void task_init( void )
 	
 	INIT_LIST(&task_sleeplist);
 	spin_init(&task_sleeplock);
+	
+	// Something to run when every task is waiting
+	worker_spawn(task_idle, NULL);
+}
+
+/* function: task_idle
+ * purpose:
+ * 	the body of the idle task. It takes itself off the ready queue, so
+ * 	the scheduler only picks it when nothing else can run, and then
+ * 	halts until the next interrupt. It is not marked running, so the
+ * 	next timer tick switches away as soon as another task is ready.
+ */
+static void task_idle(void* context ATTR((unused)))
+{
+	u32 eflags = disablei();
+	list_rem(&current->t_queue);
+	list_rem(&current->t_globlink);
+	current->t_flags = 0;
+	idle_task = current;
+	restore(eflags);
+	
+	schedule();
+	
+	while( 1 ){
+		asm volatile("sti; hlt");
+	}
 }
 
 /* function: task_preempt
@@ -205,13 +247,21 @@ void task_preempt(struct regs* regs ATTR((unused)))
 	// The same goes if the task is now waiting on IO
 	if( T_RUNNING(current) )
 		current = list_next(&current->t_queue, struct task, t_queue, &ready_tasks);
-	else
+	else if( !list_empty(&ready_tasks) )
 		current = list_entry(list_first(&ready_tasks), struct task, t_queue);
+	else
+		current = NULL;
 	// Check for end of list or dead task
 	while( !current || (current->t_flags & TF_EXIT) || T_WAITING(current) )
 	{
 		if(!current || T_WAITING(current))
 		{
+			// Nothing is able to run. The idle task waits for an interrupt
+			// to wake somebody up (e.g. a disk completion or the sleep timer).
+			if( list_empty(&ready_tasks) ){
+				current = idle_task;
+				break;
+			}
 			current = list_next(&ready_tasks, struct task, t_queue, &ready_tasks);
 			continue;
 		} else if(current->t_flags & TF_EXIT)
@@ -253,6 +303,7 @@ void task_switch(struct task* task)
 	disablei();
 
 	current = task;
+	kdata_switch(current->t_pid);
 	eip = current->t_eip;
 	esp = current->t_esp;
 	ebp = current->t_ebp;
@@ -339,7 +390,7 @@ void task_free(struct task* dead)
 	while( !list_empty(&dead->t_mesgq.queue) ){
 		message_container_t* cont = list_entry(list_first(&dead->t_mesgq.queue), message_container_t, link);
 		list_rem(&cont->link);
-		kfree(cont);
+		message_free(cont);
 	}
 
 	// We should be freeing the page directory.
@@ -347,6 +398,7 @@ void task_free(struct task* dead)
 	// page fault if  I free the directory, though...
 	//syslog(KERN_PANIC, "we aren't freeing page directories... :(");
 	free_page_dir(dead->t_dir);
+	vm_release(dead);
 	
 	// The task is not actually dead yet.
 	// It needs to notify the parent of it's death,
@@ -468,7 +520,11 @@ caddr_t sys_sbrk(int incr)
 	u32 addr = current->t_dataend & 0xFFFFF000;
 	
 	while( addr < ((u32)result + incr) ){
-		alloc_page(current->t_dir, (void*)addr, 1, 1);
+		// The first page may still hold unread data from the executable
+		vm_fault(current, addr);
+		if( alloc_page(current->t_dir, (void*)addr, 1, 1) != 0 ){
+			return (caddr_t)ERR_PTR(-ENOMEM);
+		}
 		addr += 0x1000;
 	}
 	
@@ -487,7 +543,7 @@ pid_t task_spawn(int kern)
 	// disable interrupts
 	eflags = disablei();
 	// allocate the task structure
-	task = (struct task*)kmalloc(sizeof(struct task));
+	task = (struct task*)kmem_cache_alloc(task_cache);
 	memset(task, 0, sizeof(struct task));
 	
 	// grab the esp and ebp values
@@ -506,6 +562,7 @@ pid_t task_spawn(int kern)
 	INIT_LIST(&task->t_ttywait);
 	INIT_LIST(&task->t_mesgq.queue);
 	INIT_LIST(&task->t_semlink);
+	INIT_LIST(&task->t_vmas);
 	spin_init(&task->t_mesgq.lock);
 	
 	if( !kern ){
@@ -513,6 +570,10 @@ pid_t task_spawn(int kern)
 		copy_task_vfs(&task->t_vfs, &current->t_vfs);
 		// copy the page directory
 		task->t_dir = copy_page_dir(current->t_dir);
+		if( task->t_dir && vm_copy(task, current) != 0 ){
+			free_page_dir(task->t_dir);
+			task->t_dir = NULL;
+		}
 	} else {
 		task->t_parent = current;
 		init_task_vfs(&task->t_vfs);
@@ -523,7 +584,7 @@ pid_t task_spawn(int kern)
 	signal_init(task);
 	
 	if( !task->t_dir ){
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		restore(eflags);
 		return -1;
 	}
@@ -592,7 +653,7 @@ int sys_fork( void )
 	// disable interrupts
 	eflags = disablei();
 	// allocate the task structure
-	task = (struct task*)kmalloc(sizeof(struct task));
+	task = (struct task*)kmem_cache_alloc(task_cache);
 	memset(task, 0, sizeof(struct task));
 	
 	// grab the esp and ebp values
@@ -612,13 +673,14 @@ int sys_fork( void )
 	INIT_LIST(&task->t_ttywait);
 	INIT_LIST(&task->t_mesgq.queue);
 	INIT_LIST(&task->t_semlink);
+	INIT_LIST(&task->t_vmas);
 	spin_init(&task->t_mesgq.lock);
 
 	// copy the page directory
 	task->t_dir = copy_page_dir(current->t_dir);
 	
 	if( !task->t_dir ){
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		restore(eflags);
 		return -1;
 	}
@@ -626,6 +688,16 @@ int sys_fork( void )
 	copy_task_vfs(&task->t_vfs, &current->t_vfs);
 	signal_copy(task, current);
 	
+	// Pages not yet faulted in are read again by the child
+	int error = vm_copy(task, current);
+	if( error != 0 ){
+		free_task_vfs(&task->t_vfs);
+		free_page_dir(task->t_dir);
+		kmem_cache_free(task_cache, task);
+		restore(eflags);
+		return error;
+	}
+	
 	// this is where the new task will start
 	u32 eip = read_eip();
 	
@@ -682,7 +754,7 @@ pid_t worker_spawn(void(*thread)(void*), void* context)
 	}
 	
 	// Allocate a task structure
-	struct task* task = (struct task*)kmalloc(sizeof(struct task));
+	struct task* task = (struct task*)kmem_cache_alloc(task_cache);
 	if( task == NULL ){
 		syslog(KERN_ERR, "unable to spawn kernel worker. insufficient memory!");
 		return (pid_t)-ENOMEM;
@@ -695,7 +767,7 @@ pid_t worker_spawn(void(*thread)(void*), void* context)
 	task->t_esp = (u32)kmalloc(1024);
 	if( task->t_esp == 0 ){
 		syslog(KERN_ERR, "unable to spawn kernel worker. insufficient memory!");
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		return (pid_t)-ENOMEM;
 	}	
 	task->t_ebp = 0;
@@ -719,7 +791,7 @@ pid_t worker_spawn(void(*thread)(void*), void* context)
 	if( task->t_dir == NULL ){
 		syslog(KERN_ERR, "unable to copy kernel page directory. insufficient memory!");
 		kfree((void*)task->t_esp);
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		return (pid_t)-ENOMEM;
 	}
 	
@@ -731,6 +803,7 @@ pid_t worker_spawn(void(*thread)(void*), void* context)
 	INIT_LIST(&task->t_ttywait);
 	INIT_LIST(&task->t_mesgq.queue);
 	INIT_LIST(&task->t_semlink);
+	INIT_LIST(&task->t_vmas);
 	spin_init(&task->t_mesgq.lock);
 	
 	// Add task to required lists
@@ -761,6 +834,9 @@ pid_t worker_spawn(void(*thread)(void*), void* context)
  */
 void sys_exit( int result )
 {
+	// Shared file mappings can only be written back from our own address space
+	vm_sync(current, 0, KERNEL_VIRTUAL_BASE);
+	
 	task_kill(current, result);
 
 	if( current->t_pid == 0 )
@@ -898,7 +974,7 @@ pid_t sys_waitpid(pid_t pid, int* status, int options)
 
 	// the tasks runtime data should have already been free'd, we just need
 	// to free the task structure and remove it from lists.
-	kfree(task);
+	kmem_cache_free(task_cache, task);
 	
 	restore(eflags);
 	
@@ -919,7 +995,7 @@ tick_t task_sleep_monitor(tick_t now ATTR((unused)), struct regs* regs ATTR((unu
 	
 	// Remove it from the queue
 	list_rem(&data->link);
-	kfree(data);
+	kmem_cache_free(sleep_cache, data);
 	
 	// If there are no more, cancel the timer
 	if( list_empty(&task_sleeplist) ){
@@ -948,7 +1024,7 @@ int task_sleep_compare(list_t* a, list_t* b)
 
 int task_sleep(struct task* task, u32 milli)
 {
-	sleep_data_t* data = (sleep_data_t*)kmalloc(sizeof(sleep_data_t));
+	sleep_data_t* data = (sleep_data_t*)kmem_cache_alloc(sleep_cache);
 	if( data == NULL ) return -1;
 	
 	data->task = task;
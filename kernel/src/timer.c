@@ -2,6 +2,7 @@
 #include "stewieos/timer.h"
 #include "stewieos/descriptor_tables.h"
 #include "stewieos/cmos.h"
+#include "stewieos/kdata.h"
 
 struct callback_info;
 struct callback_info
@@ -31,6 +32,7 @@ void timer_interrupt(struct regs* regs)
 			timer_sync_time();
 		}
 	}
+	kdata_timer(current_tick, current_time, timer_freq);
 	// Check for the firing of the next callback ( use while in case some callbacks have the same time)
 	while( next_callback && next_callback->when <= current_tick )
 	{
@@ -0,0 +1,529 @@
+#include "stewieos/vm.h"
+#include "stewieos/task.h"
+#include "stewieos/paging.h"
+#include "stewieos/kmem_cache.h"
+#include "stewieos/error.h"
+#include "stewieos/pmm.h"
+#include "stewieos/dentry.h"
+#include "stewieos/pcache.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+static kmem_cache_t* vm_area_cache = NULL;
+
+void vm_init( void )
+{
+	vm_area_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), NULL);
+}
+
+int vm_map(struct task* task, u32 start, u32 end, u32 flags, struct file* file, off_t offset, u32 filestart, size_t filesz)
+{
+	list_t* item;
+	vm_area_t* iter;
+
+	vm_area_t* area = (vm_area_t*)kmem_cache_alloc(vm_area_cache);
+	if( area == NULL ){
+		return -ENOMEM;
+	}
+
+	area->vm_start = PAGE_ALIGN(start);
+	area->vm_end = PAGE_OFFSET(end) ? PAGE_ALIGN(end) + PAGE_SIZE : end;
+	area->vm_flags = flags;
+	area->vm_file = file_get(file);
+	area->vm_offset = offset;
+	area->vm_filestart = filestart;
+	area->vm_filesz = file ? filesz : 0;
+	INIT_LIST(&area->vm_link);
+
+	// Keep the list sorted by address
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, iter){
+		if( iter->vm_start > area->vm_start ) break;
+	}
+	list_add_before(&area->vm_link, item);
+
+	return 0;
+}
+
+/* Map the page cache frame holding a page of a shared file mapping, so
+ * every task mapping the file (and read and write) sees the same data.
+ */
+static int vm_fault_shared(struct task* task, vm_area_t* area, u32 page_addr)
+{
+	off_t offset = area->vm_offset + (off_t)(page_addr - area->vm_filestart);
+
+	page_t* page = get_page((void*)page_addr, 1, task->t_dir);
+	if( page == NULL ){
+		return -ENOMEM;
+	}
+
+	int error = pcache_map(area->vm_file, (u32)(offset / PAGE_SIZE), page);
+	if( error != 0 ){
+		syslog(KERN_ERR, "vm: unable to map page %p for process %d: %d", page_addr, task->t_pid, error);
+		return error;
+	}
+
+	page->user = (area->vm_flags & VM_READ) ? 1 : 0;
+	page->rw = (area->vm_flags & VM_WRITE) ? 1 : 0;
+	page->cow = 0;
+	page->shared = 1;
+	page->dirty = 0;
+	invalidate_page((void*)page_addr);
+
+	return 0;
+}
+
+int vm_fault(struct task* task, u32 address)
+{
+	list_t* item;
+	vm_area_t* area;
+	u32 page_addr = PAGE_ALIGN(address);
+	u32 flags = 0;
+	int found = 0;
+
+	page_t* page = get_page((void*)page_addr, 0, task->t_dir);
+	if( page != NULL && page->present ){
+		return 0;
+	}
+
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area){
+		if( area->vm_start > page_addr ) break;
+		if( area->vm_end <= page_addr ) continue;
+		// mmap keeps shared mappings to pages of their own
+		if( (area->vm_flags & VM_SHARED) && area->vm_file != NULL ){
+			return vm_fault_shared(task, area, page_addr);
+		}
+		if( !found ){
+			// Map the page writable so it can be filled, and give it
+			// its real protection once every area has been read in.
+			int error = alloc_page(task->t_dir, (void*)page_addr, 0, 1);
+			if( error != 0 ){
+				return error;
+			}
+			invalidate_page((void*)page_addr);
+			memset((void*)page_addr, 0, PAGE_SIZE);
+			found = 1;
+		}
+		flags |= area->vm_flags;
+
+		// The part of this page backed by the file
+		u32 lo = area->vm_filestart > page_addr ? area->vm_filestart : page_addr;
+		u32 hi = area->vm_filestart + area->vm_filesz;
+		if( hi > page_addr + PAGE_SIZE ) hi = page_addr + PAGE_SIZE;
+		if( area->vm_file == NULL || lo >= hi ) continue;
+
+		file_seek(area->vm_file, area->vm_offset + (off_t)(lo - area->vm_filestart), SEEK_SET);
+		ssize_t count = file_read(area->vm_file, (void*)lo, hi - lo);
+		if( count < 0 ){
+			syslog(KERN_ERR, "vm: unable to read page %p for process %d: %d", page_addr, task->t_pid, count);
+			return (int)count;
+		}
+	}
+
+	if( !found ){
+		return -EFAULT;
+	}
+
+	page = get_page((void*)page_addr, 0, task->t_dir);
+	page->user = (flags & VM_READ) ? 1 : 0;
+	page->rw = (flags & VM_WRITE) ? 1 : 0;
+	// Filling the page does not count as a write to a shared mapping
+	page->dirty = 0;
+	invalidate_page((void*)page_addr);
+
+	return 0;
+}
+
+int vm_copy(struct task* dst, struct task* src)
+{
+	list_t* item;
+	vm_area_t* area;
+	struct file* file = NULL;
+	struct file* last = NULL;
+	int error = 0;
+
+	list_for_each_entry(item, &src->t_vmas, vm_area_t, vm_link, area)
+	{
+		// Areas backed by the same open file share the copy as well
+		if( area->vm_file != last ){
+			file_close(file);
+			file = NULL;
+			last = area->vm_file;
+			if( last != NULL ){
+				// shared mappings write through their file
+				file = file_open(&last->f_path, ((last->f_status+1) & _FWRITE) ? O_RDWR : O_RDONLY);
+				if( IS_ERR(file) ){
+					error = PTR_ERR(file);
+					file = NULL;
+					break;
+				}
+			}
+		}
+
+		error = vm_map(dst, area->vm_start, area->vm_end, area->vm_flags, file, area->vm_offset, area->vm_filestart, area->vm_filesz);
+		if( error != 0 ){
+			break;
+		}
+	}
+
+	// vm_map took its own references
+	file_close(file);
+
+	if( error != 0 ){
+		vm_release(dst);
+	}
+
+	return error;
+}
+
+void vm_release(struct task* task)
+{
+	while( !list_empty(&task->t_vmas) ){
+		vm_area_t* area = list_entry(list_first(&task->t_vmas), vm_area_t, vm_link);
+		list_rem(&area->vm_link);
+		file_close(area->vm_file);
+		kmem_cache_free(vm_area_cache, area);
+	}
+}
+
+/* Write a modified page of a shared file mapping back to the file. Only
+ * the part inside the mapping is written, and never past the end of the
+ * file, since a mapping does not grow its file.
+ */
+static int vm_writeback(vm_area_t* area, u32 addr)
+{
+	u32 lo = area->vm_filestart > addr ? area->vm_filestart : addr;
+	u32 hi = area->vm_filestart + area->vm_filesz;
+	if( hi > addr + PAGE_SIZE ) hi = addr + PAGE_SIZE;
+	if( lo >= hi ){
+		return 0;
+	}
+
+	off_t pos = area->vm_offset + (off_t)(lo - area->vm_filestart);
+	off_t size = file_inode(area->vm_file)->i_size;
+	if( pos >= size ){
+		return 0;
+	}
+	if( (off_t)(hi - lo) > size - pos ){
+		hi = lo + (u32)(size - pos);
+	}
+
+	file_seek(area->vm_file, pos, SEEK_SET);
+	ssize_t count = file_write(area->vm_file, (const void*)lo, hi - lo);
+	if( count < 0 ){
+		syslog(KERN_ERR, "vm: unable to write back page %p: %d", addr, count);
+		return (int)count;
+	}
+
+	return 0;
+}
+
+void vm_sync(struct task* task, u32 start, u32 end)
+{
+	list_t* item;
+	vm_area_t* area;
+
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area)
+	{
+		if( area->vm_start >= end ) break;
+		if( area->vm_end <= start || area->vm_file == NULL ) continue;
+		if( (area->vm_flags & (VM_SHARED|VM_WRITE)) != (VM_SHARED|VM_WRITE) ) continue;
+
+		u32 lo = area->vm_start > start ? area->vm_start : start;
+		u32 hi = area->vm_end < end ? area->vm_end : end;
+		for(u32 addr = lo; addr < hi; addr += PAGE_SIZE)
+		{
+			page_t* page = get_page((void*)addr, 0, task->t_dir);
+			if( page == NULL || !page->present || !page->dirty ) continue;
+			if( vm_writeback(area, addr) == 0 ){
+				page->dirty = 0;
+				invalidate_page((void*)addr);
+			}
+		}
+	}
+}
+
+/* Split an area at `addr`. The part from `addr` on becomes a new area
+ * following it in the list.
+ */
+static int vm_split(vm_area_t* area, u32 addr)
+{
+	vm_area_t* tail = (vm_area_t*)kmem_cache_alloc(vm_area_cache);
+	if( tail == NULL ){
+		return -ENOMEM;
+	}
+
+	memcpy(tail, area, sizeof(vm_area_t));
+	INIT_LIST(&tail->vm_link);
+	tail->vm_start = addr;
+	tail->vm_file = file_get(area->vm_file);
+	area->vm_end = addr;
+
+	list_add(&tail->vm_link, &area->vm_link);
+
+	return 0;
+}
+
+/* Split the areas straddling `start` or `end`, so every area overlapping
+ * the range lies entirely inside it.
+ */
+static int vm_isolate(struct task* task, u32 start, u32 end)
+{
+	list_t* item;
+	vm_area_t* area;
+	int error;
+
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area)
+	{
+		if( area->vm_start >= end ) break;
+		if( area->vm_end <= start ) continue;
+		if( area->vm_start < start && (error = vm_split(area, start)) != 0 ){
+			return error;
+		}
+		// the part after start is checked on the next pass
+		if( area->vm_start < start ) continue;
+		if( area->vm_end > end && (error = vm_split(area, end)) != 0 ){
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+int vm_unmap(struct task* task, u32 start, u32 end)
+{
+	vm_sync(task, start, end);
+
+	int error = vm_isolate(task, start, end);
+	if( error != 0 ){
+		return error;
+	}
+
+	list_t* item = list_first(&task->t_vmas);
+	while( item != &task->t_vmas )
+	{
+		vm_area_t* area = list_entry(item, vm_area_t, vm_link);
+		item = item->next;
+		if( area->vm_start >= end ) break;
+		if( area->vm_end <= start ) continue;
+		list_rem(&area->vm_link);
+		file_close(area->vm_file);
+		kmem_cache_free(vm_area_cache, area);
+	}
+
+	// Pages outside of any area (e.g. from sbrk) are unmapped as well
+	for(u32 addr = start; addr < end; addr += PAGE_SIZE){
+		page_t* page = get_page((void*)addr, 0, task->t_dir);
+		if( page == NULL || !page->present ) continue;
+		free_frame(page);
+		invalidate_page((void*)addr);
+	}
+
+	return 0;
+}
+
+int vm_protect(struct task* task, u32 start, u32 end, u32 flags)
+{
+	list_t* item;
+	vm_area_t* area;
+	u32 addr = start;
+
+	// Every page of the range must be mapped
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area)
+	{
+		if( area->vm_start >= end ) break;
+		if( area->vm_end <= start ) continue;
+		if( area->vm_start > addr ) break;
+		if( (flags & VM_WRITE) && (area->vm_flags & VM_SHARED) && area->vm_file && !((area->vm_file->f_status+1) & _FWRITE) ){
+			return -EACCES;
+		}
+		if( area->vm_end > addr ) addr = area->vm_end;
+	}
+	if( addr < end ){
+		return -ENOMEM;
+	}
+
+	int error = vm_isolate(task, start, end);
+	if( error != 0 ){
+		return error;
+	}
+
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area)
+	{
+		if( area->vm_start >= end ) break;
+		if( area->vm_end <= start ) continue;
+
+		area->vm_flags = (area->vm_flags & ~(VM_READ|VM_WRITE|VM_EXEC)) | flags;
+
+		for(addr = area->vm_start; addr < area->vm_end; addr += PAGE_SIZE)
+		{
+			page_t* page = get_page((void*)addr, 0, task->t_dir);
+			if( page == NULL || !page->present ) continue;
+			page->user = (flags & VM_READ) ? 1 : 0;
+			// Frames still shared since fork are copied on the first write
+			if( (flags & VM_WRITE) && !page->shared && frame_refcount(page->frame) > 1 ){
+				page->rw = 0;
+				page->cow = 1;
+			} else {
+				page->rw = (flags & VM_WRITE) ? 1 : 0;
+				page->cow = 0;
+			}
+			invalidate_page((void*)addr);
+		}
+	}
+
+	return 0;
+}
+
+/* Find `size` bytes of unused address space for mmap, preferring the
+ * callers hint. Returns 0 if there is no room.
+ */
+static u32 vm_find_free(struct task* task, u32 hint, u32 size)
+{
+	list_t* item;
+	vm_area_t* area;
+	u32 base = (hint >= TASK_MMAP_BASE && hint < TASK_MMAP_END) ? PAGE_ALIGN(hint) : TASK_MMAP_BASE;
+	u32 addr = base;
+
+	list_for_each_entry(item, &task->t_vmas, vm_area_t, vm_link, area)
+	{
+		if( area->vm_end <= addr ) continue;
+		if( area->vm_start >= addr + size ) break;
+		addr = area->vm_end;
+	}
+
+	if( addr + size > TASK_MMAP_END || addr + size < addr ){
+		return base != TASK_MMAP_BASE ? vm_find_free(task, 0, size) : 0;
+	}
+
+	return addr;
+}
+
+/* function: sys_mmap
+ * purpose:
+ * 	map a file or anonymous zero filled memory into the address space
+ * 	of the current task. Pages are only read in when first touched.
+ * 	MAP_PRIVATE mappings get their own copy of the file data, while
+ * 	MAP_SHARED mappings use the page cache frames of the file, shared
+ * 	with every other mapping and with read and write. Their modified
+ * 	pages are written back to the disk on munmap, exec and exit.
+ * return value:
+ * 	the address of the mapping, or a negative error value.
+ */
+void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	struct file* file = NULL;
+	u32 start = (u32)addr;
+	u32 vmflags = 0;
+
+	if( length == 0 || length > KERNEL_VIRTUAL_BASE || offset < 0 || PAGE_OFFSET((u32)offset) != 0 ){
+		return ERR_PTR(-EINVAL);
+	}
+	if( !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE) ){
+		return ERR_PTR(-EINVAL);
+	}
+
+	u32 size = PAGE_ALIGN(length + PAGE_SIZE - 1);
+
+	if( prot & PROT_READ ) vmflags |= VM_READ;
+	if( prot & PROT_WRITE ) vmflags |= VM_WRITE;
+	if( prot & PROT_EXEC ) vmflags |= VM_EXEC;
+	if( flags & MAP_SHARED ) vmflags |= VM_SHARED;
+
+	if( !(flags & MAP_ANONYMOUS) )
+	{
+		if( !FD_VALID(fd) ){
+			return ERR_PTR(-EBADF);
+		}
+		file = current->t_vfs.v_openvect[fd].file;
+		if( !S_ISREG(file_inode(file)->i_mode) ){
+			return ERR_PTR(-ENODEV);
+		}
+		// Sharing needs the page cache
+		if( (vmflags & VM_SHARED) && file->f_ops->readpage == NULL ){
+			return ERR_PTR(-ENODEV);
+		}
+		if( !((file->f_status+1) & _FREAD) ){
+			return ERR_PTR(-EACCES);
+		}
+		if( (vmflags & VM_SHARED) && (vmflags & VM_WRITE) && !((file->f_status+1) & _FWRITE) ){
+			return ERR_PTR(-EACCES);
+		}
+	}
+
+	if( flags & MAP_FIXED )
+	{
+		if( PAGE_OFFSET(start) != 0 || start == 0 || start + size > KERNEL_VIRTUAL_BASE || start + size < start ){
+			return ERR_PTR(-EINVAL);
+		}
+		// A fixed mapping replaces whatever was there
+		int error = vm_unmap(current, start, start + size);
+		if( error != 0 ){
+			return ERR_PTR(error);
+		}
+	} else {
+		start = vm_find_free(current, start, size);
+		if( start == 0 ){
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	// The mapping reads through its own open file, so it outlives the
+	// descriptor and never moves the descriptors offset.
+	struct file* mapfile = NULL;
+	if( file != NULL ){
+		mapfile = file_open(&file->f_path, ((vmflags & VM_SHARED) && (vmflags & VM_WRITE)) ? O_RDWR : O_RDONLY);
+		if( IS_ERR(mapfile) ){
+			return (void*)mapfile;
+		}
+	}
+
+	int error = vm_map(current, start, start + size, vmflags, mapfile, offset, start, mapfile ? size : 0);
+
+	// vm_map took its own reference
+	file_close(mapfile);
+
+	if( error != 0 ){
+		return ERR_PTR(error);
+	}
+
+	return (void*)start;
+}
+
+/* function: sys_munmap
+ * purpose:
+ * 	remove the mappings in a range of the current tasks address space.
+ * return value:
+ * 	zero on success or a negative error value.
+ */
+int sys_munmap(void* addr, size_t length)
+{
+	u32 start = (u32)addr;
+
+	if( length == 0 || PAGE_OFFSET(start) != 0 || start >= KERNEL_VIRTUAL_BASE || length > KERNEL_VIRTUAL_BASE - start ){
+		return -EINVAL;
+	}
+
+	return vm_unmap(current, start, start + PAGE_ALIGN(length + PAGE_SIZE - 1));
+}
+
+/* function: sys_mprotect
+ * purpose:
+ * 	change the access rights of mapped pages of the current task.
+ * return value:
+ * 	zero on success or a negative error value.
+ */
+int sys_mprotect(void* addr, size_t length, int prot)
+{
+	u32 start = (u32)addr;
+	u32 flags = 0;
+
+	if( length == 0 || PAGE_OFFSET(start) != 0 || start >= KERNEL_VIRTUAL_BASE || length > KERNEL_VIRTUAL_BASE - start ){
+		return -EINVAL;
+	}
+
+	if( prot & PROT_READ ) flags |= VM_READ;
+	if( prot & PROT_WRITE ) flags |= VM_WRITE;
+	if( prot & PROT_EXEC ) flags |= VM_EXEC;
+
+	return vm_protect(current, start, start + PAGE_ALIGN(length + PAGE_SIZE - 1), flags);
+}
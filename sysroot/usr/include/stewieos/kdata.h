@@ -0,0 +1,48 @@
+#ifndef _KDATA_H_
+#define _KDATA_H_
+
+#include "stewieos/kernel.h"
+#include "stewieos/timer.h"
+
+// Where every task sees the page, read-only (just past the page cache window)
+#define KDATA_ADDR				0xF2000000
+// Bumped whenever the layout below changes
+#define KDATA_VERSION			1
+
+/* structure: kdata_t
+ * purpose:
+ * 	values the kernel keeps current in a page mapped into every task,
+ * 	so userland can read them without a system call. k_seq is odd
+ * 	while the kernel is changing the page; a reader taking more than
+ * 	one field retries if it was odd or changed while reading.
+ */
+typedef struct _kdata
+{
+	volatile u32			k_version;		// KDATA_VERSION
+	volatile u32			k_seq;			// update sequence count
+	volatile u32			k_freq;			// timer ticks per second
+	volatile tick_t			k_tick;			// ticks since boot
+	volatile time_t			k_time;			// seconds since the epoch
+	volatile tick_t			k_time_tick;	// k_tick when k_time last changed
+	volatile pid_t			k_pid;			// pid of the running task
+} kdata_t;
+
+/* function: kdata_init
+ * purpose:
+ * 	map the data page into the kernel directory, so every directory
+ * 	copied from it shares the mapping. Called before the first task.
+ */
+void kdata_init( void );
+/* function: kdata_timer
+ * purpose:
+ * 	publish the tick count and wall clock time. Called from the timer
+ * 	interrupt.
+ */
+void kdata_timer(tick_t tick, time_t time, unsigned int freq);
+/* function: kdata_switch
+ * purpose:
+ * 	publish the pid of the task about to run.
+ */
+void kdata_switch(pid_t pid);
+
+#endif
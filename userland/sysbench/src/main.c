@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <stewieos/kdata.h>
+
+// Round trips timed for each entry path
+#define DEFAULT_ITERATIONS	100000
+
+#define kdata ((const kdata_t*)KDATA_ADDR)
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned long long tsc;
+	asm volatile("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
+static int have_sysenter(void)
+{
+	unsigned int eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx >> 11) & 1;
+}
+
+static int getpid_int80(void)
+{
+	int result;
+	asm volatile("int $0x80" : "=a"(result) : "a"(SYSCALL_GETPID) : "memory");
+	return result;
+}
+
+// The calling convention is described in the kernel's syscall.h
+static int getpid_sysenter(void)
+{
+	int result;
+	asm volatile(
+		"push %%edx\n\t"
+		"push %%ecx\n\t"
+		"mov %%esp,%%ecx\n\t"
+		"mov $1f,%%edx\n\t"
+		"sysenter\n"
+		"1:\n\t"
+		"pop %%ecx\n\t"
+		"pop %%edx"
+		: "=a"(result) : "a"(SYSCALL_GETPID) : "memory");
+	return result;
+}
+
+static int getpid_kdata(void)
+{
+	return kdata->k_pid;
+}
+
+// Read the time of day the way gettimeofday would, retrying while the
+// kernel updates the page
+static void kdata_timeofday(long* sec, unsigned long* usec)
+{
+	unsigned int seq;
+	do {
+		seq = kdata->k_seq;
+		*sec = kdata->k_time;
+		*usec = (kdata->k_tick - kdata->k_time_tick) * 1000000UL / kdata->k_freq;
+	} while( (seq & 1) || seq != kdata->k_seq );
+}
+
+static unsigned long long measure(int(*call)(void), int iterations)
+{
+	unsigned long long start = rdtsc();
+	for(int i = 0; i < iterations; ++i){
+		call();
+	}
+	return (rdtsc() - start) / (unsigned long long)iterations;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	if( iterations <= 0 ){
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	printf("getpid round trip over %d calls:\n", iterations);
+	printf("  int 0x80: %llu cycles\n", measure(getpid_int80, iterations));
+
+	if( kdata->k_version == KDATA_VERSION && getpid_kdata() == getpid() ){
+		long sec;
+		unsigned long usec;
+		printf("  kdata:    %llu cycles\n", measure(getpid_kdata, iterations));
+		kdata_timeofday(&sec, &usec);
+		printf("kdata time of day: %ld.%06lu\n", sec, usec);
+	}
+
+	if( !have_sysenter() ){
+		printf("  sysenter: not supported by this processor\n");
+		return 0;
+	}
+
+	if( getpid_sysenter() != getpid() ){
+		fprintf(stderr, "sysenter: getpid returned the wrong pid\n");
+		return 1;
+	}
+
+	printf("  sysenter: %llu cycles\n", measure(getpid_sysenter, iterations));
+
+	return 0;
+}